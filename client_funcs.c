@@ -0,0 +1,455 @@
+/* client_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "client_funcs.h"
+
+/* globals */
+static int client_fd = -1;
+static uint32_t client_id = 0;
+static wire_t request;
+static wire_t response;     /* answers read, pos is at the payload of the current one */
+static size_t response_end; /* where the current answer ends */
+
+int client_open(const char* socket_path) {
+  struct sockaddr_un addr;
+  char buffer[160];
+
+  if (client_fd >= 0) client_close();
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    log_debug(ERROR,"client_open(): socket path too long");
+    return MI_EXIT_ERROR;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,socket_path);
+
+  if ((client_fd = socket(AF_UNIX,SOCK_STREAM,0)) < 0 ||
+      connect(client_fd,(struct sockaddr*)&addr,sizeof(addr)) < 0) {
+    sprintf(buffer,"client_open(): could not connect to %.100s",socket_path);
+    log_debug(ERROR,buffer);
+    log_debug(ERROR,strerror(errno));
+    if (client_fd >= 0) close(client_fd);
+    client_fd = -1;
+    return MI_EXIT_ERROR;
+  }
+
+  wire_init(&request);
+  wire_init(&response);
+  response_end = 0;
+  log_debug(INFO,"client_open(): connected");
+  return MI_EXIT_OK;
+}
+
+int client_close() {
+  if (client_fd >= 0) close(client_fd);
+  client_fd = -1;
+  wire_free(&request);
+  wire_free(&response);
+  response_end = 0;
+  return MI_EXIT_OK;
+}
+
+/* the wire
+ * a call writes one request, sends it and waits for its answer, which is
+ * left in response for the caller to read from
+ */
+static size_t request_begin(int op) {
+  request.len = 0;
+  request.pos = 0;
+  request.error = 0;
+  return frame_begin(&request,(uint16_t)op,++client_id);
+}
+
+static int request_send() {
+  if (request.error) {
+    log_debug(ERROR,"client: could not build request");
+    return MI_EXIT_ERROR;
+  }
+  if (frame_write(client_fd,&request) != MI_EXIT_OK) {
+    log_debug(ERROR,"client: lost the daemon sending");
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+static int response_receive(frame_header_t* header) {
+  /* the last answer has been read */
+  response.pos = response_end;
+  wire_consume(&response,response.pos);
+  response.error = 0;
+
+  if (frame_read(client_fd,&response,header) != MI_EXIT_OK) {
+    log_debug(ERROR,"client: lost the daemon reading, or its answer was too big");
+    return MI_EXIT_ERROR;
+  }
+
+  response.pos += PROTO_HEADER_SIZE;
+  response_end = response.pos + header->length;
+  return MI_EXIT_OK;
+}
+
+/* the status of the answer to the request just built */
+static int call(size_t start) {
+  frame_header_t header;
+
+  if (client_fd < 0) {
+    log_debug(ERROR,"client: not connected");
+    return MI_EXIT_ERROR;
+  }
+  frame_end(&request,start,0);
+  if (request_send() != MI_EXIT_OK || response_receive(&header) != MI_EXIT_OK)
+    return MI_EXIT_ERROR;
+  if (header.id != client_id) {
+    log_debug(ERROR,"client: answer to some other request");
+    return MI_EXIT_ERROR;
+  }
+  return header.status;
+}
+
+/* an answer that was cut short is as good as none */
+static int checked(int retval) {
+  return (response.error) ? MI_EXIT_ERROR : retval;
+}
+
+static int call_code(int op, uint32_t code) {
+  size_t start = request_begin(op);
+
+  wire_put_u32(&request,code);
+  return call(start);
+}
+
+int client_fetch(media_t* sought, uint32_t code) {
+  int retval = call_code(REQ_FETCH,code);
+
+  if (retval == MI_EXIT_OK) wire_get_media(&response,sought);
+  return checked(retval);
+}
+
+int client_fetch_book(book_t* sought, uint32_t code) {
+  int retval = call_code(REQ_FETCH_BOOK,code);
+
+  if (retval == MI_EXIT_OK) wire_get_book(&response,sought);
+  return checked(retval);
+}
+
+int client_fetch_movie(movie_t* sought, uint32_t code) {
+  int retval = call_code(REQ_FETCH_MOVIE,code);
+
+  if (retval == MI_EXIT_OK) wire_get_movie(&response,sought);
+  return checked(retval);
+}
+
+int client_exists(uint32_t code) {
+  return call_code(REQ_EXISTS,code);
+}
+
+int client_exists_book(uint32_t code) {
+  return call_code(REQ_EXISTS_BOOK,code);
+}
+
+int client_exists_movie(uint32_t code) {
+  return call_code(REQ_EXISTS_MOVIE,code);
+}
+
+int client_delete(uint32_t code) {
+  return call_code(REQ_DELETE,code);
+}
+
+int client_touch(uint32_t code) {
+  return call_code(REQ_TOUCH,code);
+}
+
+int client_checkout(uint32_t code, const char* location) {
+  size_t start = request_begin(REQ_CHECKOUT);
+
+  wire_put_u32(&request,code);
+  wire_put_str(&request,location);
+  return call(start);
+}
+
+/* writes, the daemon sets the update time and sends it back */
+static int write_media(int op, media_t* item) {
+  size_t start = request_begin(op);
+  int retval;
+
+  wire_put_media(&request,item);
+  retval = call(start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&response);
+  return checked(retval);
+}
+
+int client_store(media_t* item) {
+  return write_media(REQ_STORE,item);
+}
+
+int client_update(media_t* item) {
+  return write_media(REQ_UPDATE,item);
+}
+
+int client_store_book(book_t* item) {
+  size_t start = request_begin(REQ_STORE_BOOK);
+
+  wire_put_book(&request,item);
+  return call(start);
+}
+
+int client_update_book(book_t* item) {
+  size_t start = request_begin(REQ_UPDATE_BOOK);
+
+  wire_put_book(&request,item);
+  return call(start);
+}
+
+int client_store_movie(movie_t* item) {
+  size_t start = request_begin(REQ_STORE_MOVIE);
+
+  wire_put_movie(&request,item);
+  return call(start);
+}
+
+int client_update_movie(movie_t* item) {
+  size_t start = request_begin(REQ_UPDATE_MOVIE);
+
+  wire_put_movie(&request,item);
+  return call(start);
+}
+
+/* detail takes its code and type from item, as in db_funcs */
+static int write_book_item(int op, media_t* item, book_t* detail) {
+  size_t start = request_begin(op);
+  int retval;
+
+  detail->code = item->code;
+  detail->type = item->type;
+  wire_put_media(&request,item);
+  wire_put_book(&request,detail);
+  retval = call(start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&response);
+  return checked(retval);
+}
+
+static int write_movie_item(int op, media_t* item, movie_t* detail) {
+  size_t start = request_begin(op);
+  int retval;
+
+  detail->code = item->code;
+  detail->type = item->type;
+  wire_put_media(&request,item);
+  wire_put_movie(&request,detail);
+  retval = call(start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&response);
+  return checked(retval);
+}
+
+int client_store_book_item(media_t* item, book_t* detail) {
+  return write_book_item(REQ_STORE_BOOK_ITEM,item,detail);
+}
+
+int client_store_movie_item(media_t* item, movie_t* detail) {
+  return write_movie_item(REQ_STORE_MOVIE_ITEM,item,detail);
+}
+
+int client_update_book_item(media_t* item, book_t* detail) {
+  return write_book_item(REQ_UPDATE_BOOK_ITEM,item,detail);
+}
+
+int client_update_movie_item(media_t* item, movie_t* detail) {
+  return write_movie_item(REQ_UPDATE_MOVIE_ITEM,item,detail);
+}
+
+/* PROTO_BATCH_MAX rows to a request, each its own transaction */
+int client_store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored) {
+  size_t stored = 0;
+  size_t count;
+  size_t start;
+  int all_there = 1;
+  int retval;
+
+  if (num_stored) *num_stored = 0;
+  for (size_t first = 0; first < n; first += count) {
+    count = (n - first < PROTO_BATCH_MAX) ? n - first : PROTO_BATCH_MAX;
+    start = request_begin(REQ_STORE_BOOK_ITEM_BATCH);
+    wire_put_u32(&request,(uint32_t)count);
+    for (size_t i = first; i < first + count; i++) {
+      details[i].code = items[i].code;
+      details[i].type = items[i].type;
+      wire_put_media(&request,&items[i]);
+      wire_put_book(&request,&details[i]);
+    }
+    if ((retval = call(start)) == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+    stored += wire_get_u32(&response);
+    for (size_t i = first; i < first + count; i++)
+      items[i].update = (time_t)wire_get_i64(&response);
+    if (num_stored) *num_stored = stored;
+    if (response.error) return MI_EXIT_ERROR;
+    if (retval != MI_EXISTS) all_there = 0;
+  }
+  return (all_there && n) ? MI_EXISTS : MI_EXIT_OK;
+}
+
+/* searches come back as a count and the rows, copied into one malloc() */
+static int search_call(int op, void** items, size_t row_size, uint32_t* num_results,
+		       const filter_t* filter) {
+  size_t start = request_begin(op);
+  uint32_t count;
+  int retval;
+
+  *items = NULL;
+  *num_results = 0;
+  wire_put_filter(&request,filter);
+  if ((retval = call(start)) != MI_EXIT_OK) return retval;
+
+  count = wire_get_u32(&response);
+  if (response.error || (*items = malloc(row_size * (count ? count : 1))) == NULL) {
+    log_debug(ERROR,"client_search(): could not read the results");
+    return MI_EXIT_ERROR;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    switch (op) {
+    case REQ_SEARCH:       wire_get_media(&response,(media_t*)*items + i); break;
+    case REQ_SEARCH_BOOKS: wire_get_book(&response,(book_t*)*items + i);   break;
+    default:               wire_get_movie(&response,(movie_t*)*items + i);
+    }
+  }
+  if (response.error) {
+    free(*items);
+    *items = NULL;
+    return MI_EXIT_ERROR;
+  }
+  *num_results = count;
+  return MI_EXIT_OK;
+}
+
+int client_search(media_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH,(void**)items,sizeof(media_t),num_results,filter);
+}
+
+int client_search_books(book_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH_BOOKS,(void**)items,sizeof(book_t),num_results,filter);
+}
+
+int client_search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH_MOVIES,(void**)items,sizeof(movie_t),num_results,filter);
+}
+
+/* batched lookups
+ * codes go PROTO_MANY_MAX to a request and up to CLIENT_PIPELINE requests
+ * are sent before the first answer is read, so a long list costs about
+ * one round trip per window rather than one per code.  The window also
+ * keeps the answers queued at the daemon under its SERVER_OUT_LIMIT, so
+ * it never stops reading while we are still sending.  After an error no
+ * more requests go out, but the answers already owed are read so the
+ * connection stays in step.
+ */
+static int fetch_many_call(int op, void* items, size_t row_size, uint8_t* found,
+			   const uint32_t* codes, size_t n) {
+  frame_header_t header;
+  size_t chunks = (n + PROTO_MANY_MAX - 1) / PROTO_MANY_MAX;
+  size_t sent = 0;
+  size_t done = 0;
+  size_t num_found = 0;
+  size_t first;
+  size_t start;
+  uint32_t first_id = client_id + 1;
+  uint32_t count;
+  int retval = MI_EXIT_OK;
+
+  if (client_fd < 0) {
+    log_debug(ERROR,"client: not connected");
+    return MI_EXIT_ERROR;
+  }
+  memset(found,0,n);
+
+  while (done < sent || (retval != MI_EXIT_ERROR && sent < chunks)) {
+    while (retval != MI_EXIT_ERROR && sent < chunks && sent - done < CLIENT_PIPELINE) {
+      first = sent * PROTO_MANY_MAX;
+      count = (uint32_t)((n - first < PROTO_MANY_MAX) ? n - first : PROTO_MANY_MAX);
+      start = request_begin(op);
+      wire_put_u32(&request,items != NULL);
+      wire_put_u32(&request,count);
+      for (uint32_t i = 0; i < count; i++)
+	wire_put_u32(&request,codes[first + i]);
+      frame_end(&request,start,0);
+      if (request_send() != MI_EXIT_OK) return MI_EXIT_ERROR;
+      sent++;
+    }
+
+    /* the connection is no good once an answer can't be read */
+    if (response_receive(&header) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    if (header.id != first_id + (uint32_t)done) {
+      log_debug(ERROR,"client: answer to some other request");
+      return MI_EXIT_ERROR;
+    }
+    first = done * PROTO_MANY_MAX;
+    done++;
+    if (header.status == MI_EXIT_ERROR) retval = MI_EXIT_ERROR;
+    if (header.status != MI_EXIT_OK || retval == MI_EXIT_ERROR) continue;
+
+    count = wire_get_u32(&response);
+    if (count != ((n - first < PROTO_MANY_MAX) ? n - first : PROTO_MANY_MAX))
+      response.error = 1;
+    for (uint32_t i = 0; i < count && !response.error; i++) {
+      if (!wire_get_u32(&response)) continue;
+      found[first + i] = 1;
+      num_found++;
+      if (items == NULL) continue;
+      switch (op) {
+      case REQ_FETCH_MANY:
+	wire_get_media(&response,(media_t*)((unsigned char*)items + (first + i) * row_size));
+	break;
+      case REQ_FETCH_MANY_BOOKS:
+	wire_get_book(&response,(book_t*)((unsigned char*)items + (first + i) * row_size));
+	break;
+      default:
+	wire_get_movie(&response,(movie_t*)((unsigned char*)items + (first + i) * row_size));
+      }
+    }
+    if (response.error) {
+      log_debug(ERROR,"client_fetch_many(): could not read the results");
+      retval = MI_EXIT_ERROR;
+    }
+  }
+
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  return (num_found) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
+
+int client_fetch_many(media_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY,items,sizeof(media_t),found,codes,n);
+}
+
+int client_fetch_many_books(book_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY_BOOKS,items,sizeof(book_t),found,codes,n);
+}
+
+int client_fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY_MOVIES,items,sizeof(movie_t),found,codes,n);
+}
@@ -0,0 +1,70 @@
+#ifndef __CLIENT_FUNCS_H__
+#define __CLIENT_FUNCS_H__
+
+/* client_funcs.h - part of mindex
+ *
+ * The db_funcs calls, made to a running mindexd instead of a database
+ * file.  Each client_*() function takes the same arguments and gives the
+ * same results as the db_funcs function of the same name; MI_EXIT_ERROR
+ * also covers losing the daemon.  Like db_handle there is one connection
+ * per process, opened with client_open().
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define CLIENT_PIPELINE 4 /* client_fetch_many*() requests sent ahead of their answers */
+
+/* prototypes */
+int client_open (const char* socket_path);
+int client_close();
+
+int client_fetch        (media_t* sought, uint32_t code);
+int client_fetch_book   (book_t* sought, uint32_t code);
+int client_fetch_movie  (movie_t* sought, uint32_t code);
+
+int client_exists       (uint32_t code);
+int client_exists_book  (uint32_t code);
+int client_exists_movie (uint32_t code);
+
+int client_fetch_many       (media_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int client_fetch_many_books (book_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int client_fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+
+int client_store        (media_t* item);
+int client_store_book   (book_t* item);
+int client_store_movie  (movie_t* item);
+
+int client_update       (media_t* item);
+int client_update_book  (book_t* item);
+int client_update_movie (movie_t* item);
+
+int client_store_book_item  (media_t* item, book_t* detail);
+int client_store_movie_item (media_t* item, movie_t* detail);
+int client_update_book_item (media_t* item, book_t* detail);
+int client_update_movie_item(media_t* item, movie_t* detail);
+int client_store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored);
+
+int client_search       (media_t** items, uint32_t* num_results, const filter_t* filter);
+int client_search_books (book_t** items, uint32_t* num_results, const filter_t* filter);
+int client_search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter);
+
+int client_delete       (uint32_t code);
+int client_touch        (uint32_t code);
+int client_checkout     (uint32_t code, const char* location);
+
+#endif /* __CLIENT_FUNCS_H__ */
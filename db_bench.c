@@ -0,0 +1,656 @@
+/* db_bench.c - part of mindex
+ *
+ * Runs the same workload against a fresh database under each runtime
+ * profile and prints the rate of each step.
+ *
+ *   ./dbb [-n items] [-f file] [-F codes] [-I codes] [-S rows] [preset ...]
+ *
+ * Each profile's lookups are also timed through a forked mindexd, one
+ * request per code and then batched with client_fetch_many().
+ *
+ * With no presets named it runs all of them.  Row timestamp formatting
+ * is timed once first, as it doesn't depend on the profile.
+ *
+ * -F times exists() misses and hits on a catalogue of that many codes
+ * (e.g. -F 5000000) with the code filter off and on, instead of the
+ * profiles.  -I does the same for fetch() hits through sqlite and
+ * through the code index, shared and owned.  -S stores that many rows
+ * into 1, 2 and 4 shards (in FILE.shards) and reads them back.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L /* clock_gettime() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "server_funcs.h"
+#include "client_funcs.h"
+#include "shard_funcs.h"
+
+#define BENCH_ITEMS 5000
+#define BENCH_PAGE  64
+#define BENCH_SOCKET "./bench.sock"
+#define BENCH_BATCH  10000 /* rows a transaction filling the filter catalogue */
+#define BENCH_PROBES 1000000
+
+static const char* all_presets[] = { "default", "durable", "bulk-import", "kiosk-readonly" };
+static const char* locations[] = { "DEN", "OFFICE", "ATTIC", "GARAGE" };
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report(const char* step, uint32_t ops, double start) {
+  double secs = now() - start;
+
+  printf("  %-10s %8u ops %9.3f s %12.0f ops/s\n",step,ops,secs,(secs > 0) ? ops / secs : 0);
+}
+
+void remove_db(const char* file) {
+  char buffer[512];
+
+  unlink(file);
+  sprintf(buffer,"%s-journal",file);
+  unlink(buffer);
+  sprintf(buffer,"%s-wal",file);
+  unlink(buffer);
+  sprintf(buffer,"%s-shm",file);
+  unlink(buffer);
+}
+
+/* a valid ISBN-13 for the i'th book */
+void bench_isbn13(char* isbn, uint32_t i) {
+  int sum = 0;
+
+  sprintf(isbn,"978%09u",i);
+  for (int j = 0; j < 12; j++)
+    sum += (j % 2) ? (isbn[j] - '0') * 3 : isbn[j] - '0';
+  sprintf(isbn + 12,"%d",(10 - sum % 10) % 10);
+}
+
+/* every item is stored with its detail, one transaction each, the way the
+ * interface adds them
+ */
+int bench_store(uint32_t* codes, uint32_t n) {
+  media_t item;
+  book_t book_detail;
+  movie_t movie_detail;
+  uint32_t stored = 0;
+  double start = now();
+
+  memset(&book_detail,0,sizeof(book_detail));
+  memset(&movie_detail,0,sizeof(movie_detail));
+  for (uint32_t i = 0; i < n; i++) {
+    item.type = (i % 2) ? dvd : book;
+    sprintf(item.name,"BENCH ITEM %u",i);
+    strcpy(item.location,locations[i % 4]);
+    item.code = code_gen(item.type,item.name);
+    codes[i] = item.code;
+
+    if (item.type == book) {
+      strcpy(book_detail.title,item.name);
+      strcpy(book_detail.author_last,"AUTHOR");
+      bench_isbn13(book_detail.isbn,i);
+      book_detail.genre = fiction;
+      if (store_book_item(&item,&book_detail) == MI_EXIT_OK) stored++;
+    }
+    else {
+      strcpy(movie_detail.title,item.name);
+      strcpy(movie_detail.director,"DIRECTOR");
+      movie_detail.genre = drama;
+      if (store_movie_item(&item,&movie_detail) == MI_EXIT_OK) stored++;
+    }
+  }
+  report("store",stored,start);
+  return (stored) ? MI_EXIT_OK : MI_EXIT_ERROR;
+}
+
+void bench_fetch(const uint32_t* codes, uint32_t n) {
+  media_t item;
+  uint32_t found = 0;
+  double start = now();
+
+  srand(1);
+  for (uint32_t i = 0; i < n; i++)
+    if (fetch(&item,codes[rand() % n]) == MI_EXIT_OK) found++;
+  report("fetch",found,start);
+}
+
+/* the same lookups as bench_fetch(), all in one call */
+void bench_fetch_many(const uint32_t* codes, uint32_t n) {
+  media_t* items = malloc(sizeof(media_t) * n);
+  uint32_t* wanted = malloc(sizeof(uint32_t) * n);
+  uint8_t* found = malloc(n);
+  double start;
+
+  if (items != NULL && wanted != NULL && found != NULL) {
+    srand(1);
+    for (uint32_t i = 0; i < n; i++)
+      wanted[i] = codes[rand() % n];
+    start = now();
+    fetch_many(items,found,wanted,n);
+    report("fetch many",n,start);
+  }
+  free(items);
+  free(wanted);
+  free(found);
+}
+
+/* the bench daemon is stopped with SIGTERM */
+static volatile sig_atomic_t serve_stop = 0;
+
+void stop_serving(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+/* starts a child serving file on BENCH_SOCKET and connects to it */
+pid_t bench_daemon(const char* file, const db_options_t* options) {
+  struct sigaction action;
+  struct timespec wait = { 0, 10000000 };
+  pid_t pid;
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    memset(&action,0,sizeof(action));
+    action.sa_handler = stop_serving;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM,&action,NULL);
+    if (init_db_ex(file,options) != MI_EXIT_OK) _exit(1);
+    _exit((serve(BENCH_SOCKET,&serve_stop) == MI_EXIT_OK && close_db() == MI_EXIT_OK) ? 0 : 1);
+  }
+  for (int i = 0; pid > 0 && i < 200; i++) {
+    if (client_open(BENCH_SOCKET) == MI_EXIT_OK) return pid;
+    nanosleep(&wait,NULL);
+  }
+  if (pid > 0) {
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+  }
+  return -1;
+}
+
+/* the same lookups again through mindexd, a request and a wait per code
+ * against client_fetch_many(), which sends PROTO_MANY_MAX codes a request
+ * with up to CLIENT_PIPELINE of them in flight
+ */
+void bench_remote(const char* file, const db_options_t* options, const uint32_t* codes,
+		  uint32_t n) {
+  media_t* items = malloc(sizeof(media_t) * n);
+  uint32_t* wanted = malloc(sizeof(uint32_t) * n);
+  uint8_t* found = malloc(n);
+  uint32_t requests = (n + PROTO_MANY_MAX - 1) / PROTO_MANY_MAX;
+  uint32_t hits = 0;
+  double start;
+  pid_t pid;
+
+  if (items != NULL && wanted != NULL && found != NULL &&
+      (pid = bench_daemon(file,options)) > 0) {
+    srand(1);
+    for (uint32_t i = 0; i < n; i++)
+      wanted[i] = codes[rand() % n];
+
+    start = now();
+    for (uint32_t i = 0; i < n; i++)
+      if (client_fetch(&items[i],wanted[i]) == MI_EXIT_OK) hits++;
+    report("remote",hits,start);
+
+    start = now();
+    client_fetch_many(items,found,wanted,n);
+    report("pipelined",n,start);
+    printf("  %-10s %8u round trips saved, %u requests of up to %d codes\n","",
+	   n - requests,requests,PROTO_MANY_MAX);
+
+    client_close();
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+  }
+  else
+    printf("  remote: no daemon\n");
+
+  free(items);
+  free(wanted);
+  free(found);
+}
+
+/* what a barcode scanner does, half the books by their ISBN */
+void bench_isbn(uint32_t n) {
+  book_t detail;
+  char isbn[16];
+  uint32_t found = 0;
+  uint32_t lookups = n / 2;
+  double start = now();
+
+  srand(1);
+  for (uint32_t i = 0; i < lookups; i++) {
+    bench_isbn13(isbn,(rand() % lookups) * 2);
+    if (fetch_book_by_isbn(&detail,isbn) == MI_EXIT_OK) found++;
+  }
+  report("isbn",found,start);
+}
+
+void bench_search(uint32_t n) {
+  filter_t filter;
+  media_t* items;
+  uint32_t num_results;
+  uint32_t searches = n / 10;
+  double start = now();
+
+  for (uint32_t i = 0; i < searches; i++) {
+    filter_init(&filter);
+    filter_text(&filter,F_LOCATION,OP_EQ,locations[i % 4]);
+    filter_order(&filter,F_UPDATE,1);
+    filter_limit(&filter,50,0);
+    if (search(&items,&num_results,&filter) == MI_EXIT_OK) free(items);
+  }
+  report("search",searches,start);
+}
+
+void bench_page(void) {
+  media_t items[BENCH_PAGE];
+  uint32_t num_results;
+  uint32_t rows = 0;
+  uint32_t after;
+  double start = now();
+
+  if (page(items,&num_results,NULL,BENCH_PAGE) != MI_EXIT_OK) return;
+  do {
+    rows += num_results;
+    after = items[num_results - 1].code;
+  } while (page(items,&num_results,&after,BENCH_PAGE) == MI_EXIT_OK);
+  report("page",rows,start);
+}
+
+/* the whole catalogue alphabetically, a page at a time */
+void bench_list(void) {
+  media_t items[BENCH_PAGE];
+  uint32_t num_results;
+  uint32_t rows = 0;
+  double start = now();
+
+  if (list(items,&num_results,NULL,BENCH_PAGE) != MI_EXIT_OK) return;
+  do {
+    rows += num_results;
+  } while (list(items,&num_results,&items[num_results - 1],BENCH_PAGE) == MI_EXIT_OK);
+  report("list",rows,start);
+}
+
+void bench_checkout(const uint32_t* codes, uint32_t n) {
+  size_t num_unknown;
+  double start = now();
+
+  checkout_batch(codes,n,"BENCH",NULL,&num_unknown);
+  report("checkout",n - (uint32_t)num_unknown,start);
+}
+
+/* row timestamps the old way, gmtime() and strftime(), against time_format() */
+void bench_time(uint32_t n) {
+  char buffer[TIME_STRING_SIZE];
+  struct tm* tm;
+  time_t when;
+  uint32_t calls = n * 100;
+  double start;
+
+  printf("time formatting:\n");
+  start = now();
+  for (uint32_t i = 0; i < calls; i++) {
+    when = 1356088260 + (time_t)i * 97;
+    tm = gmtime(&when);
+    strftime(buffer,sizeof(buffer),"%F @ %T %Z",tm);
+  }
+  report("strftime",calls,start);
+
+  start = now();
+  for (uint32_t i = 0; i < calls; i++)
+    time_format(1356088260 + (time_t)i * 97,buffer);
+  report("format",calls,start);
+
+  start = now();
+  for (uint32_t i = 0; i < calls; i++)
+    time_format_iso(1356088260 + (time_t)i * 97,buffer);
+  report("iso",calls,start);
+}
+
+/* codes are the odd numbers 1 .. 2n-1, so every even number is a miss */
+int bench_fill(const char* file, uint32_t n) {
+  db_options_t options;
+  media_t* items = malloc(sizeof(media_t) * BENCH_BATCH);
+  book_t* details = calloc(BENCH_BATCH,sizeof(book_t));
+  uint32_t count;
+  double start = now();
+
+  db_options_preset(&options,"bulk-import");
+  options.code_filter = 0;
+  remove_db(file);
+  if (items == NULL || details == NULL || init_db_ex(file,&options) != MI_EXIT_OK) {
+    free(items);
+    free(details);
+    return MI_EXIT_ERROR;
+  }
+  for (uint32_t done = 0; done < n; done += count) {
+    count = (n - done < BENCH_BATCH) ? n - done : BENCH_BATCH;
+    for (uint32_t i = 0; i < count; i++) {
+      items[i].code = (done + i) * 2 + 1;
+      items[i].type = book;
+      sprintf(items[i].name,"FILTER ITEM %u",done + i);
+      strcpy(items[i].location,locations[i % 4]);
+      strcpy(details[i].title,items[i].name);
+    }
+    if (store_book_item_batch(items,details,count,NULL) == MI_EXIT_ERROR) break;
+  }
+  report("fill",n,start);
+  close_db();
+  free(items);
+  free(details);
+  return MI_EXIT_OK;
+}
+
+void bench_probes(uint32_t n) {
+  uint32_t probes = (n < BENCH_PROBES) ? n : BENCH_PROBES;
+  uint32_t wrong = 0;
+  double start;
+
+  /* hits first, misses that never reach sqlite leave its cache cold */
+  srand(1);
+  start = now();
+  for (uint32_t i = 0; i < probes; i++)
+    if (exists(((uint32_t)rand() % n) * 2 + 1) != MI_EXISTS) wrong++;
+  report("hits",probes,start);
+
+  start = now();
+  for (uint32_t i = 0; i < probes; i++)
+    if (exists(((uint32_t)rand() % n) * 2 + 2) != MI_NO_RESULTS) wrong++;
+  report("misses",probes,start);
+  if (wrong) printf("  %u wrong answers\n",wrong);
+}
+
+int bench_filter(const char* file, uint32_t n) {
+  code_filter_stats_t stats;
+  db_options_t options;
+  double start;
+
+  printf("code filter, %u codes:\n",n);
+  if (bench_fill(file,n) != MI_EXIT_OK) {
+    printf("init_db_ex(): failed\n");
+    return 1;
+  }
+
+  for (int bits = 0; bits <= CODE_FILTER_BITS; bits += CODE_FILTER_BITS) {
+    printf("%s:\n",(bits) ? " with the filter" : " without");
+    db_options_init(&options);
+    options.code_filter = bits;
+    start = now();
+    if (init_db_ex(file,&options) != MI_EXIT_OK) {
+      printf("init_db_ex(): failed\n");
+      remove_db(file);
+      return 1;
+    }
+    report("open",1,start);
+    bench_probes(n);
+    if (code_filter_stats(&stats) == MI_EXIT_OK)
+      printf("  %ju KiB, fpr %.4f (expected %.4f), %ju of %ju misses never reached sqlite\n",
+	     (uintmax_t)stats.bits / 8192,stats.fpr,stats.expected_fpr,
+	     (uintmax_t)stats.negatives,(uintmax_t)(stats.negatives + stats.false_positives));
+    close_db();
+  }
+  remove_db(file);
+  return 0;
+}
+
+int bench_index(const char* file, uint32_t n) {
+  static const int modes[] = { INDEX_OFF, INDEX_SHARED, INDEX_OWNED };
+  static const char* names[] = { " sqlite", " index, shared", " index, owned" };
+  code_index_stats_t stats;
+  db_options_t options;
+  media_t item;
+  uint32_t probes = (n < BENCH_PROBES) ? n : BENCH_PROBES;
+  uint32_t wrong;
+  double start;
+
+  printf("code index, %u codes:\n",n);
+  if (bench_fill(file,n) != MI_EXIT_OK) {
+    printf("init_db_ex(): failed\n");
+    return 1;
+  }
+
+  for (int i = 0; i < 3; i++) {
+    printf("%s:\n",names[i]);
+    db_options_init(&options);
+    options.code_index = modes[i];
+    start = now();
+    if (init_db_ex(file,&options) != MI_EXIT_OK) {
+      printf("init_db_ex(): failed\n");
+      remove_db(file);
+      return 1;
+    }
+    report("open",1,start);
+
+    srand(1);
+    wrong = 0;
+    start = now();
+    for (uint32_t j = 0; j < probes; j++)
+      if (fetch(&item,((uint32_t)rand() % n) * 2 + 1) != MI_EXIT_OK) wrong++;
+    report("fetch",probes,start);
+    if (wrong) printf("  %u wrong answers\n",wrong);
+    if (code_index_stats(&stats) == MI_EXIT_OK)
+      printf("  %ju rows in %ju KiB, built by %d threads in %.3f s, %ju hits\n",
+	     (uintmax_t)stats.rows,(uintmax_t)stats.bytes / 1024,stats.threads,
+	     stats.build_seconds,(uintmax_t)stats.hits);
+    close_db();
+  }
+  remove_db(file);
+  return 0;
+}
+
+void remove_shards(const char* dir) {
+  char buffer[512];
+
+  for (int i = 0; i < SHARD_MAX; i++) {
+    sprintf(buffer,"%s/shard-%02d.db",dir,i);
+    remove_db(buffer);
+  }
+  sprintf(buffer,"%s/shards",dir);
+  unlink(buffer);
+  rmdir(dir);
+}
+
+/* the same rows into 1, 2 and 4 shards, each shard's worker writing its
+ * file while the others write theirs
+ */
+int bench_shards(const char* file, uint32_t n) {
+  static const int counts[] = { 1, 2, 4 };
+  db_options_t options;
+  media_t* items = malloc(sizeof(media_t) * BENCH_BATCH);
+  book_t* details = calloc(BENCH_BATCH,sizeof(book_t));
+  uint32_t* codes = malloc(sizeof(uint32_t) * BENCH_BATCH);
+  uint8_t* found = malloc(BENCH_BATCH);
+  char dir[512];
+  uint32_t count;
+  uint32_t wrong;
+  double start;
+  int ret = 0;
+
+  if (items == NULL || details == NULL || codes == NULL || found == NULL) return 1;
+  sprintf(dir,"%s.shards",file);
+  db_options_preset(&options,"bulk-import");
+  printf("shards, %u rows:\n",n);
+
+  for (int c = 0; c < 3 && !ret; c++) {
+    printf(" %d shard%s:\n",counts[c],(counts[c] > 1) ? "s" : "");
+    remove_shards(dir);
+    if (shard_open(dir,counts[c],&options) != MI_EXIT_OK) {
+      printf("shard_open(): failed\n");
+      ret = 1;
+      break;
+    }
+
+    start = now();
+    for (uint32_t done = 0; done < n; done += count) {
+      count = (n - done < BENCH_BATCH) ? n - done : BENCH_BATCH;
+      for (uint32_t i = 0; i < count; i++) {
+	items[i].code = (done + i) * 2 + 1;
+	items[i].type = book;
+	sprintf(items[i].name,"SHARD ITEM %u",done + i);
+	strcpy(items[i].location,locations[i % 4]);
+	strcpy(details[i].title,items[i].name);
+      }
+      if (shard_store_book_item_batch(items,details,count,NULL) == MI_EXIT_ERROR) ret = 1;
+    }
+    report("ingest",n,start);
+
+    wrong = 0;
+    start = now();
+    for (uint32_t done = 0; done < n; done += count) {
+      count = (n - done < BENCH_BATCH) ? n - done : BENCH_BATCH;
+      for (uint32_t i = 0; i < count; i++)
+	codes[i] = (done + i) * 2 + 1;
+      if (shard_fetch_many(items,found,codes,count) == MI_EXIT_ERROR) ret = 1;
+      for (uint32_t i = 0; i < count; i++)
+	if (!found[i]) wrong++;
+    }
+    report("fetch_many",n,start);
+    if (wrong) printf("  %u wrong answers\n",wrong);
+    shard_close();
+  }
+
+  remove_shards(dir);
+  free(items);
+  free(details);
+  free(codes);
+  free(found);
+  return ret;
+}
+
+int bench_preset(const char* preset, const char* file, uint32_t n) {
+  db_options_t options;
+  db_options_t loader;
+  uint32_t* codes;
+
+  if (db_options_preset(&options,preset) != MI_EXIT_OK) {
+    printf("%s: no such preset\n",preset);
+    return 1;
+  }
+  printf("%s:\n",preset);
+
+  if ((codes = malloc(sizeof(uint32_t) * n)) == NULL) return 1;
+  remove_db(file);
+
+  /* read only profiles get a file filled in the default one */
+  if (options.read_only) {
+    db_options_preset(&loader,"default");
+    printf("  (loaded with default)\n");
+  }
+  else
+    loader = options;
+
+  if (init_db_ex(file,&loader) != MI_EXIT_OK) {
+    printf("init_db_ex(): failed\n");
+    free(codes);
+    return 1;
+  }
+  bench_store(codes,n);
+  close_db();
+
+  /* reads start from a fresh connection */
+  if (init_db_ex(file,&options) != MI_EXIT_OK) {
+    printf("init_db_ex(): failed\n");
+    remove_db(file);
+    free(codes);
+    return 1;
+  }
+  bench_fetch(codes,n);
+  bench_fetch_many(codes,n);
+  bench_isbn(n);
+  bench_search(n);
+  bench_page();
+  bench_list();
+  if (!options.read_only)
+    bench_checkout(codes,n);
+
+  close_db();
+  bench_remote(file,&options,codes,n);
+  remove_db(file);
+  free(codes);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  const char* file = "./bench.db";
+  uint32_t n = BENCH_ITEMS;
+  uint32_t filter_codes = 0;
+  uint32_t index_codes = 0;
+  uint32_t shard_rows = 0;
+  int opt;
+  int ret = 0;
+
+  init_debug_log(NULL,NOOP_LOG,0);
+
+  while ((opt = getopt(argc,argv,"n:f:F:I:S:")) != -1) {
+    switch (opt) {
+    case 'n':
+      n = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'I':
+      index_codes = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'S':
+      shard_rows = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'F':
+      filter_codes = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'f':
+      file = optarg;
+      break;
+    default:
+      fprintf(stderr,"usage: %s [-n items] [-f file] [-F codes] [-I codes] [-S rows]"
+	      " [preset ...]\n",
+	      argv[0]);
+      return 1;
+    }
+  }
+  if (n == 0) n = BENCH_ITEMS;
+
+  if (filter_codes) return bench_filter(file,filter_codes);
+  if (index_codes) return bench_index(file,index_codes);
+  if (shard_rows) return bench_shards(file,shard_rows);
+
+  bench_time(n);
+  printf("\n%u items in %s\n\n",n,file);
+  if (optind >= argc) {
+    for (size_t i = 0; i < sizeof(all_presets) / sizeof(all_presets[0]); i++)
+      ret |= bench_preset(all_presets[i],file,n);
+  }
+  else {
+    for (int i = optind; i < argc; i++)
+      ret |= bench_preset(argv[i],file,n);
+  }
+
+  return ret;
+}
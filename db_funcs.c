@@ -17,21 +17,2303 @@
  */
 
 /* great list of includes */
+#define _POSIX_C_SOURCE 200809L /* clock_gettime(), sysconf() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <time.h>
 #include <sqlite3.h>
 #include <sys/types.h>
 #include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "db_funcs.h"
 #include "log_funcs.h"
 
 /* this space reserved for the great evil of global variables */
 sqlite3* db_handle;
+int (*db_fault_hook)(const char* where) = NULL;
+void (*db_commit_hook)(const uint32_t* codes, size_t n) = NULL;
+
+/* one statement per built in medium or genre, for migration 6 -> 7 */
+#define MEDIUM_SEED(id, name)						\
+  "INSERT INTO media_types VALUES ((SELECT count(*) FROM media_types), '" name "', '" #id "');"
+#define GENRE_SEED(id, bit, name)					\
+  "INSERT INTO genres VALUES (" #bit ", '" name "', '" #id "');"
+
+/* schema migrations
+ * migrations[n] takes a file at user_version n to n+1.  They all run in one
+ * transaction on open, so a file is never left half upgraded.
+ */
+static const char* migrations[] = {
+  /* 0 -> 1: full text index over main for as-you-type search */
+  "CREATE VIRTUAL TABLE main_fts USING fts5"
+  "(name, location, content='main', content_rowid='code', prefix='2 3');"
+  "INSERT INTO main_fts(main_fts) VALUES ('rebuild');"
+  "CREATE TRIGGER main_fts_insert AFTER INSERT ON main BEGIN "
+  "INSERT INTO main_fts(rowid, name, location) VALUES (new.code, new.name, new.location); END;"
+  "CREATE TRIGGER main_fts_delete AFTER DELETE ON main BEGIN "
+  "INSERT INTO main_fts(main_fts, rowid, name, location) "
+  "VALUES ('delete', old.code, old.name, old.location); END;"
+  "CREATE TRIGGER main_fts_update AFTER UPDATE OF code, name, location ON main BEGIN "
+  "INSERT INTO main_fts(main_fts, rowid, name, location) "
+  "VALUES ('delete', old.code, old.name, old.location); "
+  "INSERT INTO main_fts(rowid, name, location) VALUES (new.code, new.name, new.location); END;",
+  /* 1 -> 2: indexes for ordered searches, code is the rowid so every index
+   * already ends in it and (col, code) keyset seeks are a single range scan
+   */
+  "CREATE INDEX IF NOT EXISTS main_name ON main(name);"
+  "CREATE INDEX IF NOT EXISTS main_update ON main(update_time);"
+  "CREATE INDEX IF NOT EXISTS main_location_update ON main(location, update_time);"
+  "CREATE INDEX IF NOT EXISTS books_title ON books(title);"
+  "CREATE INDEX IF NOT EXISTS movies_title ON movies(title);",
+  /* 2 -> 3: detail rows belong to their main row and go with it, sqlite
+   * can't add a foreign key to a table so both are rebuilt (dropping any
+   * detail rows that had already lost their main row)
+   */
+  "CREATE TABLE books_new "
+  "(code INTEGER PRIMARY KEY REFERENCES main(code) ON DELETE CASCADE ON UPDATE CASCADE, "
+  "type INTEGER NOT NULL, genre INTEGER NOT NULL, "
+  "isbn TEXT, title TEXT, author_last TEXT, author_first TEXT, author_rest TEXT);"
+  "INSERT INTO books_new SELECT * FROM books WHERE code IN (SELECT code FROM main);"
+  "DROP TABLE books;"
+  "ALTER TABLE books_new RENAME TO books;"
+  "CREATE INDEX books_title ON books(title);"
+  "CREATE TABLE movies_new "
+  "(code INTEGER PRIMARY KEY REFERENCES main(code) ON DELETE CASCADE ON UPDATE CASCADE, "
+  "type INTEGER NOT NULL, genre INTEGER NOT NULL, "
+  "title TEXT, director TEXT, studio TEXT, rating INTEGER);"
+  "INSERT INTO movies_new SELECT * FROM movies WHERE code IN (SELECT code FROM main);"
+  "DROP TABLE movies;"
+  "ALTER TABLE movies_new RENAME TO movies;"
+  "CREATE INDEX movies_title ON movies(title);",
+  /* 3 -> 4: skip the full text reindex when an update leaves the text
+   * alone, rescanning a shelf checks items out to where they already are
+   */
+  "DROP TRIGGER main_fts_update;"
+  "CREATE TRIGGER main_fts_update AFTER UPDATE OF code, name, location ON main "
+  "WHEN old.code <> new.code OR old.name IS NOT new.name OR old.location IS NOT new.location BEGIN "
+  "INSERT INTO main_fts(main_fts, rowid, name, location) "
+  "VALUES ('delete', old.code, old.name, old.location); "
+  "INSERT INTO main_fts(rowid, name, location) VALUES (new.code, new.name, new.location); END;",
+  /* 4 -> 5: ISBNs as 13 digit integers for scanner lookups, isbn13() is
+   * registered by init_db(), anything it can't read is left NULL
+   */
+  "ALTER TABLE books ADD COLUMN isbn13 INTEGER;"
+  "UPDATE books SET isbn13 = isbn13(isbn);"
+  "CREATE INDEX books_isbn13 ON books(isbn13) WHERE isbn13 IS NOT NULL;",
+  /* 5 -> 6: alphabetical listing by a precomputed key instead of folding
+   * names in the ORDER BY, sort_key() is registered by init_db()
+   */
+  "ALTER TABLE main ADD COLUMN sort_key TEXT;"
+  "UPDATE main SET sort_key = sort_key(name);"
+  "CREATE INDEX main_sort ON main(sort_key);"
+  "ALTER TABLE books ADD COLUMN sort_key TEXT;"
+  "UPDATE books SET sort_key = sort_key(title);"
+  "CREATE INDEX books_sort ON books(sort_key);"
+  "ALTER TABLE movies ADD COLUMN sort_key TEXT;"
+  "UPDATE movies SET sort_key = sort_key(title);"
+  "CREATE INDEX movies_sort ON movies(sort_key);",
+  /* 6 -> 7: media and genres as rows, seeded from MEDIUM_LIST and
+   * GENRE_LIST with the ids and bits already stored in books and movies,
+   * so no item changes; a medium's id is the count of those before it
+   */
+  "CREATE TABLE media_types (id INTEGER PRIMARY KEY, name TEXT NOT NULL, ident TEXT);"
+  "CREATE TABLE genres (bit INTEGER PRIMARY KEY CHECK (bit >= 0 AND bit < 64), "
+  "name TEXT NOT NULL, ident TEXT);"
+  MEDIUM_LIST(MEDIUM_SEED)
+  GENRE_LIST(GENRE_SEED)
+};
+#undef MEDIUM_SEED
+#undef GENRE_SEED
+#define DB_SCHEMA_VERSION (int)(sizeof(migrations)/sizeof(migrations[0]))
+
+static int migrate_db() {
+  char buffer[128];
+  sqlite3_stmt* query = NULL;
+  int version;
+
+  if (sqlite3_prepare_v2(db_handle,"PRAGMA user_version",-1,&query,NULL) != SQLITE_OK ||
+      sqlite3_step(query) != SQLITE_ROW) {
+    log_debug(ERROR,"migrate_db(): could not read schema version");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    sqlite3_finalize(query);
+    return MI_EXIT_ERROR;
+  }
+  version = sqlite3_column_int(query,0);
+  sqlite3_finalize(query);
+
+  if (version >= DB_SCHEMA_VERSION) return MI_EXIT_OK;
+
+  sprintf(buffer,"migrate_db(): upgrading schema %d to %d",version,DB_SCHEMA_VERSION);
+  log_debug(INFO,buffer);
+
+  if (sqlite3_exec(db_handle,"BEGIN IMMEDIATE",NULL,NULL,NULL) != SQLITE_OK) {
+    log_debug(ERROR,"migrate_db(): could not start transaction");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    return MI_EXIT_ERROR;
+  }
+
+  for (; version < DB_SCHEMA_VERSION; version++) {
+    if (sqlite3_exec(db_handle,migrations[version],NULL,NULL,NULL) != SQLITE_OK) {
+      sprintf(buffer,"migrate_db(): step %d failed",version);
+      log_debug(ERROR,buffer);
+      log_debug(ERROR,sqlite3_errmsg(db_handle));
+      sqlite3_exec(db_handle,"ROLLBACK",NULL,NULL,NULL);
+      return MI_EXIT_ERROR;
+    }
+  }
+
+  sprintf(buffer,"PRAGMA user_version = %d",DB_SCHEMA_VERSION);
+  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK ||
+      sqlite3_exec(db_handle,"COMMIT",NULL,NULL,NULL) != SQLITE_OK) {
+    log_debug(ERROR,"migrate_db(): could not commit upgrade");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    sqlite3_exec(db_handle,"ROLLBACK",NULL,NULL,NULL);
+    return MI_EXIT_ERROR;
+  }
+
+  return MI_EXIT_OK;
+}
+
+/* table layouts, columns in the same order as the structs */
+#define TABLE_MAIN   0
+#define TABLE_BOOKS  1
+#define TABLE_MOVIES 2
+
+static const char* table_names[] = { "main", "books", "movies" };
+static const char* table_columns[] = {
+  "code, type, name, location, update_time",
+  "code, type, genre, isbn, title, author_last, author_first, author_rest",
+  "code, type, genre, title, director, studio, rating"
+};
+
+/* filter fields, indexed by field_t, and which tables have them (bit per TABLE_*) */
+static const char* field_names[] = {
+  "code", "type", "name", "location", "update_time", "genre", "isbn", "title",
+  "author_last", "author_first", "author_rest", "director", "studio", "rating", "sort_key"
+};
+static const int field_tables[] = { 7, 7, 1, 1, 1, 6, 2, 6, 2, 2, 2, 4, 4, 4, 7 };
+static const char* op_strings[] = { "=", "<>", "<", "<=", ">", ">=", "LIKE" };
+
+/* prepared statement cache
+ * statements are kept by SQL text, so anything built with bound parameters
+ * (filters included, their values never reach the text) is only prepared
+ * the first time it is seen.  A statement is checked out while in use; if
+ * two threads want the same one at once the second gets a private copy.
+ */
+#define STMT_CACHE_SIZE 32
+
+typedef struct {
+  uint32_t      hash;
+  char*         sql;
+  sqlite3_stmt* stmt;
+  int           busy;
+  uint64_t      used;
+} stmt_slot_t;
+
+static stmt_slot_t stmt_cache[STMT_CACHE_SIZE];
+static uint64_t stmt_tick = 0;
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t sql_hash(const char* sql) {
+  uint32_t hash = 5381;
+
+  while (*sql)
+    hash = ((hash << 5) + hash) + (unsigned char)*sql++;
+  return hash;
+}
+
+static sqlite3_stmt* stmt_get(const char* sql) {
+  uint32_t hash = sql_hash(sql);
+  sqlite3_stmt* stmt = NULL;
+  stmt_slot_t* slot = NULL;
+  char* copy;
+
+  pthread_mutex_lock(&stmt_lock);
+  for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+    if (stmt_cache[i].stmt != NULL && !stmt_cache[i].busy &&
+	stmt_cache[i].hash == hash && strcmp(stmt_cache[i].sql,sql) == 0) {
+      stmt_cache[i].busy = 1;
+      stmt_cache[i].used = ++stmt_tick;
+      stmt = stmt_cache[i].stmt;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stmt_lock);
+  if (stmt != NULL) return stmt;
+
+  if (sqlite3_prepare_v2(db_handle,sql,-1,&stmt,NULL) != SQLITE_OK) {
+    log_debug(ERROR,"stmt_get(): could not prepare statement");
+    log_debug(ERROR,sql);
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    sqlite3_finalize(stmt);
+    return NULL;
+  }
+
+  /* without a copy of the text it just goes uncached */
+  if ((copy = malloc(strlen(sql) + 1)) == NULL) return stmt;
+  strcpy(copy,sql);
+
+  /* take an empty slot, or push out the least recently used idle one */
+  pthread_mutex_lock(&stmt_lock);
+  for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+    if (stmt_cache[i].busy) continue;
+    if (slot == NULL || stmt_cache[i].stmt == NULL || stmt_cache[i].used < slot->used)
+      slot = &stmt_cache[i];
+    if (slot->stmt == NULL) break;
+  }
+  if (slot != NULL) {
+    if (slot->stmt != NULL) {
+      sqlite3_finalize(slot->stmt);
+      free(slot->sql);
+    }
+    slot->hash = hash;
+    slot->sql = copy;
+    slot->stmt = stmt;
+    slot->busy = 1;
+    slot->used = ++stmt_tick;
+  }
+  pthread_mutex_unlock(&stmt_lock);
+  if (slot == NULL) free(copy);
+
+  return stmt;
+}
+
+static void stmt_put(sqlite3_stmt* stmt) {
+  int cached = 0;
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  pthread_mutex_lock(&stmt_lock);
+  for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+    if (stmt_cache[i].stmt == stmt) {
+      stmt_cache[i].busy = 0;
+      cached = 1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stmt_lock);
+
+  /* a private copy from a busy cache */
+  if (!cached) sqlite3_finalize(stmt);
+}
+
+static void stmt_flush() {
+  pthread_mutex_lock(&stmt_lock);
+  for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+    if (stmt_cache[i].stmt == NULL) continue;
+    sqlite3_finalize(stmt_cache[i].stmt);
+    free(stmt_cache[i].sql);
+    stmt_cache[i].stmt = NULL;
+    stmt_cache[i].sql = NULL;
+    stmt_cache[i].busy = 0;
+  }
+  pthread_mutex_unlock(&stmt_lock);
+}
+
+/* the statements belong to a connection forget_db() is leaving open */
+static void stmt_forget() {
+  pthread_mutex_lock(&stmt_lock);
+  for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+    free(stmt_cache[i].sql);
+    stmt_cache[i].stmt = NULL;
+    stmt_cache[i].sql = NULL;
+    stmt_cache[i].busy = 0;
+  }
+  pthread_mutex_unlock(&stmt_lock);
+}
+
+/* code filter
+ * a Bloom filter over every code in main, so exists() and fetch() can
+ * answer most misses without asking sqlite; book and movie codes are main
+ * codes too, so it serves all three tables.  A store sets a code's bits.
+ * Bits can't be cleared, so a delete only makes the filter less sure, and
+ * it is rebuilt once deletes pass half its codes or stores outgrow it.
+ * Commits through any other connection show up as a new data_version and
+ * the filter is rebuilt before it is trusted again.
+ */
+#define CODE_FILTER_HASHES   7       /* best for about 10 bits a code */
+#define CODE_FILTER_MIN_BITS 65536
+
+static uint64_t* bloom = NULL;
+static uint64_t bloom_mask;       /* bits - 1, bits is a power of two */
+static int bloom_bits_per_code = 0; /* 0 when there is no filter */
+static int bloom_stale = 0;
+static int64_t bloom_version = -1;
+static code_filter_stats_t bloom_stats;
+static pthread_mutex_t bloom_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* splitmix64, the two halves give the start and step of the k probes */
+static uint64_t bloom_hash(uint32_t code) {
+  uint64_t x = (uint64_t)code + 0x9e3779b97f4a7c15ULL;
+
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static void bloom_set(uint32_t code) {
+  uint64_t hash = bloom_hash(code);
+  uint64_t bit = hash & 0xffffffffULL;
+  uint64_t step = (hash >> 32) | 1;
+
+  for (int i = 0; i < CODE_FILTER_HASHES; i++, bit += step)
+    bloom[(bit & bloom_mask) >> 6] |= 1ULL << (bit & 63);
+}
+
+static int bloom_test(uint32_t code) {
+  uint64_t hash = bloom_hash(code);
+  uint64_t bit = hash & 0xffffffffULL;
+  uint64_t step = (hash >> 32) | 1;
+
+  for (int i = 0; i < CODE_FILTER_HASHES; i++, bit += step)
+    if (!(bloom[(bit & bloom_mask) >> 6] & (1ULL << (bit & 63)))) return 0;
+  return 1;
+}
+
+/* bumped by commits through other connections, not this one; the code
+ * filter and the code index both go stale on a new one
+ */
+static int64_t data_version() {
+  sqlite3_stmt* query;
+  int64_t version = -1;
+
+  if ((query = stmt_get("PRAGMA data_version")) == NULL) return -1;
+  if (sqlite3_step(query) == SQLITE_ROW) version = sqlite3_column_int64(query,0);
+  stmt_put(query);
+  return version;
+}
+
+/* sized for twice the codes there are now, bloom_lock held */
+static int bloom_build() {
+  char buffer[128];
+  sqlite3_stmt* query;
+  uint64_t codes = 0;
+  uint64_t bits = CODE_FILTER_MIN_BITS;
+  uint64_t* grown;
+  int retval;
+
+  bloom_stale = 1; /* until it's built */
+  bloom_version = data_version();
+  if ((query = stmt_get("SELECT count(*) FROM main")) == NULL) return MI_EXIT_ERROR;
+  if (sqlite3_step(query) == SQLITE_ROW) codes = (uint64_t)sqlite3_column_int64(query,0);
+  stmt_put(query);
+
+  while (bits < codes * 2 * bloom_bits_per_code) bits *= 2;
+  if ((grown = realloc(bloom,bits / 8)) == NULL) {
+    log_debug(ERROR,"bloom_build(): out of memory");
+    return MI_EXIT_ERROR;
+  }
+  bloom = grown;
+  memset(bloom,0,bits / 8);
+  bloom_mask = bits - 1;
+
+  if ((query = stmt_get("SELECT code FROM main")) == NULL) return MI_EXIT_ERROR;
+  codes = 0;
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+    bloom_set((uint32_t)sqlite3_column_int64(query,0));
+    codes++;
+  }
+  stmt_put(query);
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"bloom_build(): could not read the codes");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    return MI_EXIT_ERROR;
+  }
+
+  bloom_stats.bits = bits;
+  bloom_stats.codes = codes;
+  bloom_stats.deleted = 0;
+  bloom_stats.builds++;
+  bloom_stale = 0;
+  sprintf(buffer,"bloom_build(): %ju codes in %ju KiB",(uintmax_t)codes,(uintmax_t)bits / 8192);
+  log_debug(INFO,buffer);
+  return MI_EXIT_OK;
+}
+
+static void bloom_drop() {
+  pthread_mutex_lock(&bloom_lock);
+  free(bloom);
+  bloom = NULL;
+  bloom_bits_per_code = 0;
+  bloom_version = -1;
+  memset(&bloom_stats,0,sizeof(bloom_stats));
+  pthread_mutex_unlock(&bloom_lock);
+}
+
+static int bloom_open(int bits_per_code) {
+  int retval;
+
+  bloom_drop();
+  if (bits_per_code <= 0) return MI_EXIT_OK;
+  pthread_mutex_lock(&bloom_lock);
+  bloom_bits_per_code = bits_per_code;
+  if ((retval = bloom_build()) != MI_EXIT_OK) {
+    free(bloom);
+    bloom = NULL;
+    bloom_bits_per_code = 0;
+  }
+  pthread_mutex_unlock(&bloom_lock);
+  return retval;
+}
+
+static void bloom_test_all(const uint32_t* codes, size_t n, uint8_t* maybe, size_t* absent) {
+  *absent = 0;
+  for (size_t i = 0; i < n; i++) {
+    maybe[i] = bloom_test(codes[i]);
+    *absent += !maybe[i];
+  }
+}
+
+/* marks which of codes may be in main, 1 in maybe, and returns how many
+ * are certainly not; only a "not" has to be fresh, so data_version is
+ * read when one comes up rather than on every probe.  A filter that
+ * can't be rebuilt is dropped and everything goes to sqlite
+ */
+static size_t bloom_sift(const uint32_t* codes, size_t n, uint8_t* maybe) {
+  size_t absent = 0;
+
+  memset(maybe,1,n);
+  pthread_mutex_lock(&bloom_lock);
+  if (bloom_bits_per_code) {
+    if (!bloom_stale) bloom_test_all(codes,n,maybe,&absent);
+    if ((bloom_stale || (absent && data_version() != bloom_version)) &&
+	bloom_build() == MI_EXIT_OK)
+      bloom_test_all(codes,n,maybe,&absent);
+    if (bloom_stale) {
+      log_debug(ERROR,"bloom_sift(): filter dropped");
+      free(bloom);
+      bloom = NULL;
+      bloom_bits_per_code = 0;
+      memset(maybe,1,n);
+      absent = 0;
+    }
+    else {
+      bloom_stats.probes += n;
+      bloom_stats.negatives += absent;
+    }
+  }
+  pthread_mutex_unlock(&bloom_lock);
+  return absent;
+}
+
+static int bloom_absent(uint32_t code) {
+  uint8_t maybe;
+
+  return bloom_sift(&code,1,&maybe) != 0;
+}
+
+/* the filter said maybe and sqlite said no */
+static void bloom_missed(uint64_t count) {
+  pthread_mutex_lock(&bloom_lock);
+  if (bloom_bits_per_code) bloom_stats.false_positives += count;
+  pthread_mutex_unlock(&bloom_lock);
+}
+
+static void bloom_stored(uint32_t code) {
+  pthread_mutex_lock(&bloom_lock);
+  if (bloom_bits_per_code) {
+    bloom_set(code);
+    bloom_stats.codes++;
+    if (bloom_stats.codes * bloom_bits_per_code > bloom_stats.bits) bloom_stale = 1;
+  }
+  pthread_mutex_unlock(&bloom_lock);
+}
+
+static void bloom_deleted(uint64_t count) {
+  pthread_mutex_lock(&bloom_lock);
+  if (bloom_bits_per_code) {
+    bloom_stats.deleted += count;
+    if (bloom_stats.deleted * 2 > bloom_stats.codes) bloom_stale = 1;
+  }
+  pthread_mutex_unlock(&bloom_lock);
+}
+
+int code_filter_stats(code_filter_stats_t* stats) {
+  uint64_t set = 0;
+  double fill;
+
+  pthread_mutex_lock(&bloom_lock);
+  if (!bloom_bits_per_code) {
+    pthread_mutex_unlock(&bloom_lock);
+    memset(stats,0,sizeof(code_filter_stats_t));
+    return MI_NO_RESULTS;
+  }
+  *stats = bloom_stats;
+  for (uint64_t i = 0; i < bloom_stats.bits / 64; i++)
+    set += (uint64_t)__builtin_popcountll(bloom[i]);
+  pthread_mutex_unlock(&bloom_lock);
+
+  /* a miss gets past the filter only if all k of its bits are set */
+  fill = (double)set / stats->bits;
+  stats->expected_fpr = 1;
+  for (int i = 0; i < CODE_FILTER_HASHES; i++)
+    stats->expected_fpr *= fill;
+  stats->fpr = (stats->negatives + stats->false_positives) ?
+    (double)stats->false_positives / (stats->negatives + stats->false_positives) : 0;
+  return MI_EXIT_OK;
+}
+
+/* filters */
+void filter_init(filter_t* filter) {
+  filter->num_terms = 0;
+  filter->depth = 0;
+  filter->order = -1;
+  filter->desc = 0;
+  filter->limit = 0;
+  filter->offset = 0;
+  filter->after = 0;
+}
+
+static filter_term_t* filter_add(filter_t* filter, int kind) {
+  filter_term_t* term;
+
+  if (filter->num_terms >= FILTER_MAX_TERMS) {
+    log_debug(ERROR,"filter_add(): too many terms in filter");
+    return NULL;
+  }
+  term = &filter->terms[filter->num_terms++];
+  term->kind = kind;
+  term->join = FILTER_AND;
+  term->is_text = 0;
+  term->num = 0;
+  term->text[0] = '\0';
+  return term;
+}
+
+int filter_int(filter_t* filter, field_t field, op_t op, int64_t value) {
+  filter_term_t* term;
+
+  if (op == OP_LIKE || op == OP_PREFIX) {
+    log_debug(ERROR,"filter_int(): text operator on a number");
+    return MI_EXIT_ERROR;
+  }
+  if ((term = filter_add(filter,FILTER_TERM)) == NULL) return MI_EXIT_ERROR;
+  term->field = field;
+  term->op = op;
+  term->num = value;
+  return MI_EXIT_OK;
+}
+
+int filter_text(filter_t* filter, field_t field, op_t op, const char* value) {
+  filter_term_t* term;
+
+  if (op == OP_HAS) {
+    log_debug(ERROR,"filter_text(): bit test on text");
+    return MI_EXIT_ERROR;
+  }
+  if (strlen(value) >= sizeof(term->text)) {
+    log_debug(ERROR,"filter_text(): value too long");
+    return MI_EXIT_ERROR;
+  }
+  if ((term = filter_add(filter,FILTER_TERM)) == NULL) return MI_EXIT_ERROR;
+  term->field = field;
+  term->op = op;
+  term->is_text = 1;
+  strcpy(term->text,value);
+  return MI_EXIT_OK;
+}
+
+int filter_open(filter_t* filter, int join) {
+  filter_term_t* term;
+
+  if ((term = filter_add(filter,FILTER_OPEN)) == NULL) return MI_EXIT_ERROR;
+  term->join = join;
+  filter->depth++;
+  return MI_EXIT_OK;
+}
+
+int filter_close(filter_t* filter) {
+  if (filter->depth == 0) {
+    log_debug(ERROR,"filter_close(): no group open");
+    return MI_EXIT_ERROR;
+  }
+  if (filter_add(filter,FILTER_CLOSE) == NULL) return MI_EXIT_ERROR;
+  filter->depth--;
+  return MI_EXIT_OK;
+}
+
+void filter_order(filter_t* filter, field_t field, int desc) {
+  filter->order = field;
+  filter->desc = desc;
+}
+
+void filter_limit(filter_t* filter, uint32_t limit, uint32_t offset) {
+  filter->limit = limit;
+  filter->offset = offset;
+}
+
+/* keyset cursors
+ * the next page starts just past (key, code) in the filter's order, so it
+ * costs an index seek rather than skipping over everything before it
+ */
+int filter_after_int(filter_t* filter, int64_t key, uint32_t code) {
+  if (filter->order < 0) {
+    log_debug(ERROR,"filter_after_int(): filter has no order");
+    return MI_EXIT_ERROR;
+  }
+  filter->after = 1;
+  filter->after_is_text = 0;
+  filter->after_num = key;
+  filter->after_code = code;
+  filter->offset = 0;
+  return MI_EXIT_OK;
+}
+
+int filter_after_text(filter_t* filter, const char* key, uint32_t code) {
+  if (filter->order < 0) {
+    log_debug(ERROR,"filter_after_text(): filter has no order");
+    return MI_EXIT_ERROR;
+  }
+  if (strlen(key) >= sizeof(filter->after_text)) {
+    log_debug(ERROR,"filter_after_text(): key too long");
+    return MI_EXIT_ERROR;
+  }
+  filter->after = 1;
+  filter->after_is_text = 1;
+  strcpy(filter->after_text,key);
+  filter->after_code = code;
+  filter->offset = 0;
+  return MI_EXIT_OK;
+}
+
+int filter_next(filter_t* filter, const media_t* last) {
+  char key[sizeof(last->name)];
+
+  switch (filter->order) {
+  case F_CODE:     return filter_after_int(filter,last->code,last->code);
+  case F_TYPE:     return filter_after_int(filter,last->type,last->code);
+  case F_NAME:     return filter_after_text(filter,last->name,last->code);
+  case F_LOCATION: return filter_after_text(filter,last->location,last->code);
+  case F_UPDATE:   return filter_after_int(filter,last->update,last->code);
+  case F_SORT:
+    sort_key(last->name,key,sizeof(key));
+    return filter_after_text(filter,key,last->code);
+  default:
+    log_debug(ERROR,"filter_next(): filter not ordered on a main column");
+    return MI_EXIT_ERROR;
+  }
+}
+
+int filter_next_book(filter_t* filter, const book_t* last) {
+  char key[sizeof(last->title)];
+
+  switch (filter->order) {
+  case F_CODE:         return filter_after_int(filter,last->code,last->code);
+  case F_TYPE:         return filter_after_int(filter,last->type,last->code);
+  case F_GENRE:        return filter_after_int(filter,(int64_t)last->genre,last->code);
+  case F_ISBN:         return filter_after_text(filter,last->isbn,last->code);
+  case F_TITLE:        return filter_after_text(filter,last->title,last->code);
+  case F_AUTHOR_LAST:  return filter_after_text(filter,last->author_last,last->code);
+  case F_AUTHOR_FIRST: return filter_after_text(filter,last->author_first,last->code);
+  case F_AUTHOR_REST:  return filter_after_text(filter,last->author_rest,last->code);
+  case F_SORT:
+    sort_key(last->title,key,sizeof(key));
+    return filter_after_text(filter,key,last->code);
+  default:
+    log_debug(ERROR,"filter_next_book(): filter not ordered on a books column");
+    return MI_EXIT_ERROR;
+  }
+}
+
+int filter_next_movie(filter_t* filter, const movie_t* last) {
+  char key[sizeof(last->title)];
+
+  switch (filter->order) {
+  case F_CODE:     return filter_after_int(filter,last->code,last->code);
+  case F_TYPE:     return filter_after_int(filter,last->type,last->code);
+  case F_GENRE:    return filter_after_int(filter,(int64_t)last->genre,last->code);
+  case F_TITLE:    return filter_after_text(filter,last->title,last->code);
+  case F_DIRECTOR: return filter_after_text(filter,last->director,last->code);
+  case F_STUDIO:   return filter_after_text(filter,last->studio,last->code);
+  case F_RATING:   return filter_after_int(filter,last->rating,last->code);
+  case F_SORT:
+    sort_key(last->title,key,sizeof(key));
+    return filter_after_text(filter,key,last->code);
+  default:
+    log_debug(ERROR,"filter_next_movie(): filter not ordered on a movies column");
+    return MI_EXIT_ERROR;
+  }
+}
+
+static int sql_append(char** p, char* end, const char* format, ...) {
+  va_list args;
+  int len;
+
+  if (*p >= end) return MI_EXIT_ERROR;
+  va_start(args,format);
+  len = vsnprintf(*p,end - *p,format,args);
+  va_end(args);
+  if (len < 0 || len >= end - *p) {
+    *p = end;
+    return MI_EXIT_ERROR;
+  }
+  *p += len;
+  return MI_EXIT_OK;
+}
+
+/* the SQL for a filter depends only on its shape, never its values, so
+ * the same kind of search always comes out as the same cached statement
+ */
+static int filter_compile(const filter_t* filter, int table, const char* columns,
+			  char* sql, size_t size) {
+  char* p = sql;
+  char* end = sql + size;
+  int first[FILTER_MAX_TERMS + 1];
+  int joins[FILTER_MAX_TERMS + 1];
+  int depth = 0;
+  const filter_term_t* term;
+  const char* name;
+
+  sql_append(&p,end,"SELECT %s FROM %s",columns,table_names[table]);
+
+  if (filter != NULL && (filter->num_terms > 0 || filter->after))
+    sql_append(&p,end," WHERE ");
+
+  if (filter != NULL && filter->num_terms > 0) {
+    sql_append(&p,end,"(");
+    first[0] = 1;
+    joins[0] = FILTER_AND;
+
+    for (int i = 0; i < filter->num_terms; i++) {
+      term = &filter->terms[i];
+
+      if (term->kind == FILTER_CLOSE) {
+	if (depth == 0) return MI_EXIT_ERROR;
+	sql_append(&p,end,"%s)",first[depth] ? "1" : "");
+	depth--;
+	continue;
+      }
+
+      if (!first[depth])
+	sql_append(&p,end,(joins[depth] == FILTER_OR) ? " OR " : " AND ");
+      first[depth] = 0;
+
+      if (term->kind == FILTER_OPEN) {
+	sql_append(&p,end,"(");
+	depth++;
+	first[depth] = 1;
+	joins[depth] = term->join;
+	continue;
+      }
+
+      if ((int)term->field < 0 || term->field > F_SORT ||
+	  !(field_tables[term->field] & (1 << table))) {
+	log_debug(ERROR,"filter_compile(): field not in table");
+	return MI_EXIT_ERROR;
+      }
+      if ((int)term->op < 0 || term->op > OP_HAS) {
+	log_debug(ERROR,"filter_compile(): no such operator");
+	return MI_EXIT_ERROR;
+      }
+      name = field_names[term->field];
+
+      switch (term->op) {
+      case OP_PREFIX:
+	sql_append(&p,end,"(%s >= ? AND %s < ?)",name,name);
+	break;
+      case OP_HAS:
+	sql_append(&p,end,"(%s & ?) = ?",name);
+	break;
+      default:
+	sql_append(&p,end,"%s %s ?",name,op_strings[term->op]);
+      }
+    }
+
+    /* groups left open close at the end */
+    for (; depth > 0; depth--)
+      sql_append(&p,end,"%s)",first[depth] ? "1" : "");
+    sql_append(&p,end,")");
+    if (filter->after)
+      sql_append(&p,end," AND ");
+  }
+
+  if (filter != NULL && filter->order >= 0 &&
+      (filter->order > F_SORT || !(field_tables[filter->order] & (1 << table)))) {
+    log_debug(ERROR,"filter_compile(): order field not in table");
+    return MI_EXIT_ERROR;
+  }
+
+  if (filter != NULL && filter->after) {
+    if (filter->order < 0) {
+      log_debug(ERROR,"filter_compile(): cursor without an order");
+      return MI_EXIT_ERROR;
+    }
+    /* a row value compare is one range on the (col, code) index */
+    if (filter->order == F_CODE)
+      sql_append(&p,end,"code %s ?",filter->desc ? "<" : ">");
+    /* a key rebuilt from a fetched name is cut short with the name, so
+     * the row's own key is used while the row is still there
+     */
+    else if (filter->order == F_SORT)
+      sql_append(&p,end,"(sort_key, code) %s "
+		 "(COALESCE((SELECT sort_key FROM %s WHERE code = ?), ?), ?)",
+		 filter->desc ? "<" : ">",table_names[table]);
+    else
+      sql_append(&p,end,"(%s, code) %s (?, ?)",field_names[filter->order],
+		 filter->desc ? "<" : ">");
+  }
+
+  if (filter != NULL && filter->order >= 0) {
+    /* code breaks ties so the order is always the same */
+    if (filter->order == F_CODE)
+      sql_append(&p,end," ORDER BY code%s",filter->desc ? " DESC" : "");
+    else
+      sql_append(&p,end," ORDER BY %s%s, code%s",field_names[filter->order],
+		 filter->desc ? " DESC" : "",filter->desc ? " DESC" : "");
+  }
+
+  if (filter != NULL && (filter->limit || filter->offset))
+    sql_append(&p,end," LIMIT ? OFFSET ?");
+
+  if (p >= end) {
+    log_debug(ERROR,"filter_compile(): filter too big for buffer");
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+/* smallest string above everything starting with prefix */
+static void prefix_bound(const char* prefix, char* bound) {
+  size_t len = strlen(prefix);
+
+  strcpy(bound,prefix);
+  while (len > 0 && (unsigned char)bound[len - 1] == 0xff)
+    bound[--len] = '\0';
+  if (len == 0) {
+    strcpy(bound,"\xff");
+    return;
+  }
+  bound[len - 1]++;
+}
+
+static int filter_bind(sqlite3_stmt* query, const filter_t* filter) {
+  const filter_term_t* term;
+  char bound[128];
+  int param = 1;
+
+  if (filter == NULL) return MI_EXIT_OK;
+
+  for (int i = 0; i < filter->num_terms; i++) {
+    term = &filter->terms[i];
+    if (term->kind != FILTER_TERM) continue;
+
+    switch (term->op) {
+    case OP_PREFIX:
+      prefix_bound(term->text,bound);
+      sqlite3_bind_text(query,param++,term->text,-1,SQLITE_TRANSIENT);
+      sqlite3_bind_text(query,param++,bound,-1,SQLITE_TRANSIENT);
+      break;
+    case OP_HAS:
+      sqlite3_bind_int64(query,param++,term->num);
+      sqlite3_bind_int64(query,param++,term->num);
+      break;
+    default:
+      if (term->is_text)
+	sqlite3_bind_text(query,param++,term->text,-1,SQLITE_TRANSIENT);
+      else
+	sqlite3_bind_int64(query,param++,term->num);
+    }
+  }
+
+  if (filter->after) {
+    if (filter->order == F_SORT)
+      sqlite3_bind_int64(query,param++,filter->after_code);
+    if (filter->order != F_CODE) {
+      if (filter->after_is_text)
+	sqlite3_bind_text(query,param++,filter->after_text,-1,SQLITE_TRANSIENT);
+      else
+	sqlite3_bind_int64(query,param++,filter->after_num);
+    }
+    sqlite3_bind_int64(query,param++,filter->after_code);
+  }
+
+  if (filter->limit || filter->offset) {
+    sqlite3_bind_int64(query,param++,filter->limit ? (sqlite3_int64)filter->limit : -1);
+    sqlite3_bind_int64(query,param++,filter->offset);
+  }
+  return MI_EXIT_OK;
+}
+
+/* a cached statement for the filter with its values bound, give it back with stmt_put() */
+static sqlite3_stmt* filter_prepare(const filter_t* filter, int table, const char* caller) {
+  char sql[2048];
+  sqlite3_stmt* query;
+
+  if (filter != NULL && filter->depth != 0) {
+    log_debug(ERROR,"filter_prepare(): filter has unclosed groups");
+    return NULL;
+  }
+  if (filter_compile(filter,table,table_columns[table],sql,sizeof(sql)) != MI_EXIT_OK)
+    return NULL;
+
+  log_debug(INFO,caller);
+  log_debug(INFO,sql);
+  if ((query = stmt_get(sql)) == NULL) return NULL;
+  filter_bind(query,filter);
+  return query;
+}
+
+/* text columns are copied by their byte length and cut to fit the field,
+ * short of any partly copied UTF-8 character, a NULL column reads as ""
+ */
+static size_t copy_column(char* dest, size_t size, sqlite3_stmt* query, int col) {
+  const unsigned char* text = sqlite3_column_text(query,col);
+  size_t len = (size_t)sqlite3_column_bytes(query,col);
+
+  if (text == NULL) len = 0;
+  if (len >= size) {
+    len = size - 1;
+    while (len > 0 && (text[len] & 0xc0) == 0x80) len--;
+  }
+  memcpy(dest,text,len);
+  dest[len] = '\0';
+  return len;
+}
+#define COPY_COLUMN(dest,query,col) copy_column(dest,sizeof(dest),query,col)
+
+/* row readers, one per table, in column order */
+static void read_media(sqlite3_stmt* query, media_t* item) {
+  item->code =   (uint32_t)sqlite3_column_int64(query,0);
+  item->type =   (medium_t)sqlite3_column_int(query,1);
+  COPY_COLUMN(item->name,query,2);
+  COPY_COLUMN(item->location,query,3);
+  item->update = (time_t)sqlite3_column_int64(query,4);
+}
+
+static void read_book(sqlite3_stmt* query, book_t* item) {
+  item->code =  (uint32_t)sqlite3_column_int64(query,0);
+  item->type =  (medium_t)sqlite3_column_int(query,1);
+  item->genre =  (genre_t)sqlite3_column_int64(query,2);
+  COPY_COLUMN(item->isbn,query,3);
+  COPY_COLUMN(item->title,query,4);
+  COPY_COLUMN(item->author_last,query,5);
+  COPY_COLUMN(item->author_first,query,6);
+  COPY_COLUMN(item->author_rest,query,7);
+}
+
+static void read_movie(sqlite3_stmt* query, movie_t* item) {
+  item->code =  (uint32_t)sqlite3_column_int64(query,0);
+  item->type =  (medium_t)sqlite3_column_int(query,1);
+  item->genre =  (genre_t)sqlite3_column_int64(query,2);
+  COPY_COLUMN(item->title,query,3);
+  COPY_COLUMN(item->director,query,4);
+  COPY_COLUMN(item->studio,query,5);
+  item->rating =   (short)sqlite3_column_int(query,6);
+}
+
+/* code index
+ * an optional in-memory copy of every row, so fetch*(), exists*() and
+ * fetch_many*() answer hits without going through sqlite.  Each table gets
+ * an open addressing hash table, linear probing over 8 byte slots (eight
+ * to a cache line), pointing at packed rows: the number columns and an
+ * offset into a text arena holding the text columns end to end.  It's
+ * filled at open by up to a thread per CPU, each with its own read only
+ * connection and a slice of the codes.  sqlite's update hook reports
+ * every row this connection changes, rolled back or not, and the index
+ * forgets that code; a row read through sqlite outside a transaction goes
+ * back in.  Commits through other connections clear it, unless it was
+ * opened INDEX_OWNED and there can't be any.
+ */
+#define CODE_INDEX_THREADS   8
+#define CODE_INDEX_MIN_SLOTS 1024
+
+typedef struct {
+  uint32_t code;
+  uint32_t row;   /* 0 for an empty slot, rows count from 1 */
+} index_slot_t;
+
+typedef struct {
+  int64_t  num[3]; /* the number columns after code, in column order */
+  uint32_t code;
+  uint32_t text;   /* offset of the text columns, each NUL terminated */
+} index_row_t;
+
+typedef struct {
+  index_slot_t* slots;
+  size_t        mask;      /* slots - 1, a power of two */
+  size_t        used;
+  index_row_t*  rows;
+  size_t        num_rows;  /* counting the unused rows[0] */
+  size_t        size_rows;
+  char*         text;
+  size_t        text_used;
+  size_t        size_text;
+  size_t        garbage;   /* rows no slot points at any more */
+} code_index_t;
+
+static const int index_texts[] = { 2, 5, 3 }; /* text columns per table */
+
+static code_index_t index_tables[3];
+static int index_mode = INDEX_OFF;
+static int64_t index_version = -1;
+static uint64_t index_changes = 0; /* bumped by every row this connection changes */
+static code_index_stats_t index_stats;
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t index_hash(uint32_t code) {
+  return (size_t)(((uint64_t)code * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static index_slot_t* index_find(code_index_t* ix, uint32_t code) {
+  size_t i;
+
+  if (ix->slots == NULL) return NULL;
+  for (i = index_hash(code) & ix->mask; ix->slots[i].row; i = (i + 1) & ix->mask)
+    if (ix->slots[i].code == code) return &ix->slots[i];
+  return NULL;
+}
+
+/* code must not be in it already, and there must be a free slot */
+static void index_link(code_index_t* ix, uint32_t code, uint32_t row) {
+  size_t i;
+
+  for (i = index_hash(code) & ix->mask; ix->slots[i].row; i = (i + 1) & ix->mask);
+  ix->slots[i].code = code;
+  ix->slots[i].row = row;
+  ix->used++;
+}
+
+/* slots for at least twice want, so probes stay short */
+static int index_resize(code_index_t* ix, size_t want) {
+  index_slot_t* old = ix->slots;
+  size_t old_size = (old) ? ix->mask + 1 : 0;
+  size_t size = CODE_INDEX_MIN_SLOTS;
+
+  while (size < want * 2) size *= 2;
+  if ((ix->slots = calloc(size,sizeof(index_slot_t))) == NULL) {
+    ix->slots = old;
+    log_debug(ERROR,"index_resize(): out of memory");
+    return MI_EXIT_ERROR;
+  }
+  ix->mask = size - 1;
+  ix->used = 0;
+  for (size_t i = 0; i < old_size; i++)
+    if (old[i].row) index_link(ix,old[i].code,old[i].row);
+  free(old);
+  return MI_EXIT_OK;
+}
+
+static int index_append_text(code_index_t* ix, const char* text) {
+  size_t len = strlen(text) + 1;
+  size_t size = (ix->size_text) ? ix->size_text : 65536;
+  char* grown;
+
+  while (ix->text_used + len > size) size *= 2;
+  if (size != ix->size_text) {
+    if ((grown = realloc(ix->text,size)) == NULL) return MI_EXIT_ERROR;
+    ix->text = grown;
+    ix->size_text = size;
+  }
+  memcpy(ix->text + ix->text_used,text,len);
+  ix->text_used += len;
+  return MI_EXIT_OK;
+}
+
+/* packs item into a new row, no slot, 0 if out of memory */
+static uint32_t index_append(code_index_t* ix, int table, const void* item) {
+  const char* texts[5];
+  index_row_t row;
+  index_row_t* grown;
+  size_t size;
+  int n;
+
+  memset(&row,0,sizeof(row));
+  switch (table) {
+  case TABLE_MAIN: {
+    const media_t* media = item;
+    row.code = media->code;
+    row.num[0] = media->type;
+    row.num[1] = (int64_t)media->update;
+    texts[0] = media->name;
+    texts[1] = media->location;
+    break;
+  }
+  case TABLE_BOOKS: {
+    const book_t* book = item;
+    row.code = book->code;
+    row.num[0] = book->type;
+    row.num[1] = (int64_t)book->genre;
+    texts[0] = book->isbn;
+    texts[1] = book->title;
+    texts[2] = book->author_last;
+    texts[3] = book->author_first;
+    texts[4] = book->author_rest;
+    break;
+  }
+  default: {
+    const movie_t* movie = item;
+    row.code = movie->code;
+    row.num[0] = movie->type;
+    row.num[1] = (int64_t)movie->genre;
+    row.num[2] = movie->rating;
+    texts[0] = movie->title;
+    texts[1] = movie->director;
+    texts[2] = movie->studio;
+  }
+  }
+
+  if (ix->num_rows == 0) ix->num_rows = 1;
+  if (ix->num_rows >= ix->size_rows) {
+    size = (ix->size_rows) ? ix->size_rows * 2 : 4096;
+    if ((grown = realloc(ix->rows,size * sizeof(index_row_t))) == NULL) return 0;
+    ix->rows = grown;
+    ix->size_rows = size;
+  }
+  row.text = (uint32_t)ix->text_used;
+  for (n = 0; n < index_texts[table]; n++)
+    if (index_append_text(ix,texts[n]) != MI_EXIT_OK) return 0;
+  ix->rows[ix->num_rows] = row;
+  return (uint32_t)ix->num_rows++;
+}
+
+static const char* index_copy(char* dest, const char* text) {
+  size_t len = strlen(text) + 1;
+
+  memcpy(dest,text,len);
+  return text + len;
+}
+
+static void index_read(const code_index_t* ix, int table, uint32_t r, void* item) {
+  const index_row_t* row = &ix->rows[r];
+  const char* text = ix->text + row->text;
+
+  switch (table) {
+  case TABLE_MAIN: {
+    media_t* media = item;
+    media->code = row->code;
+    media->type = (medium_t)row->num[0];
+    media->update = (time_t)row->num[1];
+    text = index_copy(media->name,text);
+    index_copy(media->location,text);
+    break;
+  }
+  case TABLE_BOOKS: {
+    book_t* book = item;
+    book->code = row->code;
+    book->type = (medium_t)row->num[0];
+    book->genre = (genre_t)row->num[1];
+    text = index_copy(book->isbn,text);
+    text = index_copy(book->title,text);
+    text = index_copy(book->author_last,text);
+    text = index_copy(book->author_first,text);
+    index_copy(book->author_rest,text);
+    break;
+  }
+  default: {
+    movie_t* movie = item;
+    movie->code = row->code;
+    movie->type = (medium_t)row->num[0];
+    movie->genre = (genre_t)row->num[1];
+    movie->rating = (short)row->num[2];
+    text = index_copy(movie->title,text);
+    text = index_copy(movie->director,text);
+    index_copy(movie->studio,text);
+  }
+  }
+}
+
+static void index_free(code_index_t* ix) {
+  free(ix->slots);
+  free(ix->rows);
+  free(ix->text);
+  memset(ix,0,sizeof(code_index_t));
+}
+
+/* copies the rows slots point at into fresh arrays, leaving the garbage */
+static int index_compact(code_index_t* ix, int table) {
+  code_index_t fresh;
+  const char* text;
+  size_t len;
+
+  memset(&fresh,0,sizeof(fresh));
+  fresh.num_rows = 1;
+  fresh.size_rows = ix->used + 1;
+  fresh.size_text = 65536;
+  for (size_t i = 0; i <= ix->mask; i++) {
+    if (!ix->slots[i].row) continue;
+    text = ix->text + ix->rows[ix->slots[i].row].text;
+    for (int n = 0; n < index_texts[table]; n++) text += strlen(text) + 1;
+    fresh.text_used += (size_t)(text - (ix->text + ix->rows[ix->slots[i].row].text));
+  }
+  while (fresh.size_text < fresh.text_used) fresh.size_text *= 2;
+  if ((fresh.rows = malloc(fresh.size_rows * sizeof(index_row_t))) == NULL ||
+      (fresh.text = malloc(fresh.size_text)) == NULL) {
+    free(fresh.rows);
+    return MI_EXIT_ERROR;
+  }
+
+  fresh.text_used = 0;
+  for (size_t i = 0; i <= ix->mask; i++) {
+    if (!ix->slots[i].row) continue;
+    fresh.rows[fresh.num_rows] = ix->rows[ix->slots[i].row];
+    text = ix->text + ix->rows[ix->slots[i].row].text;
+    len = 0;
+    for (int n = 0; n < index_texts[table]; n++) len += strlen(text + len) + 1;
+    memcpy(fresh.text + fresh.text_used,text,len);
+    fresh.rows[fresh.num_rows].text = (uint32_t)fresh.text_used;
+    fresh.text_used += len;
+    ix->slots[i].row = (uint32_t)fresh.num_rows++;
+  }
+  free(ix->rows);
+  free(ix->text);
+  ix->rows = fresh.rows;
+  ix->num_rows = fresh.num_rows;
+  ix->size_rows = fresh.size_rows;
+  ix->text = fresh.text;
+  ix->text_used = fresh.text_used;
+  ix->size_text = fresh.size_text;
+  ix->garbage = 0;
+  return MI_EXIT_OK;
+}
+
+/* index_lock held */
+static void index_add(int table, const void* item) {
+  code_index_t* ix = &index_tables[table];
+  index_slot_t* slot;
+  uint32_t code = *(const uint32_t*)item; /* code is first in every row type */
+  uint32_t row;
+
+  if (ix->num_rows + 1 >= UINT32_MAX || ix->text_used >= UINT32_MAX / 2) return;
+  if ((ix->used + 1) * 2 > ix->mask + 1 && index_resize(ix,(ix->used + 1) * 2) != MI_EXIT_OK)
+    return;
+  if ((row = index_append(ix,table,item)) == 0) return;
+  if ((slot = index_find(ix,code)) != NULL) {
+    slot->row = row;
+    ix->garbage++;
+  }
+  else
+    index_link(ix,code,row);
+  if (ix->garbage > 1024 && ix->garbage > ix->num_rows / 2) index_compact(ix,table);
+}
+
+/* backward shift deletion, so probes never need tombstones */
+static void index_forget(code_index_t* ix, uint32_t code) {
+  index_slot_t* slot = index_find(ix,code);
+  size_t i, j, home;
+
+  if (slot == NULL) return;
+  i = (size_t)(slot - ix->slots);
+  for (j = (i + 1) & ix->mask; ix->slots[j].row; j = (j + 1) & ix->mask) {
+    /* the entry at j can fill the hole at i unless its home is after i */
+    home = index_hash(ix->slots[j].code) & ix->mask;
+    if ((j > i) ? (home <= i || home > j) : (home <= i && home > j)) {
+      ix->slots[i] = ix->slots[j];
+      i = j;
+    }
+  }
+  ix->slots[i].row = 0;
+  ix->used--;
+  ix->garbage++;
+  index_stats.forgotten++;
+}
+
+static void index_clear() {
+  for (int t = 0; t < 3; t++) {
+    code_index_t* ix = &index_tables[t];
+    if (ix->slots) memset(ix->slots,0,(ix->mask + 1) * sizeof(index_slot_t));
+    ix->used = 0;
+    ix->num_rows = 1;
+    ix->text_used = 0;
+    ix->garbage = 0;
+  }
+}
+
+/* sqlite3_update_hook() callback, any row of ours that changes */
+static void index_changed(void* data, int op, const char* database, const char* table,
+			  sqlite3_int64 code) {
+  (void)data;
+  (void)op;
+  (void)database;
+  if (strcmp(table,"main") && strcmp(table,"books") && strcmp(table,"movies")) return;
+  /* a main delete cascades, so the code goes from all three */
+  pthread_mutex_lock(&index_lock);
+  index_changes++;
+  for (int t = 0; t < 3; t++)
+    index_forget(&index_tables[t],(uint32_t)code);
+  pthread_mutex_unlock(&index_lock);
+}
+
+/* a slice of one table's codes, read into rows with no slots */
+typedef struct {
+  int          table;
+  int64_t      low;
+  int64_t      high;
+  int          done;
+  code_index_t part;
+} index_job_t;
+
+typedef struct {
+  const char*     file;
+  index_job_t*    jobs;
+  int             num_jobs;
+  int             next;
+  pthread_mutex_t lock;
+} index_build_t;
+
+static int index_scan(sqlite3* handle, index_job_t* job) {
+  char sql[192];
+  sqlite3_stmt* query;
+  union {
+    media_t media;
+    book_t  book;
+    movie_t movie;
+  } item;
+  int retval;
+
+  index_free(&job->part);
+  sprintf(sql,"SELECT %s FROM %s WHERE code BETWEEN ? AND ?",
+	  table_columns[job->table],table_names[job->table]);
+  if (sqlite3_prepare_v2(handle,sql,-1,&query,NULL) != SQLITE_OK) return MI_EXIT_ERROR;
+  sqlite3_bind_int64(query,1,job->low);
+  sqlite3_bind_int64(query,2,job->high);
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+    switch (job->table) {
+    case TABLE_MAIN:  read_media(query,&item.media); break;
+    case TABLE_BOOKS: read_book(query,&item.book);   break;
+    default:          read_movie(query,&item.movie);
+    }
+    if (index_append(&job->part,job->table,&item) == 0) break;
+  }
+  sqlite3_finalize(query);
+  return (retval == SQLITE_DONE) ? MI_EXIT_OK : MI_EXIT_ERROR;
+}
+
+/* jobs a worker can't do, because its connection didn't open or a scan
+ * failed, are left for index_build() to do on db_handle
+ */
+static void* index_worker(void* data) {
+  index_build_t* build = data;
+  sqlite3* handle = NULL;
+  int job;
+
+  if (sqlite3_open_v2(build->file,&handle,SQLITE_OPEN_READONLY,NULL) != SQLITE_OK) {
+    sqlite3_close(handle);
+    return NULL;
+  }
+  for (;;) {
+    pthread_mutex_lock(&build->lock);
+    job = build->next++;
+    pthread_mutex_unlock(&build->lock);
+    if (job >= build->num_jobs) break;
+    build->jobs[job].done = (index_scan(handle,&build->jobs[job]) == MI_EXIT_OK);
+  }
+  sqlite3_close(handle);
+  return NULL;
+}
+
+/* adds a slice's rows to a table sized for them */
+static int index_merge(code_index_t* ix, const code_index_t* part) {
+  index_row_t* rows;
+  char* text;
+  size_t size_rows = ix->num_rows + part->num_rows;
+  size_t size_text = ix->text_used + part->text_used;
+
+  if (part->num_rows < 2) return MI_EXIT_OK;
+  if (ix->num_rows == 0) ix->num_rows = 1;
+  if (size_text >= UINT32_MAX) {
+    log_debug(ERROR,"index_merge(): too much text for the index");
+    return MI_EXIT_ERROR;
+  }
+  if (size_rows > ix->size_rows) {
+    if ((rows = realloc(ix->rows,size_rows * sizeof(index_row_t))) == NULL) return MI_EXIT_ERROR;
+    ix->rows = rows;
+    ix->size_rows = size_rows;
+  }
+  if (size_text > ix->size_text) {
+    if ((text = realloc(ix->text,size_text)) == NULL) return MI_EXIT_ERROR;
+    ix->text = text;
+    ix->size_text = size_text;
+  }
+
+  memcpy(ix->text + ix->text_used,part->text,part->text_used);
+  for (size_t r = 1; r < part->num_rows; r++) {
+    ix->rows[ix->num_rows] = part->rows[r];
+    ix->rows[ix->num_rows].text += (uint32_t)ix->text_used;
+    index_link(ix,part->rows[r].code,(uint32_t)ix->num_rows++);
+  }
+  ix->text_used += part->text_used;
+  return MI_EXIT_OK;
+}
+
+/* splits each table's code range between the threads, then links what
+ * they read into the tables
+ */
+static int index_build() {
+  char buffer[128];
+  char sql[96];
+  pthread_t threads[CODE_INDEX_THREADS];
+  index_job_t jobs[3 * CODE_INDEX_THREADS];
+  index_build_t build;
+  sqlite3_stmt* query;
+  struct timespec start, end;
+  int64_t low, high, step;
+  size_t rows[3] = { 0, 0, 0 };
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = (cpus > CODE_INDEX_THREADS) ? CODE_INDEX_THREADS : (cpus < 1) ? 1 : (int)cpus;
+  int started = 0;
+  int retval = MI_EXIT_OK;
+
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  build.file = sqlite3_db_filename(db_handle,"main");
+  if (build.file == NULL || build.file[0] == '\0') num_threads = 1; /* in memory, no one else can open it */
+  build.jobs = jobs;
+  build.num_jobs = 0;
+  build.next = 0;
+  pthread_mutex_init(&build.lock,NULL);
+  index_version = data_version();
+
+  for (int t = 0; t < 3; t++) {
+    sprintf(sql,"SELECT min(code), max(code) FROM %s",table_names[t]);
+    if ((query = stmt_get(sql)) == NULL) return MI_EXIT_ERROR;
+    if (sqlite3_step(query) != SQLITE_ROW || sqlite3_column_type(query,0) == SQLITE_NULL) {
+      stmt_put(query);
+      continue;
+    }
+    low = sqlite3_column_int64(query,0);
+    high = sqlite3_column_int64(query,1);
+    stmt_put(query);
+    step = (high - low) / num_threads + 1;
+    for (; low <= high; low += step) {
+      memset(&jobs[build.num_jobs],0,sizeof(index_job_t));
+      jobs[build.num_jobs].table = t;
+      jobs[build.num_jobs].low = low;
+      jobs[build.num_jobs].high = (low + step - 1 < high) ? low + step - 1 : high;
+      build.num_jobs++;
+    }
+  }
+
+  if (num_threads > 1)
+    for (; started < num_threads; started++)
+      if (pthread_create(&threads[started],NULL,index_worker,&build) != 0) break;
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i],NULL);
+  pthread_mutex_destroy(&build.lock);
+
+  for (int i = 0; i < build.num_jobs; i++) {
+    if (!jobs[i].done && index_scan(db_handle,&jobs[i]) != MI_EXIT_OK) {
+      log_debug(ERROR,"index_build(): could not read the rows");
+      log_debug(ERROR,sqlite3_errmsg(db_handle));
+      retval = MI_EXIT_ERROR;
+    }
+    if (jobs[i].part.num_rows) rows[jobs[i].table] += jobs[i].part.num_rows - 1;
+  }
+
+  /* the first slice of a table becomes its rows, the others are added on */
+  for (int i = 0; i < build.num_jobs && retval == MI_EXIT_OK; i++) {
+    code_index_t* ix = &index_tables[jobs[i].table];
+    code_index_t* part = &jobs[i].part;
+    if (ix->slots == NULL && index_resize(ix,rows[jobs[i].table]) != MI_EXIT_OK) {
+      retval = MI_EXIT_ERROR;
+      break;
+    }
+    retval = index_merge(ix,part);
+  }
+  for (int i = 0; i < build.num_jobs; i++)
+    index_free(&jobs[i].part);
+  if (retval != MI_EXIT_OK) return retval;
+
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  index_stats.threads = (started) ? started : 1;
+  index_stats.build_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  sprintf(buffer,"index_build(): %zu rows by %d threads in %.3f s",rows[0] + rows[1] + rows[2],
+	  index_stats.threads,index_stats.build_seconds);
+  log_debug(INFO,buffer);
+  return MI_EXIT_OK;
+}
+
+static void index_drop() {
+  if (db_handle != NULL) sqlite3_update_hook(db_handle,NULL,NULL);
+  pthread_mutex_lock(&index_lock);
+  for (int t = 0; t < 3; t++)
+    index_free(&index_tables[t]);
+  index_mode = INDEX_OFF;
+  index_version = -1;
+  memset(&index_stats,0,sizeof(index_stats));
+  pthread_mutex_unlock(&index_lock);
+}
+
+/* an immutable file has no other writers, whatever mode was asked for */
+static int index_open(int mode, int read_only) {
+  int retval;
+
+  index_drop();
+  if (mode != INDEX_SHARED && mode != INDEX_OWNED) return MI_EXIT_OK;
+  pthread_mutex_lock(&index_lock);
+  if ((retval = index_build()) == MI_EXIT_OK) {
+    index_mode = (read_only == DB_IMMUTABLE) ? INDEX_OWNED : mode;
+    sqlite3_update_hook(db_handle,index_changed,NULL);
+  }
+  else {
+    log_debug(ERROR,"index_open(): no code index");
+    for (int t = 0; t < 3; t++)
+      index_free(&index_tables[t]);
+  }
+  pthread_mutex_unlock(&index_lock);
+  return retval;
+}
+
+/* MI_EXIT_OK and the row in item (if it isn't NULL) when the index has
+ * code, MI_NO_RESULTS to ask sqlite; *mark is for index_offer()
+ */
+static int index_fetch(int table, uint32_t code, void* item, uint64_t* mark) {
+  index_slot_t* slot;
+  int retval = MI_NO_RESULTS;
+
+  if (index_mode == INDEX_OFF) return MI_NO_RESULTS;
+  pthread_mutex_lock(&index_lock);
+  if (index_mode == INDEX_SHARED && data_version() != index_version) {
+    index_clear();
+    index_stats.clears++;
+    index_version = data_version();
+  }
+  if ((slot = index_find(&index_tables[table],code)) != NULL) {
+    if (item) index_read(&index_tables[table],table,slot->row,item);
+    index_stats.hits++;
+    retval = MI_EXIT_OK;
+  }
+  else
+    index_stats.misses++;
+  if (mark) *mark = index_changes;
+  pthread_mutex_unlock(&index_lock);
+  return retval;
+}
+
+/* a row just read through sqlite; it's only trusted if nothing changed
+ * since the mark and there's no transaction that could still roll back
+ */
+static void index_offer(int table, const void* item, uint64_t mark) {
+  if (index_mode == INDEX_OFF) return;
+  pthread_mutex_lock(&index_lock);
+  if (index_mode != INDEX_OFF && index_changes == mark && sqlite3_get_autocommit(db_handle))
+    index_add(table,item);
+  pthread_mutex_unlock(&index_lock);
+}
+
+int code_index_stats(code_index_stats_t* stats) {
+  pthread_mutex_lock(&index_lock);
+  if (index_mode == INDEX_OFF) {
+    pthread_mutex_unlock(&index_lock);
+    memset(stats,0,sizeof(code_index_stats_t));
+    return MI_NO_RESULTS;
+  }
+  *stats = index_stats;
+  stats->rows = 0;
+  stats->bytes = 0;
+  for (int t = 0; t < 3; t++) {
+    const code_index_t* ix = &index_tables[t];
+    stats->rows += ix->used;
+    stats->bytes += ((ix->slots) ? (ix->mask + 1) * sizeof(index_slot_t) : 0) +
+      ix->size_rows * sizeof(index_row_t) + ix->size_text;
+  }
+  pthread_mutex_unlock(&index_lock);
+  return MI_EXIT_OK;
+}
+
+/* row writers
+ * the INSERT and UPDATE for a table take their parameters in the same
+ * order, sort key and code last, so one binder serves both
+ */
+static const char* insert_sql[] = {
+  "INSERT INTO main (type, name, location, update_time, sort_key, code) "
+  "VALUES (?, ?, ?, ?, ?, ?)",
+  "INSERT INTO books (type, genre, isbn, title, author_last, author_first, author_rest, isbn13, "
+  "sort_key, code) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+  "INSERT INTO movies (type, genre, title, director, studio, rating, sort_key, code) "
+  "VALUES (?, ?, ?, ?, ?, ?, ?, ?)"
+};
+static const char* update_sql[] = {
+  "UPDATE main SET type = ?, name = ?, location = ?, update_time = ?, sort_key = ? "
+  "WHERE code = ?",
+  "UPDATE books SET type = ?, genre = ?, isbn = ?, title = ?, author_last = ?, "
+  "author_first = ?, author_rest = ?, isbn13 = ?, sort_key = ? WHERE code = ?",
+  "UPDATE movies SET type = ?, genre = ?, title = ?, director = ?, studio = ?, rating = ?, "
+  "sort_key = ? WHERE code = ?"
+};
+
+static void bind_media(sqlite3_stmt* query, const media_t* item, const char* key) {
+  sqlite3_bind_int(query,1,item->type);
+  sqlite3_bind_text(query,2,item->name,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,3,item->location,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,4,(sqlite3_int64)item->update);
+  sqlite3_bind_text(query,5,key,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,6,item->code);
+}
+
+/* isbn13 is the normalised isbn, 0 when there isn't a valid one */
+static void bind_book(sqlite3_stmt* query, const book_t* item, uint64_t isbn13,
+		      const char* key) {
+  sqlite3_bind_int(query,1,item->type);
+  sqlite3_bind_int64(query,2,(sqlite3_int64)item->genre);
+  sqlite3_bind_text(query,3,item->isbn,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,4,item->title,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,5,item->author_last,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,6,item->author_first,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,7,item->author_rest,-1,SQLITE_STATIC);
+  if (isbn13)
+    sqlite3_bind_int64(query,8,(sqlite3_int64)isbn13);
+  else
+    sqlite3_bind_null(query,8);
+  sqlite3_bind_text(query,9,key,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,10,item->code);
+}
+
+static void bind_movie(sqlite3_stmt* query, const movie_t* item, const char* key) {
+  sqlite3_bind_int(query,1,item->type);
+  sqlite3_bind_int64(query,2,(sqlite3_int64)item->genre);
+  sqlite3_bind_text(query,3,item->title,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,4,item->director,-1,SQLITE_STATIC);
+  sqlite3_bind_text(query,5,item->studio,-1,SQLITE_STATIC);
+  sqlite3_bind_int(query,6,item->rating);
+  sqlite3_bind_text(query,7,key,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,8,item->code);
+}
+
+/* codes changed since the last commit, for db_commit_hook
+ * kept through savepoints rolled back inside a transaction (the hook
+ * reads the rows as committed, so a code that ended up unchanged costs a
+ * lookup and nothing more) and dropped when the whole transaction is
+ */
+static uint32_t* changed_codes = NULL;
+static size_t num_changed = 0;
+static size_t size_changed = 0;
+
+static void changed(uint32_t code) {
+  uint32_t* grown;
+  size_t size;
+
+  if (db_commit_hook == NULL) return;
+  if (num_changed >= size_changed) {
+    size = (size_changed) ? size_changed * 2 : 64;
+    if ((grown = realloc(changed_codes,sizeof(uint32_t) * size)) == NULL) {
+      log_debug(ERROR,"changed(): out of memory, change not passed on");
+      return;
+    }
+    changed_codes = grown;
+    size_changed = size;
+  }
+  changed_codes[num_changed++] = code;
+}
+
+/* after a write, a commit or a rollback, only the outermost counts */
+static void changes_done(int committed) {
+  if (!sqlite3_get_autocommit(db_handle)) return;
+  if (committed && num_changed && db_commit_hook != NULL)
+    db_commit_hook(changed_codes,num_changed);
+  num_changed = 0;
+}
+
+/* MI_EXISTS if an insert hits a code already there, MI_NO_RESULTS if an
+ * update finds nothing to change
+ */
+static int write_row(int table, int insert, const void* item, const char* caller) {
+  char buffer[128];
+  char key[128];
+  sqlite3_stmt* query;
+  uint64_t isbn13 = 0;
+  int retval;
+
+  /* an isbn that doesn't check out is kept as text, just not indexed */
+  if (table == TABLE_BOOKS &&
+      isbn_normalise(((const book_t*)item)->isbn,&isbn13) == MI_EXIT_ERROR) {
+    sprintf(buffer,"%s: isbn not valid, not indexed",caller);
+    log_debug(INFO,buffer);
+    log_debug(INFO,((const book_t*)item)->isbn);
+    isbn13 = 0;
+  }
+
+  switch (table) {
+  case TABLE_MAIN:  sort_key(((const media_t*)item)->name,key,sizeof(key));  break;
+  case TABLE_BOOKS: sort_key(((const book_t*)item)->title,key,sizeof(key));  break;
+  default:          sort_key(((const movie_t*)item)->title,key,sizeof(key));
+  }
+
+  sprintf(buffer,"%s: executing query",caller);
+  log_debug(INFO,buffer);
+  log_debug(INFO,(insert) ? insert_sql[table] : update_sql[table]);
+  if ((query = stmt_get((insert) ? insert_sql[table] : update_sql[table])) == NULL)
+    return MI_EXIT_ERROR;
+
+  switch (table) {
+  case TABLE_MAIN:  bind_media(query,item,key);        break;
+  case TABLE_BOOKS: bind_book(query,item,isbn13,key); break;
+  default:          bind_movie(query,item,key);
+  }
+
+  retval = sqlite3_step(query);
+  stmt_put(query);
+
+  if (retval == SQLITE_DONE) {
+    if (!insert && sqlite3_changes(db_handle) == 0) {
+      sprintf(buffer,"%s: no such item in %s",caller,table_names[table]);
+      log_debug(INFO,buffer);
+      return MI_NO_RESULTS;
+    }
+    if (insert && table == TABLE_MAIN) bloom_stored(((const media_t*)item)->code);
+    switch (table) {
+    case TABLE_MAIN:  changed(((const media_t*)item)->code); break;
+    case TABLE_BOOKS: changed(((const book_t*)item)->code);  break;
+    default:          changed(((const movie_t*)item)->code);
+    }
+    changes_done(1);
+    return MI_EXIT_OK;
+  }
+  if (sqlite3_extended_errcode(db_handle) == SQLITE_CONSTRAINT_PRIMARYKEY) {
+    sprintf(buffer,"%s: item already in %s",caller,table_names[table]);
+    log_debug(INFO,buffer);
+    return MI_EXISTS;
+  }
+  sprintf(buffer,"%s: error writing %s",caller,table_names[table]);
+  log_debug(ERROR,buffer);
+  log_debug(ERROR,sqlite3_errmsg(db_handle));
+  return MI_EXIT_ERROR;
+}
+
+/* transactions
+ * savepoints rather than BEGIN so these nest inside a caller's own
+ * transaction, outside of one they start and commit a real one
+ */
+static int exec_cached(const char* sql) {
+  sqlite3_stmt* query;
+  int retval;
+
+  if ((query = stmt_get(sql)) == NULL) return MI_EXIT_ERROR;
+  retval = sqlite3_step(query);
+  stmt_put(query);
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,sql);
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+static int tx_begin() {
+  return exec_cached("SAVEPOINT mindex_tx");
+}
+
+static int tx_commit() {
+  if (exec_cached("RELEASE mindex_tx") == MI_EXIT_OK) {
+    changes_done(1);
+    return MI_EXIT_OK;
+  }
+  exec_cached("ROLLBACK TO mindex_tx");
+  exec_cached("RELEASE mindex_tx");
+  changes_done(0);
+  return MI_EXIT_ERROR;
+}
+
+static void tx_rollback() {
+  exec_cached("ROLLBACK TO mindex_tx");
+  exec_cached("RELEASE mindex_tx");
+  changes_done(0);
+}
+
+/* isbn13(text) for SQL, NULL for anything that isn't an ISBN */
+static void isbn13_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+  const unsigned char* text = sqlite3_value_text(argv[0]);
+  uint64_t isbn13;
+
+  (void)argc;
+  if (text != NULL && isbn_normalise((const char*)text,&isbn13) == MI_EXIT_OK)
+    sqlite3_result_int64(context,(sqlite3_int64)isbn13);
+  else
+    sqlite3_result_null(context);
+}
+
+/* sort_key(text) for SQL */
+static void sort_key_function(sqlite3_context* context, int argc, sqlite3_value** argv) {
+  const unsigned char* text = sqlite3_value_text(argv[0]);
+  char key[512];
+
+  (void)argc;
+  if (text == NULL) {
+    sqlite3_result_null(context);
+    return;
+  }
+  sort_key((const char*)text,key,sizeof(key));
+  sqlite3_result_text(context,key,-1,SQLITE_TRANSIENT);
+}
+
+/* runtime profiles */
+static const char* journal_names[] = {
+  NULL, "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"
+};
+
+void db_options_init(db_options_t* options) {
+  options->cache_kib = 0;
+  options->mmap_size = 0;
+  options->journal = JOURNAL_DEFAULT;
+  options->synchronous = -1;
+  options->temp_store = 0;
+  options->busy_timeout = 0;
+  options->page_size = 0;
+  options->read_only = DB_READ_WRITE;
+  options->code_filter = CODE_FILTER_BITS;
+  options->code_index = INDEX_OFF;
+}
+
+int db_options_preset(db_options_t* options, const char* name) {
+  db_options_init(options);
+
+  if (strcmp(name,"default") == 0) {
+    return MI_EXIT_OK;
+  }
+  if (strcmp(name,"durable") == 0) {
+    /* every commit on disk before it returns, readers never wait on it */
+    options->journal = JOURNAL_WAL;
+    options->synchronous = 2;
+    options->busy_timeout = 5000;
+    return MI_EXIT_OK;
+  }
+  if (strcmp(name,"bulk-import") == 0) {
+    /* a crash means starting the import again */
+    options->cache_kib = 65536;
+    options->journal = JOURNAL_MEMORY;
+    options->synchronous = 0;
+    options->temp_store = 2;
+    options->page_size = 8192;
+    return MI_EXIT_OK;
+  }
+  if (strcmp(name,"kiosk-readonly") == 0) {
+    /* lookups only, served out of the page cache and the mapped file, and
+     * no locks on a file that is only replaced, never written in place
+     */
+    options->cache_kib = 16384;
+    options->mmap_size = 268435456;
+    options->temp_store = 2;
+    options->read_only = DB_IMMUTABLE;
+    options->code_index = INDEX_OWNED;
+    return MI_EXIT_OK;
+  }
+
+  log_debug(ERROR,"db_options_preset(): no such preset");
+  log_debug(ERROR,name);
+  return MI_NO_RESULTS;
+}
+
+static int apply_pragma(const char* sql) {
+  log_debug(INFO,sql);
+  if (sqlite3_exec(db_handle,sql,NULL,NULL,NULL) != SQLITE_OK) {
+    log_debug(ERROR,"apply_options(): pragma failed");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+/* page size first, it only takes before the first table is made and can't
+ * change once the file is in WAL mode
+ */
+static int apply_options(const db_options_t* options) {
+  char buffer[128];
+
+  if (options->read_only) {
+    /* page size and journal are the writer's business */
+    if (apply_pragma("PRAGMA query_only = ON") != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  else if (options->page_size > 0) {
+    sprintf(buffer,"PRAGMA page_size = %d",options->page_size);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (!options->read_only && options->journal > JOURNAL_DEFAULT &&
+      options->journal <= JOURNAL_OFF) {
+    sprintf(buffer,"PRAGMA journal_mode = %s",journal_names[options->journal]);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (options->synchronous >= 0 && options->synchronous <= 3) {
+    sprintf(buffer,"PRAGMA synchronous = %d",options->synchronous);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (options->cache_kib > 0) {
+    /* negative means KiB rather than pages */
+    sprintf(buffer,"PRAGMA cache_size = -%d",options->cache_kib);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (options->mmap_size > 0) {
+    sprintf(buffer,"PRAGMA mmap_size = %jd",(intmax_t)options->mmap_size);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (options->temp_store > 0 && options->temp_store <= 2) {
+    sprintf(buffer,"PRAGMA temp_store = %d",options->temp_store);
+    if (apply_pragma(buffer) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  }
+  if (options->busy_timeout > 0)
+    sqlite3_busy_timeout(db_handle,options->busy_timeout);
+
+  return MI_EXIT_OK;
+}
+
+/* medium and genre names
+ * the registry: names by id (or bit) in dense arrays, and a hash of every
+ * name and enum name, any case, to its id.  init_db() loads it from the
+ * media_types and genres tables, close_db() puts back the built in lists.
+ * Names, and the genre strings made from them, are interned and only
+ * freed at exit, so a string handed out stays valid whatever is opened
+ * after, and opening the same catalogue again reuses the same strings.
+ */
+#define MEDIUM_NAME(id, name) name,
+#define MEDIUM_ID(id, name)   #id,
+static const char* builtin_medium_names[] = { MEDIUM_LIST(MEDIUM_NAME) };
+static const char* builtin_medium_ids[]   = { MEDIUM_LIST(MEDIUM_ID) };
+#undef MEDIUM_NAME
+#undef MEDIUM_ID
+
+#define GENRE_BIT(id, bit, name)  bit,
+#define GENRE_NAME(id, bit, name) name,
+#define GENRE_ID(id, bit, name)   #id,
+static const int builtin_genre_bits[]    = { GENRE_LIST(GENRE_BIT) };
+static const char* builtin_genre_names[] = { GENRE_LIST(GENRE_NAME) };
+static const char* builtin_genre_ids[]   = { GENRE_LIST(GENRE_ID) };
+#undef GENRE_BIT
+#undef GENRE_NAME
+#undef GENRE_ID
+
+#define GENRE_STRING_MAX (GENRE_MAX * (GENRE_NAME_SIZE + 2)) /* every genre at once fits */
+
+typedef struct {
+  const char* key;
+  int         id;
+} name_slot_t;
+
+typedef struct {
+  name_slot_t* slots;
+  size_t       mask; /* size - 1, size a power of two */
+  size_t       used;
+} name_map_t;
+
+static name_map_t interned;         /* exact case, ids unused */
+static const char** medium_names = NULL;
+static const char** medium_ids = NULL; /* NULL for media added by medium_add() */
+static int num_media = 0;
+static int size_media = 0;
+static name_map_t medium_map;
+static const char* genre_names[GENRE_MAX];
+static const char* genre_ids[GENRE_MAX];
+static size_t genre_lengths[GENRE_MAX];
+static uint64_t genre_defined = 0;
+static name_map_t genre_map;
+static int registry_ready = 0;
+
+/* a string per genre mask, built the first time it's asked for; catalogues
+ * only use a handful of combinations, so this stays small
+ */
+typedef struct {
+  uint64_t    mask;
+  const char* string; /* interned */
+} genre_slot_t;
+
+static genre_slot_t* genre_cache = NULL;
+static size_t genre_cache_mask = 0;
+static size_t genre_cache_used = 0;
+static pthread_mutex_t genre_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t name_hash(const char* text, size_t len, int fold) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)((fold) ? toupper((unsigned char)text[i]) : text[i]);
+    hash *= 0x100000001b3ULL;
+  }
+  return (size_t)hash;
+}
+
+/* the slot holding text (len bytes), or the empty one it would go in */
+static name_slot_t* map_find(const name_map_t* map, const char* text, size_t len, int fold) {
+  size_t i;
+
+  if (map->slots == NULL) return NULL;
+  for (i = name_hash(text,len,fold) & map->mask; map->slots[i].key != NULL;
+       i = (i + 1) & map->mask) {
+    if (((fold) ? strncasecmp(map->slots[i].key,text,len) :
+	 strncmp(map->slots[i].key,text,len)) == 0 && map->slots[i].key[len] == '\0')
+      break;
+  }
+  return &map->slots[i];
+}
+
+/* the first id given a key keeps it */
+static int map_put(name_map_t* map, const char* key, int id, int fold) {
+  name_slot_t* grown;
+  name_slot_t* old = map->slots;
+  size_t old_size = (old) ? map->mask + 1 : 0;
+  size_t size;
+  name_slot_t* slot;
+
+  if ((map->used + 1) * 2 > old_size) {
+    size = (old_size) ? old_size * 2 : 64;
+    if ((grown = calloc(size,sizeof(name_slot_t))) == NULL) return MI_EXIT_ERROR;
+    map->slots = grown;
+    map->mask = size - 1;
+    for (size_t i = 0; i < old_size; i++) {
+      if (old[i].key == NULL) continue;
+      *map_find(map,old[i].key,strlen(old[i].key),fold) = old[i];
+    }
+    free(old);
+  }
+
+  slot = map_find(map,key,strlen(key),fold);
+  if (slot->key != NULL) return MI_EXISTS;
+  slot->key = key;
+  slot->id = id;
+  map->used++;
+  return MI_EXIT_OK;
+}
+
+static void map_clear(name_map_t* map) {
+  free(map->slots);
+  map->slots = NULL;
+  map->mask = 0;
+  map->used = 0;
+}
+
+/* everything the registry holds, at exit */
+static void registry_free() {
+  if (interned.slots != NULL)
+    for (size_t i = 0; i <= interned.mask; i++) free((char*)interned.slots[i].key);
+  map_clear(&interned);
+  map_clear(&medium_map);
+  map_clear(&genre_map);
+  free(medium_names);
+  free(medium_ids);
+  medium_names = NULL;
+  medium_ids = NULL;
+  num_media = 0;
+  size_media = 0;
+  genre_defined = 0;
+  memset(genre_names,0,sizeof(genre_names));
+  memset(genre_ids,0,sizeof(genre_ids));
+  free(genre_cache);
+  genre_cache = NULL;
+  genre_cache_mask = 0;
+  genre_cache_used = 0;
+  registry_ready = 0;
+}
+
+static const char* intern(const char* text) {
+  static int registered = 0;
+  name_slot_t* slot = map_find(&interned,text,strlen(text),0);
+  size_t len = strlen(text);
+  char* copy;
+
+  if (slot != NULL && slot->key != NULL) return slot->key;
+  if (!registered) registered = (atexit(registry_free) == 0);
+  if ((copy = malloc(len + 1)) == NULL) return NULL;
+  memcpy(copy,text,len + 1);
+  if (map_put(&interned,copy,0,0) == MI_EXIT_ERROR) {
+    free(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+static int registry_medium(int id, const char* name, const char* ident) {
+  const char** names;
+  const char** ids;
+  int size;
+
+  if (id < 0 || id >= MEDIUM_MAX || strlen(name) >= MEDIUM_NAME_SIZE) {
+    log_debug(ERROR,"registry_medium(): medium out of range");
+    return MI_EXIT_ERROR;
+  }
+  if (id >= size_media) {
+    for (size = (size_media) ? size_media : 32; size <= id; size *= 2);
+    if ((names = realloc(medium_names,sizeof(char*) * size)) == NULL) return MI_EXIT_ERROR;
+    medium_names = names;
+    if ((ids = realloc(medium_ids,sizeof(char*) * size)) == NULL) return MI_EXIT_ERROR;
+    medium_ids = ids;
+    size_media = size;
+  }
+  /* gaps read as OTHER */
+  for (; num_media <= id; num_media++) {
+    medium_names[num_media] = "OTHER";
+    medium_ids[num_media] = NULL;
+  }
+  if ((medium_names[id] = intern(name)) == NULL) return MI_EXIT_ERROR;
+  medium_ids[id] = NULL;
+  if (ident != NULL && (medium_ids[id] = intern(ident)) == NULL) return MI_EXIT_ERROR;
+  return MI_EXIT_OK;
+}
+
+static int registry_genre(int bit, const char* name, const char* ident) {
+  if (bit < 0 || bit >= GENRE_MAX || strlen(name) >= GENRE_NAME_SIZE || strchr(name,',')) {
+    log_debug(ERROR,"registry_genre(): genre out of range");
+    return MI_EXIT_ERROR;
+  }
+  if ((genre_names[bit] = intern(name)) == NULL) return MI_EXIT_ERROR;
+  genre_ids[bit] = NULL;
+  if (ident != NULL && (genre_ids[bit] = intern(ident)) == NULL) return MI_EXIT_ERROR;
+  genre_lengths[bit] = strlen(name);
+  genre_defined |= (uint64_t)1 << bit;
+  return MI_EXIT_OK;
+}
+
+/* enum names first, OTHER is both vinyl's name and other's */
+static int registry_index() {
+  map_clear(&medium_map);
+  map_clear(&genre_map);
+  for (int i = 0; i < num_media; i++)
+    if (medium_ids[i] != NULL && map_put(&medium_map,medium_ids[i],i,1) == MI_EXIT_ERROR)
+      return MI_EXIT_ERROR;
+  for (int i = 0; i < num_media; i++)
+    if (map_put(&medium_map,medium_names[i],i,1) == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  for (int bit = 0; bit < GENRE_MAX; bit++)
+    if (genre_ids[bit] != NULL && map_put(&genre_map,genre_ids[bit],bit,1) == MI_EXIT_ERROR)
+      return MI_EXIT_ERROR;
+  for (int bit = 0; bit < GENRE_MAX; bit++)
+    if ((genre_defined & ((uint64_t)1 << bit)) &&
+	map_put(&genre_map,genre_names[bit],bit,1) == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  return MI_EXIT_OK;
+}
+
+/* cached genre strings stay right unless a bit they name changes name;
+ * only the table goes, the strings are interned and stay valid for
+ * whoever still holds them, and are found again if the names come back
+ */
+static void genre_cache_check(const char** old_names, uint64_t old_defined) {
+  for (int bit = 0; bit < GENRE_MAX; bit++) {
+    if (!(old_defined & ((uint64_t)1 << bit))) continue;
+    if ((genre_defined & ((uint64_t)1 << bit)) && genre_names[bit] == old_names[bit]) continue;
+    pthread_mutex_lock(&genre_lock);
+    free(genre_cache);
+    genre_cache = NULL;
+    genre_cache_mask = 0;
+    genre_cache_used = 0;
+    pthread_mutex_unlock(&genre_lock);
+    return;
+  }
+}
+
+static void registry_reset() {
+  num_media = 0;
+  genre_defined = 0;
+  memset(genre_names,0,sizeof(genre_names));
+  memset(genre_ids,0,sizeof(genre_ids));
+}
+
+static void registry_builtin() {
+  const char* old_names[GENRE_MAX];
+  uint64_t old_defined = genre_defined;
+  int retval = MI_EXIT_OK;
+
+  memcpy(old_names,genre_names,sizeof(old_names));
+  registry_reset();
+  for (int i = 0; i < NUM_MEDIA && retval == MI_EXIT_OK; i++)
+    retval = registry_medium(i,builtin_medium_names[i],builtin_medium_ids[i]);
+  for (int i = 0; i < NUM_GENRES && retval == MI_EXIT_OK; i++)
+    retval = registry_genre(builtin_genre_bits[i],builtin_genre_names[i],builtin_genre_ids[i]);
+  if (retval != MI_EXIT_OK || registry_index() != MI_EXIT_OK)
+    log_debug(ERROR,"registry_builtin(): out of memory");
+  genre_cache_check(old_names,old_defined);
+  registry_ready = 1;
+}
+
+static void registry_check() {
+  if (!registry_ready) registry_builtin();
+}
+
+/* from the open catalogue, the built in lists if it can't be read */
+static int registry_load() {
+  const char* old_names[GENRE_MAX];
+  uint64_t old_defined = genre_defined;
+  sqlite3_stmt* query = NULL;
+  int retval = MI_EXIT_OK;
+  int step;
+
+  memcpy(old_names,genre_names,sizeof(old_names));
+  registry_reset();
+
+  if (sqlite3_prepare_v2(db_handle,"SELECT id, name, ident FROM media_types ORDER BY id",
+			 -1,&query,NULL) != SQLITE_OK) retval = MI_EXIT_ERROR;
+  while (retval == MI_EXIT_OK && (step = sqlite3_step(query)) == SQLITE_ROW)
+    retval = registry_medium(sqlite3_column_int(query,0),
+			     (const char*)sqlite3_column_text(query,1),
+			     (const char*)sqlite3_column_text(query,2));
+  if (retval == MI_EXIT_OK && step != SQLITE_DONE) retval = MI_EXIT_ERROR;
+  sqlite3_finalize(query);
+  query = NULL;
+
+  if (retval == MI_EXIT_OK &&
+      sqlite3_prepare_v2(db_handle,"SELECT bit, name, ident FROM genres",
+			 -1,&query,NULL) != SQLITE_OK) retval = MI_EXIT_ERROR;
+  while (retval == MI_EXIT_OK && (step = sqlite3_step(query)) == SQLITE_ROW)
+    retval = registry_genre(sqlite3_column_int(query,0),
+			    (const char*)sqlite3_column_text(query,1),
+			    (const char*)sqlite3_column_text(query,2));
+  if (retval == MI_EXIT_OK && step != SQLITE_DONE) retval = MI_EXIT_ERROR;
+  sqlite3_finalize(query);
+
+  if (retval == MI_EXIT_OK) retval = registry_index();
+  if (retval != MI_EXIT_OK) {
+    log_debug(ERROR,"registry_load(): could not read media and genres");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    registry_builtin();
+    return MI_EXIT_ERROR;
+  }
+  genre_cache_check(old_names,old_defined);
+  registry_ready = 1;
+  return MI_EXIT_OK;
+}
+
+/* read only opens go through a URI so immutable=1 can be passed, nothing
+ * is created or migrated, so the file has to be up to date already
+ */
+static int open_read_only(const char* file, const db_options_t* options) {
+  char uri[1024];
+  char* p = uri;
+  sqlite3_stmt* query = NULL;
+  int version = -1;
+
+  p += sprintf(p,"file:");
+  for (; *file != '\0'; file++) {
+    if (p - uri > (int)sizeof(uri) - 32) {
+      log_debug(ERROR,"init_db(): file name too long");
+      return MI_EXIT_ERROR;
+    }
+    if (*file == '?' || *file == '#' || *file == '%')
+      p += sprintf(p,"%%%02X",(unsigned char)*file);
+    else
+      *p++ = *file;
+  }
+  sprintf(p,"?mode=ro%s",(options->read_only == DB_IMMUTABLE) ? "&immutable=1" : "");
+  log_debug(INFO,uri);
+
+  if (sqlite3_open_v2(uri,&db_handle,SQLITE_OPEN_READONLY | SQLITE_OPEN_URI,NULL) != SQLITE_OK) {
+    log_debug(ERROR,"init_db(): error opening database");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    close_db();
+    return MI_EXIT_ERROR;
+  }
+  if (apply_options(options) != MI_EXIT_OK) {
+    close_db();
+    return MI_EXIT_ERROR;
+  }
+
+  if (sqlite3_prepare_v2(db_handle,"PRAGMA user_version",-1,&query,NULL) == SQLITE_OK &&
+      sqlite3_step(query) == SQLITE_ROW)
+    version = sqlite3_column_int(query,0);
+  sqlite3_finalize(query);
+  if (version != DB_SCHEMA_VERSION) {
+    log_debug(ERROR,"init_db(): file is not at the current schema, open it writable once");
+    close_db();
+    return MI_EXIT_ERROR;
+  }
+
+  log_debug(INFO,"init_db(): read only open successful");
+  return MI_EXIT_OK;
+}
 
 int init_db(const char* file) {
+  return init_db_ex(file,NULL);
+}
+
+int init_db_ex(const char* file, const db_options_t* options) {
   /* schema defs */
   const char init_string_main[] =
     "CREATE TABLE IF NOT EXISTS main "
@@ -39,11 +2321,13 @@ int init_db(const char* file) {
     "location TEXT NOT NULL, update_time INTEGER NOT NULL)";
   const char init_string_book[] =
     "CREATE TABLE IF NOT EXISTS books "
-    "(code INTEGER PRIMARY KEY, type INTEGER NOT NULL, genre INTEGER NOT NULL, "
+    "(code INTEGER PRIMARY KEY REFERENCES main(code) ON DELETE CASCADE ON UPDATE CASCADE, "
+    "type INTEGER NOT NULL, genre INTEGER NOT NULL, "
     "isbn TEXT, title TEXT, author_last TEXT, author_first TEXT, author_rest TEXT)";
   const char init_string_movie[] =
     "CREATE TABLE IF NOT EXISTS movies "
-    "(code INTEGER PRIMARY KEY, type INTEGER NOT NULL, genre INTEGER NOT NULL, "
+    "(code INTEGER PRIMARY KEY REFERENCES main(code) ON DELETE CASCADE ON UPDATE CASCADE, "
+    "type INTEGER NOT NULL, genre INTEGER NOT NULL, "
     "title TEXT, director TEXT, studio TEXT, rating INTEGER)";
   char buffer[512];
  
@@ -51,12 +2335,33 @@ int init_db(const char* file) {
  sprintf(buffer,"init_db(): opening %s as db file",file);
  log_debug(INFO,buffer);
 
- if (sqlite3_open(file, &db_handle) != SQLITE_OK) {
-   log_debug(ERROR,"init_db(): error opening database");
+ if (options != NULL && options->read_only) {
+   if (open_read_only(file,options) != MI_EXIT_OK) return MI_EXIT_ERROR;
+   if (registry_load() != MI_EXIT_OK) {
+     close_db();
+     return MI_EXIT_ERROR;
+   }
+   bloom_open(options->code_filter);
+   index_open(options->code_index,options->read_only);
+   return MI_EXIT_OK;
+ }
+
+ if (sqlite3_open(file, &db_handle) != SQLITE_OK) {
+   log_debug(ERROR,"init_db(): error opening database");
+   log_debug(ERROR,sqlite3_errmsg(db_handle));
+   return MI_EXIT_ERROR;
+ }
+ log_debug(INFO,"init_db(): open successful");
+
+ if (options != NULL && apply_options(options) != MI_EXIT_OK)
+   return MI_EXIT_ERROR;
+
+ /* off by default in sqlite, and per connection */
+ if (sqlite3_exec(db_handle,"PRAGMA foreign_keys = ON",NULL,NULL,NULL) != SQLITE_OK) {
+   log_debug(ERROR,"init_db(): could not enable foreign keys");
    log_debug(ERROR,sqlite3_errmsg(db_handle));
    return MI_EXIT_ERROR;
  }
- log_debug(INFO,"init_db(): open successful");
 
  log_debug(INFO,"init_db(): db init (if needed)");
 
@@ -81,921 +2386,1667 @@ int init_db(const char* file) {
    return MI_EXIT_ERROR;
  }
 
+ /* used by the migrations */
+ if (sqlite3_create_function(db_handle,"isbn13",1,SQLITE_UTF8 | SQLITE_DETERMINISTIC,NULL,
+			     isbn13_function,NULL,NULL) != SQLITE_OK ||
+     sqlite3_create_function(db_handle,"sort_key",1,SQLITE_UTF8 | SQLITE_DETERMINISTIC,NULL,
+			     sort_key_function,NULL,NULL) != SQLITE_OK) {
+   log_debug(ERROR,"init_db(): could not register sql functions");
+   log_debug(ERROR,sqlite3_errmsg(db_handle));
+   return MI_EXIT_ERROR;
+ }
+
+ /* bring older files up to date */
+ if (migrate_db() != MI_EXIT_OK || registry_load() != MI_EXIT_OK) return MI_EXIT_ERROR;
+ bloom_open((options != NULL) ? options->code_filter : CODE_FILTER_BITS);
+ if (options != NULL) index_open(options->code_index,options->read_only);
  return MI_EXIT_OK;
 }
 
 int close_db() {
+  num_changed = 0;
+  index_drop();
+  bloom_drop();
+  stmt_flush();
   sqlite3_close(db_handle);
+  db_handle = NULL;
+  registry_builtin();
   return MI_EXIT_OK;
 }
 
-int fetch(media_t* sought,uint32_t code) {
+/* the connection is leaked on purpose: sqlite3_close() in a child of
+ * fork() can checkpoint or delete the parent's WAL and journal, because
+ * the parent's locks aren't inherited and the child thinks it's alone
+ */
+int forget_db() {
+  num_changed = 0;
+  db_commit_hook = NULL;
+  stmt_forget();
+  db_handle = NULL;
+  index_drop();
+  bloom_drop();
+  registry_builtin();
+  return MI_EXIT_OK;
+}
+
+/* safe to call from another thread, the statement running on db_handle
+ * bails out with an error at its next step
+ */
+int interrupt_db() {
+  if (db_handle == NULL) return MI_NO_RESULTS;
+  sqlite3_interrupt(db_handle);
+  return MI_EXIT_OK;
+}
+
+static int fetch_table(int table, uint32_t code, void* sought, const char* caller) {
+  char sql[128];
   char buffer[128];
-  sqlite3_stmt* query = NULL;
+  sqlite3_stmt* query;
+  uint64_t mark = 0;
   int retval;
 
-  if (sought == NULL) {
-    return exists(code);
+  if (index_fetch(table,code,sought,&mark) == MI_EXIT_OK) return MI_EXIT_OK;
+  if (bloom_absent(code)) {
+    sprintf(buffer,"%s: no results found",caller);
+    log_debug(INFO,buffer);
+    return MI_NO_RESULTS;
   }
-  /* select media with matching code
+
+  /* select the row with matching code
    * should only be one, so we'll only use the first result, if there is one
    */
-  sprintf(buffer,"SELECT * FROM main WHERE code=%u",code);
-  log_debug(INFO,"fetch(): starting query");
+  sprintf(sql,"SELECT %s FROM %s WHERE code = ?",table_columns[table],table_names[table]);
+  sprintf(buffer,"%s: starting query",caller);
   log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"fetch(): error with lookup");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  log_debug(INFO,sql);
+  if ((query = stmt_get(sql)) == NULL) {
+    sprintf(buffer,"%s: error with lookup",caller);
+    log_debug(ERROR,buffer);
     return MI_EXIT_ERROR;
   }
+  sqlite3_bind_int64(query,1,code);
 
   retval = sqlite3_step(query);
   if (retval == SQLITE_ROW) {
-    sought->code =          (uint32_t)sqlite3_column_int64(query,0);
-    sought->type =          (medium_t)sqlite3_column_int(query,1);
-    strcpy(sought->name,    (char *)sqlite3_column_text(query,2));
-    strcpy(sought->location,(char *)sqlite3_column_text(query,3));
-    sought->update =        (time_t)sqlite3_column_int64(query,4);
-    log_debug(INFO,"fetch(): result found");
+    switch (table) {
+    case TABLE_MAIN:  read_media(query,sought); break;
+    case TABLE_BOOKS: read_book(query,sought);  break;
+    default:          read_movie(query,sought);
+    }
+    index_offer(table,sought,mark);
+    retval = MI_EXIT_OK;
   }
   else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"fetch(): no results found");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
+    sprintf(buffer,"%s: no results found",caller);
+    log_debug(INFO,buffer);
+    if (table == TABLE_MAIN) bloom_missed(1);
+    retval = MI_NO_RESULTS;
   }
   else {
-    log_debug(ERROR,"fetch(): some error didst occur");
-    sqlite3_finalize(query);
-    return MI_EXIT_ERROR;
+    sprintf(buffer,"%s: some error didst occur",caller);
+    log_debug(ERROR,buffer);
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    retval = MI_EXIT_ERROR;
   }
 
-  sqlite3_finalize(query);
-  return MI_EXIT_OK;
+  stmt_put(query);
+  return retval;
+}
+
+int fetch(media_t* sought,uint32_t code) {
+  if (sought == NULL) {
+    return exists(code);
+  }
+  return fetch_table(TABLE_MAIN,code,sought,"fetch()");
 }
 
 int fetch_book(book_t* sought,uint32_t code) {
+  if (sought == NULL) {
+    return exists_book(code);
+  }
+  return fetch_table(TABLE_BOOKS,code,sought,"fetch_book()");
+}
+
+int fetch_movie(movie_t* sought,uint32_t code) {
+  if (sought == NULL) {
+    return exists_movie(code);
+  }
+  return fetch_table(TABLE_MOVIES,code,sought,"fetch_movie()");
+}
+
+int fetch_book_by_isbn(book_t* sought, const char* isbn) {
   char buffer[128];
-  sqlite3_stmt* query = NULL;
+  char sql[192];
+  sqlite3_stmt* query;
+  uint64_t isbn13;
   int retval;
 
-  if (sought == NULL) {
-    return exists_book(code);
+  if (isbn_normalise(isbn,&isbn13) != MI_EXIT_OK) {
+    log_debug(INFO,"fetch_book_by_isbn(): not an isbn");
+    return MI_NO_RESULTS;
   }
-  /* select media with matching code
-   * should only be one, so we'll only use the first result, if there is one
-   */
-  sprintf(buffer,"SELECT * FROM books WHERE code=%u",code);
-  log_debug(INFO,"fetch_book(): starting query");
-  log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"fetch_book(): error with lookup");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+
+  /* copies of the same book share an isbn, the lowest code wins */
+  sprintf(sql,"SELECT %s FROM books WHERE isbn13 = ? ORDER BY code LIMIT 1",
+	  table_columns[TABLE_BOOKS]);
+  log_debug(INFO,"fetch_book_by_isbn(): starting query");
+  log_debug(INFO,sql);
+  if ((query = stmt_get(sql)) == NULL) {
+    log_debug(ERROR,"fetch_book_by_isbn(): error with lookup");
     return MI_EXIT_ERROR;
   }
+  sqlite3_bind_int64(query,1,(sqlite3_int64)isbn13);
 
   retval = sqlite3_step(query);
   if (retval == SQLITE_ROW) {
-    sought->code =            (uint32_t)sqlite3_column_int64(query,0);
-    sought->type =            (medium_t)sqlite3_column_int(query,1);
-    sought->genre =          (genre_t)sqlite3_column_int(query,2);
-    strcpy(sought->isbn,        (char *)sqlite3_column_text(query,3));
-    strcpy(sought->title,       (char *)sqlite3_column_text(query,4));
-    strcpy(sought->author_last, (char *)sqlite3_column_text(query,5));
-    strcpy(sought->author_first,(char *)sqlite3_column_text(query,6));
-    strcpy(sought->author_rest, (char *)sqlite3_column_text(query,7));
-    log_debug(INFO,"fetch_book(): result found");
+    if (sought != NULL) read_book(query,sought);
+    retval = MI_EXIT_OK;
   }
   else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"fetch_book(): no results found");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
+    sprintf(buffer,"fetch_book_by_isbn(): no book with isbn %013ju",(uintmax_t)isbn13);
+    log_debug(INFO,buffer);
+    retval = MI_NO_RESULTS;
   }
   else {
-    log_debug(ERROR,"fetch_book(): some error didst occur");
-    sqlite3_finalize(query);
+    log_debug(ERROR,"fetch_book_by_isbn(): some error didst occur");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    retval = MI_EXIT_ERROR;
+  }
+
+  stmt_put(query);
+  return retval;
+}
+
+/* the statement is put back before returning, a stepped but unreset one
+ * would hold a read lock on the file until the next exists()
+ */
+static int exists_table(int table, uint32_t code, const char* caller) {
+  char sql[64];
+  char buffer[128];
+  sqlite3_stmt* query;
+  int retval;
+
+  if (index_fetch(table,code,NULL,NULL) == MI_EXIT_OK) return MI_EXISTS;
+  if (bloom_absent(code)) return MI_NO_RESULTS;
+
+  sprintf(sql,"SELECT 1 FROM %s WHERE code = ?",table_names[table]);
+  sprintf(buffer,"%s: starting query",caller);
+  log_debug(INFO,buffer);
+  log_debug(INFO,sql);
+  if ((query = stmt_get(sql)) == NULL) {
+    sprintf(buffer,"%s: error with lookup",caller);
+    log_debug(ERROR,buffer);
     return MI_EXIT_ERROR;
   }
+  sqlite3_bind_int64(query,1,code);
 
-  sqlite3_finalize(query);
-  return MI_EXIT_OK;
+  retval = sqlite3_step(query);
+  stmt_put(query);
+  if (retval == SQLITE_ROW)
+    return MI_EXISTS;
+  if (retval == SQLITE_DONE) {
+    if (table == TABLE_MAIN) bloom_missed(1);
+    return MI_NO_RESULTS;
+  }
+
+  sprintf(buffer,"%s: some error didst occur",caller);
+  log_debug(ERROR,buffer);
+  log_debug(ERROR,sqlite3_errmsg(db_handle));
+  return MI_EXIT_ERROR;
 }
 
-int fetch_movie(movie_t* sought,uint32_t code) {
+int exists(uint32_t code) {
+  return exists_table(TABLE_MAIN,code,"exists()");
+}
+
+int exists_book(uint32_t code) {
+  return exists_table(TABLE_BOOKS,code,"exists_book()");
+}
+
+int exists_movie(uint32_t code) {
+  return exists_table(TABLE_MOVIES,code,"exists_movie()");
+}
+
+/* batched lookups
+ * codes go to sqlite FETCH_MANY_CHUNK at a time as one IN list, so a
+ * chunk costs one statement step loop instead of one query per code.
+ * The statement always has the full number of parameters, the spare ones
+ * bound to NULL, so one cached statement serves every chunk.  The rows
+ * come back in code order and are matched against the chunk sorted the
+ * same way, then copied to the positions the codes had in the caller's
+ * array; a code asked for twice gets the row twice.
+ */
+#define FETCH_MANY_CHUNK 256
+
+typedef struct {
+  uint32_t code;
+  size_t   pos;
+} wanted_t;
+
+static int wanted_compare(const void* a, const void* b) {
+  const wanted_t* x = a;
+  const wanted_t* y = b;
+
+  if (x->code != y->code) return (x->code < y->code) ? -1 : 1;
+  return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+static int fetch_many_table(int table, void* items, uint8_t* found, const uint32_t* codes,
+			    size_t n, const char* caller) {
+  static const size_t row_sizes[] = { sizeof(media_t), sizeof(book_t), sizeof(movie_t) };
+  char sql[FETCH_MANY_CHUNK * 2 + 192];
   char buffer[128];
-  sqlite3_stmt* query = NULL;
+  wanted_t wanted[FETCH_MANY_CHUNK];
+  sqlite3_stmt* query;
+  unsigned char* row;
+  size_t size = row_sizes[table];
+  size_t num_found = 0;
+  size_t missed = 0;
+  size_t chunk;
+  uint64_t mark = 0;
+  size_t j;
+  uint32_t code;
+  char* p;
   int retval;
 
-  if (sought == NULL) {
-    return exists_movie(code);
+  sprintf(buffer,"%s: looking up %zu codes",caller,n);
+  log_debug(INFO,buffer);
+
+  p = sql + sprintf(sql,"SELECT %s FROM %s WHERE code IN (?",
+		    (items) ? table_columns[table] : "code",table_names[table]);
+  for (int i = 1; i < FETCH_MANY_CHUNK; i++) {
+    *p++ = ',';
+    *p++ = '?';
   }
-  /* select media with matching code
-   * should only be one, so we'll only use the first result, if there is one
+  strcpy(p,") ORDER BY code");
+  if ((query = stmt_get(sql)) == NULL) {
+    sprintf(buffer,"%s: error with lookup",caller);
+    log_debug(ERROR,buffer);
+    return MI_EXIT_ERROR;
+  }
+
+  /* found[] is 2 for codes the code filter passes until they're found,
+   * the ones it rules out never reach sqlite, and neither do the ones
+   * the code index has
    */
-  sprintf(buffer,"SELECT * FROM movies WHERE code=%u",code);
-  log_debug(INFO,"fetch_movie(): starting query");
+  bloom_sift(codes,n,found);
+  for (size_t i = 0; i < n; i++) {
+    found[i] *= 2;
+    if (found[i] &&
+	index_fetch(table,codes[i],(items) ? (unsigned char*)items + i * size : NULL,&mark) ==
+	MI_EXIT_OK) {
+      found[i] = 1;
+      num_found++;
+    }
+  }
+
+  for (size_t next = 0; next < n;) {
+    for (chunk = 0; chunk < FETCH_MANY_CHUNK && next < n; next++) {
+      if (found[next] != 2) continue;
+      wanted[chunk].code = codes[next];
+      wanted[chunk].pos = next;
+      chunk++;
+    }
+    if (chunk == 0) break;
+    qsort(wanted,chunk,sizeof(wanted_t),wanted_compare);
+    for (int i = 0; i < FETCH_MANY_CHUNK; i++) {
+      if ((size_t)i < chunk)
+	sqlite3_bind_int64(query,i + 1,wanted[i].code);
+      else
+	sqlite3_bind_null(query,i + 1);
+    }
+
+    j = 0;
+    while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+      code = (uint32_t)sqlite3_column_int64(query,0);
+      while (j < chunk && wanted[j].code < code) j++;
+      if (j == chunk || wanted[j].code != code) continue;
+
+      row = NULL;
+      if (items) {
+	row = (unsigned char*)items + wanted[j].pos * size;
+	switch (table) {
+	case TABLE_MAIN:  read_media(query,(media_t*)row); break;
+	case TABLE_BOOKS: read_book(query,(book_t*)row);   break;
+	default:          read_movie(query,(movie_t*)row);
+	}
+	index_offer(table,row,mark);
+      }
+      found[wanted[j++].pos] = 1;
+      num_found++;
+      for (; j < chunk && wanted[j].code == code; j++) {
+	if (row) memcpy((unsigned char*)items + wanted[j].pos * size,row,size);
+	found[wanted[j].pos] = 1;
+	num_found++;
+      }
+    }
+    sqlite3_reset(query);
+    if (retval != SQLITE_DONE) {
+      sprintf(buffer,"%s: some error didst occur",caller);
+      log_debug(ERROR,buffer);
+      log_debug(ERROR,sqlite3_errmsg(db_handle));
+      stmt_put(query);
+      memset(found,0,n);
+      return MI_EXIT_ERROR;
+    }
+  }
+  stmt_put(query);
+
+  for (size_t i = 0; i < n; i++) {
+    if (found[i] != 2) continue;
+    found[i] = 0;
+    missed++;
+  }
+  if (table == TABLE_MAIN) bloom_missed(missed);
+
+  sprintf(buffer,"%s: %zu of %zu found",caller,num_found,n);
+  log_debug(INFO,buffer);
+  return (num_found) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
+
+int fetch_many(media_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_table(TABLE_MAIN,items,found,codes,n,"fetch_many()");
+}
+
+int fetch_many_books(book_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_table(TABLE_BOOKS,items,found,codes,n,"fetch_many_books()");
+}
+
+int fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_table(TABLE_MOVIES,items,found,codes,n,"fetch_many_movies()");
+}
+
+int store(media_t* item) {
+  item->update = time(NULL);
+  return write_row(TABLE_MAIN,1,item,"store()");
+}
+
+int store_book(book_t* item) {
+  return write_row(TABLE_BOOKS,1,item,"store_book()");
+}
+
+int store_movie(movie_t* item) {
+  return write_row(TABLE_MOVIES,1,item,"store_movie()");
+}
+
+int update(media_t* item) {
+  item->update = time(NULL);
+  return write_row(TABLE_MAIN,0,item,"update()");
+}
+
+int update_book(book_t* item) {
+  return write_row(TABLE_BOOKS,0,item,"update_book()");
+}
+
+int update_movie(movie_t* item) {
+  return write_row(TABLE_MOVIES,0,item,"update_movie()");
+}
+
+/* main row and detail row in one transaction, both or neither */
+static int write_item(int table, int insert, media_t* item, const void* detail,
+		      const char* caller) {
+  char buffer[128];
+  int retval;
+
+  item->update = time(NULL);
+
+  if (tx_begin() != MI_EXIT_OK) {
+    sprintf(buffer,"%s: could not start transaction",caller);
+    log_debug(ERROR,buffer);
+    return MI_EXIT_ERROR;
+  }
+
+  retval = write_row(TABLE_MAIN,insert,item,caller);
+  if (retval == MI_EXIT_OK && db_fault_hook != NULL && db_fault_hook(caller)) {
+    sprintf(buffer,"%s: fault injected",caller);
+    log_debug(ERROR,buffer);
+    retval = MI_EXIT_ERROR;
+  }
+  if (retval == MI_EXIT_OK)
+    retval = write_row(table,insert,detail,caller);
+
+  if (retval != MI_EXIT_OK) {
+    tx_rollback();
+    return retval;
+  }
+  return tx_commit();
+}
+
+int store_book_item(media_t* item, book_t* detail) {
+  detail->code = item->code;
+  detail->type = item->type;
+  return write_item(TABLE_BOOKS,1,item,detail,"store_book_item()");
+}
+
+int store_movie_item(media_t* item, movie_t* detail) {
+  detail->code = item->code;
+  detail->type = item->type;
+  return write_item(TABLE_MOVIES,1,item,detail,"store_movie_item()");
+}
+
+int update_book_item(media_t* item, book_t* detail) {
+  detail->code = item->code;
+  detail->type = item->type;
+  return write_item(TABLE_BOOKS,0,item,detail,"update_book_item()");
+}
+
+int update_movie_item(media_t* item, movie_t* detail) {
+  detail->code = item->code;
+  detail->type = item->type;
+  return write_item(TABLE_MOVIES,0,item,detail,"update_movie_item()");
+}
+
+/* each item's savepoint nests inside the batch's, so an item already there
+ * only rolls back itself while an error rolls back the lot
+ */
+int store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored) {
+  char buffer[128];
+  size_t stored = 0;
+  int retval;
+
+  if (num_stored != NULL) *num_stored = 0;
+  sprintf(buffer,"store_book_item_batch(): storing %zu items",n);
+  log_debug(INFO,buffer);
+
+  if (tx_begin() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  for (size_t i = 0; i < n; i++) {
+    details[i].code = items[i].code;
+    details[i].type = items[i].type;
+    retval = write_item(TABLE_BOOKS,1,&items[i],&details[i],"store_book_item_batch()");
+    if (retval == MI_EXIT_ERROR) {
+      tx_rollback();
+      return MI_EXIT_ERROR;
+    }
+    if (retval == MI_EXIT_OK) stored++;
+  }
+  if (tx_commit() != MI_EXIT_OK) return MI_EXIT_ERROR;
+
+  if (num_stored != NULL) *num_stored = stored;
+  return (stored) ? MI_EXIT_OK : MI_EXISTS;
+}
+
+int search(media_t** items, uint32_t* num_results, const filter_t* filter) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  media_t* rows = NULL;
+  media_t* grown;
+  uint32_t count = 0;
+  uint32_t size = 0;
+  int retval;
+
+  *items = NULL;
+  *num_results = 0;
+
+  if ((query = filter_prepare(filter,TABLE_MAIN,"search(): starting query")) == NULL)
+    return MI_EXIT_ERROR;
+
+  log_debug(INFO,"search(): staring row processing");
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+    if (count == size) {
+      size = (size) ? size * 2 : 64;
+      if ((grown = realloc(rows,sizeof(media_t)*size)) == NULL) {
+	log_debug(ERROR,"search(): out of memory");
+	retval = SQLITE_NOMEM;
+	break;
+      }
+      rows = grown;
+    }
+    read_media(query,&rows[count++]);
+  }
+
+  if (retval != SQLITE_DONE) {
+    /* error of some sort */
+    log_debug(ERROR,"search(): error during row processing");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    free(rows);
+    stmt_put(query);
+    return MI_EXIT_ERROR;
+  }
+
+  stmt_put(query);
+  sprintf(buffer,"search(): %u rows processed",count);
   log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"fetch_movie(): error with lookup");
+
+  if (count == 0) {
+    log_debug(INFO,"search(): no results for query");
+    free(rows);
+    return MI_NO_RESULTS;
+  }
+
+  *items = rows;
+  *num_results = count;
+  return MI_EXIT_OK;
+}
+
+int search_books(book_t** items, uint32_t* num_results, const filter_t* filter) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  book_t* rows = NULL;
+  book_t* grown;
+  uint32_t count = 0;
+  uint32_t size = 0;
+  int retval;
+
+  *items = NULL;
+  *num_results = 0;
+
+  if ((query = filter_prepare(filter,TABLE_BOOKS,"search_books(): starting query")) == NULL)
+    return MI_EXIT_ERROR;
+
+  log_debug(INFO,"search_books(): staring row processing");
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+    if (count == size) {
+      size = (size) ? size * 2 : 64;
+      if ((grown = realloc(rows,sizeof(book_t)*size)) == NULL) {
+	log_debug(ERROR,"search_books(): out of memory");
+	retval = SQLITE_NOMEM;
+	break;
+      }
+      rows = grown;
+    }
+    read_book(query,&rows[count++]);
+  }
+
+  if (retval != SQLITE_DONE) {
+    /* error of some sort */
+    log_debug(ERROR,"search_books(): error during row processing");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
+    free(rows);
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
 
-  retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW) {
-    sought->code =         (uint32_t)sqlite3_column_int64(query,0);
-    sought->type =         (medium_t)sqlite3_column_int(query,1);
-    sought->genre =       (genre_t)sqlite3_column_int(query,2);
-    strcpy(sought->title,   (char *)sqlite3_column_text(query,3));
-    strcpy(sought->director,(char *)sqlite3_column_text(query,4));
-    strcpy(sought->studio,  (char *)sqlite3_column_text(query,5));
-    sought->rating =         (short)sqlite3_column_int(query,6);
-    log_debug(INFO,"fetch_movie(): result found");
+  stmt_put(query);
+  sprintf(buffer,"search_books(): %u rows processed",count);
+  log_debug(INFO,buffer);
+
+  if (count == 0) {
+    log_debug(INFO,"search_books(): no results for query");
+    free(rows);
+    return MI_NO_RESULTS;
   }
-  else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"fetch_movie(): no results found");
-    sqlite3_finalize(query);
+
+  *items = rows;
+  *num_results = count;
+  return MI_EXIT_OK;
+}
+
+int search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  movie_t* rows = NULL;
+  movie_t* grown;
+  uint32_t count = 0;
+  uint32_t size = 0;
+  int retval;
+
+  *items = NULL;
+  *num_results = 0;
+
+  if ((query = filter_prepare(filter,TABLE_MOVIES,"search_movies(): starting query")) == NULL)
+    return MI_EXIT_ERROR;
+
+  log_debug(INFO,"search_movies(): staring row processing");
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW) {
+    if (count == size) {
+      size = (size) ? size * 2 : 64;
+      if ((grown = realloc(rows,sizeof(movie_t)*size)) == NULL) {
+	log_debug(ERROR,"search_movies(): out of memory");
+	retval = SQLITE_NOMEM;
+	break;
+      }
+      rows = grown;
+    }
+    read_movie(query,&rows[count++]);
+  }
+
+  if (retval != SQLITE_DONE) {
+    /* error of some sort */
+    log_debug(ERROR,"search_movies(): error during row processing");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    free(rows);
+    stmt_put(query);
+    return MI_EXIT_ERROR;
+  }
+
+  stmt_put(query);
+  sprintf(buffer,"search_movies(): %u rows processed",count);
+  log_debug(INFO,buffer);
+
+  if (count == 0) {
+    log_debug(INFO,"search_movies(): no results for query");
+    free(rows);
     return MI_NO_RESULTS;
   }
-  else {
-    log_debug(ERROR,"fetch_movie(): some error didst occur");
-    sqlite3_finalize(query);
-    return MI_EXIT_ERROR;
-  }
 
-  sqlite3_finalize(query);
+  *items = rows;
+  *num_results = count;
   return MI_EXIT_OK;
 }
 
-int exists(uint32_t code) {
+/* keyset paging
+ * rows come back ordered by code, starting after *after (or from the start
+ * if after is NULL), so a page costs a rowid seek plus max rows no matter
+ * how deep into the table it is
+ */
+static int count_table(int table, uint32_t* total) {
   char buffer[128];
-  sqlite3_stmt* query = NULL;
+  sqlite3_stmt* query;
   int retval;
-  int count;
 
-  sprintf(buffer,"SELECT COUNT(*) FROM main WHERE code = %u",code);
-  log_debug(INFO,"exists(): starting query");
+  sprintf(buffer,"SELECT COUNT(*) FROM %s",table_names[table]);
+  log_debug(INFO,"count_table(): starting query");
   log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"exists(): error with lookup");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  if ((query = stmt_get(buffer)) == NULL) {
+    log_debug(ERROR,"count_table(): error with lookup");
     return MI_EXIT_ERROR;
   }
-  
+
   retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW) {
-    count = (int)sqlite3_column_int(query,0);
-    log_debug(INFO,"exists(): success");
-  }
-  else if (retval == SQLITE_DONE) {
-    count = 0;
-    log_debug(INFO,"exists(): failure");
-  }
-  else {
-    log_debug(ERROR,"exists(): some error didst occur");
+  if (retval != SQLITE_ROW) {
+    log_debug(ERROR,"count_table(): some error didst occur");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
 
-  return (count) ? MI_EXISTS : MI_NO_RESULTS;
+  *total = (uint32_t)sqlite3_column_int64(query,0);
+  stmt_put(query);
+  return MI_EXIT_OK;
 }
 
-int exists_book(uint32_t code) {
-  char buffer[128];
-  sqlite3_stmt* query = NULL;
+static int seek_table(int table, uint32_t* code, const uint32_t* after, uint32_t skip) {
+  char buffer[192];
+  sqlite3_stmt* query;
   int retval;
-  int count;
 
-  sprintf(buffer,"SELECT COUNT(*) FROM books WHERE code = %u",code);
-  log_debug(INFO,"exists_book(): starting query");
+  sprintf(buffer,"SELECT code FROM %s WHERE code > ? ORDER BY code LIMIT 1 OFFSET ?",
+	  table_names[table]);
+  log_debug(INFO,"seek_table(): starting query");
   log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"exists_book(): error with lookup");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  if ((query = stmt_get(buffer)) == NULL) {
+    log_debug(ERROR,"seek_table(): error with lookup");
     return MI_EXIT_ERROR;
   }
-  
+  /* codes are unsigned, -1 is before all of them */
+  sqlite3_bind_int64(query,1,(after) ? (sqlite3_int64)*after : -1);
+  sqlite3_bind_int64(query,2,skip);
+
   retval = sqlite3_step(query);
   if (retval == SQLITE_ROW) {
-    count = (int)sqlite3_column_int(query,0);
-    log_debug(INFO,"exists_book(): success");
+    *code = (uint32_t)sqlite3_column_int64(query,0);
   }
   else if (retval == SQLITE_DONE) {
-    count = 0;
-    log_debug(INFO,"exists_book(): failure");
+    log_debug(INFO,"seek_table(): ran off the end of the table");
+    stmt_put(query);
+    return MI_NO_RESULTS;
   }
   else {
-    log_debug(ERROR,"exists_book(): some error didst occur");
+    log_debug(ERROR,"seek_table(): some error didst occur");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
 
-  return (count) ? MI_EXISTS : MI_NO_RESULTS;
+  stmt_put(query);
+  return MI_EXIT_OK;
 }
-      
-int exists_movie(uint32_t code) {
-  char buffer[128];
-  sqlite3_stmt* query = NULL;
+
+static sqlite3_stmt* page_query(int table, const uint32_t* after, uint32_t max) {
+  filter_t filter;
+
+  filter_init(&filter);
+  filter_int(&filter,F_CODE,OP_GT,(after) ? (int64_t)*after : -1);
+  filter_order(&filter,F_CODE,0);
+  filter_limit(&filter,max,0);
+  return filter_prepare(&filter,table,"page_query(): starting query");
+}
+
+int count_items(uint32_t* total) {
+  return count_table(TABLE_MAIN,total);
+}
+
+int count_books(uint32_t* total) {
+  return count_table(TABLE_BOOKS,total);
+}
+
+int count_movies(uint32_t* total) {
+  return count_table(TABLE_MOVIES,total);
+}
+
+int seek(uint32_t* code, const uint32_t* after, uint32_t skip) {
+  return seek_table(TABLE_MAIN,code,after,skip);
+}
+
+int seek_books(uint32_t* code, const uint32_t* after, uint32_t skip) {
+  return seek_table(TABLE_BOOKS,code,after,skip);
+}
+
+int seek_movies(uint32_t* code, const uint32_t* after, uint32_t skip) {
+  return seek_table(TABLE_MOVIES,code,after,skip);
+}
+
+int page(media_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
-  int count;
+  uint32_t count = 0;
 
-  sprintf(buffer,"SELECT COUNT(*) FROM movies WHERE code = %u",code);
-  log_debug(INFO,"exists_movie(): starting query");
-  log_debug(INFO,buffer);
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"exists_movie(): error with lookup");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  *num_results = 0;
+  if ((query = page_query(TABLE_MAIN,after,max)) == NULL)
     return MI_EXIT_ERROR;
-  }
-  
-  retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW) {
-    count = (int)sqlite3_column_int(query,0);
-    log_debug(INFO,"exists_movie(): success");
-  }
-  else if (retval == SQLITE_DONE) {
-    count = 0;
-    log_debug(INFO,"exists_movie(): failure");
-  }
-  else {
-    log_debug(ERROR,"exists_movie(): some error didst occur");
+
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_media(query,&items[count++]);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"page(): error during row processing");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
 
-  return (count) ? MI_EXISTS : MI_NO_RESULTS;
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
-  
-int store(media_t* item) {
-  char buffer[1024];
+
+int page_books(book_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
 
-  retval = exists(item->code);
-  if (retval != MI_NO_RESULTS) {
-    return retval;
-  }
+  *num_results = 0;
+  if ((query = page_query(TABLE_BOOKS,after,max)) == NULL)
+    return MI_EXIT_ERROR;
 
-  item->update=time(NULL);
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_book(query,&items[count++]);
 
-  sprintf(buffer,"INSERT INTO main VALUES (%u, %d, '%s', '%s', %jd)",
-	  item->code,item->type,item->name,item->location,(intmax_t)item->update);
-  log_debug(INFO,"store(): executing query");
-  log_debug(INFO,buffer);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"store(): error with insertion");
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"page_books(): error during row processing");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
-  return MI_EXIT_OK;
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int store_book(book_t* item) {
-  char buffer[1024];
+int page_movies(movie_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
 
-  retval = exists_book(item->code);
-  if (retval != MI_NO_RESULTS) {
-    return retval;
-  }
+  *num_results = 0;
+  if ((query = page_query(TABLE_MOVIES,after,max)) == NULL)
+    return MI_EXIT_ERROR;
 
-  sprintf(buffer,"INSERT INTO books VALUES (%u, %d, %d, '%s', '%s', '%s', '%s', '%s')",
-	  item->code,item->type,item->genre,item->isbn,item->title,item->author_last,
-	  item->author_first,item->author_rest);
-  log_debug(INFO,"store_book(): executing query");
-  log_debug(INFO,buffer);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"store_book(): error with insertion");
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_movie(query,&items[count++]);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"page_movies(): error during row processing");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
-  return MI_EXIT_OK;
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int store_movie(movie_t* item) {
-  char buffer[1024];
+/* alphabetical listing
+ * the same keyset paging as page() but over the sort key index, so any
+ * page of the list is one range scan however far down it is
+ */
+static sqlite3_stmt* list_query(int table, const void* after, uint32_t max) {
+  filter_t filter;
+
+  filter_init(&filter);
+  filter_order(&filter,F_SORT,0);
+  filter_limit(&filter,max,0);
+  if (after != NULL) {
+    switch (table) {
+    case TABLE_MAIN:  filter_next(&filter,after);       break;
+    case TABLE_BOOKS: filter_next_book(&filter,after);  break;
+    default:          filter_next_movie(&filter,after);
+    }
+  }
+  return filter_prepare(&filter,table,"list_query(): starting query");
+}
+
+int list(media_t* items, uint32_t* num_results, const media_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
 
-  retval = exists_movie(item->code);
-  if (retval != MI_NO_RESULTS) {
-    return retval;
-  }
+  *num_results = 0;
+  if ((query = list_query(TABLE_MAIN,after,max)) == NULL)
+    return MI_EXIT_ERROR;
 
-  sprintf(buffer,"INSERT INTO movies VALUES (%u, %d, %d, '%s', '%s', '%s', %d)",
-	  item->code,item->type,item->genre,item->title,item->director,
-	  item->studio,item->rating);
-  log_debug(INFO,"store_movie(): executing query");
-  log_debug(INFO,buffer);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"store_movie(): error with insertion");
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_media(query,&items[count++]);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"list(): error during row processing");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
-  return MI_EXIT_OK;
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int update(media_t* item) {
-  char buffer[1024];
-  char err_buf[128];
+int list_books(book_t* items, uint32_t* num_results, const book_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
 
-  /* check to see if item actually exists */
-  retval = exists(item->code);
+  *num_results = 0;
+  if ((query = list_query(TABLE_BOOKS,after,max)) == NULL)
+    return MI_EXIT_ERROR;
 
-  if (retval == MI_EXISTS) {
-    sprintf(err_buf,"update(): item #%u exists, starting update",item->code);
-    log_debug(INFO,err_buf);
-    item->update = time(NULL);
-    sprintf(buffer,"UPDATE main SET type = %d, name = '%s', location = '%s', update_time = %jd WHERE code = %u",
-	    item->type, item->name, item->location, item->update, item->code);
-    log_debug(INFO,buffer);
-    if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-      log_debug(ERROR,"update(): error with insertion");
-      log_debug(ERROR,sqlite3_errmsg(db_handle));
-      return MI_EXIT_ERROR;
-    }
-    return MI_EXIT_OK;
-  }
-  else {
-    sprintf(err_buf,"update(): item #%u does not exist, or an error occured",item->code);
-    log_debug(INFO,err_buf);
-    return retval;
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_book(query,&items[count++]);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"list_books(): error during row processing");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
+    return MI_EXIT_ERROR;
   }
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int update_book(book_t* item) {
-  char buffer[1024];
-  char err_buf[128];
+int list_movies(movie_t* items, uint32_t* num_results, const movie_t* after, uint32_t max) {
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
 
-  /* check to see if item actually exists */
-  retval = exists(item->code);
+  *num_results = 0;
+  if ((query = list_query(TABLE_MOVIES,after,max)) == NULL)
+    return MI_EXIT_ERROR;
 
-  if (retval == MI_EXISTS) {
-    sprintf(err_buf,"update_book(): item #%u exists, starting update",item->code);
-    log_debug(INFO,err_buf);
-    sprintf(buffer,"UPDATE books SET type = %d, genre = %d, isbn = '%s', title = '%s', author_last = '%s', "
-	    "author_first = '%s', author_rest = '%s' WHERE code = %u",
-	    item->type,item->genre,item->isbn,item->title,item->author_last,item->author_first,
-	    item->author_rest,item->code);
-    log_debug(INFO,buffer);
-    if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-      log_debug(ERROR,"update_book(): error with insertion");
-      log_debug(ERROR,sqlite3_errmsg(db_handle));
-      return MI_EXIT_ERROR;
-    }
-    return MI_EXIT_OK;
-  }
-  else {
-    sprintf(err_buf,"update_book(): item #%u does not exist, or an error occured",item->code);
-    log_debug(INFO,err_buf);
-    return retval;
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    read_movie(query,&items[count++]);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"list_movies(): error during row processing");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
+    return MI_EXIT_ERROR;
   }
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int update_movie(movie_t* item) {
-  char buffer[1024];
-  char err_buf[128];
+/* full text search
+ * every word typed is matched as a prefix of a word in name or location,
+ * so "blu tra" finds THE MYSTERY OF THE BLUE TRAIN.  Codes come back in
+ * code order, at most max of them.
+ */
+int search_text(uint32_t* codes, uint32_t* num_results, const char* text, uint32_t max) {
+  char match[512];
+  char* p = match;
+  const char* word;
+  sqlite3_stmt* query;
   int retval;
+  uint32_t count = 0;
+
+  *num_results = 0;
+
+  /* quote each word so punctuation can't be read as query syntax */
+  for (word = text; *word != '\0'; ) {
+    while (*word == ' ' || *word == '\t') word++;
+    if (*word == '\0') break;
+    if (p + 4 >= match + sizeof(match)) break;
+    *p++ = '"';
+    while (*word != '\0' && *word != ' ' && *word != '\t' && p + 3 < match + sizeof(match)) {
+      if (*word == '"') *p++ = '"';
+      *p++ = *word++;
+    }
+    while (*word != '\0' && *word != ' ' && *word != '\t') word++;
+    *p++ = '"';
+    *p++ = '*';
+    *p++ = ' ';
+  }
+  *p = '\0';
 
-  /* check to see if item actually exists */
-  retval = exists(item->code);
+  if (p == match) {
+    log_debug(INFO,"search_text(): nothing to search for");
+    return MI_NO_RESULTS;
+  }
 
-  if (retval == MI_EXISTS) {
-    sprintf(err_buf,"update_movie(): item #%u exists, starting update",item->code);
-    log_debug(INFO,err_buf);
-    sprintf(buffer,"UPDATE movies SET type = %d, genre = %d, title = '%s', director = '%s', studio = '%s', rating = %d "
-	    "WHERE code = %u", item->type, item->genre, item->title, item->director, item->studio, item->rating, 
-	    item->code);
-    log_debug(INFO,buffer);
-    if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-      log_debug(ERROR,"update_movie(): error with insertion");
-      log_debug(ERROR,sqlite3_errmsg(db_handle));
-      return MI_EXIT_ERROR;
-    }
-    return MI_EXIT_OK;
+  log_debug(INFO,"search_text(): starting query");
+  log_debug(INFO,match);
+  if ((query = stmt_get("SELECT rowid FROM main_fts WHERE main_fts MATCH ? "
+			"ORDER BY rowid LIMIT ?")) == NULL) {
+    log_debug(ERROR,"search_text(): error with lookup");
+    return MI_EXIT_ERROR;
   }
-  else {
-    sprintf(err_buf,"update_movie(): item #%u does not exist, or an error occured",item->code);
-    log_debug(INFO,err_buf);
-    return retval;
+  sqlite3_bind_text(query,1,match,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,2,max);
+
+  while ((retval = sqlite3_step(query)) == SQLITE_ROW)
+    codes[count++] = (uint32_t)sqlite3_column_int64(query,0);
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"search_text(): error during row processing");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
+    return MI_EXIT_ERROR;
   }
+
+  stmt_put(query);
+  *num_results = count;
+  return (count) ? MI_EXIT_OK : MI_NO_RESULTS;
 }
 
-int search(media_t* items, uint32_t* num_results, const char* terms) {
-  char buffer[1024];
-  sqlite3_stmt* query;
+/* books and movies rows go with their main row (ON DELETE CASCADE) */
+static int delete_row(sqlite3_stmt* query, uint32_t code, const char* caller) {
+  char buffer[128];
   int retval;
-  uint32_t count;
 
-  if (terms == NULL) {
-    strcpy(buffer, "SELECT COUNT(*) FROM main");
+  sqlite3_bind_int64(query,1,code);
+  retval = sqlite3_step(query);
+  sqlite3_reset(query);
+  if (retval != SQLITE_DONE) {
+    sprintf(buffer,"%s: delete of #%u failed",caller,code);
+    log_debug(ERROR,buffer);
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    return MI_EXIT_ERROR;
   }
-  else {
-    if ((sizeof(buffer)-50) < sizeof(terms)) {
-      log_debug(ERROR,"search(): terms exceeds buffer");
-      return MI_EXIT_ERROR;
-    }
+  if (sqlite3_changes(db_handle) == 0) return MI_NO_RESULTS;
+  bloom_deleted(1);
+  changed(code);
+  return MI_EXIT_OK;
+}
 
-    strcpy(buffer, "SELECT COUNT(*) FROM main WHERE ");
-    strcat(buffer, terms);
-  }
+int delete(uint32_t code) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  int retval;
 
-  log_debug(INFO,"search(): starting query");
+  sprintf(buffer,"delete(): starting of delete of #%u",code);
   log_debug(INFO,buffer);
 
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  if (tx_begin() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  if ((query = stmt_get("DELETE FROM main WHERE code = ?")) == NULL) {
+    tx_rollback();
     return MI_EXIT_ERROR;
   }
+  retval = delete_row(query,code,"delete()");
+  stmt_put(query);
 
-  retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW)
-    *num_results = (uint32_t)sqlite3_column_int(query,0);
-  else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"search(): no results for query");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
-  }
-  else {
-    log_debug(ERROR,"search(): unknown error");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
+  if (retval == MI_EXIT_ERROR) {
+    tx_rollback();
     return MI_EXIT_ERROR;
   }
+  if (tx_commit() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  return retval;
+}
 
-  if (*num_results == 0) {
-    log_debug(INFO,"search(): no results for query");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
-  }
+int delete_batch(const uint32_t* codes, size_t n) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  size_t deleted = 0;
+  int retval;
+
+  sprintf(buffer,"delete_batch(): deleting %zu items",n);
+  log_debug(INFO,buffer);
 
-  if (terms == NULL) {
-    strcpy(buffer, "SELECT * FROM main");
+  if (tx_begin() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  if ((query = stmt_get("DELETE FROM main WHERE code = ?")) == NULL) {
+    tx_rollback();
+    return MI_EXIT_ERROR;
   }
-  else {
-    strcpy(buffer, "SELECT * FROM main WHERE ");
-    strcat(buffer, terms);
+
+  for (size_t i = 0; i < n; i++) {
+    retval = delete_row(query,codes[i],"delete_batch()");
+    if (retval == MI_EXIT_ERROR) {
+      stmt_put(query);
+      tx_rollback();
+      return MI_EXIT_ERROR;
+    }
+    if (retval == MI_EXIT_OK) deleted++;
   }
+  stmt_put(query);
 
-  log_debug(INFO,"search(): starting query");
+  if (tx_commit() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  sprintf(buffer,"delete_batch(): %zu of %zu deleted",deleted,n);
   log_debug(INFO,buffer);
+  return (deleted) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
 
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+/* touch and checkout share one statement per kind, location is ?1 in
+ * both so the binds line up, and the time and location are bound once
+ * for a whole batch with only the code changing per row
+ */
+static int touch_rows(const uint32_t* codes, size_t n, const char* location,
+		      uint32_t* unknown, size_t* num_unknown, const char* caller) {
+  char buffer[128];
+  sqlite3_stmt* query;
+  size_t missing = 0;
+  int retval;
+
+  if (num_unknown != NULL) *num_unknown = 0;
+
+  sprintf(buffer,"%s: updating %zu items",caller,n);
+  log_debug(INFO,buffer);
+
+  if (tx_begin() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  query = stmt_get((location) ?
+		   "UPDATE main SET location = ?1, update_time = ?2 WHERE code = ?3" :
+		   "UPDATE main SET update_time = ?2 WHERE code = ?3");
+  if (query == NULL) {
+    tx_rollback();
     return MI_EXIT_ERROR;
   }
+  if (location)
+    sqlite3_bind_text(query,1,location,-1,SQLITE_STATIC);
+  sqlite3_bind_int64(query,2,(sqlite3_int64)time(NULL));
 
-  items = malloc(sizeof(media_t)*(*num_results));
-  count = 0;
-
-  log_debug(INFO,"search(): staring row processing");
-  while (1) {
+  for (size_t i = 0; i < n; i++) {
+    sqlite3_bind_int64(query,3,codes[i]);
     retval = sqlite3_step(query);
-
-    if (retval == SQLITE_ROW) {
-      items[count].code =          (uint32_t)sqlite3_column_int(query,0);
-      items[count].type =          (medium_t)sqlite3_column_int(query,1);
-      strcpy(items[count].name,    (char *)sqlite3_column_text(query,2));
-      strcpy(items[count].location,(char *)sqlite3_column_text(query,3));
-      items[count].update =        (time_t)sqlite3_column_int64(query,4);
-      count++;
-      sprintf(buffer,"search(): loaded row %u", count);
-      log_debug(INFO,buffer);
-    }
-    else if (retval == SQLITE_DONE) {
-      /* all done */
-      log_debug(INFO,"search(): row processing done");
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
-      break;
-    }
-    else {
-      /* error of some sort */
-      log_debug(ERROR,"search(): error during row processing");
+    sqlite3_reset(query);
+    if (retval != SQLITE_DONE) {
+      sprintf(buffer,"%s: update of #%u failed",caller,codes[i]);
+      log_debug(ERROR,buffer);
       log_debug(ERROR,sqlite3_errmsg(db_handle));
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
-      *num_results = 0;
-      free(items);
-      items = NULL;
-      sqlite3_finalize(query);
+      stmt_put(query);
+      tx_rollback();
       return MI_EXIT_ERROR;
     }
+    if (sqlite3_changes(db_handle) == 0) {
+      sprintf(buffer,"%s: no item #%u",caller,codes[i]);
+      log_debug(INFO,buffer);
+      if (unknown != NULL) unknown[missing] = codes[i];
+      missing++;
+    }
+    else
+      changed(codes[i]);
   }
+  stmt_put(query);
 
-  sqlite3_finalize(query);
-  *num_results = count;
+  if (tx_commit() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  if (num_unknown != NULL) *num_unknown = missing;
+  return (missing < n) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
+
+int touch(uint32_t code) {
+  return touch_rows(&code,1,NULL,NULL,NULL,"touch()");
+}
+
+int checkout(uint32_t code, const char* location) {
+  return touch_rows(&code,1,location,NULL,NULL,"checkout()");
+}
+
+int touch_batch(const uint32_t* codes, size_t n, uint32_t* unknown, size_t* num_unknown) {
+  return touch_rows(codes,n,NULL,unknown,num_unknown,"touch_batch()");
+}
+
+int checkout_batch(const uint32_t* codes, size_t n, const char* location,
+		   uint32_t* unknown, size_t* num_unknown) {
+  return touch_rows(codes,n,location,unknown,num_unknown,"checkout_batch()");
+}
+
+/* row states
+ * a code's rows as a whole, for copying changes from one database to
+ * another without caring how they came about
+ */
+int fetch_state(row_state_t* state, uint32_t code) {
+  int retval;
+
+  memset(state,0,sizeof(*state));
+  state->code = code;
+  if ((retval = fetch_table(TABLE_MAIN,code,&state->item,"fetch_state()")) != MI_EXIT_OK)
+    return retval;
+  state->tables = STATE_MAIN;
+
+  if ((retval = fetch_table(TABLE_BOOKS,code,&state->book,"fetch_state()")) == MI_EXIT_OK)
+    state->tables |= STATE_BOOK;
+  else if (retval == MI_EXIT_ERROR)
+    return MI_EXIT_ERROR;
+  if ((retval = fetch_table(TABLE_MOVIES,code,&state->movie,"fetch_state()")) == MI_EXIT_OK)
+    state->tables |= STATE_MOVIE;
+  else if (retval == MI_EXIT_ERROR)
+    return MI_EXIT_ERROR;
   return MI_EXIT_OK;
 }
 
-int search_books(book_t* items, uint32_t* num_results, const char* terms) {
-  char buffer[1024];
+/* an update that finds nothing becomes an insert, so the rows end up the
+ * same whether or not they were there
+ */
+/* a row is taken as the writer committed it, write_row() never turns a
+ * book away over its isbn, so nothing here can wedge a follower
+ */
+static int put_row(int table, const void* item) {
+  int retval = write_row(table,0,item,"apply_states()");
+
+  if (retval == MI_NO_RESULTS) retval = write_row(table,1,item,"apply_states()");
+  return retval;
+}
+
+static int drop_row(int table, uint32_t code) {
+  static const char* drop_sql[] = {
+    "DELETE FROM main WHERE code = ?",
+    "DELETE FROM books WHERE code = ?",
+    "DELETE FROM movies WHERE code = ?"
+  };
   sqlite3_stmt* query;
   int retval;
-  uint32_t count;
 
-  if (terms == NULL) {
-    strcpy(buffer, "SELECT COUNT(*) FROM books");
-  }
-  else {
-    if ((sizeof(buffer)-50) < sizeof(terms)) {
-      log_debug(ERROR,"search_books(): terms exceeds buffer");
-      return MI_EXIT_ERROR;
-    }
+  if ((query = stmt_get(drop_sql[table])) == NULL) return MI_EXIT_ERROR;
+  retval = delete_row(query,code,"apply_states()");
+  stmt_put(query);
+  return (retval == MI_EXIT_ERROR) ? MI_EXIT_ERROR : MI_EXIT_OK;
+}
 
-    strcpy(buffer, "SELECT COUNT(*) FROM books WHERE ");
-    strcat(buffer, terms);
-  }
+int apply_states(const row_state_t* states, size_t n) {
+  char buffer[128];
+  const row_state_t* state;
+  int retval = MI_EXIT_OK;
 
-  log_debug(INFO,"search_books(): starting query");
+  sprintf(buffer,"apply_states(): applying %zu states",n);
   log_debug(INFO,buffer);
 
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search_books(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
+  if (tx_begin() != MI_EXIT_OK) return MI_EXIT_ERROR;
+  for (size_t i = 0; i < n && retval == MI_EXIT_OK; i++) {
+    state = &states[i];
+    if (!(state->tables & STATE_MAIN)) {
+      retval = drop_row(TABLE_MAIN,state->code);
+      continue;
+    }
+    if (state->item.code != state->code ||
+	((state->tables & STATE_BOOK) && state->book.code != state->code) ||
+	((state->tables & STATE_MOVIE) && state->movie.code != state->code)) {
+      log_debug(ERROR,"apply_states(): rows don't match their code");
+      retval = MI_EXIT_ERROR;
+      break;
+    }
+    retval = put_row(TABLE_MAIN,&state->item);
+    if (retval == MI_EXIT_OK)
+      retval = (state->tables & STATE_BOOK) ? put_row(TABLE_BOOKS,&state->book) :
+	drop_row(TABLE_BOOKS,state->code);
+    if (retval == MI_EXIT_OK)
+      retval = (state->tables & STATE_MOVIE) ? put_row(TABLE_MOVIES,&state->movie) :
+	drop_row(TABLE_MOVIES,state->code);
   }
 
-  retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW)
-    *num_results = (uint32_t)sqlite3_column_int(query,0);
-  else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"search_books(): no results for query");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
-  }
-  else {
-    log_debug(ERROR,"search_books(): unknown error");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
+  if (retval != MI_EXIT_OK) {
+    tx_rollback();
     return MI_EXIT_ERROR;
   }
+  return tx_commit();
+}
 
-  if (*num_results == 0) {
-    log_debug(INFO,"search(): no results for query");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
-  }
+/* online backup
+ * the copy is made pages_per_step pages at a time, holding the read lock
+ * only for a step, so writers get in between steps; a write through
+ * another connection makes sqlite start the copy over.  After
+ * SNAPSHOT_RESTARTS of those the rest is copied in one step, under one
+ * read lock that nothing can restart.  The destination is only
+ * committed once the whole copy is done.
+ */
+static double snapshot_clock() {
+  struct timespec ts;
 
-  if (terms == NULL) {
-    strcpy(buffer, "SELECT * FROM books");
-  }
-  else {
-    strcpy(buffer, "SELECT * FROM books WHERE ");
-    strcat(buffer, terms);
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int snapshot_db(const char* dest, int pages_per_step) {
+  return snapshot_db_ex(dest,pages_per_step,NULL,NULL,NULL);
+}
+
+int snapshot_db_ex(const char* dest, int pages_per_step, snapshot_progress_t progress,
+		   void* data, snapshot_stats_t* stats) {
+  char buffer[256];
+  sqlite3* dest_handle;
+  sqlite3_backup* backup;
+  sqlite3_stmt* query = NULL;
+  snapshot_stats_t local;
+  double start;
+  int copied = 0;
+  int retval;
+
+  if (stats == NULL) stats = &local;
+  memset(stats,0,sizeof(snapshot_stats_t));
+  if (pages_per_step <= 0) pages_per_step = -1; /* all of it in one step */
+
+  if (db_handle == NULL) {
+    log_debug(ERROR,"snapshot_db(): no database open");
+    return MI_EXIT_ERROR;
   }
 
-  log_debug(INFO,"search_books(): starting query");
+  sprintf(buffer,"snapshot_db(): copying to %.200s",dest);
   log_debug(INFO,buffer);
 
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search_books(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  if (sqlite3_open(dest,&dest_handle) != SQLITE_OK) {
+    log_debug(ERROR,"snapshot_db(): error opening destination");
+    log_debug(ERROR,sqlite3_errmsg(dest_handle));
+    sqlite3_close(dest_handle);
+    return MI_EXIT_ERROR;
+  }
+  if ((backup = sqlite3_backup_init(dest_handle,"main",db_handle,"main")) == NULL) {
+    log_debug(ERROR,"snapshot_db(): could not start backup");
+    log_debug(ERROR,sqlite3_errmsg(dest_handle));
+    sqlite3_close(dest_handle);
     return MI_EXIT_ERROR;
   }
 
-  items = malloc(sizeof(book_t)*(*num_results));
-  count = 0;
-
-  log_debug(INFO,"search_books(): staring row processing");
-  while (1) {
-    retval = sqlite3_step(query);
+  if (sqlite3_prepare_v2(db_handle,"PRAGMA page_size",-1,&query,NULL) == SQLITE_OK &&
+      sqlite3_step(query) == SQLITE_ROW)
+    stats->page_size = sqlite3_column_int(query,0);
+  sqlite3_finalize(query);
 
-    if (retval == SQLITE_ROW) {
-      items[count].code =            (uint32_t)sqlite3_column_int(query,0);
-      items[count].type =            (medium_t)sqlite3_column_int(query,1);
-      items[count].genre =          (genre_t)sqlite3_column_int(query,2);
-      strcpy(items[count].isbn,        (char *)sqlite3_column_text(query,3));
-      strcpy(items[count].title,       (char *)sqlite3_column_text(query,4));
-      strcpy(items[count].author_last, (char *)sqlite3_column_text(query,5));
-      strcpy(items[count].author_first,(char *)sqlite3_column_text(query,6));
-      strcpy(items[count].author_rest, (char *)sqlite3_column_text(query,7));
-      count++;
-      sprintf(buffer,"search_books(): loaded row %u", count);
-      log_debug(INFO,buffer);
+  start = snapshot_clock();
+  do {
+    retval = sqlite3_backup_step(backup,pages_per_step);
+    stats->steps++;
+    stats->total = sqlite3_backup_pagecount(backup);
+    stats->pages = stats->total - sqlite3_backup_remaining(backup);
+
+    /* a step that got no further than the last one started over */
+    if (retval == SQLITE_OK && stats->pages <= copied &&
+	++stats->restarts == SNAPSHOT_RESTARTS &&
+	pages_per_step > 0) {
+      log_debug(INFO,"snapshot_db(): restarted too often, copying the rest at once");
+      pages_per_step = -1;
     }
-    else if (retval == SQLITE_DONE) {
-      /* all done */
-      log_debug(INFO,"search_books(): row processing done");
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
+    copied = stats->pages;
+
+    if (progress != NULL && progress(stats,data)) {
+      log_debug(INFO,"snapshot_db(): cancelled");
+      retval = SQLITE_ABORT;
       break;
     }
-    else {
-      /* error of some sort */
-      log_debug(ERROR,"search_books(): error during row processing");
-      log_debug(ERROR,sqlite3_errmsg(db_handle));
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
-      *num_results = 0;
-      free(items);
-      items = NULL;
-      sqlite3_finalize(query);
-      return MI_EXIT_ERROR;
-    }
+    /* someone else has the file, give them a moment */
+    if (retval == SQLITE_BUSY || retval == SQLITE_LOCKED)
+      sqlite3_sleep(10);
+  } while (retval == SQLITE_OK || retval == SQLITE_BUSY || retval == SQLITE_LOCKED);
+
+  sqlite3_backup_finish(backup);
+  stats->seconds = snapshot_clock() - start;
+
+  if (retval != SQLITE_DONE) {
+    log_debug(ERROR,"snapshot_db(): backup failed");
+    log_debug(ERROR,sqlite3_errmsg(dest_handle));
+    sqlite3_close(dest_handle);
+    return MI_EXIT_ERROR;
   }
+  sqlite3_close(dest_handle);
 
-  sqlite3_finalize(query);
-  *num_results = count;
+  sprintf(buffer,"snapshot_db(): %d pages in %d steps, %.3f s",
+	  stats->pages,stats->steps,stats->seconds);
+  log_debug(INFO,buffer);
   return MI_EXIT_OK;
 }
 
-int search_movies(movie_t* items, uint32_t* num_results, const char* terms) {
-  char buffer[1024];
-  sqlite3_stmt* query;
-  int retval;
-  uint32_t count;
-
-  if (terms == NULL) {
-    strcpy(buffer, "SELECT COUNT(*) FROM movies");
-  }
-  else {
-    if ((sizeof(buffer)-50) < sizeof(terms)) {
-      log_debug(ERROR,"search_movies(): terms exceeds buffer");
-      return MI_EXIT_ERROR;
-    }
+uint32_t hash_string(char* source) {
+  //DJB Hash
+  uint32_t hash = 5381;
 
-    strcpy(buffer, "SELECT COUNT(*) FROM movies WHERE ");
-    strcat(buffer, terms);
-  }
+  for (int i = 0; i < (int)strlen(source); source++, i++)
+    hash = ((hash << 5) + hash) + *source;
 
-  log_debug(INFO,"search_movies(): starting query");
-  log_debug(INFO,buffer);
+  return hash;
+}
 
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search_movies(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
+/* ISBN-10 and ISBN-13, with or without hyphens or spaces, come out as the
+ * 13 digit number, ISBN-10s gaining the 978 prefix and a new check digit
+ */
+int isbn_normalise(const char* text, uint64_t* isbn13) {
+  int digits[13];
+  int n = 0;
+  int sum = 0;
+
+  for (; *text != '\0'; text++) {
+    if (*text == '-' || *text == ' ')
+      continue;
+    if (n >= 13)
+      return MI_EXIT_ERROR;
+    if (*text >= '0' && *text <= '9')
+      digits[n++] = *text - '0';
+    else if ((*text == 'X' || *text == 'x') && n == 9)
+      digits[n++] = 10; /* ISBN-10 check digit only */
+    else
+      return MI_EXIT_ERROR;
   }
 
-  retval = sqlite3_step(query);
-  if (retval == SQLITE_ROW)
-    *num_results = (uint32_t)sqlite3_column_int(query,0);
-  else if (retval == SQLITE_DONE) {
-    log_debug(INFO,"search_movies(): no results for query");
-    sqlite3_finalize(query);
+  if (n == 0)
     return MI_NO_RESULTS;
-  }
-  else {
-    log_debug(ERROR,"search_movies(): unknown error");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    sqlite3_finalize(query);
-    return MI_EXIT_ERROR;
-  }
 
-  if (*num_results == 0) {
-    log_debug(INFO,"search_movies(): no results for query");
-    sqlite3_finalize(query);
-    return MI_NO_RESULTS;
-  }
+  if (n == 10) {
+    for (int i = 0; i < 10; i++)
+      sum += (10 - i) * digits[i];
+    if (sum % 11 != 0)
+      return MI_EXIT_ERROR;
 
-  if (terms == NULL) {
-    strpcy(buffer, "SELECT * FROM movies");
+    /* 978 + the first nine, then a fresh ISBN-13 check digit */
+    for (int i = 8; i >= 0; i--)
+      digits[i + 3] = digits[i];
+    digits[0] = 9;
+    digits[1] = 7;
+    digits[2] = 8;
+    sum = 0;
+    for (int i = 0; i < 12; i++)
+      sum += (i % 2) ? digits[i] * 3 : digits[i];
+    digits[12] = (10 - sum % 10) % 10;
   }
-  else {
-    strcpy(buffer, "SELECT * FROM movies WHERE ");
-    strcat(buffer, terms);
+  else if (n == 13) {
+    if (digits[0] != 9 || digits[1] != 7 || (digits[2] != 8 && digits[2] != 9))
+      return MI_EXIT_ERROR;
+    for (int i = 0; i < 13; i++)
+      sum += (i % 2) ? digits[i] * 3 : digits[i];
+    if (sum % 10 != 0)
+      return MI_EXIT_ERROR;
   }
-
-  log_debug(INFO,"search_movies(): starting query");
-  log_debug(INFO,buffer);
-
-  if (sqlite3_prepare_v2(db_handle,buffer,-1,&query,NULL) != SQLITE_OK) {
-    log_debug(ERROR,"search_movies(): error executing query");
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
+  else
     return MI_EXIT_ERROR;
-  }
-
-  items = malloc(sizeof(movie_t)*(*num_results));
-  count = 0;
 
-  log_debug(INFO,"search_movies(): staring row processing");
-  while (1) {
-    retval = sqlite3_step(query);
+  *isbn13 = 0;
+  for (int i = 0; i < 13; i++)
+    *isbn13 = *isbn13 * 10 + digits[i];
+  return MI_EXIT_OK;
+}
 
-    if (retval == SQLITE_ROW) {
-      items[count].code =         (uint32_t)sqlite3_column_int(query,0);
-      items[count].type =         (medium_t)sqlite3_column_int(query,1);
-      items[count].genre =       (genre_t)sqlite3_column_int(query,2);
-      strcpy(items[count].title,   (char *)sqlite3_column_text(query,3));
-      strcpy(items[count].director,(char *)sqlite3_column_text(query,4));
-      strcpy(items[count].studio,  (char *)sqlite3_column_text(query,5));
-      items[count].rating =         (short)sqlite3_column_int(query,6);
-      count++;
-      sprintf(buffer,"search_movies(): loaded row %u", count);
-      log_debug(INFO,buffer);
+/* what the Latin-1 letters U+00C0 to U+00FF sort as, "" drops the character */
+static const char* latin1_fold[] = {
+  "A", "A", "A", "A", "A", "A", "AE", "C", "E", "E", "E", "E", "I", "I", "I", "I",
+  "D", "N", "O", "O", "O", "O", "O", "", "O", "U", "U", "U", "U", "Y", "TH", "SS",
+  "A", "A", "A", "A", "A", "A", "AE", "C", "E", "E", "E", "E", "I", "I", "I", "I",
+  "D", "N", "O", "O", "O", "O", "O", "", "O", "U", "U", "U", "U", "Y", "TH", "Y"
+};
+
+/* upper case letters and digits with single spaces between words, accents
+ * folded off Latin-1 letters and anything past Latin-1 kept as it is; the
+ * key is never longer than text, and is cut short to fit size
+ */
+size_t sort_key(const char* text, char* key, size_t size) {
+  static const char* articles[] = { "THE ", "A ", "AN " };
+  const unsigned char* p = (const unsigned char*)text;
+  const char* fold;
+  char letter[2] = { '\0', '\0' };
+  size_t len = 0;
+  size_t used;
+  size_t n;
+  int space = 0;
+
+  if (size == 0) return 0;
+
+  while (*p != '\0') {
+    /* what the next character sorts as, and how many bytes of text it is */
+    if ((*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')) {
+      letter[0] = *p;
+      fold = letter;
+      used = 1;
     }
-    else if (retval == SQLITE_DONE) {
-      /* all done */
-      log_debug(INFO,"search_movies(): row processing done");
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
-      break;
+    else if (*p >= 'a' && *p <= 'z') {
+      letter[0] = *p - 'a' + 'A';
+      fold = letter;
+      used = 1;
+    }
+    else if (*p == 0xc3 && (p[1] & 0xc0) == 0x80) {
+      fold = latin1_fold[p[1] - 0x80];
+      used = 2;
+    }
+    else if (*p >= 0xc4) {
+      /* past Latin-1 it's copied whole, or not at all */
+      for (used = 1; (p[used] & 0xc0) == 0x80; used++);
+      fold = NULL;
     }
     else {
-      /* error of some sort */
-      log_debug(ERROR,"search_movies: error during row processing");
-      log_debug(ERROR,sqlite3_errmsg(db_handle));
-      sprintf(buffer,"%u rows processed out of %u rows actual",count,*num_results);
-      log_debug(INFO,buffer);
-      *num_results = 0;
-      free(items);
-      items = NULL;
-      sqlite3_finalize(query);
-      return MI_EXIT_ERROR;
+      /* punctuation and symbols separate words, apostrophes don't */
+      if (*p != '\'' && len > 0) space = 1;
+      if (*p == 0xc2 && (p[1] & 0xc0) == 0x80) p++;
+      p++;
+      continue;
+    }
+
+    n = (fold != NULL) ? strlen(fold) : used;
+    if (len + space + n >= size) break;
+    if (n > 0) {
+      if (space) key[len++] = ' ';
+      space = 0;
+      memcpy(key + len,(fold != NULL) ? fold : (const char*)p,n);
+      len += n;
+    }
+    p += used;
+  }
+  key[len] = '\0';
+
+  /* THE MYSTERY OF THE BLUE TRAIN files under M */
+  for (size_t i = 0; i < sizeof(articles) / sizeof(articles[0]); i++) {
+    n = strlen(articles[i]);
+    if (len > n && strncmp(key,articles[i],n) == 0) {
+      len -= n;
+      memmove(key,key + n,len + 1);
+      break;
     }
   }
+  return len;
+}
 
-  sqlite3_finalize(query);
-  *num_results = count;
-  return MI_EXIT_OK;
+/* medium and genre names, see the registry above init_db() */
+const char* medium_string(medium_t type) {
+  registry_check();
+  if ((unsigned)type >= (unsigned)num_media) return "OTHER";
+  return medium_names[type];
 }
 
-int delete(uint32_t code) {
-  char buffer[128];
+uint32_t code_gen(medium_t type, const char* name) {
+  char buffer[151];
+  strcpy(buffer,medium_string(type));
+  strcat(buffer,name);
+  return hash_string(buffer);
+}
 
-  sprintf(buffer,"delete(): starting of delete of #%u",code);
-  log_debug(INFO,buffer);
+int csv_load(const char* dir, const char* prefix) {
+  log_debug(TODO,"csv_load(): not implemented");
+  return MI_NOT_IMPL;
+}
 
-  sprintf(buffer,"DELETE FROM main WHERE code = %u",code);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    sprintf(buffer,"delete(): delete of #%u failed",code);
-    log_debug(ERROR,buffer);
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
-  }
+static genre_slot_t* genre_cache_find(uint64_t mask) {
+  size_t i = (size_t)((mask * 0x9e3779b97f4a7c15ULL) >> 32) & genre_cache_mask;
 
-  sprintf(buffer,"DELETE FROM books WHERE code = %u",code);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    sprintf(buffer,"delete(): delete of #%u failed",code);
-    log_debug(ERROR,buffer);
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
+  while (genre_cache[i].mask != 0 && genre_cache[i].mask != mask)
+    i = (i + 1) & genre_cache_mask;
+  return &genre_cache[i];
+}
+
+/* under genre_lock, false if there's no memory for it */
+static int genre_cache_put(uint64_t mask, const char* string) {
+  genre_slot_t* old = genre_cache;
+  size_t old_size = (old) ? genre_cache_mask + 1 : 0;
+  size_t size;
+  genre_slot_t* slot;
+
+  if ((genre_cache_used + 1) * 2 > old_size) {
+    size = (old_size) ? old_size * 2 : 64;
+    if ((genre_cache = calloc(size,sizeof(genre_slot_t))) == NULL) {
+      genre_cache = old;
+      return 0;
+    }
+    genre_cache_mask = size - 1;
+    for (size_t i = 0; i < old_size; i++)
+      if (old[i].mask != 0) *genre_cache_find(old[i].mask) = old[i];
+    free(old);
   }
+  slot = genre_cache_find(mask);
+  slot->mask = mask;
+  slot->string = string;
+  genre_cache_used++;
+  return 1;
+}
 
-  sprintf(buffer,"DELETE FROM movies WHERE code = %u",code);
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    sprintf(buffer,"delete(): delete of #%u failed",code);
-    log_debug(ERROR,buffer);
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
+const char* genre_string(genre_t genre) {
+  static char fallback[GENRE_STRING_MAX];
+  uint64_t mask;
+  char buffer[GENRE_STRING_MAX];
+  const char* string = NULL;
+  size_t len = 0;
+
+  registry_check();
+  if ((mask = genre & genre_defined) == 0) return "";
+
+  pthread_mutex_lock(&genre_lock);
+  if (genre_cache != NULL) string = genre_cache_find(mask)->string;
+  if (string == NULL) {
+    for (int bit = 0; bit < GENRE_MAX; bit++) {
+      if (!(mask & ((uint64_t)1 << bit))) continue;
+      if (len) {
+	memcpy(buffer + len,", ",2);
+	len += 2;
+      }
+      memcpy(buffer + len,genre_names[bit],genre_lengths[bit]);
+      len += genre_lengths[bit];
+    }
+    buffer[len] = '\0';
+
+    /* out of memory, the old way: good until the next call */
+    if ((string = intern(buffer)) == NULL) {
+      strcpy(fallback,buffer);
+      string = fallback;
+    }
+    else
+      genre_cache_put(mask,string);
   }
+  pthread_mutex_unlock(&genre_lock);
+  return string;
+}
 
+int medium_parse(const char* text, medium_t* type) {
+  name_slot_t* slot;
+
+  registry_check();
+  if ((slot = map_find(&medium_map,text,strlen(text),1)) == NULL || slot->key == NULL)
+    return MI_NO_RESULTS;
+  *type = (medium_t)slot->id;
   return MI_EXIT_OK;
 }
 
-int touch(uint32_t code) {
-  char buffer[256];
-  
-  sprintf(buffer,"UPDATE main SET update_time = %jd WHERE code = %u",(intmax_t)time(NULL),code);
-  log_debug(INFO,"touch():");
-  log_debug(INFO,buffer);
+int genre_parse(const char* text, genre_t* genre) {
+  uint64_t mask = 0;
+  name_slot_t* slot;
+  const char* end;
+  size_t len;
 
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    sprintf(buffer,"touch(): update of #%u failed",code);
-    log_debug(ERROR,buffer);
-    log_debug(ERROR,sqlite3_errmsg(db_handle));
-    return MI_EXIT_ERROR;
+  registry_check();
+  while (*text != '\0') {
+    while (*text == ' ' || *text == ',') text++;
+    if (*text == '\0') break;
+
+    for (end = text; *end != '\0' && *end != ','; end++);
+    for (len = end - text; len > 0 && text[len - 1] == ' '; len--);
+
+    if ((slot = map_find(&genre_map,text,len,1)) == NULL || slot->key == NULL)
+      return MI_NO_RESULTS;
+
+    mask |= (uint64_t)1 << slot->id;
+    text = end;
   }
 
+  *genre = mask;
   return MI_EXIT_OK;
 }
 
-int checkout(uint32_t code, const char* location) {
-  char buffer[256];
+int medium_add(const char* name, medium_t* type) {
+  sqlite3_stmt* query;
+  int id;
 
-  sprintf(buffer,"UPDATE main SET location = '%s', update_time = %jd WHERE code = %u",
-	  location,(intmax_t)time(NULL),code);
-  log_debug(INFO,"checkout():");
-  log_debug(INFO,buffer);
+  if (db_handle == NULL || *name == '\0' || strlen(name) >= MEDIUM_NAME_SIZE) {
+    log_debug(ERROR,"medium_add(): no catalogue open or bad name");
+    return MI_EXIT_ERROR;
+  }
+  if (medium_parse(name,type) == MI_EXIT_OK) return MI_EXISTS;
+  if ((id = num_media) >= MEDIUM_MAX) {
+    log_debug(ERROR,"medium_add(): too many media");
+    return MI_EXIT_ERROR;
+  }
 
-  if (sqlite3_exec(db_handle,buffer,NULL,NULL,NULL) != SQLITE_OK) {
-    sprintf(buffer,"checkout(): update of #%u failed",code);
-    log_debug(ERROR,buffer);
+  if ((query = stmt_get("INSERT INTO media_types (id, name) VALUES (?, ?)")) == NULL)
+    return MI_EXIT_ERROR;
+  sqlite3_bind_int(query,1,id);
+  sqlite3_bind_text(query,2,name,-1,SQLITE_STATIC);
+  if (sqlite3_step(query) != SQLITE_DONE) {
+    log_debug(ERROR,"medium_add(): could not store medium");
     log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
     return MI_EXIT_ERROR;
   }
+  stmt_put(query);
 
+  if (registry_medium(id,name,NULL) != MI_EXIT_OK ||
+      map_put(&medium_map,medium_names[id],id,1) == MI_EXIT_ERROR) {
+    log_debug(ERROR,"medium_add(): out of memory, reopen to see it");
+    return MI_EXIT_ERROR;
+  }
+  *type = (medium_t)id;
   return MI_EXIT_OK;
 }
 
-uint32_t hash_string(char* source) {
-  //DJB Hash
-  uint32_t hash = 5381;
-
-  for (int i = 0; i < (int)strlen(source); source++, i++)
-    hash = ((hash << 5) + hash) + *source;
+int genre_add(const char* name, genre_t* genre) {
+  sqlite3_stmt* query;
+  name_slot_t* slot;
+  int bit;
 
-  return hash;
-}
+  if (db_handle == NULL || *name == '\0' || strlen(name) >= GENRE_NAME_SIZE ||
+      strchr(name,',')) {
+    log_debug(ERROR,"genre_add(): no catalogue open or bad name");
+    return MI_EXIT_ERROR;
+  }
+  registry_check();
+  if ((slot = map_find(&genre_map,name,strlen(name),1)) != NULL && slot->key != NULL) {
+    *genre = (genre_t)1 << slot->id;
+    return MI_EXISTS;
+  }
+  for (bit = 0; bit < GENRE_MAX && (genre_defined & ((uint64_t)1 << bit)); bit++);
+  if (bit == GENRE_MAX) {
+    log_debug(ERROR,"genre_add(): every bit is taken");
+    return MI_EXIT_ERROR;
+  }
 
-const char* medium_string(medium_t type) {
-  static char name[30];
-  switch (type) {
-  case book:
-    strcpy(name,"BOOK");
-    break;
-  case xbox:
-    strcpy(name,"MICROSOFT XBOX");
-    break;
-  case xbox360:
-    strcpy(name,"MICROSOFT XBOX 360");
-    break;
-  case ps2:
-    strcpy(name,"SONY PLAYSTATION 2");
-    break;
-  case ps3:
-    strcpy(name,"SONY PLAYSTATION 3");
-    break;
-  case psp:
-    strcpy(name,"SONY PLAYSTATION PORTABLE");
-    break;
-  case n64:
-    strcpy(name,"NINTENDO 64");
-    break;
-  case wii:
-    strcpy(name,"NINTENDO WII");
-    break;
-  case ds:
-    strcpy(name,"NINTENDO DS");
-    break;
-  case dvd:
-    strcpy(name,"DVD");
-    break;
-  case bluray:
-    strcpy(name,"BLU-RAY");
-    break;
-  case vhs:
-    strcpy(name,"VHS");
-    break;
-  case tape:
-    strcpy(name,"TAPE");
-    break;
-  case cdrom:
-    strcpy(name,"CD-ROM");
-    break;
-  default:
-    strcpy(name,"OTHER");
+  if ((query = stmt_get("INSERT INTO genres (bit, name) VALUES (?, ?)")) == NULL)
+    return MI_EXIT_ERROR;
+  sqlite3_bind_int(query,1,bit);
+  sqlite3_bind_text(query,2,name,-1,SQLITE_STATIC);
+  if (sqlite3_step(query) != SQLITE_DONE) {
+    log_debug(ERROR,"genre_add(): could not store genre");
+    log_debug(ERROR,sqlite3_errmsg(db_handle));
+    stmt_put(query);
+    return MI_EXIT_ERROR;
   }
-  return name;
-}
+  stmt_put(query);
 
-uint32_t code_gen(medium_t type, const char* name) {
-  char buffer[151];
-  strcat(buffer,medium_string(type));
-  strcat(buffer,name);
-  return hash_string(buffer);
+  if (registry_genre(bit,name,NULL) != MI_EXIT_OK ||
+      map_put(&genre_map,genre_names[bit],bit,1) == MI_EXIT_ERROR) {
+    log_debug(ERROR,"genre_add(): out of memory, reopen to see it");
+    return MI_EXIT_ERROR;
+  }
+  *genre = (genre_t)1 << bit;
+  return MI_EXIT_OK;
 }
 
-int csv_load(const char* dir, const char* prefix) {
-  log_debug(TODO,"csv_load(): not implemented");
-  return MI_NOT_IMPL;
+int medium_count() {
+  registry_check();
+  return num_media;
 }
 
-#define GENRE_STR_APP(flag,ptr,test,str) \
-  do {					 \
-  if ((flag & test) == test) {		 \
-    if (comma_flag) {			 \
-      strcpy(ptr,", ");			 \
-      ptr += strlen(ptr);		 \
-    }					 \
-    strcpy(ptr,str);			 \
-    ptr += strlen(ptr);			 \
-    comma_flag++;			 \
-  }					 \
-  } while (0)
-
-const char* genre_string(genre_t genre) {
-  static char buffer[256];
-  char* p;
-  int comma_flag = 0;
-
-  p = buffer;
-
-  GENRE_STR_APP(genre,p,reference,"REFERENCE");
-  GENRE_STR_APP(genre,p,classic,"CLASSIC");
-  GENRE_STR_APP(genre,p,religious,"RELIGIOUS");
-  GENRE_STR_APP(genre,p,scifi,"SCI-FI");
-  GENRE_STR_APP(genre,p,fantasy,"FANTASY");
-  GENRE_STR_APP(genre,p,mystery,"MYSTERY");
-  GENRE_STR_APP(genre,p,fiction,"FICTION");
-  GENRE_STR_APP(genre,p,computer,"COMPUTER");
-  GENRE_STR_APP(genre,p,documentary,"DOCUMENTARY");
-  GENRE_STR_APP(genre,p,action,"ACTION");
-  GENRE_STR_APP(genre,p,adventure,"ADVENTURE");
-  GENRE_STR_APP(genre,p,animation,"ANIMATION");
-  GENRE_STR_APP(genre,p,drama,"DRAMA");
-  GENRE_STR_APP(genre,p,suspense,"SUSPENSE");
-  GENRE_STR_APP(genre,p,thriller,"THRILLER");
-  GENRE_STR_APP(genre,p,horror,"HORROR");
-  GENRE_STR_APP(genre,p,misc,"MISCELLANEOUS");
-  GENRE_STR_APP(genre,p,bmovie,"B-MOVIE");
-
-  return buffer;
+int genre_count() {
+  registry_check();
+  return __builtin_popcountll(genre_defined);
 }
 
 const char* error_string(int err) {
@@ -1121,11 +4172,7 @@ int csv_dump(const char* dir, const char* prefix) {
     retval = sqlite3_step(main_query);
 
     if (retval == SQLITE_ROW) {
-      mtemp.code =        (uint32_t)sqlite3_column_int(main_query,0);
-      mtemp.type =        (medium_t)sqlite3_column_int(main_query,1);
-      strcpy(mtemp.name,    (char *)sqlite3_column_text(main_query,2));
-      strcpy(mtemp.location,(char *)sqlite3_column_text(main_query,3));
-      mtemp.update =        (time_t)sqlite3_column_int64(main_query,4);
+      read_media(main_query,&mtemp);
       count++;
       fprintf(main_out,"%u,%d,%s,%s,%jd\n",
 	      mtemp.code,mtemp.type,mtemp.name,mtemp.location,(intmax_t)mtemp.update);
@@ -1175,16 +4222,9 @@ int csv_dump(const char* dir, const char* prefix) {
     retval = sqlite3_step(book_query);
 
     if (retval == SQLITE_ROW) {
-      btemp.code =            (uint32_t)sqlite3_column_int(book_query,0);
-      btemp.type =            (medium_t)sqlite3_column_int(book_query,1);
-      btemp.genre =            (genre_t)sqlite3_column_int(book_query,2);
-      strcpy(btemp.isbn,        (char *)sqlite3_column_text(book_query,3));
-      strcpy(btemp.title,       (char *)sqlite3_column_text(book_query,4));
-      strcpy(btemp.author_last, (char *)sqlite3_column_text(book_query,5));
-      strcpy(btemp.author_first,(char *)sqlite3_column_text(book_query,6));
-      strcpy(btemp.author_rest, (char *)sqlite3_column_text(book_query,7));
+      read_book(book_query,&btemp);
       count++;
-      fprintf(book_out,"%u,%d,%d,%s,%s,%s,%s,%s\n",
+      fprintf(book_out,"%u,%d,%" PRIu64 ",%s,%s,%s,%s,%s\n",
 	      btemp.code,btemp.type,btemp.genre,btemp.isbn,btemp.title,btemp.author_last,
 	      btemp.author_first,btemp.author_rest);
       sprintf(buffer,"csv_dump(): output row %d",count);
@@ -1231,15 +4271,9 @@ int csv_dump(const char* dir, const char* prefix) {
     retval = sqlite3_step(movie_query);
 
     if (retval == SQLITE_ROW) {
-      vtemp.code =        (uint32_t)sqlite3_column_int(movie_query,0);
-      vtemp.type =        (medium_t)sqlite3_column_int(movie_query,1);
-      vtemp.genre =        (genre_t)sqlite3_column_int(movie_query,2);
-      strcpy(vtemp.title,   (char *)sqlite3_column_text(movie_query,3));
-      strcpy(vtemp.director,(char *)sqlite3_column_text(movie_query,4));
-      strcpy(vtemp.studio,  (char *)sqlite3_column_text(movie_query,5));
-      vtemp.rating =         (short)sqlite3_column_int(movie_query,6);
+      read_movie(movie_query,&vtemp);
       count++;
-      fprintf(movie_out,"%u,%d,%d,%s,%s,%s,%d\n",
+      fprintf(movie_out,"%u,%d,%" PRIu64 ",%s,%s,%s,%d\n",
 	      vtemp.code,vtemp.type,vtemp.genre,vtemp.title,vtemp.director,vtemp.studio,vtemp.rating);
       sprintf(buffer,"csv_dump(): output row %d",count);
       log_debug(INFO,buffer);
@@ -1330,16 +4364,12 @@ int pretty_dump(const char* file) {
     retval = sqlite3_step(main_query);
 
     if (retval == SQLITE_ROW) {
-      mtemp.code =        (uint32_t)sqlite3_column_int(main_query,0);
-      mtemp.type =        (medium_t)sqlite3_column_int(main_query,1);
-      strcpy(mtemp.name,    (char *)sqlite3_column_text(main_query,2));
-      strcpy(mtemp.location,(char *)sqlite3_column_text(main_query,3));
-      mtemp.update =        (time_t)sqlite3_column_int64(main_query,4);
+      read_media(main_query,&mtemp);
       count++;
       fprintf(out,"#%u: %s\n",mtemp.code,mtemp.name);
       fprintf(out,"\tType:        %s\n",medium_string(mtemp.type));
       fprintf(out,"\tLocation:    %s\n",mtemp.location);
-      fprintf(out,"\tLast Update: %s\n\n",time_string(&mtemp.update));
+      fprintf(out,"\tLast Update: %s\n\n",time_string(mtemp.update));
 
       sprintf(buffer,"pretty_dump(): output row %d",count);
       log_debug(INFO,buffer);
@@ -1383,14 +4413,7 @@ int pretty_dump(const char* file) {
     retval = sqlite3_step(book_query);
 
     if (retval == SQLITE_ROW) {
-      btemp.code =            (uint32_t)sqlite3_column_int(book_query,0);
-      btemp.type =            (medium_t)sqlite3_column_int(book_query,1);
-      btemp.genre =            (genre_t)sqlite3_column_int(book_query,2);
-      strcpy(btemp.isbn,        (char *)sqlite3_column_text(book_query,3));
-      strcpy(btemp.title,       (char *)sqlite3_column_text(book_query,4));
-      strcpy(btemp.author_last, (char *)sqlite3_column_text(book_query,5));
-      strcpy(btemp.author_first,(char *)sqlite3_column_text(book_query,6));
-      strcpy(btemp.author_rest, (char *)sqlite3_column_text(book_query,7));
+      read_book(book_query,&btemp);
       count++;
       fprintf(out,"#%u:%s: %s\n",btemp.code,medium_string(btemp.type),btemp.isbn);
       fprintf(out,"\tTitle:  %s\n",btemp.title);
@@ -1440,13 +4463,7 @@ int pretty_dump(const char* file) {
     retval = sqlite3_step(movie_query);
 
     if (retval == SQLITE_ROW) {
-      vtemp.code =        (uint32_t)sqlite3_column_int(movie_query,0);
-      vtemp.type =        (medium_t)sqlite3_column_int(movie_query,1);
-      vtemp.genre =        (genre_t)sqlite3_column_int(movie_query,2);
-      strcpy(vtemp.title,   (char *)sqlite3_column_text(movie_query,3));
-      strcpy(vtemp.director,(char *)sqlite3_column_text(movie_query,4));
-      strcpy(vtemp.studio,  (char *)sqlite3_column_text(movie_query,5));
-      vtemp.rating =         (short)sqlite3_column_int(movie_query,6);
+      read_movie(movie_query,&vtemp);
       count++;
       fprintf(out,"#%u:%s: %s\n",vtemp.code,medium_string(vtemp.type),vtemp.title);
       fprintf(out,"\tDirector: %s\n",vtemp.director);
@@ -1485,12 +4502,76 @@ int pretty_dump(const char* file) {
   return MI_EXIT_OK;
 }
 
-const char* time_string(time_t time) {
-  struct tm* time_tmp;
-  static char buffer[50];
+/* timestamps
+ * the date comes from the day number by arithmetic and each two digit
+ * field from a table, so formatting a row's time costs no gmtime() or
+ * strftime() call and touches nothing shared
+ */
+static const char digit_pairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static char* put_pair(char* p, int n) {
+  memcpy(p,digit_pairs + n * 2,2);
+  return p + 2;
+}
+
+/* writes YYYY-MM-DD, between, then HH:MM:SS and returns the end; the date
+ * part is Howard Hinnant's civil_from_days()
+ */
+static char* put_date_time(char* p, time_t time, const char* between) {
+  int64_t days = (int64_t)time / 86400;
+  int64_t secs = (int64_t)time % 86400;
+  int64_t era, year;
+  int doe, yoe, doy, mp, day, month;
+
+  if (secs < 0) {
+    secs += 86400;
+    days--;
+  }
+
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = (int)(days - era * 146097);
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = (mp < 10) ? mp + 3 : mp - 9;
+  year = yoe + era * 400 + (month <= 2);
+
+  if (year >= 0 && year <= 9999) {
+    p = put_pair(p,(int)(year / 100));
+    p = put_pair(p,(int)(year % 100));
+  }
+  else
+    p += sprintf(p,"%" PRId64,year);
+  *p++ = '-';
+  p = put_pair(p,month);
+  *p++ = '-';
+  p = put_pair(p,day);
+  while (*between != '\0') *p++ = *between++;
+  p = put_pair(p,(int)(secs / 3600));
+  *p++ = ':';
+  p = put_pair(p,(int)(secs / 60 % 60));
+  *p++ = ':';
+  return put_pair(p,(int)(secs % 60));
+}
 
-  time_tmp = gmtime(&time);
-  strftime(buffer,sizeof(buffer), "%F @ %T %Z", time_tmp);
+/* what strftime("%F @ %T %Z") gives for a gmtime() */
+char* time_format(time_t time, char* buffer) {
+  strcpy(put_date_time(buffer,time," @ ")," GMT");
+  return buffer;
+}
 
+char* time_format_iso(time_t time, char* buffer) {
+  strcpy(put_date_time(buffer,time,"T"),"Z");
   return buffer;
 }
+
+const char* time_string(time_t time) {
+  static char buffer[TIME_STRING_SIZE];
+
+  return time_format(time,buffer);
+}
@@ -27,50 +27,114 @@
 #define MI_NOT_IMPL   -2
 #define MI_EXISTS      2
 
+/* time_format() buffers, room for any 64 bit year */
+#define TIME_STRING_SIZE 40
+
+/* open modes */
+#define DB_READ_WRITE 0
+#define DB_READ_ONLY  1 /* no writes, no schema set up, still locks */
+#define DB_IMMUTABLE  2 /* read only and the file is promised never to change,
+			 * sqlite skips all locking and change checks
+			 */
+
+/* Bloom filter bits per code in front of exists() and fetch(); at 10,
+ * and built for twice the codes there are, well under 1% of misses get
+ * through to sqlite
+ */
+#define CODE_FILTER_BITS 10
+
+/* code index modes, an in-memory copy of every row behind fetch() */
+#define INDEX_OFF    0
+#define INDEX_SHARED 1 /* checks for other connections' commits on every lookup */
+#define INDEX_OWNED  2 /* nothing else writes the file while it's open */
+
+/* which rows a row_state_t has */
+#define STATE_MAIN  1
+#define STATE_BOOK  2
+#define STATE_MOVIE 4
+
+/* search filters */
+#define FILTER_MAX_TERMS 16 /* conditions plus brackets */
+
+#define FILTER_AND 0 /* how the terms of a group are joined */
+#define FILTER_OR  1
+
+#define FILTER_TERM  0 /* filter_term_t kinds */
+#define FILTER_OPEN  1
+#define FILTER_CLOSE 2
+
 /* typedefs */
 
-/* type codes */
-/* TODO: don't hardcode these */
+/* type codes
+ * the media every catalogue starts with, the enum and the rows
+ * init_db() seeds media_types with are both generated from this
+ * list; medium_add() adds more to a catalogue at run time.  The name is
+ * what code_gen() hashes, so it can't change once items have been
+ * labelled
+ */
+#define MEDIUM_LIST(X)					\
+  X(book,    "BOOK")					\
+  X(xbox,    "MICROSOFT XBOX")				\
+  X(xbox360, "MICROSOFT XBOX 360")			\
+  X(ps2,     "SONY PLAYSTATION 2")			\
+  X(ps3,     "SONY PLAYSTATION 3")			\
+  X(psp,     "SONY PLAYSTATION PORTABLE")		\
+  X(n64,     "NINTENDO 64")				\
+  X(wii,     "NINTENDO WII")				\
+  X(ds,      "NINTENDO DS")				\
+  X(dvd,     "DVD")					\
+  X(bluray,  "BLU-RAY")					\
+  X(vhs,     "VHS")					\
+  X(tape,    "TAPE")					\
+  X(cdrom,   "CD-ROM")					\
+  X(vinyl,   "OTHER") /* never had a name of its own */	\
+  X(other,   "OTHER")
+
+#define MEDIUM_ENUM(id, name) id,
 typedef enum {
-  book,
-  xbox,
-  xbox360,
-  ps2,
-  ps3,
-  psp,
-  n64,
-  wii,
-  ds,
-  dvd,
-  bluray,
-  vhs,
-  tape,
-  cdrom,
-  vinyl,
-  other
+  MEDIUM_LIST(MEDIUM_ENUM)
+  NUM_MEDIA
 } medium_t;
+#undef MEDIUM_ENUM
 
-/* genre codes: */
-typedef enum {
-  reference   =     1, //0
-  classic     =     2, //1
-  religious   =     4, //2
-  scifi       =     8, //3
-  fantasy     =    16, //4
-  mystery     =    32, //5
-  fiction     =    64, //6
-  computer    =   128, //7
-  documentary =   256, //8
-  action      =   512, //9
-  adventure   =  1024, //10
-  animation   =  2048, //11
-  drama       =  4096, //12
-  suspense    =  8192, //13
-  thriller    = 16384, //14
-  horror      = 32768, //15
-  misc        = 65536, //16
-  bmovie      = 131072 //17
-} genre_t;
+/* genre codes, one bit of a 64 bit mask each so a title can have several
+ * the genres every catalogue starts with, in bit order, which is the
+ * order genre_string() names them; genre_add() takes the next free bit
+ */
+#define GENRE_LIST(X)				\
+  X(reference,    0, "REFERENCE")		\
+  X(classic,      1, "CLASSIC")			\
+  X(religious,    2, "RELIGIOUS")		\
+  X(scifi,        3, "SCI-FI")			\
+  X(fantasy,      4, "FANTASY")			\
+  X(mystery,      5, "MYSTERY")			\
+  X(fiction,      6, "FICTION")			\
+  X(computer,     7, "COMPUTER")		\
+  X(documentary,  8, "DOCUMENTARY")		\
+  X(action,       9, "ACTION")			\
+  X(adventure,   10, "ADVENTURE")		\
+  X(animation,   11, "ANIMATION")		\
+  X(drama,       12, "DRAMA")			\
+  X(suspense,    13, "SUSPENSE")		\
+  X(thriller,    14, "THRILLER")		\
+  X(horror,      15, "HORROR")			\
+  X(misc,        16, "MISCELLANEOUS")		\
+  X(bmovie,      17, "B-MOVIE")
+
+#define GENRE_ENUM(id, bit, name) id = 1 << bit,
+enum {
+  GENRE_LIST(GENRE_ENUM)
+};
+#undef GENRE_ENUM
+typedef uint64_t genre_t;
+
+#define GENRE_ONE(id, bit, name) + 1
+#define NUM_GENRES (0 GENRE_LIST(GENRE_ONE)) /* built in, GENRE_MAX with genre_add() */
+#define GENRE_MAX  64
+#define MEDIUM_MAX 1024
+
+#define MEDIUM_NAME_SIZE 30 /* a name, with code_gen()'s 120 of item name, fits 151 */
+#define GENRE_NAME_SIZE  30
 
 /* type for main index */
 typedef struct {
@@ -104,9 +168,164 @@ typedef struct {
   short     rating;        /* column 6 */
 } movie_t;
 
+/* columns a filter can test, only the ones in the table being searched
+ * are allowed (code and type are in all three, genre in books and movies)
+ */
+typedef enum {
+  F_CODE,
+  F_TYPE,
+  F_NAME,
+  F_LOCATION,
+  F_UPDATE,
+  F_GENRE,
+  F_ISBN,
+  F_TITLE,
+  F_AUTHOR_LAST,
+  F_AUTHOR_FIRST,
+  F_AUTHOR_REST,
+  F_DIRECTOR,
+  F_STUDIO,
+  F_RATING,
+  F_SORT     /* sort key, of the name in main and the title in books and movies */
+} field_t;
+
+typedef enum {
+  OP_EQ,
+  OP_NE,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_LIKE,   /* text only, SQL LIKE pattern */
+  OP_PREFIX, /* text only, starts with value, can use an index */
+  OP_HAS     /* numbers only, all bits of value set (genre masks) */
+} op_t;
+
+typedef struct {
+  int     kind;       /* FILTER_TERM, FILTER_OPEN or FILTER_CLOSE */
+  int     join;       /* FILTER_AND or FILTER_OR, for FILTER_OPEN */
+  field_t field;
+  op_t    op;
+  int     is_text;
+  int64_t num;
+  char    text[121];
+} filter_term_t;
+
+/* a search, built up with the filter_*() functions and never turned into
+ * SQL text with the values in it, so quotes in a title are just quotes
+ */
+typedef struct {
+  int           num_terms;
+  int           depth;     /* brackets left open */
+  filter_term_t terms[FILTER_MAX_TERMS];
+  int           order;     /* field_t to sort on, -1 for none */
+  int           desc;
+  uint32_t      limit;     /* 0 for no limit */
+  uint32_t      offset;
+  int           after;     /* keyset cursor set, see filter_after_int() */
+  int           after_is_text;
+  int64_t       after_num;
+  char          after_text[121];
+  uint32_t      after_code;
+} filter_t;
+
+/* sqlite journal modes */
+typedef enum {
+  JOURNAL_DEFAULT,  /* whatever the file already uses */
+  JOURNAL_DELETE,
+  JOURNAL_TRUNCATE,
+  JOURNAL_PERSIST,
+  JOURNAL_MEMORY,
+  JOURNAL_WAL,
+  JOURNAL_OFF
+} journal_t;
+
+/* how the connection is tuned, zero/default fields leave sqlite's own
+ * setting alone
+ */
+typedef struct {
+  int       cache_kib;    /* page cache, in KiB */
+  int64_t   mmap_size;    /* bytes of the file read through mmap() */
+  journal_t journal;
+  int       synchronous;  /* 0 OFF, 1 NORMAL, 2 FULL, 3 EXTRA, -1 default */
+  int       temp_store;   /* 1 file, 2 memory, 0 default */
+  int       busy_timeout; /* ms to wait on a locked file, 0 fails at once */
+  int       page_size;    /* only used when the file is created */
+  int       read_only;    /* DB_READ_WRITE, DB_READ_ONLY or DB_IMMUTABLE */
+  int       code_filter;  /* bits per code of the code filter, 0 for none */
+  int       code_index;   /* INDEX_OFF, INDEX_SHARED or INDEX_OWNED */
+} db_options_t;
+
+/* how the code filter is doing, negatives are lookups it answered and
+ * false positives ones it passed on that sqlite didn't find
+ */
+typedef struct {
+  uint64_t bits;
+  uint64_t codes;           /* set since it was built, deletes don't clear */
+  uint64_t deleted;
+  uint64_t builds;          /* at open, when full, after others commit */
+  uint64_t probes;
+  uint64_t negatives;
+  uint64_t false_positives;
+  double   fpr;             /* false positives / all misses, so far */
+  double   expected_fpr;    /* from how full it is */
+} code_filter_stats_t;
+
+/* how the code index is doing, hits are lookups it answered */
+typedef struct {
+  uint64_t rows;          /* in all three tables */
+  uint64_t bytes;         /* slots, rows and text */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t forgotten;     /* rows dropped because this connection changed them */
+  uint64_t clears;        /* after other connections commit */
+  int      threads;       /* that built it at open */
+  double   build_seconds;
+} code_index_stats_t;
+
+/* every row under one code, as fetch_state() found it; no STATE_MAIN
+ * means the code isn't there
+ */
+typedef struct {
+  uint32_t code;
+  int      tables; /* STATE_* */
+  media_t  item;
+  book_t   book;
+  movie_t  movie;
+} row_state_t;
+
+#define SNAPSHOT_RESTARTS 3 /* after this many the rest is copied in one step */
+
+/* how far a snapshot has got */
+typedef struct {
+  int    pages;     /* copied so far */
+  int    total;     /* in the source, as of the last step */
+  int    steps;
+  int    restarts;  /* started over by writes through other connections */
+  int    page_size; /* bytes */
+  double seconds;   /* set when the copy finishes */
+} snapshot_stats_t;
+
+/* called after every step, a non-zero return cancels the snapshot */
+typedef int (*snapshot_progress_t)(const snapshot_stats_t* stats, void* data);
+
 /* access functions */
 int init_db(const char* file);
+int init_db_ex(const char* file, const db_options_t* options); /* NULL is the same as init_db() */
+void db_options_init(db_options_t* options);      /* all defaults */
+int db_options_preset(db_options_t* options, const char* name);
+                                                  /* "default", "durable" (WAL, full sync),
+						   * "bulk-import" (no sync, big cache) or
+						   * "kiosk-readonly" (immutable, big cache,
+						   * mmap and the code index),
+						   * MI_NO_RESULTS for any other name
+						   */
 int close_db();
+int forget_db();                                  /* in a child of fork(), drops the
+						   * parent's connection without closing
+						   * it, and any commit hook with it
+						   */
+int interrupt_db();                               /* aborts whatever query is running */
 
 int fetch        (media_t* sought,uint32_t code); /* this fetches from the main database
 						   * books and movies have more detail
@@ -115,12 +334,27 @@ int fetch        (media_t* sought,uint32_t code); /* this fetches from the main
 						   */
 int fetch_book   (book_t* sought,uint32_t code);  /* fetches books */ 
 int fetch_movie  (movie_t* sought,uint32_t code); /* fetches movies */
+int fetch_book_by_isbn(book_t* sought, const char* isbn); /* any ISBN-10 or ISBN-13 form,
+							    * one index probe
+							    */
 
 int exists       (uint32_t code);                 /* because in this implementation, fetch()
 						   * is crowded enough already
 						   */
 int exists_book  (uint32_t code);
 int exists_movie (uint32_t code);
+int code_filter_stats(code_filter_stats_t* stats); /* MI_NO_RESULTS if there is no filter */
+int code_index_stats (code_index_stats_t* stats); /* MI_NO_RESULTS if there is no index */
+
+int fetch_many       (media_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int fetch_many_books (book_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+                                                  /* items[i] and found[i] are for codes[i],
+						   * found[i] is 1 if it was there (items[i]
+						   * is left alone if not), items may be
+						   * NULL to only check, MI_NO_RESULTS if
+						   * none of them were there
+						   */
 
 int store        (media_t* item);
 int store_book   (book_t* item);
@@ -130,25 +364,179 @@ int update       (media_t* item);
 int update_book  (book_t* item);
 int update_movie (movie_t* item);
 
-int search       (media_t* items, uint32_t* num_results, const char* terms);
-int search_books (book_t* items, uint32_t* num_results, const char* terms);
-int search_movies(movie_t* items, uint32_t* num_results, const char* terms);
+int store_book_item  (media_t* item, book_t* detail);
+int store_movie_item (media_t* item, movie_t* detail);
+int update_book_item (media_t* item, book_t* detail);
+int update_movie_item(media_t* item, movie_t* detail);
+                                                  /* writes the main row and its detail in
+						   * one transaction, so a crash or error
+						   * leaves both or neither; detail takes
+						   * its code and type from item
+						   */
+int store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored);
+                                                  /* store_book_item() for each, in one
+						   * transaction, items already there are
+						   * skipped, MI_EXISTS if they all were
+						   */
+
+int search       (media_t** items, uint32_t* num_results, const filter_t* filter);
+int search_books (book_t** items, uint32_t* num_results, const filter_t* filter);
+int search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter);
+                                                  /* *items is malloc()ed to fit every
+						   * match and is the caller's to free(),
+						   * NULL when nothing matched
+						   */
+
+void filter_init (filter_t* filter);              /* empty filter matches everything */
+int filter_int   (filter_t* filter, field_t field, op_t op, int64_t value);
+int filter_text  (filter_t* filter, field_t field, op_t op, const char* value);
+int filter_open  (filter_t* filter, int join);    /* starts a bracketed group whose terms are
+						   * joined by join, the top level is AND
+						   */
+int filter_close (filter_t* filter);
+void filter_order(filter_t* filter, field_t field, int desc);
+void filter_limit(filter_t* filter, uint32_t limit, uint32_t offset);
+int filter_after_int (filter_t* filter, int64_t key, uint32_t code);
+int filter_after_text(filter_t* filter, const char* key, uint32_t code);
+                                                  /* only rows past (key, code) in the
+						   * filter's order, needs filter_order()
+						   * first and clears any offset; F_SORT
+						   * takes the key stored with code while
+						   * that row is still there
+						   */
+int filter_next      (filter_t* filter, const media_t* last);
+int filter_next_book (filter_t* filter, const book_t* last);
+int filter_next_movie(filter_t* filter, const movie_t* last);
+                                                  /* moves the cursor past last, the final
+						   * row of the previous page, e.g.
+						   * order F_UPDATE desc, limit 50 then
+						   * filter_next() for each following page
+						   */
+
+int search_text  (uint32_t* codes, uint32_t* num_results, const char* text, uint32_t max);
+                                                  /* codes of up to max items whose name or
+						   * location has words starting with each
+						   * word of text, in code order
+						   */
+
+int count_items  (uint32_t* total);
+int count_books  (uint32_t* total);
+int count_movies (uint32_t* total);
+
+int page         (media_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max);
+int page_books   (book_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max);
+int page_movies  (movie_t* items, uint32_t* num_results, const uint32_t* after, uint32_t max);
+                                                  /* up to max rows in code order, starting
+						   * after the code *after (NULL starts at
+						   * the top), items must hold max rows
+						   */
+
+int list         (media_t* items, uint32_t* num_results, const media_t* after, uint32_t max);
+int list_books   (book_t* items, uint32_t* num_results, const book_t* after, uint32_t max);
+int list_movies  (movie_t* items, uint32_t* num_results, const movie_t* after, uint32_t max);
+                                                  /* like page() but alphabetical by name
+						   * or title, after is the last row of
+						   * the previous page (NULL for the first)
+						   */
+
+int seek         (uint32_t* code, const uint32_t* after, uint32_t skip);
+int seek_books   (uint32_t* code, const uint32_t* after, uint32_t skip);
+int seek_movies  (uint32_t* code, const uint32_t* after, uint32_t skip);
+                                                  /* code of the row skip rows past the
+						   * first one after *after; the rows in
+						   * between aren't read, but sqlite's
+						   * btrees keep no counts, so it still
+						   * steps over every one (O(skip))
+						   */
 
 int delete       (uint32_t code);                 /* amazingly, only 1 of these is needed
-						   * (it automagically looks up if its a movie
-						   *  or book and deletes that entry)
+						   * (the book or movie entry is deleted
+						   *  along with it by the schema),
+						   * MI_NO_RESULTS if code wasn't there
 						   */
+int delete_batch (const uint32_t* codes, size_t n); /* all of codes in one transaction, unknown
+						     * codes are skipped, MI_NO_RESULTS if
+						     * none of them were there
+						     */
 int touch        (uint32_t code);                 /* updates time */
 int checkout     (uint32_t code, const char* location); /* update time and location */
+int touch_batch   (const uint32_t* codes, size_t n, uint32_t* unknown, size_t* num_unknown);
+int checkout_batch(const uint32_t* codes, size_t n, const char* location,
+		   uint32_t* unknown, size_t* num_unknown);
+                                                  /* all of codes in one transaction, codes
+						   * not in the database are copied to
+						   * unknown (room for n, or NULL) and
+						   * counted in *num_unknown, MI_NO_RESULTS
+						   * if none of them were there
+						   */
+
+int snapshot_db   (const char* dest, int pages_per_step);
+int snapshot_db_ex(const char* dest, int pages_per_step, snapshot_progress_t progress,
+		   void* data, snapshot_stats_t* stats);
+                                                  /* copies the open database to dest while
+						   * it stays in use, pages_per_step at a
+						   * time (0 or less for all at once),
+						   * progress and stats may be NULL
+						   */
+
+int fetch_state  (row_state_t* state, uint32_t code); /* MI_NO_RESULTS if code isn't there */
+int apply_states (const row_state_t* states, size_t n);
+                                                  /* makes each code's rows what its state
+						   * says, stored, updated or deleted, all
+						   * in one transaction
+						   */
+
+/* test hook, called between the main and detail writes of the *_item()
+ * functions with the function name, a non-zero return fails the write
+ */
+extern int (*db_fault_hook)(const char* where);
+
+/* called after each commit that changed rows, with the codes changed (in
+ * the order written, maybe more than once); fetch_state() gives what
+ * they are now.  The hook must not write.
+ */
+extern void (*db_commit_hook)(const uint32_t* codes, size_t n);
 
 /* public errata functions */
 uint32_t code_gen(medium_t type, const char* name);
+int isbn_normalise(const char* text, uint64_t* isbn13); /* MI_EXIT_ERROR if text isn't a valid
+							 * ISBN, MI_NO_RESULTS if it's blank
+							 */
 int csv_load     (const char* dir, const char* prefix);
 int csv_dump     (const char* dir, const char* prefix);
 int pretty_dump  (const char* file);
-const char* medium_string(medium_t type);
-const char* genre_string(genre_t genre);
+size_t sort_key(const char* text, char* key, size_t size); /* folds case and accents, drops
+							   * punctuation and a leading
+							   * THE, A or AN
+							   */
+const char* medium_string(medium_t type);         /* both return constant strings that */
+const char* genre_string(genre_t genre);          /* stay valid until exit, genre names
+						   * are joined by ", " in bit order
+						   */
+int medium_parse (const char* text, medium_t* type); /* name or enum name, any case,
+						      * MI_NO_RESULTS if unknown
+						      */
+int genre_parse  (const char* text, genre_t* genre); /* comma separated names, as
+						      * genre_string() writes them,
+						      * MI_NO_RESULTS if any is unknown
+						      */
+int medium_add   (const char* name, medium_t* type); /* stored in the open catalogue,
+						      * MI_EXISTS and its type if
+						      * name is already a medium
+						      */
+int genre_add    (const char* name, genre_t* genre); /* the next free bit, MI_EXISTS as
+						      * for medium_add(); names can't
+						      * hold commas
+						      */
+int medium_count();                               /* ids run from 0 to one less */
+int genre_count();                                /* bits named, not always the lowest */
 const char* error_string(int err);
-const char* time_string(time_t time);
+const char* time_string(time_t time);             /* not reentrant, the next call reuses
+						   * the buffer
+						   */
+char* time_format    (time_t time, char* buffer); /* "2012-12-21 @ 11:11:00 GMT" and */
+char* time_format_iso(time_t time, char* buffer); /* "2012-12-21T11:11:00Z" into buffer,
+						   * which holds TIME_STRING_SIZE
+						   */
 
 #endif /* __DB_FUNCS_H__ */
@@ -15,14 +15,26 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  *
  */
+#define _POSIX_C_SOURCE 200809L /* fork() and friends for the crash test */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
 #include <locale.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sqlite3.h>
 #include "db_funcs.h"
 #include "log_funcs.h"
+#include "intake_funcs.h"
+#include "proto_funcs.h"
+#include "server_funcs.h"
+#include "client_funcs.h"
+#include "shard_funcs.h"
+#include "repl_funcs.h"
 
 void make_media(media_t* new, medium_t type, const char* name, const char* location) {
   new->code = code_gen(type,name);
@@ -57,10 +69,73 @@ void make_movie(movie_t* new, uint32_t code, medium_t type, genre_t genre,
   new->rating = rating;
 }
 
+/* fault hooks for the *_item() tests */
+int fail_hook(const char* where) {
+  printf("fail_hook(): failing %s\n",where);
+  return 1;
+}
+
+int crash_hook(const char* where) {
+  printf("crash_hook(): dying in %s\n",where);
+  fflush(stdout);
+  _exit(3);
+}
+
+/* snapshot progress callbacks */
+int count_steps(const snapshot_stats_t* stats, void* data) {
+  (void)stats;
+  (*(int*)data)++;
+  return 0;
+}
+
+int cancel_steps(const snapshot_stats_t* stats, void* data) {
+  (void)data;
+  return stats->pages >= 2;
+}
+
+/* a write through another connection between every step */
+int write_steps(const snapshot_stats_t* stats, void* data) {
+  (void)stats;
+  sqlite3_exec((sqlite3*)data,"UPDATE main SET update_time = update_time + 1 "
+	       "WHERE code = (SELECT min(code) FROM main)",NULL,NULL,NULL);
+  return 0;
+}
+
+/* the daemon test's server is stopped with SIGTERM */
+static volatile sig_atomic_t serve_stop = 0;
+
+void stop_serving(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+/* starts a child serving db_file on socket_path and connects to it */
+pid_t start_daemon(const char* db_file, const char* socket_path) {
+  struct sigaction action;
+  struct timespec wait = { 0, 10000000 };
+  pid_t pid;
+
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    memset(&action,0,sizeof(action));
+    action.sa_handler = stop_serving;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM,&action,NULL);
+    if (init_db(db_file) != MI_EXIT_OK) _exit(1);
+    _exit((serve(socket_path,&serve_stop) == MI_EXIT_OK && close_db() == MI_EXIT_OK) ? 0 : 1);
+  }
+  for (int i = 0; pid > 0 && i < 200; i++) {
+    if (client_open(socket_path) == MI_EXIT_OK) return pid;
+    nanosleep(&wait,NULL);
+  }
+  return -1;
+}
+
 /* program in some big obivious section markers */
 
 int main(int argc, char** argv) {
   int retval;
+  uint64_t isbn13;
   int exit = 0;
   media_t test_values[5];
   media_t fetch_test;
@@ -73,15 +148,59 @@ int main(int argc, char** argv) {
   movie_t fetch_movie_test;
   book_t* search_test_book = NULL;
   movie_t* search_test_movie = NULL;
+  media_t page_test[4];
+  uint32_t seek_code;
+  char key_test[4][121];
+  medium_t medium_test;
+  genre_t genre_test;
+  char time_test[2][TIME_STRING_SIZE];
+  struct tm tm_test;
+  uint32_t text_test[8];
+  filter_t filter;
+  wire_t wire_test;
+  uint32_t op_test;
+  const char* db_file;
+  db_options_t options;
+  media_t item_test;
+  pid_t pid;
+  int status;
+  uint32_t batch_unknown[8];
+  size_t num_unknown;
+  char long_text[256];
+  char sql_test[640];
+  sqlite3* side_test;
+  media_t long_test[2];
+  int steps;
+  snapshot_stats_t snapshot_test;
+  const char* genre_held;
+  uint32_t many_codes[4];
+  media_t many_test[4];
+  movie_t many_movie_test[4];
+  uint8_t many_found[4];
+  uint32_t* pipeline_codes;
+  media_t* pipeline_test;
+  uint8_t* pipeline_found;
+  intake_t intake;
+  code_filter_stats_t filter_test;
+  code_index_stats_t index_test;
+  book_t* shard_books;
+  book_t shard_book_pair[2];
+  repl_follower_t follower;
+  repl_stats_t repl_test;
+  int shard_rows[4] = { 0, 0, 0, 0 };
 
   setlocale(LC_ALL,"");
   init_access_log(NULL,STD_ERR_LOG,10);
   init_debug_log(NULL,STD_ERR_LOG,10);
 
-  if (argc <= 1)
-    retval = init_db("./test.db");
-  else
-    retval = init_db(argv[1]);
+  db_file = (argc <= 1) ? "./test.db" : argv[1];
+  if (db_options_preset(&options,"bulk-import") != MI_EXIT_OK ||
+      db_options_preset(&options,"fast") != MI_NO_RESULTS) {
+    printf("db_options_preset(): failed\n");
+    return 1;
+  }
+  db_options_preset(&options,"durable");
+  retval = init_db_ex(db_file,&options);
 
   if (retval != MI_EXIT_OK) {
     printf("init_db(): %s\n",error_string(retval));
@@ -177,10 +296,30 @@ int main(int argc, char** argv) {
   printf("\tStudio:   %s\n",fetch_movie_test.studio);
   printf("\tRating:   %d\n",fetch_movie_test.rating);
 
+  /* the rows line up with the codes, whatever order the index gives */
+  many_codes[0] = test_values[2].code;
+  many_codes[1] = 0;
+  many_codes[2] = test_values[0].code;
+  many_codes[3] = test_values[2].code;
+  retval = fetch_many(many_test,many_found,many_codes,4);
+  printf("fetch_many(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || !many_found[0] || many_found[1] || !many_found[2] ||
+      !many_found[3] || strcmp(many_test[0].name,test_values[2].name) ||
+      strcmp(many_test[2].name,test_values[0].name) || many_test[3].code != many_codes[3])
+    return 1;
+  retval = fetch_many_movies(many_movie_test,many_found,many_codes,4);
+  printf("fetch_many_movies(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || !many_found[0] || many_found[2] ||
+      strcmp(many_movie_test[3].director,"DEAN DEBLOIS")) return 1;
+  if (fetch_many_books(NULL,many_found,many_codes,2) != MI_NO_RESULTS || many_found[0])
+    return 1;
+
   /* test search */
   printf("Searching for items: \n\n");
 
-  retval = search(search_test,&num_results,"location = 'DEN'");
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"DEN");
+  retval = search(&search_test,&num_results,&filter);
   if (retval != MI_EXIT_OK) {
     printf("search(): %s\n",error_string(retval));
     return 1;
@@ -188,17 +327,66 @@ int main(int argc, char** argv) {
 
   if (num_results == 3)
     printf("search(): test ok\n");
-  else
-    printf("search(): %u results found",num_results);
+  else {
+    printf("search(): %u results found\n",num_results);
+    return 1;
+  }
+
+  free(search_test);
+
+  /* same shape again, should come out of the statement cache */
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"OFFICE");
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 2) return 1;
+  free(search_test);
 
+  /* location = 'DEN' or type = dvd */
+  filter_init(&filter);
+  filter_open(&filter,FILTER_OR);
+  filter_text(&filter,F_LOCATION,OP_EQ,"DEN");
+  filter_int(&filter,F_TYPE,OP_EQ,dvd);
+  filter_close(&filter);
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 4) return 1;
   free(search_test);
 
-  retval = search_books(search_test_book,&num_results,"author_last = 'HAMILTON'");
+  filter_init(&filter);
+  filter_text(&filter,F_NAME,OP_PREFIX,"HOW TO");
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1 || search_test[0].code != test_values[2].code)
+    return 1;
+  free(search_test);
+
+  filter_init(&filter);
+  filter_order(&filter,F_NAME,0);
+  filter_limit(&filter,2,1);
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 2 ||
+      strcmp(search_test[0].name,search_test[1].name) > 0) return 1;
+  free(search_test);
+
+  /* quotes are data, not SQL */
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"x' OR '1'='1");
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS || search_test != NULL) return 1;
+
+  filter_init(&filter);
+  filter_text(&filter,F_AUTHOR_LAST,OP_EQ,"HAMILTON");
+  retval = search_books(&search_test_book,&num_results,&filter);
   printf("search_books(): %s\n",error_string(retval));
   printf("search_books(): %u results found\n",num_results);
-  if (search_test_book) free(search_test_book);
+  if (retval != MI_NO_RESULTS) return 1;
 
-  retval = search_movies(search_test_movie,&num_results,"rating = 10");
+  filter_init(&filter);
+  filter_int(&filter,F_RATING,OP_EQ,10);
+  retval = search_movies(&search_test_movie,&num_results,&filter);
   printf("search_movies(): %s\n",error_string(retval));
   if (retval != MI_EXIT_OK) {
     printf("search_movies(): %s\n",error_string(retval));
@@ -207,7 +395,102 @@ int main(int argc, char** argv) {
 
   if (num_results == 1)
     printf("search_movies(): test ok\n");
-  if (search_test_movie) free(search_test_movie);
+  else
+    return 1;
+  free(search_test_movie);
+
+  filter_init(&filter);
+  filter_int(&filter,F_GENRE,OP_HAS,drama|action);
+  retval = search_movies(&search_test_movie,&num_results,&filter);
+  printf("search_movies(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1 || search_test_movie[0].code != test_movie[0].code)
+    return 1;
+  free(search_test_movie);
+
+  /* keyset pages in name order, two at a time */
+  filter_init(&filter);
+  filter_order(&filter,F_NAME,0);
+  filter_limit(&filter,2,0);
+  seek_code = 0;
+  fetch_test.name[0] = '\0';
+  while ((retval = search(&search_test,&num_results,&filter)) == MI_EXIT_OK) {
+    for (uint32_t i = 0; i < num_results; i++) {
+      if (strcmp(fetch_test.name,search_test[i].name) > 0) return 1;
+      fetch_test = search_test[i];
+    }
+    seek_code += num_results;
+    filter_next(&filter,&search_test[num_results - 1]);
+    free(search_test);
+  }
+  printf("search(): %u rows paged by name\n",seek_code);
+  if (retval != MI_NO_RESULTS || seek_code != 5) return 1;
+
+  /* most recently updated in the den, then the rest */
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"DEN");
+  filter_order(&filter,F_UPDATE,1);
+  filter_limit(&filter,2,0);
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 2 || search_test[0].update < search_test[1].update)
+    return 1;
+  filter_next(&filter,&search_test[1]);
+  free(search_test);
+  retval = search(&search_test,&num_results,&filter);
+  printf("search(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1) return 1;
+  free(search_test);
+
+  filter_init(&filter);
+  filter_order(&filter,F_TITLE,0);
+  filter_limit(&filter,1,0);
+  retval = search_movies(&search_test_movie,&num_results,&filter);
+  if (retval != MI_EXIT_OK || strcmp(search_test_movie[0].title,"CATCH ME IF YOU CAN")) return 1;
+  filter_next_movie(&filter,&search_test_movie[0]);
+  free(search_test_movie);
+  retval = search_movies(&search_test_movie,&num_results,&filter);
+  printf("search_movies(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || strcmp(search_test_movie[0].title,"HOW TO TRAIN YOUR DRAGON")) return 1;
+  free(search_test_movie);
+
+  /* names longer than a media_t keeps, written behind the library's
+   * back, still page by their whole keys, QQ..QA before QQ..QB
+   */
+  make_media(&long_test[0],book,"FIRST LONG NAME","LONGSHELF");
+  make_media(&long_test[1],book,"SECOND LONG NAME","LONGSHELF");
+  if (store(&long_test[0]) != MI_EXIT_OK || store(&long_test[1]) != MI_EXIT_OK ||
+      sqlite3_open(db_file,&side_test) != SQLITE_OK) return 1;
+  sqlite3_busy_timeout(side_test,5000);
+  memset(long_text,'Q',120);
+  for (int i = 0; i < 2; i++) {
+    long_text[120] = 'B' - i;
+    long_text[121] = '\0';
+    sprintf(sql_test,"UPDATE main SET name = '%s', sort_key = '%s' WHERE code = %u",
+	    long_text,long_text,long_test[i].code);
+    if (sqlite3_exec(side_test,sql_test,NULL,NULL,NULL) != SQLITE_OK) return 1;
+  }
+  sqlite3_close(side_test);
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"LONGSHELF");
+  filter_order(&filter,F_SORT,0);
+  filter_limit(&filter,1,0);
+  seek_code = 0;
+  while (seek_code < 4 && (retval = search(&search_test,&num_results,&filter)) == MI_EXIT_OK) {
+    if (search_test[0].code != long_test[1 - seek_code].code) return 1;
+    filter_next(&filter,&search_test[0]);
+    free(search_test);
+    seek_code++;
+  }
+  printf("search(): %u rows with long names paged by sort key\n",seek_code);
+  if (retval != MI_NO_RESULTS || seek_code != 2 ||
+      delete(long_test[0].code) != MI_EXIT_OK || delete(long_test[1].code) != MI_EXIT_OK) return 1;
+
+  /* name is not a books column */
+  filter_init(&filter);
+  filter_text(&filter,F_NAME,OP_EQ,"HALO REACH");
+  retval = search_books(&search_test_book,&num_results,&filter);
+  printf("search_books(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
 
   /* test touch and checkout */
   printf("Testing touch and checkout: \n\n");
@@ -232,6 +515,375 @@ int main(int argc, char** argv) {
   if (retval != MI_EXIT_OK) return 1;
   printf("#%u: %s %jd\n",fetch_test.code,fetch_test.location,fetch_test.update);
 
+  /* test paging */
+  printf("Paging through main: \n\n");
+
+  retval = count_items(&num_results);
+  printf("count_items(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 6) return 1;
+
+  retval = page(page_test,&num_results,NULL,4);
+  printf("page(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 4) return 1;
+
+  retval = seek(&seek_code,NULL,3);
+  printf("seek(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || seek_code != page_test[3].code) return 1;
+
+  retval = page(page_test,&num_results,&seek_code,4);
+  printf("page(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 2 || page_test[0].code <= seek_code) return 1;
+
+  retval = seek(&seek_code,&page_test[1].code,0);
+  printf("seek(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* test alphabetical listing */
+  printf("Listing by name: \n\n");
+  sort_key("The Mystery of the Blue Train",key_test[0],sizeof(key_test[0]));
+  sort_key("  Amélie (2001)",key_test[1],sizeof(key_test[1]));
+  sort_key("A",key_test[2],sizeof(key_test[2]));
+  sort_key("O'BRIEN - AN ÆSTHETE",key_test[3],8);
+  if (strcmp(key_test[0],"MYSTERY OF THE BLUE TRAIN") || strcmp(key_test[1],"AMELIE 2001") ||
+      strcmp(key_test[2],"A") || strcmp(key_test[3],"OBRIEN")) {
+    printf("sort_key(): failed\n");
+    return 1;
+  }
+
+  /* in key order, so THE MYSTERY OF THE BLUE TRAIN comes after HOW TO TRAIN... */
+  retval = list(page_test,&num_results,NULL,4);
+  printf("list(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 4) return 1;
+  for (int i = 1; i < 4; i++) {
+    sort_key(page_test[i - 1].name,key_test[0],sizeof(key_test[0]));
+    sort_key(page_test[i].name,key_test[1],sizeof(key_test[1]));
+    if (strcmp(key_test[0],key_test[1]) > 0) return 1;
+  }
+  retval = list(page_test,&num_results,&page_test[3],4);
+  printf("list(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 2 ||
+      strcmp(page_test[0].name,"THE MYSTERY OF THE BLUE TRAIN")) return 1;
+  retval = list(page_test,&num_results,&page_test[1],4);
+  printf("list(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* test full text search */
+  printf("Full text search: \n\n");
+
+  retval = search_text(text_test,&num_results,"blu tra",8);
+  printf("search_text(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1 || text_test[0] != test_values[0].code) return 1;
+
+  retval = search_text(text_test,&num_results,"nirn",8);
+  printf("search_text(): %s, %u results\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1 || text_test[0] != tc_test.code) return 1;
+
+  retval = search_text(text_test,&num_results,"aetherius",8);
+  printf("search_text(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* test item transactions */
+  printf("Storing items with detail: \n\n");
+
+  make_media(&item_test, book, "THE COLOUR OF MAGIC", "DEN");
+  make_book(&test_book, 0, other, fantasy, "0-552-12475-3", "THE COLOUR OF MAGIC",
+	    "PRATCHETT", "TERRY", "");
+  retval = store_book_item(&item_test,&test_book);
+  printf("store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || test_book.code != item_test.code) return 1;
+  if (fetch_book(&fetch_book_test,item_test.code) != MI_EXIT_OK ||
+      fetch_book_test.type != book) return 1;
+
+  /* a second store of the same code changes nothing */
+  strcpy(test_book.title,"EQUAL RITES");
+  retval = store_book_item(&item_test,&test_book);
+  printf("store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXISTS) return 1;
+
+  strcpy(item_test.location,"OFFICE");
+  retval = update_book_item(&item_test,&test_book);
+  printf("update_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  fetch(&fetch_test,item_test.code);
+  fetch_book(&fetch_book_test,item_test.code);
+  if (strcmp(fetch_test.location,"OFFICE") || strcmp(fetch_book_test.title,"EQUAL RITES"))
+    return 1;
+
+  /* no movie row for a book, so the main row update is undone too */
+  make_movie(&test_movie[0], 0, dvd, fantasy, "EQUAL RITES", "", "", 0);
+  strcpy(item_test.location,"ATTIC");
+  retval = update_movie_item(&item_test,&test_movie[0]);
+  printf("update_movie_item(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+  fetch(&fetch_test,item_test.code);
+  if (strcmp(fetch_test.location,"OFFICE")) return 1;
+  delete(item_test.code);
+
+  make_media(&item_test, dvd, "THE LAST UNICORN", "DEN");
+  make_movie(&test_movie[0], 0, dvd, fantasy|animation, "THE LAST UNICORN",
+	     "JULES BASS", "ITC", 8);
+  db_fault_hook = fail_hook;
+  retval = store_movie_item(&item_test,&test_movie[0]);
+  db_fault_hook = NULL;
+  printf("store_movie_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
+  if (exists(item_test.code) != MI_NO_RESULTS || exists_movie(item_test.code) != MI_NO_RESULTS)
+    return 1;
+
+  /* kill a writer between the main and detail rows, it must leave neither */
+  close_db();
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    if (init_db(db_file) != MI_EXIT_OK) _exit(1);
+    db_fault_hook = crash_hook;
+    store_movie_item(&item_test,&test_movie[0]);
+    _exit(0);
+  }
+  if (pid < 0 || waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 3)
+    return 1;
+  if (init_db(db_file) != MI_EXIT_OK) return 1;
+  retval = exists(item_test.code);
+  printf("exists(): %s after crash\n",error_string(retval));
+  if (retval != MI_NO_RESULTS || exists_movie(item_test.code) != MI_NO_RESULTS) return 1;
+
+  retval = store_movie_item(&item_test,&test_movie[0]);
+  printf("store_movie_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || exists_movie(item_test.code) != MI_EXISTS) return 1;
+
+  /* the movie row goes with the main one */
+  retval = delete(item_test.code);
+  printf("delete(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || exists_movie(item_test.code) != MI_NO_RESULTS) return 1;
+  retval = delete(item_test.code);
+  printf("delete(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* and there can't be one without it */
+  retval = store_movie(&test_movie[0]);
+  printf("store_movie(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
+
+  /* batch delete, with a code that was never there */
+  make_media(&test_values[0], book, "MORT", "DEN");
+  make_book(&test_book, 0, book, fantasy, "0-575-03818-2", "MORT", "PRATCHETT", "TERRY", "");
+  store_book_item(&test_values[0],&test_book);
+  make_media(&test_values[1], dvd, "LABYRINTH", "DEN");
+  make_movie(&test_movie[0], 0, dvd, fantasy, "LABYRINTH", "JIM HENSON", "TRISTAR", 8);
+  store_movie_item(&test_values[1],&test_movie[0]);
+  make_media(&test_values[2], vinyl, "THE DARK SIDE OF THE MOON", "DEN");
+  store(&test_values[2]);
+  text_test[0] = test_values[0].code;
+  text_test[1] = test_values[1].code;
+  text_test[2] = test_values[2].code;
+  text_test[3] = 0;
+  retval = delete_batch(text_test,4);
+  printf("delete_batch(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  for (int i = 0; i < 3; i++)
+    if (exists(text_test[i]) != MI_NO_RESULTS) return 1;
+  if (exists_book(text_test[0]) != MI_NO_RESULTS || exists_movie(text_test[1]) != MI_NO_RESULTS)
+    return 1;
+  retval = delete_batch(text_test,4);
+  printf("delete_batch(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* test isbn lookup */
+  printf("Lookup by isbn: \n\n");
+  if (isbn_normalise("0-425-13026-6",&isbn13) != MI_EXIT_OK || isbn13 != 9780425130261ULL ||
+      isbn_normalise("978 0 552 12475 1",&isbn13) != MI_EXIT_OK || isbn13 != 9780552124751ULL ||
+      isbn_normalise("0-8044-2957-X",&isbn13) != MI_EXIT_OK ||
+      isbn_normalise("0-425-13026-5",&isbn13) != MI_EXIT_ERROR ||
+      isbn_normalise("978-0-552-12475-2",&isbn13) != MI_EXIT_ERROR ||
+      isbn_normalise("0-425-1302",&isbn13) != MI_EXIT_ERROR ||
+      isbn_normalise("",&isbn13) != MI_NO_RESULTS) {
+    printf("isbn_normalise(): failed\n");
+    return 1;
+  }
+
+  make_media(&item_test, book, "SOURCERY", "DEN");
+  make_book(&test_book, 0, book, fantasy, "0-552-13107-5", "SOURCERY", "PRATCHETT", "TERRY", "");
+  retval = store_book_item(&item_test,&test_book);
+  printf("store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+
+  /* any spelling of the isbn finds it */
+  retval = fetch_book_by_isbn(&fetch_book_test,"0552131075");
+  printf("fetch_book_by_isbn(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || fetch_book_test.code != item_test.code) return 1;
+  retval = fetch_book_by_isbn(&fetch_book_test,"978-0-552-13107-0");
+  printf("fetch_book_by_isbn(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || strcmp(fetch_book_test.title,"SOURCERY")) return 1;
+  retval = fetch_book_by_isbn(&fetch_book_test,"0-552-12475-3");
+  printf("fetch_book_by_isbn(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS) return 1;
+
+  /* a bad check digit is kept as written, but can't be looked up */
+  strcpy(test_book.isbn,"0-552-13107-6");
+  retval = update_book_item(&item_test,&test_book);
+  printf("update_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || fetch_book(&fetch_book_test,item_test.code) != MI_EXIT_OK ||
+      strcmp(fetch_book_test.isbn,"0-552-13107-6") ||
+      fetch_book_by_isbn(NULL,"9780552131070") != MI_NO_RESULTS ||
+      fetch_book_by_isbn(NULL,"0-552-13107-6") != MI_NO_RESULTS) return 1;
+  delete(item_test.code);
+
+  /* test batch checkout */
+  printf("Batch checkout: \n\n");
+
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"DEN");
+  retval = search(&search_test,&num_results,&filter);
+  if (retval != MI_EXIT_OK || num_results > 7) return 1;
+  for (uint32_t i = 0; i < num_results; i++)
+    text_test[i] = search_test[i].code;
+  text_test[num_results] = 0;
+  free(search_test);
+  retval = checkout_batch(text_test,num_results + 1,"GARAGE",batch_unknown,&num_unknown);
+  printf("checkout_batch(): %s, %zu unknown\n",error_string(retval),num_unknown);
+  if (retval != MI_EXIT_OK || num_unknown != 1 || batch_unknown[0] != 0) return 1;
+
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"GARAGE");
+  retval = search(&search_test,&seek_code,&filter);
+  if (retval != MI_EXIT_OK || seek_code != num_results) return 1;
+  free(search_test);
+
+  retval = touch_batch(text_test,num_results,NULL,&num_unknown);
+  printf("touch_batch(): %s, %zu unknown\n",error_string(retval),num_unknown);
+  if (retval != MI_EXIT_OK || num_unknown != 0) return 1;
+
+  retval = touch_batch(&text_test[num_results],1,batch_unknown,&num_unknown);
+  printf("touch_batch(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS || num_unknown != 1) return 1;
+
+  /* text longer than the field is cut to fit, not overflowed */
+  printf("Over long fields: \n\n");
+
+  memset(long_text,'A',99);
+  long_text[99] = '\0';
+  for (int i = 0; i < 40; i++)
+    strcat(long_text,"\xc3\xa9"); /* e acute, 2 bytes */
+  retval = checkout(text_test[0],long_text);
+  printf("checkout(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  retval = fetch(&fetch_test,text_test[0]);
+  printf("fetch(): %s, %zu bytes\n",error_string(retval),strlen(fetch_test.location));
+  if (retval != MI_EXIT_OK || strlen(fetch_test.location) != 119 ||
+      strncmp(fetch_test.location,long_text,119)) return 1;
+  checkout(text_test[0],"GARAGE");
+
+  /* test medium and genre names */
+  printf("Medium and genre names: \n\n");
+  printf("genre_string(): %s\n",genre_string(fantasy|adventure|animation));
+  if (strcmp(medium_string(bluray),"BLU-RAY") || strcmp(medium_string(vinyl),"OTHER") ||
+      strcmp(genre_string(drama|action),"ACTION, DRAMA") || strcmp(genre_string(0),"") ||
+      genre_string(scifi|horror) != genre_string(horror|scifi)) {
+    printf("medium_string(), genre_string(): failed\n");
+    return 1;
+  }
+  if (medium_parse("blu-ray",&medium_test) != MI_EXIT_OK || medium_test != bluray ||
+      medium_parse("VINYL",&medium_test) != MI_EXIT_OK || medium_test != vinyl ||
+      medium_parse("OTHER",&medium_test) != MI_EXIT_OK || medium_test != other ||
+      medium_parse("BETAMAX",&medium_test) != MI_NO_RESULTS) {
+    printf("medium_parse(): failed\n");
+    return 1;
+  }
+  if (genre_parse(genre_string(fantasy|adventure|animation),&genre_test) != MI_EXIT_OK ||
+      genre_test != (fantasy|adventure|animation) ||
+      genre_parse(" sci-fi,horror , bmovie",&genre_test) != MI_EXIT_OK ||
+      genre_test != (scifi|horror|bmovie) ||
+      genre_parse("",&genre_test) != MI_EXIT_OK || genre_test != 0 ||
+      genre_parse("DRAMA, SPAGHETTI WESTERN",&genre_test) != MI_NO_RESULTS) {
+    printf("genre_parse(): failed\n");
+    return 1;
+  }
+
+  /* media and genres added at run time, kept in the catalogue; the
+   * genres fill every bit up to 63, so the last has the sign bit
+   */
+  retval = medium_add("NINTENDO SWITCH",&medium_test);
+  printf("medium_add(): %s, %s is %d\n",error_string(retval),medium_string(medium_test),
+	 medium_test);
+  if ((retval != MI_EXIT_OK && retval != MI_EXISTS) || medium_test < NUM_MEDIA ||
+      medium_count() <= (int)medium_test || strcmp(medium_string(medium_test),"NINTENDO SWITCH") ||
+      medium_add("VINYL",&medium_test) != MI_EXISTS || medium_test != vinyl ||
+      medium_add("nintendo switch",&medium_test) != MI_EXISTS || medium_test < NUM_MEDIA ||
+      medium_add("",&medium_test) != MI_EXIT_ERROR) {
+    printf("medium_add(): failed\n");
+    return 1;
+  }
+  for (int i = NUM_GENRES; i < GENRE_MAX; i++) {
+    sprintf(key_test[0],"GENRE %02d",i);
+    retval = genre_add(key_test[0],&genre_test);
+    if ((retval != MI_EXIT_OK && retval != MI_EXISTS) || genre_test != (genre_t)1 << i) {
+      printf("genre_add(): %s failed\n",key_test[0]);
+      return 1;
+    }
+  }
+  printf("genre_string(): %s\n",genre_string(drama | (genre_t)1 << 63));
+  if (genre_count() != GENRE_MAX || genre_add("SPAGHETTI WESTERN",&genre_test) != MI_EXIT_ERROR ||
+      genre_add("WESTERN, SPAGHETTI",&genre_test) != MI_EXIT_ERROR ||
+      genre_add("b-movie",&genre_test) != MI_EXISTS || genre_test != bmovie ||
+      strcmp(genre_string(drama | (genre_t)1 << 63),"DRAMA, GENRE 63") ||
+      genre_parse("genre 63, Drama",&genre_test) != MI_EXIT_OK ||
+      genre_test != (drama | (genre_t)1 << 63)) {
+    printf("genre_add(): failed\n");
+    return 1;
+  }
+  make_media(&page_test[0], medium_test, "HOGWARTS LEGACY", "DEN");
+  make_book(&shard_book_pair[0], 0, medium_test, genre_test | (genre_t)1 << 40, "",
+	    "HOGWARTS LEGACY", "", "", "");
+  if (store_book_item(&page_test[0],&shard_book_pair[0]) != MI_EXIT_OK ||
+      fetch_book(&fetch_book_test,page_test[0].code) != MI_EXIT_OK ||
+      fetch_book_test.type != medium_test || fetch_book_test.genre != shard_book_pair[0].genre ||
+      page_test[0].code != code_gen(medium_test,"HOGWARTS LEGACY")) {
+    printf("store_book_item(): added medium and genres failed\n");
+    return 1;
+  }
+
+  /* gone with the catalogue, back with it, and a string held across
+   * both is still good and the one handed out again
+   */
+  genre_held = genre_string(fetch_book_test.genre);
+  close_db();
+  if (medium_parse("NINTENDO SWITCH",&medium_test) != MI_NO_RESULTS ||
+      medium_count() != NUM_MEDIA || genre_count() != NUM_GENRES ||
+      strcmp(genre_string(drama | (genre_t)1 << 63),"DRAMA")) {
+    printf("close_db(): registry not reset\n");
+    return 1;
+  }
+  if (init_db_ex(db_file,&options) != MI_EXIT_OK) return 1;
+  if (medium_parse("NINTENDO SWITCH",&medium_test) != MI_EXIT_OK ||
+      medium_test != shard_book_pair[0].type || genre_count() != GENRE_MAX ||
+      strcmp(genre_string(fetch_book_test.genre),"DRAMA, GENRE 40, GENRE 63") ||
+      genre_string(fetch_book_test.genre) != genre_held) {
+    printf("init_db(): registry not loaded\n");
+    return 1;
+  }
+  delete(page_test[0].code);
+
+  /* test time formatting, against strftime() over a spread of times */
+  printf("Time formatting: \n\n");
+  printf("time_format_iso(): %s\n",time_format_iso(1356088260,time_test[0]));
+  if (strcmp(time_test[0],"2012-12-21T11:11:00Z") ||
+      strcmp(time_format_iso(951782400,time_test[0]),"2000-02-29T00:00:00Z") ||
+      strcmp(time_format_iso(-1,time_test[0]),"1969-12-31T23:59:59Z")) {
+    printf("time_format_iso(): failed\n");
+    return 1;
+  }
+  for (int64_t t = -2208988800LL; t < 4102444800LL; t += 86399 * 37 + 1234) {
+    time_t when = (time_t)t;
+
+    gmtime_r(&when,&tm_test);
+    strftime(time_test[0],sizeof(time_test[0]),"%F @ %T %Z",&tm_test);
+    if (strcmp(time_format(when,time_test[1]),time_test[0]) ||
+	strcmp(time_string(when),time_test[0])) {
+      printf("time_format(): %s, not %s\n",time_test[1],time_test[0]);
+      return 1;
+    }
+  }
+
   /* test csv dump */
   printf("Staring csv dump: \n\n");
   retval = csv_dump("./","test-");
@@ -242,9 +894,485 @@ int main(int argc, char** argv) {
   retval = pretty_dump("./test-ppd.txt");
   printf("pretty_dump(): %s\n",error_string(retval));
 
+  /* test snapshot */
+  printf("Snapshot: \n\n");
+
+  count_items(&seek_code);
+  steps = 0;
+  retval = snapshot_db_ex("./test-snap.db",1,count_steps,&steps,NULL);
+  printf("snapshot_db_ex(): %s, %d steps\n",error_string(retval),steps);
+  if (retval != MI_EXIT_OK || steps < 2) return 1;
+  close_db();
+  options.read_only = DB_IMMUTABLE;
+  if (init_db_ex("./test-snap.db",&options) != MI_EXIT_OK) return 1;
+  retval = count_items(&num_results);
+  printf("count_items(): %s, %u rows in snapshot\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != seek_code) return 1;
+  close_db();
+  if (init_db(db_file) != MI_EXIT_OK) return 1;
+
+  /* written to all the while, it gives up starting over */
+  if (sqlite3_open(db_file,&side_test) != SQLITE_OK) return 1;
+  sqlite3_busy_timeout(side_test,5000);
+  retval = snapshot_db_ex("./test-snap.db",1,write_steps,side_test,&snapshot_test);
+  sqlite3_close(side_test);
+  printf("snapshot_db_ex(): %s, %d restarts\n",error_string(retval),snapshot_test.restarts);
+  if (retval != MI_EXIT_OK || snapshot_test.restarts != SNAPSHOT_RESTARTS) return 1;
+  close_db();
+  if (init_db(db_file) != MI_EXIT_OK) return 1;
+
+  /* cancelled part way, nothing is written */
+  unlink("./test-snap.db");
+  retval = snapshot_db_ex("./test-snap.db",1,cancel_steps,NULL,NULL);
+  printf("snapshot_db_ex(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
+
+  /* test the code filter */
+  printf("Code filter: \n\n");
+
+  retval = code_filter_stats(&filter_test);
+  printf("code_filter_stats(): %s, %ju codes in %ju bits\n",error_string(retval),
+	 (uintmax_t)filter_test.codes,(uintmax_t)filter_test.bits);
+  if (retval != MI_EXIT_OK || filter_test.codes == 0) return 1;
+  for (uint32_t i = 1; i <= 1000; i++)
+    if (exists(i) != MI_NO_RESULTS) return 1;
+  code_filter_stats(&filter_test);
+  printf("%ju of 1000 misses answered, fpr %.4f (expected %.4f)\n",
+	 (uintmax_t)filter_test.negatives,filter_test.fpr,filter_test.expected_fpr);
+  if (filter_test.negatives + filter_test.false_positives != 1000 ||
+      filter_test.negatives < 900) return 1;
+
+  make_media(&item_test, book, "THUD!", "DEN");
+  if (exists(item_test.code) != MI_NO_RESULTS || store(&item_test) != MI_EXIT_OK ||
+      exists(item_test.code) != MI_EXISTS) return 1;
+  if (delete(item_test.code) != MI_EXIT_OK || exists(item_test.code) != MI_NO_RESULTS) return 1;
+
+  /* a store through another connection is seen, under a code the
+   * filter has never had
+   */
+  item_test.code++;
+  if (exists(item_test.code) != MI_NO_RESULTS) return 1;
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close_db();
+    _exit((init_db(db_file) == MI_EXIT_OK && store(&item_test) == MI_EXIT_OK &&
+	   close_db() == MI_EXIT_OK) ? 0 : 1);
+  }
+  if (waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return 1;
+  retval = exists(item_test.code);
+  printf("exists(): %s after another connection's store\n",error_string(retval));
+  code_filter_stats(&filter_test);
+  if (retval != MI_EXISTS || filter_test.builds != 2) return 1;
+  delete(item_test.code);
+
+  /* test the code index */
+  printf("Code index: \n\n");
+
+  close_db();
+  db_options_init(&options);
+  options.code_index = INDEX_SHARED;
+  retval = init_db_ex(db_file,&options);
+  code_index_stats(&index_test);
+  printf("init_db_ex(): %s, %ju rows indexed by %d threads\n",error_string(retval),
+	 (uintmax_t)index_test.rows,index_test.threads);
+  if (retval != MI_EXIT_OK || index_test.rows == 0) return 1;
+  if (fetch(&fetch_test,tc_test.code) != MI_EXIT_OK || strcmp(fetch_test.name,tc_test.name) ||
+      exists(tc_test.code) != MI_EXISTS) return 1;
+  if (page_movies(many_movie_test,&num_results,NULL,1) != MI_EXIT_OK ||
+      fetch_movie(&fetch_movie_test,many_movie_test[0].code) != MI_EXIT_OK ||
+      strcmp(fetch_movie_test.title,many_movie_test[0].title) ||
+      strcmp(fetch_movie_test.studio,many_movie_test[0].studio) ||
+      fetch_movie_test.rating != many_movie_test[0].rating) return 1;
+  many_codes[0] = tc_test.code;
+  many_codes[1] = 12;
+  if (fetch_many(many_test,many_found,many_codes,2) != MI_EXIT_OK || !many_found[0] ||
+      many_found[1] || many_test[0].code != tc_test.code) return 1;
+  code_index_stats(&index_test);
+  printf("code_index_stats(): %ju hits, %ju KiB\n",(uintmax_t)index_test.hits,
+	 (uintmax_t)index_test.bytes / 1024);
+  if (index_test.hits != 4) return 1;
+
+  /* a change through this connection is forgotten, then read back in */
+  strcpy(fetch_test.location,"ATTIC");
+  if (update(&fetch_test) != MI_EXIT_OK ||
+      fetch(&fetch_test,tc_test.code) != MI_EXIT_OK || strcmp(fetch_test.location,"ATTIC") ||
+      fetch(&fetch_test,tc_test.code) != MI_EXIT_OK) return 1;
+  code_index_stats(&index_test);
+  if (index_test.forgotten != 1 || index_test.hits != 5) return 1;
+  make_media(&item_test, book, "GRAULT", "DEN");
+  if (store(&item_test) != MI_EXIT_OK || fetch(&fetch_test,item_test.code) != MI_EXIT_OK ||
+      delete(item_test.code) != MI_EXIT_OK ||
+      fetch(&fetch_test,item_test.code) != MI_NO_RESULTS) return 1;
+
+  /* and a commit through another connection clears it */
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close_db();
+    if (init_db(db_file) != MI_EXIT_OK || fetch(&fetch_test,tc_test.code) != MI_EXIT_OK) _exit(1);
+    strcpy(fetch_test.location,"CELLAR");
+    _exit((update(&fetch_test) == MI_EXIT_OK && close_db() == MI_EXIT_OK) ? 0 : 1);
+  }
+  if (waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return 1;
+  retval = fetch(&fetch_test,tc_test.code);
+  printf("fetch(): %s, in %s after another connection's update\n",error_string(retval),
+	 fetch_test.location);
+  code_index_stats(&index_test);
+  if (retval != MI_EXIT_OK || strcmp(fetch_test.location,"CELLAR") || index_test.clears != 1)
+    return 1;
+  close_db();
+  if (init_db(db_file) != MI_EXIT_OK || code_index_stats(&index_test) != MI_NO_RESULTS) return 1;
+
+  /* test intake, times are made up so the window and flush are exact */
+  printf("Intake: \n\n");
+
+  intake_init(&intake,"INTAKE",1.0,4,0.5);
+  retval = intake_load(&intake);
+  printf("intake_load(): %s, %zu keys\n",error_string(retval),intake.num_keys);
+  if (retval != MI_EXIT_OK || intake.num_keys == 0) return 1;
+  sprintf(long_text,"%u",tc_test.code);
+  if (intake_scan(&intake,long_text,10.0,&seek_code) != INTAKE_KNOWN ||
+      seek_code != tc_test.code) return 1;
+  if (intake_scan(&intake,long_text,10.5,&seek_code) != INTAKE_DUPLICATE) return 1;
+  if (intake_due(&intake,10.4) || !intake_due(&intake,10.5)) return 1;
+  if (intake_scan(&intake," 0-552-14616-1\r",10.6,&seek_code) != INTAKE_NEW) return 1;
+  item_test.code = seek_code;
+  if (intake_scan(&intake,"9780552146166",12.0,&seek_code) != INTAKE_KNOWN ||
+      seek_code != item_test.code) return 1;
+  if (intake_scan(&intake,"12",12.0,&seek_code) != INTAKE_UNKNOWN ||
+      intake_scan(&intake,"SPAM",12.0,&seek_code) != INTAKE_BAD) return 1;
+  if (!intake_due(&intake,12.0)) return 1;
+
+  retval = intake_flush(&intake);
+  printf("intake_flush(): %s, %u stored, %u checked out\n",error_string(retval),
+	 intake.stats.stored,intake.stats.checked_out);
+  if (retval != MI_EXIT_OK || intake.stats.stored != 1 || intake.stats.checked_out != 2 ||
+      intake_wait(&intake,12.0) != -1) return 1;
+  if (fetch_book_by_isbn(&fetch_book_test,"0552146161") != MI_EXIT_OK ||
+      fetch_book_test.code != item_test.code) return 1;
+  fetch(&fetch_test,tc_test.code);
+  if (strcmp(fetch_test.location,"INTAKE")) return 1;
+  intake_free(&intake);
+  delete(item_test.code);
+
+  /* a filter off the wire with an operator out of range is refused, by
+   * the decoder and by search() itself
+   */
+  printf("Filter decoding: \n\n");
+  filter_init(&filter);
+  filter_int(&filter,F_TYPE,OP_EQ,book);
+  filter.order = F_CODE;
+  wire_init(&wire_test);
+  wire_put_filter(&wire_test,&filter);
+  op_test = 100000;
+  memcpy(wire_test.data + 5 * sizeof(uint32_t),&op_test,sizeof(op_test));
+  wire_get_filter(&wire_test,&filter);
+  printf("wire_get_filter(): %s with a bad op\n",(wire_test.error) ? "error" : "no error");
+  if (!wire_test.error || filter.num_terms != 0) return 1;
+  wire_free(&wire_test);
+  filter_init(&filter);
+  filter_int(&filter,F_TYPE,OP_EQ,book);
+  filter.terms[0].op = (op_t)100000;
+  if (search(&search_test,&num_results,&filter) != MI_EXIT_ERROR) return 1;
+  filter_init(&filter);
+  filter.order = F_TITLE + 100;
+  filter.after = 1;
+  if (search(&search_test,&num_results,&filter) != MI_EXIT_ERROR) return 1;
+
+  /* test the daemon */
+  printf("Daemon: \n\n");
+  close_db();
+  if ((pid = start_daemon(db_file,"./test.sock")) < 0) return 1;
+
+  make_media(&item_test, book, "GOING POSTAL", "DEN");
+  make_book(&test_book, 0, book, fantasy, "0-385-60342-8", "GOING POSTAL",
+	    "PRATCHETT", "TERRY", "");
+  item_test.update = 0;
+  retval = client_store_book_item(&item_test,&test_book);
+  printf("client_store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || item_test.update == 0 || test_book.code != item_test.code) return 1;
+  retval = client_store_book_item(&item_test,&test_book);
+  printf("client_store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXISTS) return 1;
+
+  retval = client_fetch(&fetch_test,item_test.code);
+  printf("client_fetch(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || strcmp(fetch_test.name,"GOING POSTAL") ||
+      fetch_test.update != item_test.update) return 1;
+  retval = client_fetch_book(&fetch_book_test,item_test.code);
+  printf("client_fetch_book(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || strcmp(fetch_book_test.isbn,"0-385-60342-8")) return 1;
+  if (client_exists_movie(item_test.code) != MI_NO_RESULTS) return 1;
+
+  /* enough codes for several requests, sent ahead of their answers */
+  pipeline_codes = malloc(sizeof(uint32_t) * 2500);
+  pipeline_test = malloc(sizeof(media_t) * 2500);
+  pipeline_found = malloc(2500);
+  if (pipeline_codes == NULL || pipeline_test == NULL || pipeline_found == NULL) return 1;
+  for (int i = 0; i < 2500; i++)
+    pipeline_codes[i] = (i % 2) ? 0 : item_test.code;
+  retval = client_fetch_many(pipeline_test,pipeline_found,pipeline_codes,2500);
+  printf("client_fetch_many(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  for (int i = 0; i < 2500; i++) {
+    if (pipeline_found[i] != !(i % 2)) return 1;
+    if (!(i % 2) && strcmp(pipeline_test[i].name,"GOING POSTAL")) return 1;
+  }
+  retval = client_fetch_many_movies(NULL,pipeline_found,pipeline_codes,2500);
+  printf("client_fetch_many_movies(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS || client_exists_book(item_test.code) != MI_EXISTS) return 1;
+  free(pipeline_codes);
+  free(pipeline_test);
+  free(pipeline_found);
+
+  retval = client_checkout(item_test.code,"POST OFFICE");
+  printf("client_checkout(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+
+  filter_init(&filter);
+  filter_text(&filter,F_LOCATION,OP_EQ,"POST OFFICE");
+  retval = client_search(&search_test,&num_results,&filter);
+  printf("client_search(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 1 || search_test[0].code != item_test.code) return 1;
+  free(search_test);
+  filter_init(&filter);
+  filter_text(&filter,F_AUTHOR_LAST,OP_EQ,"NOBODY");
+  retval = client_search_books(&search_test_book,&num_results,&filter);
+  printf("client_search_books(): %s\n",error_string(retval));
+  if (retval != MI_NO_RESULTS || search_test_book != NULL) return 1;
+
+  retval = client_delete(item_test.code);
+  printf("client_delete(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || client_exists(item_test.code) != MI_NO_RESULTS) return 1;
+
+  make_media(&page_test[0], book, "FEET OF CLAY", "DEN");
+  make_media(&page_test[1], book, "JINGO", "DEN");
+  make_book(&shard_book_pair[0], 0, book, fantasy, "0-425-13026-6", "FEET OF CLAY",
+	    "PRATCHETT", "TERRY", "");
+  make_book(&shard_book_pair[1], 0, book, fantasy, "0552146161", "JINGO",
+	    "PRATCHETT", "TERRY", "");
+  page_test[1].update = 0;
+  retval = client_store_book_item_batch(page_test,shard_book_pair,2,&num_unknown);
+  printf("client_store_book_item_batch(): %s, %zu stored\n",error_string(retval),num_unknown);
+  if (retval != MI_EXIT_OK || num_unknown != 2 || page_test[1].update == 0 ||
+      client_fetch_book(&fetch_book_test,page_test[1].code) != MI_EXIT_OK ||
+      strcmp(fetch_book_test.title,"JINGO")) return 1;
+  if (client_store_book_item_batch(page_test,shard_book_pair,2,&num_unknown) != MI_EXISTS ||
+      num_unknown != 0) return 1;
+  client_delete(page_test[0].code);
+  client_delete(page_test[1].code);
+
+  client_close();
+  kill(pid,SIGTERM);
+  if (waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return 1;
+  if (access("./test.sock",F_OK) == 0) return 1;
+  if (init_db(db_file) != MI_EXIT_OK) return 1;
+
+  /* test shards, each file is written by a worker of its own */
+  printf("Shards: \n\n");
+
+  retval = shard_open("./test-shards",4,NULL);
+  printf("shard_open(): %s, %d shards\n",error_string(retval),shard_count());
+  if (retval != MI_EXIT_OK || shard_count() != 4) return 1;
+
+  pipeline_codes = malloc(sizeof(uint32_t) * 301);
+  pipeline_test = malloc(sizeof(media_t) * 301);
+  pipeline_found = malloc(301);
+  shard_books = malloc(sizeof(book_t) * 300);
+  if (pipeline_codes == NULL || pipeline_test == NULL || pipeline_found == NULL ||
+      shard_books == NULL) return 1;
+  for (int i = 0; i < 300; i++) {
+    sprintf(long_text,"%03d SHARD BOOK",i);
+    make_media(&pipeline_test[i], book, long_text, "DEN");
+    sprintf(long_text,"SHARD BOOK %03d",i);
+    make_book(&shard_books[i], 0, book, fiction, "0-385-60342-8", long_text,
+	      "SHARDSON", "", "");
+    pipeline_test[i].update = 0;
+    pipeline_codes[i] = pipeline_test[i].code;
+    shard_rows[shard_of(pipeline_codes[i])]++;
+  }
+  pipeline_codes[300] = 12;
+  printf("shard_of(): %d %d %d %d rows\n",shard_rows[0],shard_rows[1],shard_rows[2],
+	 shard_rows[3]);
+  if (!shard_rows[0] || !shard_rows[1] || !shard_rows[2] || !shard_rows[3]) return 1;
+
+  retval = shard_store_book_item_batch(pipeline_test,shard_books,300,&num_unknown);
+  printf("shard_store_book_item_batch(): %s, %zu stored\n",error_string(retval),num_unknown);
+  if (retval != MI_EXIT_OK || num_unknown != 300 || pipeline_test[299].update == 0) return 1;
+  if (shard_store_book_item_batch(pipeline_test,shard_books,300,&num_unknown) != MI_EXISTS ||
+      num_unknown != 0) return 1;
+
+  retval = shard_fetch_many(pipeline_test,pipeline_found,pipeline_codes,301);
+  printf("shard_fetch_many(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || pipeline_found[300]) return 1;
+  for (int i = 0; i < 300; i++) {
+    sprintf(long_text,"%03d SHARD BOOK",i);
+    if (!pipeline_found[i] || strcmp(pipeline_test[i].name,long_text)) return 1;
+  }
+
+  make_media(&item_test, book, "SHARD SINGLE", "DEN");
+  make_book(&test_book, 0, book, fiction, "0-385-60342-8", "SHARD SINGLE", "SHARDSON", "", "");
+  retval = shard_store_book_item(&item_test,&test_book);
+  printf("shard_store_book_item(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || shard_exists_book(item_test.code) != MI_EXISTS ||
+      shard_exists_movie(item_test.code) != MI_NO_RESULTS) return 1;
+  retval = shard_checkout(item_test.code,"ANNEX");
+  printf("shard_checkout(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || shard_fetch(&fetch_test,item_test.code) != MI_EXIT_OK ||
+      strcmp(fetch_test.location,"ANNEX")) return 1;
+  retval = shard_delete(item_test.code);
+  printf("shard_delete(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || shard_exists(item_test.code) != MI_NO_RESULTS) return 1;
+
+  /* the page comes from the merge, not from any one shard */
+  filter_init(&filter);
+  filter_text(&filter,F_AUTHOR_LAST,OP_EQ,"SHARDSON");
+  filter_order(&filter,F_SORT,1);
+  filter_limit(&filter,5,10);
+  retval = shard_search_books(&search_test_book,&num_results,&filter);
+  printf("shard_search_books(): %s, %u rows from %s\n",error_string(retval),num_results,
+	 (search_test_book != NULL) ? search_test_book[0].title : "none");
+  if (retval != MI_EXIT_OK || num_results != 5) return 1;
+  for (uint32_t i = 0; i < num_results; i++) {
+    sprintf(long_text,"SHARD BOOK %03u",289 - i);
+    if (strcmp(search_test_book[i].title,long_text)) return 1;
+  }
+  free(search_test_book);
+  filter_init(&filter);
+  filter_text(&filter,F_NAME,OP_LIKE,"%SHARD BOOK");
+  retval = shard_search(&search_test,&num_results,&filter);
+  printf("shard_search(): %s, %u rows\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 300) return 1;
+  free(search_test);
+
+  /* no order with a limit gives the rows one catalogue would, by code,
+   * even when the shards read theirs through the name index, which the
+   * lowest codes are renamed to sort last in
+   */
+  for (int i = 0; i < 20; i++) {
+    sprintf(pipeline_test[i].name,"R%02d SHARD BOOK",i);
+    if (shard_update(&pipeline_test[i]) != MI_EXIT_OK) return 1;
+  }
+  filter_init(&filter);
+  filter_text(&filter,F_NAME,OP_GE,"0");
+  filter_limit(&filter,10,5);
+  retval = shard_search(&search_test,&num_results,&filter);
+  printf("shard_search(): %s, %u rows with a limit\n",error_string(retval),num_results);
+  if (retval != MI_EXIT_OK || num_results != 10) return 1;
+  for (uint32_t i = 0; i < num_results; i++) {
+    seek_code = 0;
+    for (int j = 0; j < 300; j++)
+      if (pipeline_codes[j] < search_test[i].code) seek_code++;
+    if (seek_code != 5 + i) return 1;
+  }
+  free(search_test);
+
+  retval = shard_csv_dump("./test-shards/","");
+  printf("shard_csv_dump(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK || access("./test-shards/shard-03-book.csv",F_OK) != 0) return 1;
+
+  /* the count is kept with the files */
+  shard_close();
+  retval = shard_open("./test-shards",0,NULL);
+  printf("shard_open(): %s, %d shards\n",error_string(retval),shard_count());
+  if (retval != MI_EXIT_OK || shard_count() != 4 ||
+      shard_exists(pipeline_codes[299]) != MI_EXISTS) return 1;
+  shard_close();
+  retval = shard_open("./test-shards",2,NULL);
+  printf("shard_open(): %s with the wrong count\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR || shard_count() != 0) return 1;
+  free(pipeline_codes);
+  free(pipeline_test);
+  free(pipeline_found);
+  free(shard_books);
+
+  /* test replication, this process writes and a child follows */
+  printf("Replication: \n\n");
+
+  retval = repl_log_open("./test-changes.log");
+  printf("repl_log_open(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  make_media(&page_test[0], book, "NIGHT WATCH", "DEN");
+  /* a bad check digit is the writer's business, the follower takes it */
+  make_book(&shard_book_pair[0], 0, book, fantasy, "0-385-60342-9", "NIGHT WATCH",
+	    "PRATCHETT", "TERRY", "");
+  make_media(&page_test[1], book, "SMALL GODS", "DEN");
+  make_book(&shard_book_pair[1], 0, book, fantasy, "0552146161", "SMALL GODS",
+	    "PRATCHETT", "TERRY", "");
+  make_media(&page_test[2], dvd, "HOGFATHER", "DEN");
+  if (isbn_normalise(shard_book_pair[0].isbn,&isbn13) != MI_EXIT_ERROR ||
+      store_book_item_batch(page_test,shard_book_pair,2,NULL) != MI_EXIT_OK ||
+      store(&page_test[2]) != MI_EXIT_OK ||
+      store_book_item(&page_test[0],&shard_book_pair[0]) != MI_EXISTS ||
+      checkout(page_test[0].code,"LOFT") != MI_EXIT_OK ||
+      delete(page_test[1].code) != MI_EXIT_OK) return 1;
+  printf("repl_log_seq(): %u records\n",repl_log_seq());
+  if (repl_log_seq() != 4) return 1;
+  repl_log_close();
+
+  /* two rows to a batch, so the store and the checkout of NIGHT WATCH
+   * are applied in steps of their own
+   */
+  fflush(stdout);
+  if ((pid = fork()) == 0) {
+    close_db();
+    if (init_db("./test-follower.db") != MI_EXIT_OK ||
+	repl_follow_open(&follower,"./test-changes.log","./test-follower.db-follow") != MI_EXIT_OK ||
+	repl_follow_stats(&follower,&repl_test) != MI_EXIT_OK || repl_test.lag_bytes == 0)
+      _exit(1);
+    while ((retval = repl_follow_step(&follower,2)) == MI_EXIT_OK);
+    repl_follow_stats(&follower,&repl_test);
+    printf("repl_follow_step(): %s, record %u, %ju rows in %ju batches, %ju bytes behind\n",
+	   error_string(retval),repl_test.seq,(uintmax_t)repl_test.rows,
+	   (uintmax_t)repl_test.batches,(uintmax_t)repl_test.lag_bytes);
+    if (retval != MI_NO_RESULTS || repl_test.seq != 4 || repl_test.batches != 3 ||
+	repl_test.lag_bytes != 0 || repl_test.lag_seconds != 0) _exit(1);
+    if (fetch(&fetch_test,page_test[0].code) != MI_EXIT_OK || strcmp(fetch_test.location,"LOFT") ||
+	fetch_book(&fetch_book_test,page_test[0].code) != MI_EXIT_OK ||
+	strcmp(fetch_book_test.title,"NIGHT WATCH") || strcmp(fetch_book_test.isbn,"0-385-60342-9") ||
+	exists(page_test[1].code) != MI_NO_RESULTS ||
+	exists_book(page_test[1].code) != MI_NO_RESULTS || exists(page_test[2].code) != MI_EXISTS)
+      _exit(1);
+    repl_follow_close(&follower);
+
+    /* the state file picks up where it left off */
+    if (repl_follow_open(&follower,"./test-changes.log","./test-follower.db-follow") != MI_EXIT_OK ||
+	repl_follow_step(&follower,0) != MI_NO_RESULTS) _exit(1);
+    repl_follow_close(&follower);
+    fflush(stdout);
+    _exit(close_db());
+  }
+  if (waitpid(pid,&status,0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    return 1;
+  delete(page_test[0].code);
+  delete(page_test[2].code);
+
+  /* test read only open */
+  printf("Read only open: \n\n");
+
+  close_db();
+  db_options_preset(&options,"kiosk-readonly");
+  retval = init_db_ex(db_file,&options);
+  printf("init_db_ex(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  retval = fetch(&fetch_test,tc_test.code);
+  printf("fetch(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_OK) return 1;
+  retval = touch(tc_test.code);
+  printf("touch(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
+
   retval = close_db();
   printf("close_db(): %s\n",error_string(retval));
 
+  /* a file that was never set up isn't created */
+  options.read_only = DB_READ_ONLY;
+  retval = init_db_ex("./test-missing.db",&options);
+  printf("init_db_ex(): %s\n",error_string(retval));
+  if (retval != MI_EXIT_ERROR) return 1;
+
   printf("All Done!\n");
 
   return 0;
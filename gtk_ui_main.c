@@ -20,6 +20,7 @@
 #include <stdint.h>
 #include "log_funcs.h"
 #include "db_funcs.h"
+#include "gtk_ui_model.h"
 #include "gtk_ui_main.h"
 
 int main(int argc, char** argv) {
@@ -86,6 +87,7 @@ gboolean init_app(mindex_t* mindex) {
   mindex->window = GTK_WIDGET(gtk_builder_get_object(builder,"main_window"));
   mindex->statusbar = GTK_WIDGET(gtk_builder_get_object(builder,"main_window_statusbar"));
   mindex->tree_view = GTK_WIDGET(gtk_builder_get_object(builder,"main_tree_display"));
+  mindex->search_entry = GTK_WIDGET(gtk_builder_get_object(builder,"main_search_entry"));
 
   /* connect signals */
   gtk_builder_connect_signals(builder, mindex);
@@ -100,9 +102,35 @@ gboolean init_app(mindex_t* mindex) {
   id = gtk_statusbar_get_context_id(GTK_STATUSBAR(mindex->statusbar), "mindex - The Media Index");
   mindex->statusbar_context_id = id;
   reset_default_status(mindex);
+  id = gtk_statusbar_get_context_id(GTK_STATUSBAR(mindex->statusbar), "Search results");
+  mindex->search_context_id = id;
+
+  /* progress bar for loads, tucked into the statusbar and hidden until needed */
+  mindex->progress = gtk_progress_bar_new();
+  gtk_widget_set_no_show_all(mindex->progress, TRUE);
+  gtk_widget_set_valign(mindex->progress, GTK_ALIGN_CENTER);
+  gtk_box_pack_end(GTK_BOX(mindex->statusbar), mindex->progress, FALSE, FALSE, 0);
 
   /* set filename to NULL since no database opened yet */
   mindex->filename = NULL;
+  mindex->main = NULL;
+  mindex->books = NULL;
+  mindex->movies = NULL;
+  mindex->results = NULL;
+  mindex->db_open = FALSE;
+
+  /* nothing loading either */
+  mindex->load_cancel = NULL;
+  mindex->pending = NULL;
+  mindex->generation = 0;
+
+  /* or searching */
+  mindex->search_timeout = 0;
+  mindex->search_cancel = NULL;
+  mindex->search_generation = 0;
+  g_mutex_init(&mindex->search_lock);
+  g_cond_init(&mindex->search_idle);
+  mindex->searches_running = 0;
 
   return TRUE;
 }
@@ -125,7 +153,7 @@ gchar* get_open_filename(mindex_t* mindex) {
   return filename;
 }
 
-ghcar* get_save_filename(mindex_t* mindex) {
+gchar* get_save_filename(mindex_t* mindex) {
   GtkWidget *chooser;
   gchar* filename = NULL;
 
@@ -143,187 +171,429 @@ ghcar* get_save_filename(mindex_t* mindex) {
   return filename;
 }
 
-/* loads and/or create a new database */
-void load_database(mindex_t* mindex, gchar* filename) {
-  gchar* status;
-  gchar* err;
+/* background loading
+ * the worker opens the file (init_db() creates or migrates the schema),
+ * counts the tables and then walks the main table's page keys, handing
+ * everything back to the main loop with idle callbacks.  These run at default
+ * priority so they land ahead of the GTask's own completion.  Anything queued
+ * by a load that has since been superseded carries a stale generation and is
+ * dropped on arrival.
+ */
+static void load_job_free(gpointer data) {
+  load_job_t* job = data;
 
-  /* set status to loading */
-  status = g_strdup_printf("Loading Database %s…", filename);
-  gtk_statusbar_push(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id, status);
-  g_free(status);
+  g_free(job->filename);
+  g_slice_free(load_job_t, job);
+}
+
+static gboolean load_counts_idle(gpointer data) {
+  load_counts_t* counts = data;
+  mindex_t* mindex = counts->mindex;
+
+  if (counts->generation == mindex->generation) {
+    /* the view can go up as soon as the tables are counted, rows page in as drawn */
+    mindex->main = GTK_TREE_MODEL(mindex_model_new_sized(MODEL_MAIN, counts->n_main));
+    mindex->books = GTK_TREE_MODEL(mindex_model_new_sized(MODEL_BOOKS, counts->n_books));
+    mindex->movies = GTK_TREE_MODEL(mindex_model_new_sized(MODEL_MOVIES, counts->n_movies));
+    gtk_tree_view_set_model(GTK_TREE_VIEW(mindex->tree_view), mindex->main);
+    setup_tree_main(mindex);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(mindex->progress), LOAD_COUNTED);
+
+    /* catch up with anything typed while the file was opening */
+    start_search(mindex, gtk_entry_get_text(GTK_ENTRY(mindex->search_entry)));
+  }
+
+  g_slice_free(load_counts_t, counts);
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean load_batch_idle(gpointer data) {
+  load_batch_t* batch = data;
+  mindex_t* mindex = batch->mindex;
+
+  if (batch->generation == mindex->generation && mindex->main != NULL) {
+    mindex_model_add_keys(MINDEX_MODEL(mindex->main), batch->first, batch->keys, batch->n_keys);
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(mindex->progress), batch->fraction);
+  }
+
+  g_slice_free(load_batch_t, batch);
+  return G_SOURCE_REMOVE;
+}
+
+static void load_thread(GTask* task, gpointer source, gpointer task_data, GCancellable* cancel) {
+  load_job_t* job = task_data;
+  load_counts_t* counts;
+  load_batch_t* batch = NULL;
+  uint32_t n_main, n_books, n_movies;
+  uint32_t code, prev;
+  guint pages, p;
+  int retval;
 
-  /* clear event queue */
-  while (gtk_events_pending()) gtk_main_iteration();
+  if (init_db(job->filename) != MI_EXIT_OK) {
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "Could not load %s", job->filename);
+    return;
+  }
+  if (g_task_return_error_if_cancelled(task)) return;
+
+  if (count_items(&n_main) != MI_EXIT_OK ||
+      count_books(&n_books) != MI_EXIT_OK ||
+      count_movies(&n_movies) != MI_EXIT_OK) {
+    if (g_task_return_error_if_cancelled(task)) return;
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "Could not read %s", job->filename);
+    return;
+  }
+  if (g_task_return_error_if_cancelled(task)) return;
+
+  counts = g_slice_new(load_counts_t);
+  counts->mindex = job->mindex;
+  counts->generation = job->generation;
+  counts->n_main = n_main;
+  counts->n_books = n_books;
+  counts->n_movies = n_movies;
+  g_idle_add_full(G_PRIORITY_DEFAULT, load_counts_idle, counts, NULL);
+
+  /* walk the page keys so scrolling anywhere in the view is a single seek */
+  pages = (n_main + MODEL_PAGE_SIZE - 1) / MODEL_PAGE_SIZE;
+  for (p = 1; p < pages && !g_cancellable_is_cancelled(cancel); p++) {
+    retval = (p == 1) ? seek(&code, NULL, MODEL_PAGE_SIZE - 1)
+                      : seek(&code, &prev, MODEL_PAGE_SIZE - 1);
+    if (retval != MI_EXIT_OK) break; /* rows went away under us, the model seeks the rest itself */
+    prev = code;
+
+    if (batch == NULL) {
+      batch = g_slice_new(load_batch_t);
+      batch->mindex = job->mindex;
+      batch->generation = job->generation;
+      batch->first = p;
+      batch->n_keys = 0;
+    }
+    batch->keys[batch->n_keys++] = code;
+
+    if (batch->n_keys == LOAD_BATCH_PAGES) {
+      batch->fraction = LOAD_COUNTED + (1.0 - LOAD_COUNTED) * p / pages;
+      g_idle_add_full(G_PRIORITY_DEFAULT, load_batch_idle, batch, NULL);
+      batch = NULL;
+    }
+  }
 
-  if (init_db(filename) != MI_EXIT_OK) {
-    err = g_strdup_printf("Could not load %s", filename);
-    error_message(err);
-    g_free(err);
-    g_free(filename);
+  /* interrupt_db() makes the seek fail rather than the loop test */
+  if (g_task_return_error_if_cancelled(task)) {
+    if (batch != NULL) g_slice_free(load_batch_t, batch);
+    return;
+  }
+
+  if (batch != NULL) {
+    batch->fraction = 1.0;
+    g_idle_add_full(G_PRIORITY_DEFAULT, load_batch_idle, batch, NULL);
+  }
+
+  g_task_return_boolean(task, TRUE);
+}
+
+static void load_done(GObject* source, GAsyncResult* result, gpointer data) {
+  mindex_t* mindex = data;
+  load_job_t* job = g_task_get_task_data(G_TASK(result));
+  GError* err = NULL;
+  gchar* next;
+
+  g_clear_object(&mindex->load_cancel);
+  gtk_widget_hide(mindex->progress);
+  gtk_statusbar_pop(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id);
+
+  if (g_task_propagate_boolean(G_TASK(result), &err)) {
+    mindex->db_open = TRUE;
+    g_free(mindex->filename);
+    mindex->filename = g_strdup(job->filename);
   } else {
-    mindex->main = load_main();
-    mindex->books = load_books();
-    mindex->movies = load_movies();
-    if (mindex->filename != NULL) g_free(mindex->filename);
-    mindex->filename = filename;
+    /* a failed or cancelled load leaves nothing worth keeping open */
+    mindex->generation++;
+    unload_database(mindex);
+    close_db();
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      error_message(err->message);
+    g_error_free(err);
   }
 
-  /* clear loading status and restore default  */
-  gtk_statusbar_pop (GTK_STATUSBAR (editor->statusbar),
-		     editor->statusbar_context_id);
-  reset_default_status (editor);
+  reset_default_status(mindex);
+
+  /* somebody picked another file while we were busy */
+  if (mindex->pending != NULL) {
+    next = mindex->pending;
+    mindex->pending = NULL;
+    load_database(mindex, next);
+  }
 }
 
-void reset_default_status(mindex_t* mindex) {
-  gchar* file;
+/* drops the models so nothing on this thread touches db_handle any more */
+void unload_database(mindex_t* mindex) {
+  gtk_tree_view_set_model(GTK_TREE_VIEW(mindex->tree_view), NULL);
+
+  /* searches in flight belong to the old file */
+  if (mindex->search_timeout != 0) {
+    g_source_remove(mindex->search_timeout);
+    mindex->search_timeout = 0;
+  }
+  if (mindex->search_cancel != NULL) {
+    g_cancellable_cancel(mindex->search_cancel);
+    g_clear_object(&mindex->search_cancel);
+  }
+  mindex->search_generation++;
+  clear_search(mindex);
+  wait_for_search(mindex);
+
+  g_clear_object(&mindex->main);
+  g_clear_object(&mindex->books);
+  g_clear_object(&mindex->movies);
+}
+
+/* loads and/or create a new database, in the background */
+void load_database(mindex_t* mindex, gchar* filename) {
+  load_job_t* job;
+  GTask* task;
   gchar* status;
 
-  if (mindex->filename == NULL)
-    file = g_strdup("No Database Opened…");
-  else
-    file = g_path_get_basename(mindex->filename);
+  unload_database(mindex);
+  mindex->generation++;
 
-  status = g_strdup_printf("Database: %s", file);
-  gtk_statusbar_pop(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id);
+  /* the worker owns db_handle until it finishes, so queue this one up */
+  if (mindex->load_cancel != NULL) {
+    g_free(mindex->pending);
+    mindex->pending = filename;
+    g_cancellable_cancel(mindex->load_cancel);
+    interrupt_db();
+    return;
+  }
+
+  if (mindex->db_open) {
+    close_db();
+    mindex->db_open = FALSE;
+    g_free(mindex->filename);
+    mindex->filename = NULL;
+  }
+
+  /* set status to loading */
+  status = g_strdup_printf("Loading Database %s…", filename);
   gtk_statusbar_push(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id, status);
   g_free(status);
-  g_free(file);
+  gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(mindex->progress), 0.0);
+  gtk_widget_show(mindex->progress);
+
+  job = g_slice_new(load_job_t);
+  job->mindex = mindex;
+  job->filename = filename;
+  job->generation = mindex->generation;
+
+  mindex->load_cancel = g_cancellable_new();
+  task = g_task_new(NULL, mindex->load_cancel, load_done, mindex);
+  g_task_set_task_data(task, job, load_job_free);
+  g_task_run_in_thread(task, load_thread);
+  g_object_unref(task);
 }
 
-GtkListStore* load_main() {
-  GtkListStore* main;
-  GtkTreeIter iter;
-  media_t* media;
-  uint32_t num_results;
-  int retval;
+/* search as you type
+ * keystrokes restart a short timer, and only when it runs out is the text
+ * handed to a worker thread.  Each new search bumps search_generation, so
+ * results from one the user has already typed past are thrown away.  Matches
+ * are shown through a model over their codes while the full model and its
+ * cache stay put underneath, ready for when the entry is cleared.
+ */
+static void search_job_free(gpointer data) {
+  search_job_t* job = data;
 
-  /* load the media */
-  retval = search(media, &num_results, NULL);
+  g_free(job->text);
+  g_free(job->codes);
+  g_slice_free(search_job_t, job);
+}
 
-  if (retval == MI_EXIT_ERROR) {
-    error_message("An error occured, please check your logs");
-    return NULL;
-  }
+/* a worker is done with db_handle */
+static void search_finished(mindex_t* mindex) {
+  g_mutex_lock(&mindex->search_lock);
+  mindex->searches_running--;
+  g_cond_broadcast(&mindex->search_idle);
+  g_mutex_unlock(&mindex->search_lock);
+}
 
-  /* create the object */
-  main = gtk_list_store_new(5,              /* columns  */
-			    G_TYPE_INT,     /* code     */
-			    G_TYPE_STRING,  /* type     */
-			    G_TYPE_STRING,  /* name     */
-			    G_TYPE_STRING,  /* location */
-			    G_TYPE_STRING); /* update   */
-
-  for (int i = 0; i < num_results; i++) {
-    gtk_list_store_append(main, &iter);
-    gtk_list_store_set(main, &iter,
-		       0, media[i].code,
-		       1, medium_string(media[i].type),
-		       2, media[i].name,
-		       3, media[i].location,
-		       4, time_string(media[i].update),
-		       -1);
+/* close_db() can't run under a worker still in search_text(), so it is
+ * interrupted (again, if it hadn't reached its query yet) until it gives up
+ */
+void wait_for_search(mindex_t* mindex) {
+  g_mutex_lock(&mindex->search_lock);
+  while (mindex->searches_running > 0) {
+    interrupt_db();
+    g_cond_wait_until(&mindex->search_idle, &mindex->search_lock,
+		      g_get_monotonic_time() + 10 * G_TIME_SPAN_MILLISECOND);
   }
-
-  free(media);
-  return main;
+  g_mutex_unlock(&mindex->search_lock);
 }
 
-GtkListStore* load_books() {
-  GtkListStore* books;
-  GtkTreeIter iter;
-  book_t* book;
-  uint32_t num_results;
+static void search_thread(GTask* task, gpointer source, gpointer task_data, GCancellable* cancel) {
+  search_job_t* job = task_data;
+  gint64 start;
   int retval;
 
-  /* load the books */
-  retval = search_books(book, &num_results, NULL);
+  if (g_task_return_error_if_cancelled(task)) {
+    search_finished(job->mindex);
+    return;
+  }
+
+  job->codes = g_new(uint32_t, SEARCH_MAX_RESULTS);
+  start = g_get_monotonic_time();
+  retval = search_text(job->codes, &job->n_codes, job->text, SEARCH_MAX_RESULTS);
+  job->usec = g_get_monotonic_time() - start;
+  search_finished(job->mindex);
+
+  if (g_task_return_error_if_cancelled(task)) return;
 
   if (retval == MI_EXIT_ERROR) {
-    error_message("An error occured, please check your logs");
-    return NULL;
+    g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+			    "search_thread(): search for %s failed", job->text);
+    return;
   }
 
-  /* create the object */
-  books = gtk_list_store_new(8,              /* columns      */
-			     G_TYPE_INT,     /* code         */
-			     G_TYPE_STRING,  /* type         */
-			     G_TYPE_STRING,  /* genre        */
-			     G_TYPE_STRING,  /* isbn         */
-			     G_TYPE_STRING,  /* title        */
-			     G_TYPE_STRING,  /* author_last  */
-			     G_TYPE_STRING,  /* author_first */
-			     G_TYPE_STRING); /* author_rest  */
-
-  for (int i = 0; i < num_results; i++) {
-    gtk_list_store_append(books, &iter);
-    gkt_list_store_set(books, &iter,
-		       0, book[i].code,
-		       1, medium_string(book[i].type),
-		       2, genre_string(book[i].genre),
-		       3, book[i].isbn,
-		       4, book[i].title,
-		       5, book[i].author_last,
-		       6, book[i].author_first,
-		       7, book[i].author_rest,
-		       -1);
+  /* give back what a short result list doesn't need */
+  job->codes = g_renew(uint32_t, job->codes, MAX(job->n_codes, 1));
+  g_task_return_boolean(task, TRUE);
+}
+
+static void search_done(GObject* source, GAsyncResult* result, gpointer data) {
+  mindex_t* mindex = data;
+  search_job_t* job = g_task_get_task_data(G_TASK(result));
+  GtkTreeModel* results;
+  GError* err = NULL;
+  gchar* status;
+
+  if (!g_task_propagate_boolean(G_TASK(result), &err)) {
+    if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      log_debug(ERROR, err->message);
+    g_error_free(err);
+    return;
   }
 
-  free(book);
-  return books;
+  /* typed past, or a different file by now */
+  if (job->generation != mindex->search_generation || job->db_generation != mindex->generation)
+    return;
+
+  g_clear_object(&mindex->search_cancel);
+
+  results = GTK_TREE_MODEL(mindex_model_new_codes(MODEL_MAIN, job->codes, job->n_codes));
+  job->codes = NULL;
+  gtk_tree_view_set_model(GTK_TREE_VIEW(mindex->tree_view), results);
+  if (mindex->results != NULL) g_object_unref(mindex->results);
+  mindex->results = results;
+
+  status = g_strdup_printf("%u%s matches for \"%s\" in %.1f ms", job->n_codes,
+			   (job->n_codes == SEARCH_MAX_RESULTS) ? "+" : "",
+			   job->text, job->usec / 1000.0);
+  gtk_statusbar_remove_all(GTK_STATUSBAR(mindex->statusbar), mindex->search_context_id);
+  gtk_statusbar_push(GTK_STATUSBAR(mindex->statusbar), mindex->search_context_id, status);
+  g_free(status);
 }
 
-GtkListStore* load_movies() {
-  GtkListStore* movies;
-  GtkTreeiter iter;
-  movie_t* movie;
-  uint32_t num_results;
-  int retval;
+static gboolean search_timeout_cb(gpointer data) {
+  mindex_t* mindex = data;
 
-  /* load the movies */
-  retval = search_movies(movie, &num_results, NULL);
+  mindex->search_timeout = 0;
+  start_search(mindex, gtk_entry_get_text(GTK_ENTRY(mindex->search_entry)));
+  return G_SOURCE_REMOVE;
+}
 
-  if (retval == MI_EXIT_ERROR) {
-    error_message("An error occured, please check your logs");
-    return NULL;
+void start_search(mindex_t* mindex, const gchar* text) {
+  search_job_t* job;
+  GTask* task;
+
+  /* whatever is still running is out of date */
+  if (mindex->search_cancel != NULL) {
+    g_cancellable_cancel(mindex->search_cancel);
+    g_clear_object(&mindex->search_cancel);
   }
+  mindex->search_generation++;
 
-  /* create the object */
-  movies = gtk_list_store_new(7,             /* columns  */
-			      G_TYPE_INT,    /* code     */
-			      G_TYPE_STRING, /* type     */
-			      G_TYPE_STRING, /* genre    */
-			      G_TYPE_STRING, /* title    */
-			      G_TYPE_STRING, /* director */
-			      G_TYPE_STRING, /* studio   */
-			      G_TYPE_INT);   /* rating   */
-
-  for (int i = 0; i < num_results, i++) {
-    gtk_list_store_append(movies, &iter);
-    gtk_list_store_set(movies, &iter,
-		       0, movie[i].code,
-		       1, medium_string(movie[i].type),
-		       2, genre_string(movie[i].genre),
-		       3, movie[i].title,
-		       4, movie[i].director,
-		       5, movie[i].studio,
-		       6, movie[i].rating,
-		       -1);
+  if (mindex->main == NULL) return;
+
+  /* an empty entry puts the whole catalogue back */
+  while (g_ascii_isspace(*text)) text++;
+  if (*text == '\0') {
+    clear_search(mindex);
+    return;
   }
 
-  free(movie);
-  return movies;
+  job = g_slice_new0(search_job_t);
+  job->mindex = mindex;
+  job->text = g_strdup(text);
+  job->generation = mindex->search_generation;
+  job->db_generation = mindex->generation;
+
+  g_mutex_lock(&mindex->search_lock);
+  mindex->searches_running++;
+  g_mutex_unlock(&mindex->search_lock);
+
+  mindex->search_cancel = g_cancellable_new();
+  task = g_task_new(NULL, mindex->search_cancel, search_done, mindex);
+  g_task_set_task_data(task, job, search_job_free);
+  g_task_run_in_thread(task, search_thread);
+  g_object_unref(task);
 }
-/*
-void setup_tree_main() {
-  GtkTreeViewColumn* column;
+
+void clear_search(mindex_t* mindex) {
+  if (mindex->results != NULL) {
+    gtk_tree_view_set_model(GTK_TREE_VIEW(mindex->tree_view), mindex->main);
+    g_clear_object(&mindex->results);
+  }
+  gtk_statusbar_remove_all(GTK_STATUSBAR(mindex->statusbar), mindex->search_context_id);
+}
+
+void reset_default_status(mindex_t* mindex) {
+  gchar* file;
+  gchar* status;
+
+  if (mindex->filename == NULL)
+    file = g_strdup("No Database Opened…");
+  else
+    file = g_path_get_basename(mindex->filename);
+
+  status = g_strdup_printf("Database: %s", file);
+  gtk_statusbar_pop(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id);
+  gtk_statusbar_push(GTK_STATUSBAR(mindex->statusbar), mindex->statusbar_context_id, status);
+  g_free(status);
+  g_free(file);
+}
+
+/* the tree view runs in fixed height mode so it never has to measure rows
+ * it isn't showing, which means every column has to be fixed width
+ */
+static void add_column(GtkTreeView* tree_view, const gchar* title, gint column, gint width) {
+  GtkTreeViewColumn* col;
   GtkCellRenderer* renderer = gtk_cell_renderer_text_new();
 
-  column = gtk_tree_view_column_new_with_attributes("Code", renderer,
-						    "text", 0,
-						    NULL);
+  col = gtk_tree_view_column_new_with_attributes(title, renderer,
+						 "text", column,
+						 NULL);
+  gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_set_fixed_width(col, width);
+  gtk_tree_view_column_set_resizable(col, TRUE);
+  gtk_tree_view_append_column(tree_view, col);
+}
+
+static void clear_columns(GtkTreeView* tree_view) {
+  GtkTreeViewColumn* col;
+
+  while ((col = gtk_tree_view_get_column(tree_view, 0)) != NULL)
+    gtk_tree_view_remove_column(tree_view, col);
+}
+
+void setup_tree_main(mindex_t* mindex) {
+  GtkTreeView* tree_view = GTK_TREE_VIEW(mindex->tree_view);
+
+  clear_columns(tree_view);
+  add_column(tree_view, "Code",     0, 100);
+  add_column(tree_view, "Type",     1, 160);
+  add_column(tree_view, "Name",     2, 260);
+  add_column(tree_view, "Location", 3, 120);
+  add_column(tree_view, "Updated",  4, 200);
 }
-*/
+
 /* window callback functions */
 void on_window_destroy(GObject* object, mindex_t* mindex) {
   gtk_main_quit();
@@ -337,25 +607,20 @@ void on_main_tree_selection_changed(GtkTreeSelection *selection, mindex_t* minde
   log_debug(TODO, "on_main_tree_selection_changed_not_implemented");
 }
 
+void on_main_search_entry_changed(GtkEditable* editable, mindex_t* mindex) {
+  /* debounce, only search once typing pauses */
+  if (mindex->search_timeout != 0)
+    g_source_remove(mindex->search_timeout);
+  mindex->search_timeout = g_timeout_add(SEARCH_DELAY_MS, search_timeout_cb, mindex);
+}
+
 /* file menu callback functions */
 void on_open_menu_item_activate(GtkMenuItem *menuitem, mindex_t* mindex) {
   gchar* filename;
 
   filename = get_open_filename(mindex);
 
-  if (filename != NULL) {
-    gtk_tree_view_set_model(mindex->tree_view, NULL);
-  
-    /* check for existing data */
-    if (mindex->main != NULL) g_object_unref(G_OBJECT(mindex->main));
-    if (mindex->books != NULL) g_object_unref(G_OBJECT(mindex->books));
-    if (mindex->movies != NULL) g_object_unref(G_OBJECT(mindex->movies));
-
-    /* load new data */
+  /* load new data, the tree view is filled in as it arrives */
+  if (filename != NULL)
     load_database(mindex, filename);
-
-    /* display tree view */
-    gtk_tree_view_set_model(mindex->tree_view, mindex->main);
-    setup_tree_main();
-  }
 }
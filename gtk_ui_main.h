@@ -30,24 +30,84 @@
 #define VERSION "0.1"
 #define COMMENTS "GTK+ Media Indexing Program"
 
+/* background loading */
+#define LOAD_BATCH_PAGES 256  /* page keys sent to the main loop at a time */
+#define LOAD_COUNTED     0.1  /* progress once the tables are counted */
+
+/* search as you type */
+#define SEARCH_DELAY_MS    150   /* quiet time after a keystroke before searching */
+#define SEARCH_MAX_RESULTS 10000
+
 /* typedefs */
 typedef struct {
   GtkWidget* window;
   GtkWidget* statusbar;
   GtkWidget* tree_view;
-  GtkListStore* main;
-  GtkListStore* books;
-  GtkListStore* movies;
+  GtkWidget* progress;
+  GtkWidget* search_entry;
+  GtkTreeModel* main;   /* MindexModel, see gtk_ui_model.h */
+  GtkTreeModel* books;
+  GtkTreeModel* movies;
+  GtkTreeModel* results; /* search results, shown in place of main while searching */
 
   guint statusbar_context_id;
+  guint search_context_id;
   gchar* filename;
+  gboolean db_open;
+
+  GCancellable* load_cancel; /* non-NULL while a load is running */
+  gchar* pending;            /* file to open once it winds down */
+  guint generation;          /* bumped per load, stale idle callbacks check it */
+
+  guint search_timeout;         /* debounce source, 0 if none pending */
+  GCancellable* search_cancel;  /* non-NULL while a search is running */
+  guint search_generation;      /* bumped per keystroke, stale results check it */
+  GMutex search_lock;
+  GCond search_idle;
+  guint searches_running;       /* workers that may still touch db_handle */
 } mindex_t;
 
+/* messages passed back from the loader thread */
+typedef struct {
+  mindex_t* mindex;
+  gchar*    filename;
+  guint     generation;
+} load_job_t;
+
+typedef struct {
+  mindex_t* mindex;
+  guint     generation;
+  guint     n_main;
+  guint     n_books;
+  guint     n_movies;
+} load_counts_t;
+
+typedef struct {
+  mindex_t* mindex;
+  guint     generation;
+  gdouble   fraction;
+  guint     first;                 /* page index of keys[0] */
+  guint     n_keys;
+  uint32_t  keys[LOAD_BATCH_PAGES];
+} load_batch_t;
+
+/* a search handed to a worker thread */
+typedef struct {
+  mindex_t* mindex;
+  gchar*    text;
+  guint     generation;     /* search_generation it was started under */
+  guint     db_generation;  /* and the load generation */
+  uint32_t* codes;
+  uint32_t  n_codes;
+  gint64    usec;           /* time spent in search_text() */
+} search_job_t;
+
 /* prototypes */
 /* window callback functions */
 void on_window_destroy(GObject* object, mindex_t* mindex);
 gboolean on_window_delete_event(GtkWidget* widget, GdkEvent* event, mindex_t* mindex);
 void on_main_tree_selection_changed(GtkTreeSelection *selection, mindex_t* mindex);
+void on_main_search_entry_changed(GtkEditable* editable, mindex_t* mindex);
 
 /* file menu callback functions */
 void on_open_menu_item_activate(GtkMenuItem *menuitem, mindex_t* mindex);
@@ -66,13 +126,12 @@ void error_message(const gchar* message);
 gboolean init_app(mindex_t* mindex);
 gchar* get_open_filename(mindex_t* mindex);
 gchar* get_save_filename(mindex_t* mindex);
-void load_database(mindex_t* mindex, gchar* filename);
+void load_database(mindex_t* mindex, gchar* filename); /* takes ownership of filename */
+void unload_database(mindex_t* mindex);
+void start_search(mindex_t* mindex, const gchar* text);
+void clear_search(mindex_t* mindex);
 void reset_default_status(mindex_t* mindex);
-GtkListStore* load_main();
-GtkListStore* load_books();
-GtkListStore* load_movies();
-void setup_tree_main();
-void setup_tree_books();
-void setup_tree_movies();
+void wait_for_search(mindex_t* mindex);
+void setup_tree_main(mindex_t* mindex);
 
 #endif
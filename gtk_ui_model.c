@@ -0,0 +1,494 @@
+/* gtk_ui_model.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <gtk/gtk.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "log_funcs.h"
+#include "db_funcs.h"
+#include "gtk_ui_model.h"
+
+static void mindex_model_tree_model_init(GtkTreeModelIface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(MindexModel, mindex_model, G_TYPE_OBJECT,
+			G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL,
+					      mindex_model_tree_model_init))
+
+/* column layout, in the same order the old list stores used */
+static const GType main_columns[] = {
+  G_TYPE_UINT,   /* code     */
+  G_TYPE_STRING, /* type     */
+  G_TYPE_STRING, /* name     */
+  G_TYPE_STRING, /* location */
+  G_TYPE_STRING  /* update   */
+};
+
+static const GType book_columns[] = {
+  G_TYPE_UINT,   /* code         */
+  G_TYPE_STRING, /* type         */
+  G_TYPE_STRING, /* genre        */
+  G_TYPE_STRING, /* isbn         */
+  G_TYPE_STRING, /* title        */
+  G_TYPE_STRING, /* author_last  */
+  G_TYPE_STRING, /* author_first */
+  G_TYPE_STRING  /* author_rest  */
+};
+
+static const GType movie_columns[] = {
+  G_TYPE_UINT,   /* code     */
+  G_TYPE_STRING, /* type     */
+  G_TYPE_STRING, /* genre    */
+  G_TYPE_STRING, /* title    */
+  G_TYPE_STRING, /* director */
+  G_TYPE_STRING, /* studio   */
+  G_TYPE_INT     /* rating   */
+};
+
+static gsize row_size(model_kind_t kind) {
+  switch (kind) {
+  case MODEL_BOOKS:
+    return sizeof(book_t);
+  case MODEL_MOVIES:
+    return sizeof(movie_t);
+  default:
+    return sizeof(media_t);
+  }
+}
+
+/* finds the code that page p starts after, seeking forward from the last
+ * page we know about if need be.  Only codes are read while seeking, so
+ * jumping to the bottom of a big table doesn't drag every row through the
+ * cache, but it does step over every code on the way: one seek() per page
+ * and O(rows) in all.  The loader walks every page key in the background
+ * for the same reason, so this is only slow until it has finished.
+ */
+static gboolean model_key(MindexModel* model, guint p, uint32_t* key) {
+  uint32_t code;
+  int retval;
+
+  while (model->keys->len <= p) {
+    if (model->keys->len == 1) {
+      /* page 0 starts at the top of the table */
+      switch (model->kind) {
+      case MODEL_BOOKS:
+	retval = seek_books(&code, NULL, MODEL_PAGE_SIZE - 1);
+	break;
+      case MODEL_MOVIES:
+	retval = seek_movies(&code, NULL, MODEL_PAGE_SIZE - 1);
+	break;
+      default:
+	retval = seek(&code, NULL, MODEL_PAGE_SIZE - 1);
+      }
+    } else {
+      uint32_t prev = g_array_index(model->keys, uint32_t, model->keys->len - 1);
+      switch (model->kind) {
+      case MODEL_BOOKS:
+	retval = seek_books(&code, &prev, MODEL_PAGE_SIZE - 1);
+	break;
+      case MODEL_MOVIES:
+	retval = seek_movies(&code, &prev, MODEL_PAGE_SIZE - 1);
+	break;
+      default:
+	retval = seek(&code, &prev, MODEL_PAGE_SIZE - 1);
+      }
+    }
+
+    if (retval != MI_EXIT_OK) {
+      log_debug(ERROR, "model_key(): could not seek to page");
+      return FALSE;
+    }
+    g_array_append_val(model->keys, code);
+  }
+
+  *key = g_array_index(model->keys, uint32_t, p);
+  return TRUE;
+}
+
+/* a model over a list of codes (search results) has no keys to seek on,
+ * each row is fetched by its code instead
+ */
+static model_page_t* model_load_codes(MindexModel* model, model_page_t* slot, guint p) {
+  guint first = p * MODEL_PAGE_SIZE;
+  guint rows = MIN(MODEL_PAGE_SIZE, model->n_rows - first);
+  gsize size = row_size(model->kind);
+  gpointer row;
+  int retval;
+
+  for (guint i = 0; i < rows; i++) {
+    row = (gchar*)slot->data + i * size;
+    switch (model->kind) {
+    case MODEL_BOOKS:
+      retval = fetch_book(row, model->codes[first + i]);
+      break;
+    case MODEL_MOVIES:
+      retval = fetch_movie(row, model->codes[first + i]);
+      break;
+    default:
+      retval = fetch(row, model->codes[first + i]);
+    }
+
+    /* deleted since the search ran, leave it blank */
+    if (retval != MI_EXIT_OK)
+      memset(row, 0, size);
+  }
+
+  slot->page = p;
+  slot->rows = rows;
+  return slot;
+}
+
+static model_page_t* model_load_page(MindexModel* model, guint p) {
+  model_page_t* slot = &model->cache[0];
+  uint32_t key;
+  uint32_t rows = 0;
+  const uint32_t* after = NULL;
+  int retval;
+
+  /* evict whatever was used least recently */
+  for (int i = 1; i < MODEL_CACHE_PAGES; i++) {
+    if (model->cache[i].used < slot->used)
+      slot = &model->cache[i];
+  }
+
+  if (slot->data == NULL)
+    slot->data = g_malloc(row_size(model->kind) * MODEL_PAGE_SIZE);
+
+  if (model->codes != NULL)
+    return model_load_codes(model, slot, p);
+
+  if (p > 0) {
+    if (!model_key(model, p, &key)) return NULL;
+    after = &key;
+  }
+
+  switch (model->kind) {
+  case MODEL_BOOKS:
+    retval = page_books(slot->data, &rows, after, MODEL_PAGE_SIZE);
+    break;
+  case MODEL_MOVIES:
+    retval = page_movies(slot->data, &rows, after, MODEL_PAGE_SIZE);
+    break;
+  default:
+    retval = page(slot->data, &rows, after, MODEL_PAGE_SIZE);
+  }
+
+  if (retval == MI_EXIT_ERROR) {
+    log_debug(ERROR, "model_load_page(): could not load page");
+    slot->page = -1;
+    slot->used = 0;
+    return NULL;
+  }
+
+  slot->page = p;
+  slot->rows = rows;
+
+  /* a full page hands us the key of the next one for free */
+  if (rows == MODEL_PAGE_SIZE && model->keys->len == p + 1) {
+    uint32_t next;
+    switch (model->kind) {
+    case MODEL_BOOKS:
+      next = ((book_t*)slot->data)[rows - 1].code;
+      break;
+    case MODEL_MOVIES:
+      next = ((movie_t*)slot->data)[rows - 1].code;
+      break;
+    default:
+      next = ((media_t*)slot->data)[rows - 1].code;
+    }
+    g_array_append_val(model->keys, next);
+  }
+
+  return slot;
+}
+
+static gpointer model_row(MindexModel* model, guint index) {
+  model_page_t* slot = NULL;
+  guint p = index / MODEL_PAGE_SIZE;
+  guint offset = index % MODEL_PAGE_SIZE;
+
+  if (index >= model->n_rows) return NULL;
+
+  for (int i = 0; i < MODEL_CACHE_PAGES; i++) {
+    if (model->cache[i].page == (gint)p) {
+      slot = &model->cache[i];
+      break;
+    }
+  }
+
+  if (slot == NULL && (slot = model_load_page(model, p)) == NULL)
+    return NULL;
+
+  slot->used = ++model->tick;
+  if (offset >= slot->rows) return NULL;
+
+  return (gchar*)slot->data + offset * row_size(model->kind);
+}
+
+/* GtkTreeModel implementation */
+static GtkTreeModelFlags model_get_flags(GtkTreeModel* tree_model) {
+  return GTK_TREE_MODEL_LIST_ONLY | GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+static gint model_get_n_columns(GtkTreeModel* tree_model) {
+  switch (MINDEX_MODEL(tree_model)->kind) {
+  case MODEL_BOOKS:
+    return G_N_ELEMENTS(book_columns);
+  case MODEL_MOVIES:
+    return G_N_ELEMENTS(movie_columns);
+  default:
+    return G_N_ELEMENTS(main_columns);
+  }
+}
+
+static GType model_get_column_type(GtkTreeModel* tree_model, gint index) {
+  g_return_val_if_fail(index >= 0 && index < model_get_n_columns(tree_model), G_TYPE_INVALID);
+
+  switch (MINDEX_MODEL(tree_model)->kind) {
+  case MODEL_BOOKS:
+    return book_columns[index];
+  case MODEL_MOVIES:
+    return movie_columns[index];
+  default:
+    return main_columns[index];
+  }
+}
+
+static gboolean model_get_iter(GtkTreeModel* tree_model, GtkTreeIter* iter, GtkTreePath* path) {
+  MindexModel* model = MINDEX_MODEL(tree_model);
+  gint index;
+
+  if (gtk_tree_path_get_depth(path) != 1) return FALSE;
+
+  index = gtk_tree_path_get_indices(path)[0];
+  if (index < 0 || (guint)index >= model->n_rows) return FALSE;
+
+  iter->stamp = model->stamp;
+  iter->user_data = GUINT_TO_POINTER(index);
+  return TRUE;
+}
+
+static GtkTreePath* model_get_path(GtkTreeModel* tree_model, GtkTreeIter* iter) {
+  GtkTreePath* path;
+
+  g_return_val_if_fail(iter->stamp == MINDEX_MODEL(tree_model)->stamp, NULL);
+
+  path = gtk_tree_path_new();
+  gtk_tree_path_append_index(path, GPOINTER_TO_UINT(iter->user_data));
+  return path;
+}
+
+static void model_get_value(GtkTreeModel* tree_model, GtkTreeIter* iter, gint column, GValue* value) {
+  MindexModel* model = MINDEX_MODEL(tree_model);
+  gpointer row;
+  char time_buffer[TIME_STRING_SIZE];
+
+  g_return_if_fail(iter->stamp == model->stamp);
+
+  g_value_init(value, model_get_column_type(tree_model, column));
+
+  /* a row we can't read just shows up blank */
+  row = model_row(model, GPOINTER_TO_UINT(iter->user_data));
+  if (row == NULL) return;
+
+  switch (model->kind) {
+  case MODEL_MAIN: {
+    media_t* media = row;
+    switch (column) {
+    case 0: g_value_set_uint(value, media->code); break;
+    case 1: g_value_set_string(value, medium_string(media->type)); break;
+    case 2: g_value_set_string(value, media->name); break;
+    case 3: g_value_set_string(value, media->location); break;
+    case 4: g_value_set_string(value, time_format(media->update, time_buffer)); break;
+    }
+    break;
+  }
+  case MODEL_BOOKS: {
+    book_t* book = row;
+    switch (column) {
+    case 0: g_value_set_uint(value, book->code); break;
+    case 1: g_value_set_string(value, medium_string(book->type)); break;
+    case 2: g_value_set_string(value, genre_string(book->genre)); break;
+    case 3: g_value_set_string(value, book->isbn); break;
+    case 4: g_value_set_string(value, book->title); break;
+    case 5: g_value_set_string(value, book->author_last); break;
+    case 6: g_value_set_string(value, book->author_first); break;
+    case 7: g_value_set_string(value, book->author_rest); break;
+    }
+    break;
+  }
+  case MODEL_MOVIES: {
+    movie_t* movie = row;
+    switch (column) {
+    case 0: g_value_set_uint(value, movie->code); break;
+    case 1: g_value_set_string(value, medium_string(movie->type)); break;
+    case 2: g_value_set_string(value, genre_string(movie->genre)); break;
+    case 3: g_value_set_string(value, movie->title); break;
+    case 4: g_value_set_string(value, movie->director); break;
+    case 5: g_value_set_string(value, movie->studio); break;
+    case 6: g_value_set_int(value, movie->rating); break;
+    }
+    break;
+  }
+  }
+}
+
+static gboolean model_iter_next(GtkTreeModel* tree_model, GtkTreeIter* iter) {
+  MindexModel* model = MINDEX_MODEL(tree_model);
+  guint next = GPOINTER_TO_UINT(iter->user_data) + 1;
+
+  if (next >= model->n_rows) return FALSE;
+
+  iter->user_data = GUINT_TO_POINTER(next);
+  return TRUE;
+}
+
+static gboolean model_iter_nth_child(GtkTreeModel* tree_model, GtkTreeIter* iter,
+				     GtkTreeIter* parent, gint n) {
+  MindexModel* model = MINDEX_MODEL(tree_model);
+
+  /* it's a list, nothing has children */
+  if (parent != NULL) return FALSE;
+  if (n < 0 || (guint)n >= model->n_rows) return FALSE;
+
+  iter->stamp = model->stamp;
+  iter->user_data = GUINT_TO_POINTER(n);
+  return TRUE;
+}
+
+static gboolean model_iter_children(GtkTreeModel* tree_model, GtkTreeIter* iter, GtkTreeIter* parent) {
+  return model_iter_nth_child(tree_model, iter, parent, 0);
+}
+
+static gboolean model_iter_has_child(GtkTreeModel* tree_model, GtkTreeIter* iter) {
+  return FALSE;
+}
+
+static gint model_iter_n_children(GtkTreeModel* tree_model, GtkTreeIter* iter) {
+  if (iter != NULL) return 0;
+  return MINDEX_MODEL(tree_model)->n_rows;
+}
+
+static gboolean model_iter_parent(GtkTreeModel* tree_model, GtkTreeIter* iter, GtkTreeIter* child) {
+  return FALSE;
+}
+
+static void mindex_model_tree_model_init(GtkTreeModelIface* iface) {
+  iface->get_flags       = model_get_flags;
+  iface->get_n_columns   = model_get_n_columns;
+  iface->get_column_type = model_get_column_type;
+  iface->get_iter        = model_get_iter;
+  iface->get_path        = model_get_path;
+  iface->get_value       = model_get_value;
+  iface->iter_next       = model_iter_next;
+  iface->iter_children   = model_iter_children;
+  iface->iter_has_child  = model_iter_has_child;
+  iface->iter_n_children = model_iter_n_children;
+  iface->iter_nth_child  = model_iter_nth_child;
+  iface->iter_parent     = model_iter_parent;
+}
+
+/* GObject housekeeping */
+static void mindex_model_finalize(GObject* object) {
+  MindexModel* model = MINDEX_MODEL(object);
+
+  for (int i = 0; i < MODEL_CACHE_PAGES; i++)
+    g_free(model->cache[i].data);
+  g_array_free(model->keys, TRUE);
+  g_free(model->codes);
+
+  G_OBJECT_CLASS(mindex_model_parent_class)->finalize(object);
+}
+
+static void mindex_model_class_init(MindexModelClass* klass) {
+  G_OBJECT_CLASS(klass)->finalize = mindex_model_finalize;
+}
+
+static void mindex_model_init(MindexModel* model) {
+  uint32_t none = 0;
+
+  model->stamp = g_random_int();
+  model->n_rows = 0;
+  model->codes = NULL;
+  model->tick = 0;
+
+  /* slot 0 is a placeholder, page 0 has nothing before it */
+  model->keys = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+  g_array_append_val(model->keys, none);
+
+  for (int i = 0; i < MODEL_CACHE_PAGES; i++) {
+    model->cache[i].page = -1;
+    model->cache[i].rows = 0;
+    model->cache[i].used = 0;
+    model->cache[i].data = NULL;
+  }
+}
+
+MindexModel* mindex_model_new(model_kind_t kind) {
+  uint32_t total;
+  int retval;
+
+  switch (kind) {
+  case MODEL_BOOKS:
+    retval = count_books(&total);
+    break;
+  case MODEL_MOVIES:
+    retval = count_movies(&total);
+    break;
+  default:
+    retval = count_items(&total);
+  }
+
+  if (retval != MI_EXIT_OK) {
+    log_debug(ERROR, "mindex_model_new(): could not count rows");
+    return NULL;
+  }
+
+  return mindex_model_new_sized(kind, total);
+}
+
+MindexModel* mindex_model_new_sized(model_kind_t kind, guint n_rows) {
+  MindexModel* model;
+
+  model = g_object_new(MINDEX_TYPE_MODEL, NULL);
+  model->kind = kind;
+  model->n_rows = n_rows;
+
+  return model;
+}
+
+MindexModel* mindex_model_new_codes(model_kind_t kind, uint32_t* codes, guint n_codes) {
+  MindexModel* model;
+
+  model = mindex_model_new_sized(kind, n_codes);
+  model->codes = codes;
+
+  return model;
+}
+
+guint mindex_model_get_n_rows(MindexModel* model) {
+  return model->n_rows;
+}
+
+void mindex_model_add_keys(MindexModel* model, guint first, const uint32_t* keys, guint n) {
+  /* skip anything model_key() already seeked to while the user scrolled */
+  for (guint i = 0; i < n; i++) {
+    if (first + i == model->keys->len)
+      g_array_append_val(model->keys, keys[i]);
+  }
+}
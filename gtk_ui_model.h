@@ -0,0 +1,82 @@
+#ifndef __GTK_UI_MODEL_H__
+#define __GTK_UI_MODEL_H__
+
+/* gtk_ui_model.h - part of mindex
+ *
+ * A GtkTreeModel that reads straight out of the database a page at a time
+ * instead of copying every row into a GtkListStore.  Rows are addressed by
+ * their position in code order; pages are located with keyset seeks and the
+ * last few are kept in a small cache, so memory use does not grow with the
+ * size of the catalogue.  A model can also be built over a list of codes,
+ * which is how search results are shown.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define MODEL_PAGE_SIZE   64 /* rows fetched per query */
+#define MODEL_CACHE_PAGES 16 /* pages kept around, least recently used goes first */
+
+#define MINDEX_TYPE_MODEL     (mindex_model_get_type())
+#define MINDEX_MODEL(obj)     (G_TYPE_CHECK_INSTANCE_CAST((obj), MINDEX_TYPE_MODEL, MindexModel))
+#define MINDEX_IS_MODEL(obj)  (G_TYPE_CHECK_INSTANCE_TYPE((obj), MINDEX_TYPE_MODEL))
+
+/* typedefs */
+typedef enum {
+  MODEL_MAIN,
+  MODEL_BOOKS,
+  MODEL_MOVIES
+} model_kind_t;
+
+typedef struct {
+  gint     page;  /* page held in this slot, -1 if empty */
+  guint    rows;  /* valid rows, less than MODEL_PAGE_SIZE on the last page */
+  guint64  used;  /* tick of last access for eviction */
+  gpointer data;  /* MODEL_PAGE_SIZE media_t, book_t or movie_t */
+} model_page_t;
+
+typedef struct {
+  GObject parent;
+
+  model_kind_t kind;
+  gint         stamp;
+  guint        n_rows;
+  GArray*      keys;   /* keys[p] is the last code before page p, for p >= 1 */
+  uint32_t*    codes;  /* rows by code instead of by table order, NULL if unused */
+  guint64      tick;
+  model_page_t cache[MODEL_CACHE_PAGES];
+} MindexModel;
+
+typedef struct {
+  GObjectClass parent_class;
+} MindexModelClass;
+
+/* prototypes */
+GType        mindex_model_get_type(void);
+MindexModel* mindex_model_new(model_kind_t kind);  /* NULL if the table can't be counted */
+MindexModel* mindex_model_new_sized(model_kind_t kind, guint n_rows); /* row count already known */
+MindexModel* mindex_model_new_codes(model_kind_t kind, uint32_t* codes, guint n_codes);
+                                   /* just the rows in codes, which the model takes
+				    * over and g_free()s
+				    */
+guint        mindex_model_get_n_rows(MindexModel* model);
+void         mindex_model_add_keys(MindexModel* model, guint first, const uint32_t* keys, guint n);
+                                   /* hands over page keys found elsewhere, keys[0] being
+				    * the key of page first
+				    */
+
+#endif /* __GTK_UI_MODEL_H__ */
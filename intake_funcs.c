@@ -0,0 +1,332 @@
+/* intake_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "intake_funcs.h"
+
+#define INTAKE_PAGE 256 /* rows read per page() while loading */
+
+void intake_init(intake_t* intake, const char* location, double window, uint32_t batch,
+		 double flush) {
+  memset(intake,0,sizeof(intake_t));
+  snprintf(intake->location,sizeof(intake->location),"%s",location);
+  intake->window = window;
+  intake->batch = (batch) ? batch : 1;
+  intake->flush = flush;
+  /* a key of 0 is a code, so the empty ring is marked by an old time */
+  for (int i = 0; i < INTAKE_RECENT; i++)
+    intake->recent[i].when = -1e9;
+}
+
+void intake_free(intake_t* intake) {
+  free(intake->keys);
+  free(intake->new_items);
+  free(intake->new_details);
+  free(intake->seen);
+  intake->keys = NULL;
+  intake->new_items = NULL;
+  intake->new_details = NULL;
+  intake->seen = NULL;
+  intake->num_keys = intake->size_keys = 0;
+  intake->num_new = intake->size_new = 0;
+  intake->num_seen = intake->size_seen = 0;
+}
+
+/* growable arrays, doubling */
+static int grow(void** array, size_t* size, size_t needed, size_t item) {
+  size_t bigger = (*size) ? *size : 64;
+  void* grown;
+
+  if (needed <= *size) return MI_EXIT_OK;
+  while (bigger < needed) bigger *= 2;
+  if ((grown = realloc(*array,bigger * item)) == NULL) {
+    log_debug(ERROR,"intake: out of memory");
+    return MI_EXIT_ERROR;
+  }
+  *array = grown;
+  *size = bigger;
+  return MI_EXIT_OK;
+}
+
+/* the index
+ * a sorted array, filled in one go and sorted once by intake_load(), then
+ * kept sorted as new books are added; copies of a book share its ISBN and
+ * the lowest code wins, as in fetch_book_by_isbn()
+ */
+static int key_compare(const void* a, const void* b) {
+  const intake_key_t* x = a;
+  const intake_key_t* y = b;
+
+  if (x->key != y->key) return (x->key < y->key) ? -1 : 1;
+  return (x->code < y->code) ? -1 : (x->code > y->code);
+}
+
+/* where key is, or would go */
+static size_t key_find(const intake_t* intake, uint64_t key) {
+  size_t low = 0;
+  size_t high = intake->num_keys;
+  size_t mid;
+
+  while (low < high) {
+    mid = low + (high - low) / 2;
+    if (intake->keys[mid].key < key) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+static int key_lookup(const intake_t* intake, uint64_t key, uint32_t* code) {
+  size_t i = key_find(intake,key);
+
+  if (i == intake->num_keys || intake->keys[i].key != key) return 0;
+  *code = intake->keys[i].code;
+  return 1;
+}
+
+static int key_insert(intake_t* intake, uint64_t key, uint32_t code) {
+  size_t i = key_find(intake,key);
+
+  if (i < intake->num_keys && intake->keys[i].key == key) return MI_EXIT_OK;
+  if (grow((void**)&intake->keys,&intake->size_keys,intake->num_keys + 1,
+	   sizeof(intake_key_t)) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  memmove(&intake->keys[i + 1],&intake->keys[i],
+	  (intake->num_keys - i) * sizeof(intake_key_t));
+  intake->keys[i].key = key;
+  intake->keys[i].code = code;
+  intake->num_keys++;
+  return MI_EXIT_OK;
+}
+
+static int key_append(intake_t* intake, uint64_t key, uint32_t code) {
+  if (grow((void**)&intake->keys,&intake->size_keys,intake->num_keys + 1,
+	   sizeof(intake_key_t)) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  intake->keys[intake->num_keys].key = key;
+  intake->keys[intake->num_keys].code = code;
+  intake->num_keys++;
+  return MI_EXIT_OK;
+}
+
+int intake_load(intake_t* intake) {
+  char buffer[128];
+  media_t items[INTAKE_PAGE];
+  book_t books[INTAKE_PAGE];
+  uint32_t num_results;
+  uint32_t after;
+  uint64_t isbn13;
+  size_t kept = 0;
+  int retval;
+
+  intake->num_keys = 0;
+  retval = page(items,&num_results,NULL,INTAKE_PAGE);
+  while (retval == MI_EXIT_OK) {
+    for (uint32_t i = 0; i < num_results; i++)
+      if (key_append(intake,items[i].code,items[i].code) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    after = items[num_results - 1].code;
+    retval = page(items,&num_results,&after,INTAKE_PAGE);
+  }
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+
+  retval = page_books(books,&num_results,NULL,INTAKE_PAGE);
+  while (retval == MI_EXIT_OK) {
+    for (uint32_t i = 0; i < num_results; i++) {
+      if (isbn_normalise(books[i].isbn,&isbn13) == MI_EXIT_OK &&
+	  key_append(intake,isbn13,books[i].code) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    }
+    after = books[num_results - 1].code;
+    retval = page_books(books,&num_results,&after,INTAKE_PAGE);
+  }
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+
+  /* sorted by key then code, the first of each key is kept */
+  qsort(intake->keys,intake->num_keys,sizeof(intake_key_t),key_compare);
+  for (size_t i = 0; i < intake->num_keys; i++)
+    if (kept == 0 || intake->keys[i].key != intake->keys[kept - 1].key)
+      intake->keys[kept++] = intake->keys[i];
+  intake->num_keys = kept;
+
+  sprintf(buffer,"intake_load(): %zu codes and isbns",kept);
+  log_debug(INFO,buffer);
+  return MI_EXIT_OK;
+}
+
+/* repeats, a held trigger or a second pass over the same item */
+static int repeated(intake_t* intake, uint64_t key, double now) {
+  for (int i = 0; i < INTAKE_RECENT; i++) {
+    if (intake->recent[i].key == key && now - intake->recent[i].when < intake->window) {
+      intake->recent[i].when = now;
+      return 1;
+    }
+  }
+  intake->recent[intake->next_recent].key = key;
+  intake->recent[intake->next_recent].when = now;
+  intake->next_recent = (intake->next_recent + 1) % INTAKE_RECENT;
+  return 0;
+}
+
+static void queued(intake_t* intake, double now) {
+  if (intake->num_new + intake->num_seen == 1) intake->oldest = now;
+}
+
+static int queue_seen(intake_t* intake, uint32_t code, double now) {
+  if (grow((void**)&intake->seen,&intake->size_seen,intake->num_seen + 1,
+	   sizeof(uint32_t)) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  intake->seen[intake->num_seen++] = code;
+  queued(intake,now);
+  return MI_EXIT_OK;
+}
+
+/* a new book is named after its ISBN until someone fills it in */
+static int queue_new(intake_t* intake, uint64_t isbn13, double now, uint32_t* code) {
+  size_t size = intake->size_new;
+  media_t* item;
+  book_t* detail;
+
+  if (grow((void**)&intake->new_items,&size,intake->num_new + 1,sizeof(media_t)) != MI_EXIT_OK ||
+      grow((void**)&intake->new_details,&intake->size_new,intake->num_new + 1,
+	   sizeof(book_t)) != MI_EXIT_OK) return MI_EXIT_ERROR;
+
+  item = &intake->new_items[intake->num_new];
+  detail = &intake->new_details[intake->num_new];
+  memset(item,0,sizeof(media_t));
+  memset(detail,0,sizeof(book_t));
+  item->type = book;
+  sprintf(item->name,"ISBN %013" PRIu64,isbn13);
+  strcpy(item->location,intake->location);
+  item->code = code_gen(book,item->name);
+  sprintf(detail->isbn,"%013" PRIu64,isbn13);
+
+  if (key_insert(intake,isbn13,item->code) != MI_EXIT_OK ||
+      key_insert(intake,item->code,item->code) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  intake->num_new++;
+  queued(intake,now);
+  *code = item->code;
+  return MI_EXIT_OK;
+}
+
+int intake_scan(intake_t* intake, const char* text, double now, uint32_t* code) {
+  char scan[64];
+  size_t len;
+  uint64_t key = 0;
+  uint64_t isbn13;
+  int digits;
+  int kind;
+
+  *code = 0;
+  intake->stats.scans++;
+
+  while (isspace((unsigned char)*text)) text++;
+  for (len = strlen(text); len > 0 && isspace((unsigned char)text[len - 1]); len--);
+  if (len == 0 || len >= sizeof(scan)) {
+    intake->stats.bad++;
+    return INTAKE_BAD;
+  }
+  memcpy(scan,text,len);
+  scan[len] = '\0';
+  digits = (strspn(scan,"0123456789") == len && len <= 10);
+  if (digits) key = strtoull(scan,NULL,10);
+
+  /* a known code first, ten digits can also pass as an ISBN-10 */
+  if (digits && key <= UINT32_MAX && key_lookup(intake,key,code))
+    kind = INTAKE_KNOWN;
+  else if (isbn_normalise(scan,&isbn13) == MI_EXIT_OK) {
+    key = isbn13;
+    kind = (key_lookup(intake,key,code)) ? INTAKE_KNOWN : INTAKE_NEW;
+  }
+  else if (digits && key <= UINT32_MAX)
+    kind = INTAKE_UNKNOWN;
+  else {
+    intake->stats.bad++;
+    return INTAKE_BAD;
+  }
+
+  if (repeated(intake,key,now)) {
+    *code = 0;
+    intake->stats.duplicates++;
+    return INTAKE_DUPLICATE;
+  }
+
+  switch (kind) {
+  case INTAKE_KNOWN:
+    if (queue_seen(intake,*code,now) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    intake->stats.known++;
+    break;
+  case INTAKE_NEW:
+    if (queue_new(intake,key,now,code) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    intake->stats.added++;
+    break;
+  default:
+    intake->stats.unknown++;
+  }
+  return kind;
+}
+
+int intake_due(const intake_t* intake, double now) {
+  return intake_wait(intake,now) == 0;
+}
+
+double intake_wait(const intake_t* intake, double now) {
+  size_t waiting = intake->num_new + intake->num_seen;
+  double left;
+
+  if (waiting == 0) return -1;
+  if (waiting >= intake->batch) return 0;
+  left = intake->oldest + intake->flush - now;
+  return (left > 0) ? left : 0;
+}
+
+/* the new books go first, so a checkout queued after one finds it */
+int intake_flush(intake_t* intake) {
+  char buffer[128];
+  size_t stored = 0;
+  size_t num_unknown = 0;
+  int retval;
+
+  if (intake->num_new + intake->num_seen == 0) return MI_NO_RESULTS;
+
+  if (intake->num_new) {
+    retval = store_book_item_batch(intake->new_items,intake->new_details,intake->num_new,&stored);
+    if (retval == MI_EXIT_ERROR) {
+      log_debug(ERROR,"intake_flush(): could not store the new books");
+      return MI_EXIT_ERROR;
+    }
+    intake->stats.stored += stored;
+    intake->num_new = 0;
+  }
+
+  if (intake->num_seen) {
+    retval = checkout_batch(intake->seen,intake->num_seen,intake->location,NULL,&num_unknown);
+    if (retval == MI_EXIT_ERROR) {
+      log_debug(ERROR,"intake_flush(): could not check out the scanned items");
+      return MI_EXIT_ERROR;
+    }
+    intake->stats.checked_out += intake->num_seen - num_unknown;
+    intake->num_seen = 0;
+  }
+
+  intake->stats.batches++;
+  sprintf(buffer,"intake_flush(): %zu stored, batch %u",stored,intake->stats.batches);
+  log_debug(INFO,buffer);
+  return MI_EXIT_OK;
+}
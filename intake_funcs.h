@@ -0,0 +1,120 @@
+#ifndef __INTAKE_FUNCS_H__
+#define __INTAKE_FUNCS_H__
+
+/* intake_funcs.h - part of mindex
+ *
+ * Barcode intake: scans are answered from an in-memory index of every
+ * code and ISBN in the catalogue, so the operator never waits on the
+ * database.  Known items are checked out to the intake location, unknown
+ * ISBNs become new books named after their ISBN, and a repeat of the same
+ * barcode within the window is dropped.  What a scan decides is queued
+ * and written by intake_flush() in one transaction per kind, whenever
+ * intake_due() says a batch is full or old enough.
+ *
+ * Times are seconds from any fixed point (a monotonic clock), passed in
+ * by the caller.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define INTAKE_RECENT 64    /* scans remembered for dropping repeats */
+#define INTAKE_WINDOW 2.0   /* seconds a repeat is dropped for */
+#define INTAKE_BATCH  64    /* queued writes that make a batch due */
+#define INTAKE_FLUSH  0.25  /* seconds the oldest queued write may wait */
+
+/* what a scan was */
+#define INTAKE_KNOWN     0 /* in the catalogue, checkout queued */
+#define INTAKE_NEW       1 /* an ISBN not in the catalogue, new book queued */
+#define INTAKE_DUPLICATE 2 /* seen within the window, nothing done */
+#define INTAKE_UNKNOWN   3 /* a code that isn't in the catalogue */
+#define INTAKE_BAD       4 /* neither a code nor an ISBN */
+
+/* typedefs */
+
+/* index keys are codes (< 2^32) and ISBN-13s (>= 978 * 10^10), which can't
+ * collide, both mapping to an item code
+ */
+typedef struct {
+  uint64_t key;
+  uint32_t code;
+} intake_key_t;
+
+typedef struct {
+  uint64_t key;
+  double   when;
+} intake_scan_t;
+
+typedef struct {
+  uint32_t scans;
+  uint32_t known;
+  uint32_t added;
+  uint32_t duplicates;
+  uint32_t unknown;
+  uint32_t bad;
+  uint32_t batches;
+  uint32_t stored;      /* rows written by the flushes */
+  uint32_t checked_out;
+} intake_stats_t;
+
+typedef struct {
+  char           location[121];
+  double         window;
+  uint32_t       batch;
+  double         flush;
+
+  intake_key_t*  keys;           /* sorted by key */
+  size_t         num_keys;
+  size_t         size_keys;
+
+  intake_scan_t  recent[INTAKE_RECENT]; /* a ring, next is the oldest */
+  size_t         next_recent;
+
+  media_t*       new_items;      /* queued, with new_details */
+  book_t*        new_details;
+  size_t         num_new;
+  size_t         size_new;
+  uint32_t*      seen;           /* codes queued for checkout */
+  size_t         num_seen;
+  size_t         size_seen;
+  double         oldest;         /* when the first queued write was queued */
+
+  intake_stats_t stats;
+} intake_t;
+
+/* prototypes */
+void intake_init (intake_t* intake, const char* location, double window, uint32_t batch,
+		  double flush);
+int  intake_load (intake_t* intake);              /* reads every code and ISBN from the open
+						   * database into the index
+						   */
+void intake_free (intake_t* intake);
+int  intake_scan (intake_t* intake, const char* text, double now, uint32_t* code);
+                                                  /* one scan, INTAKE_* and the item's
+						   * code (0 unless KNOWN or NEW), never
+						   * touches the database
+						   */
+int  intake_due  (const intake_t* intake, double now);
+double intake_wait(const intake_t* intake, double now);
+                                                  /* seconds until a flush is due, 0 if
+						   * one is, -1 if nothing is queued
+						   */
+int  intake_flush(intake_t* intake);              /* writes the queue, MI_EXIT_ERROR leaves
+						   * it queued to try again
+						   */
+
+#endif /* __INTAKE_FUNCS_H__ */
@@ -0,0 +1,1022 @@
+/* mindex.c - part of mindex
+ *
+ * Command line front end, one subcommand per job:
+ *
+ *   mindex [--time] get DATABASE [-b|-m] CODE...
+ *   mindex [--time] put DATABASE [-u] TYPE NAME LOCATION
+ *   mindex [--time] search DATABASE [-n max] [-l location] [-t type] [WORD...]
+ *   mindex [--time] checkout DATABASE LOCATION CODE...
+ *   mindex [--time] touch DATABASE CODE...
+ *   mindex [--time] delete DATABASE CODE...
+ *   mindex [--time] import DATABASE [FILE]
+ *   mindex [--time] export DATABASE [FILE]
+ *   mindex [--time] stats DATABASE
+ *   mindex [--time] media DATABASE [NAME...]
+ *   mindex [--time] genres DATABASE [NAME...]
+ *   mindex [--time] batch DATABASE
+ *   mindex intake DATABASE [-l location] [-w ms] [-b batch] [-f ms] [DEVICE]
+ *   mindex snapshot [-s pages] [-q] SOURCE DEST
+ *   mindex follow DATABASE [-b rows] [-i ms] [-o] LOG
+ *
+ * Rows are written one to a line, fields separated by tabs, main rows as
+ * code, type, name, location and update time; import reads the same.
+ *
+ * media and genres list the catalogue's media by id and genres by bit,
+ * adding any NAMEs it doesn't have yet first.
+ *
+ * batch keeps the database open and reads the other commands, without
+ * DATABASE, from stdin one to a line.  Fields are split on tabs, or on
+ * spaces when a line has no tabs, and each command's output ends with a
+ * line of "." and its result, e.g. ". MI_EXIT_OK", followed by the
+ * seconds it took with --time.  Without batch --time goes to stderr.
+ * import in batch needs its FILE, as stdin is the batch itself.
+ *
+ * --log LOG, before the command, records every commit it makes in the
+ * change log LOG (see repl_funcs.h), as mindexd -r does.  follow keeps
+ * DATABASE, a read-only copy seeded by snapshot, up to date from LOG:
+ * it applies up to -b rows a step, printing a line of the last record
+ * applied, rows applied and bytes and seconds behind, and looks again
+ * every -i ms once caught up until SIGINT or SIGTERM, or exits then with
+ * -o.  Where it has got to is kept in DATABASE-follow.
+ *
+ * intake reads barcode scans, a line each, from DEVICE (a tty, FIFO or
+ * file) or stdin and answers each at once with a line of what it was,
+ * its code and the scan, while the writes are made in batches; see
+ * intake_funcs.h.  Its counts and scan latency go to stderr at the end.
+ *
+ * Exit status is 0 when a command worked, 1 when it failed, 2 for bad
+ * arguments and 3 when it found nothing.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L /* getopt(), clock_gettime() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "intake_funcs.h"
+#include "proto_funcs.h"
+#include "repl_funcs.h"
+
+/* defines */
+#define SNAPSHOT_PAGES 256  /* pages per backup step unless -s says otherwise */
+#define SEARCH_MAX     1000 /* rows a word search returns unless -n says otherwise */
+#define EXPORT_PAGE    256  /* rows read per page() */
+#define LINE_SIZE      1024 /* longest batch or import line */
+#define LINE_FIELDS    64
+#define FOLLOW_WAIT    1000 /* ms between looks at a caught up log unless -i says otherwise */
+#define CLI_USAGE      -3   /* a command's arguments were wrong, after MI_* */
+
+/* typedefs */
+
+/* main() opens DATABASE with preset (read only if asked) before run();
+ * a command with no preset opens its own files and takes no DATABASE
+ */
+typedef struct {
+  const char* name;
+  int (*run)(int argc, char** argv);
+  const char* usage;
+  const char* preset;
+  int         read_only;
+} command_t;
+
+/* prototypes */
+int cmd_get(int argc, char** argv);
+int cmd_put(int argc, char** argv);
+int cmd_search(int argc, char** argv);
+int cmd_checkout(int argc, char** argv);
+int cmd_touch(int argc, char** argv);
+int cmd_delete(int argc, char** argv);
+int cmd_import(int argc, char** argv);
+int cmd_export(int argc, char** argv);
+int cmd_stats(int argc, char** argv);
+int cmd_media(int argc, char** argv);
+int cmd_genres(int argc, char** argv);
+int cmd_batch(int argc, char** argv);
+int cmd_intake(int argc, char** argv);
+int cmd_snapshot(int argc, char** argv);
+int cmd_follow(int argc, char** argv);
+
+static const command_t commands[] = {
+  { "get",      cmd_get,      "DATABASE [-b|-m] CODE...",           "default",     1 },
+  { "put",      cmd_put,      "DATABASE [-u] TYPE NAME LOCATION",   "default",     0 },
+  { "search",   cmd_search,   "DATABASE [-n max] [-l location] [-t type] [WORD...]",
+    "default", 1 },
+  { "checkout", cmd_checkout, "DATABASE LOCATION CODE...",          "default",     0 },
+  { "touch",    cmd_touch,    "DATABASE CODE...",                   "default",     0 },
+  { "delete",   cmd_delete,   "DATABASE CODE...",                   "default",     0 },
+  { "import",   cmd_import,   "DATABASE [FILE]",                    "bulk-import", 0 },
+  { "export",   cmd_export,   "DATABASE [FILE]",                    "default",     1 },
+  { "stats",    cmd_stats,    "DATABASE",                           "default",     1 },
+  { "media",    cmd_media,    "DATABASE [NAME...]",                 "default",     0 },
+  { "genres",   cmd_genres,   "DATABASE [NAME...]",                 "default",     0 },
+  { "batch",    cmd_batch,    "DATABASE",                           "default",     0 },
+  { "intake",   cmd_intake,   "DATABASE [-l location] [-w ms] [-b batch] [-f ms] [DEVICE]",
+    "default", 0 },
+  { "snapshot", cmd_snapshot, "[-s pages] [-q] SOURCE DEST",        NULL,          0 },
+  { "follow",   cmd_follow,   "DATABASE [-b rows] [-i ms] [-o] LOG", "default",     0 }
+};
+#define NUM_COMMANDS (int)(sizeof(commands)/sizeof(commands[0]))
+
+/* globals */
+static int show_time = 0;
+static int in_batch = 0;  /* stdin is batch's own commands */
+static const char* change_log = NULL;
+static const char* database = NULL;
+static volatile sig_atomic_t stop = 0;
+
+void usage(const char* command) {
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    if (command == NULL || strcmp(command,commands[i].name) == 0)
+      fprintf(stderr,"usage: mindex %s%s%s %s\n",(commands[i].preset) ? "[--time] " : "",
+	      (commands[i].preset && !commands[i].read_only && commands[i].run != cmd_follow) ?
+	      "[--log LOG] " : "",commands[i].name,commands[i].usage);
+}
+
+const command_t* find_command(const char* name) {
+  for (int i = 0; i < NUM_COMMANDS; i++)
+    if (strcmp(name,commands[i].name) == 0) return &commands[i];
+  return NULL;
+}
+
+double now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int exit_status(int retval) {
+  switch (retval) {
+  case MI_EXIT_OK:
+  case MI_EXISTS:     return 0;
+  case MI_NO_RESULTS: return 3;
+  case CLI_USAGE:     return 2;
+  default:            return 1;
+  }
+}
+
+/* source files are opened read only so a copy can't change them */
+int open_source(const char* file) {
+  db_options_t options;
+
+  db_options_init(&options);
+  options.read_only = DB_READ_ONLY;
+  options.busy_timeout = 5000;
+  if (init_db_ex(file,&options) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: could not open %s\n",file);
+    return 1;
+  }
+  return 0;
+}
+
+int open_database(const char* file, const command_t* command) {
+  db_options_t options;
+
+  db_options_preset(&options,command->preset);
+  if (command->read_only) options.read_only = DB_READ_ONLY;
+  if (init_db_ex(file,&options) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: could not open %s\n",file);
+    return 1;
+  }
+  return 0;
+}
+
+/* arguments */
+int parse_code(const char* text, uint32_t* code) {
+  char* end;
+  unsigned long value = strtoul(text,&end,10);
+
+  if (*text == '\0' || *text == '-' || *end != '\0' || value > UINT32_MAX) {
+    fprintf(stderr,"mindex: %s is not a code\n",text);
+    return 1;
+  }
+  *code = (uint32_t)value;
+  return 0;
+}
+
+/* the arguments from optind on, MI_EXIT_ERROR if any isn't a code */
+int parse_codes(int argc, char** argv, uint32_t** codes, size_t* n) {
+  *n = (argc > optind) ? (size_t)(argc - optind) : 0;
+  if ((*codes = malloc(sizeof(uint32_t) * (*n ? *n : 1))) == NULL) return MI_EXIT_ERROR;
+  for (size_t i = 0; i < *n; i++) {
+    if (parse_code(argv[optind + i],&(*codes)[i])) {
+      free(*codes);
+      *codes = NULL;
+      return MI_EXIT_ERROR;
+    }
+  }
+  return MI_EXIT_OK;
+}
+
+/* rows, tab separated */
+void print_media(FILE* out, const media_t* item) {
+  char when[TIME_STRING_SIZE];
+
+  fprintf(out,"%u\t%s\t%s\t%s\t%s\n",item->code,medium_string(item->type),item->name,
+	  item->location,time_format_iso(item->update,when));
+}
+
+void print_book(const book_t* item) {
+  printf("%u\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",item->code,medium_string(item->type),
+	 genre_string(item->genre),item->isbn,item->title,item->author_last,
+	 item->author_first,item->author_rest);
+}
+
+void print_movie(const movie_t* item) {
+  printf("%u\t%s\t%s\t%s\t%s\t%s\t%d\n",item->code,medium_string(item->type),
+	 genre_string(item->genre),item->title,item->director,item->studio,item->rating);
+}
+
+void print_unknown(const uint32_t* codes, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    fprintf(stderr,"mindex: no item #%u\n",codes[i]);
+}
+
+/* get, in the order the codes were given, all in one fetch_many() */
+int cmd_get(int argc, char** argv) {
+  uint32_t* codes;
+  uint8_t* found;
+  void* items;
+  size_t n;
+  int table = 0;
+  int opt;
+  int retval;
+
+  while ((opt = getopt(argc,argv,"bm")) != -1) {
+    switch (opt) {
+    case 'b':
+      table = 1;
+      break;
+    case 'm':
+      table = 2;
+      break;
+    default:
+      usage("get");
+      return CLI_USAGE;
+    }
+  }
+  if (argc <= optind) {
+    usage("get");
+    return CLI_USAGE;
+  }
+  if (parse_codes(argc,argv,&codes,&n) != MI_EXIT_OK) return CLI_USAGE;
+
+  found = malloc(n);
+  items = malloc(n * ((table == 0) ? sizeof(media_t) :
+		      (table == 1) ? sizeof(book_t) : sizeof(movie_t)));
+  if (found == NULL || items == NULL) {
+    free(codes);
+    free(found);
+    free(items);
+    return MI_EXIT_ERROR;
+  }
+
+  switch (table) {
+  case 0:  retval = fetch_many(items,found,codes,n);        break;
+  case 1:  retval = fetch_many_books(items,found,codes,n);  break;
+  default: retval = fetch_many_movies(items,found,codes,n);
+  }
+  for (size_t i = 0; retval != MI_EXIT_ERROR && i < n; i++) {
+    if (!found[i])
+      print_unknown(&codes[i],1);
+    else if (table == 0)
+      print_media(stdout,(media_t*)items + i);
+    else if (table == 1)
+      print_book((book_t*)items + i);
+    else
+      print_movie((movie_t*)items + i);
+  }
+
+  free(codes);
+  free(found);
+  free(items);
+  return retval;
+}
+
+/* put, the code is made from the type and name as everywhere else */
+int cmd_put(int argc, char** argv) {
+  media_t item;
+  int replace = 0;
+  int opt;
+  int retval;
+
+  while ((opt = getopt(argc,argv,"u")) != -1) {
+    switch (opt) {
+    case 'u':
+      replace = 1;
+      break;
+    default:
+      usage("put");
+      return CLI_USAGE;
+    }
+  }
+  if (argc - optind != 3) {
+    usage("put");
+    return CLI_USAGE;
+  }
+  if (medium_parse(argv[optind],&item.type) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: no such type %s\n",argv[optind]);
+    return CLI_USAGE;
+  }
+  snprintf(item.name,sizeof(item.name),"%s",argv[optind + 1]);
+  snprintf(item.location,sizeof(item.location),"%s",argv[optind + 2]);
+  item.code = code_gen(item.type,item.name);
+
+  retval = (replace) ? update(&item) : store(&item);
+  if (retval == MI_EXIT_OK) printf("%u\n",item.code);
+  else if (retval == MI_EXISTS) fprintf(stderr,"mindex: #%u is already there\n",item.code);
+  return retval;
+}
+
+/* search, words go through search_text() and -l and -t through a filter,
+ * given both the word matches are filtered here
+ */
+int cmd_search(int argc, char** argv) {
+  char text[LINE_SIZE];
+  filter_t filter;
+  media_t* items = NULL;
+  uint32_t* codes;
+  uint8_t* found;
+  uint32_t num_results = 0;
+  uint32_t max = SEARCH_MAX;
+  const char* location = NULL;
+  medium_t type = 0;
+  int typed = 0;
+  int printed = 0;
+  int opt;
+  int retval;
+
+  while ((opt = getopt(argc,argv,"n:l:t:")) != -1) {
+    switch (opt) {
+    case 'n':
+      max = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'l':
+      location = optarg;
+      break;
+    case 't':
+      if (medium_parse(optarg,&type) != MI_EXIT_OK) {
+	fprintf(stderr,"mindex: no such type %s\n",optarg);
+	return CLI_USAGE;
+      }
+      typed = 1;
+      break;
+    default:
+      usage("search");
+      return CLI_USAGE;
+    }
+  }
+  if (max == 0 || (argc <= optind && location == NULL && !typed)) {
+    usage("search");
+    return CLI_USAGE;
+  }
+
+  if (argc <= optind) {
+    filter_init(&filter);
+    if (location) filter_text(&filter,F_LOCATION,OP_EQ,location);
+    if (typed) filter_int(&filter,F_TYPE,OP_EQ,type);
+    filter_order(&filter,F_SORT,0);
+    filter_limit(&filter,max,0);
+    if ((retval = search(&items,&num_results,&filter)) != MI_EXIT_OK) return retval;
+    for (uint32_t i = 0; i < num_results; i++)
+      print_media(stdout,&items[i]);
+    free(items);
+    return MI_EXIT_OK;
+  }
+
+  text[0] = '\0';
+  for (int i = optind; i < argc; i++) {
+    if (strlen(text) + strlen(argv[i]) + 2 > sizeof(text)) break;
+    if (i > optind) strcat(text," ");
+    strcat(text,argv[i]);
+  }
+  if ((codes = malloc(sizeof(uint32_t) * max)) == NULL) return MI_EXIT_ERROR;
+  if ((retval = search_text(codes,&num_results,text,max)) != MI_EXIT_OK) {
+    free(codes);
+    return retval;
+  }
+  found = malloc(num_results);
+  items = malloc(sizeof(media_t) * num_results);
+  if (found == NULL || items == NULL ||
+      (retval = fetch_many(items,found,codes,num_results)) == MI_EXIT_OK) {
+    for (uint32_t i = 0; items != NULL && found != NULL && i < num_results; i++) {
+      if (!found[i] || (location && strcmp(items[i].location,location)) ||
+	  (typed && items[i].type != type)) continue;
+      print_media(stdout,&items[i]);
+      printed++;
+    }
+  }
+  if (found == NULL || items == NULL) retval = MI_EXIT_ERROR;
+  else if (retval == MI_EXIT_OK && !printed) retval = MI_NO_RESULTS;
+
+  free(codes);
+  free(found);
+  free(items);
+  return retval;
+}
+
+/* checkout and touch, one transaction for the lot */
+int update_codes(int argc, char** argv, const char* location, const char* command) {
+  uint32_t* codes;
+  uint32_t* unknown;
+  size_t num_unknown = 0;
+  size_t n;
+  int retval;
+
+  if (getopt(argc,argv,"") != -1 || argc <= optind) {
+    usage(command);
+    return CLI_USAGE;
+  }
+  if (parse_codes(argc,argv,&codes,&n) != MI_EXIT_OK) return CLI_USAGE;
+  if ((unknown = malloc(sizeof(uint32_t) * n)) == NULL) {
+    free(codes);
+    return MI_EXIT_ERROR;
+  }
+
+  if (location)
+    retval = checkout_batch(codes,n,location,unknown,&num_unknown);
+  else
+    retval = touch_batch(codes,n,unknown,&num_unknown);
+  if (retval != MI_EXIT_ERROR) {
+    print_unknown(unknown,num_unknown);
+    printf("%zu\n",n - num_unknown);
+  }
+
+  free(codes);
+  free(unknown);
+  return retval;
+}
+
+int cmd_checkout(int argc, char** argv) {
+  if (argc < 3 || argv[1][0] == '-') {
+    usage("checkout");
+    return CLI_USAGE;
+  }
+  /* the location goes in argv[0]'s place, so the codes are left */
+  return update_codes(argc - 1,argv + 1,argv[1],"checkout");
+}
+
+int cmd_touch(int argc, char** argv) {
+  return update_codes(argc,argv,NULL,"touch");
+}
+
+int cmd_delete(int argc, char** argv) {
+  uint32_t* codes;
+  size_t n;
+  int retval;
+
+  if (getopt(argc,argv,"") != -1 || argc <= optind) {
+    usage("delete");
+    return CLI_USAGE;
+  }
+  if (parse_codes(argc,argv,&codes,&n) != MI_EXIT_OK) return CLI_USAGE;
+  retval = delete_batch(codes,n);
+  free(codes);
+  return retval;
+}
+
+/* lines */
+int split_line(char* line, char** fields, int max) {
+  const char* separators = (strchr(line,'\t')) ? "\t" : " ";
+  char* saved;
+  char* field;
+  int n = 0;
+
+  line[strcspn(line,"\r\n")] = '\0';
+  if (separators[0] == '\t') {
+    /* empty fields count between tabs */
+    for (field = line; n < max; field = saved + 1) {
+      fields[n++] = field;
+      if ((saved = strchr(field,'\t')) == NULL) break;
+      *saved = '\0';
+    }
+    return n;
+  }
+  for (field = strtok_r(line," ",&saved); field && n < max; field = strtok_r(NULL," ",&saved))
+    fields[n++] = field;
+  return n;
+}
+
+/* import, rows as export writes them, a blank code is made from the type
+ * and name; only code, type, name and location are read
+ */
+int cmd_import(int argc, char** argv) {
+  char line[LINE_SIZE];
+  char* fields[LINE_FIELDS];
+  media_t item;
+  FILE* in = stdin;
+  uint32_t stored = 0;
+  uint32_t existing = 0;
+  uint32_t bad = 0;
+  int n;
+  int retval = MI_EXIT_OK;
+
+  if (getopt(argc,argv,"") != -1 || argc - optind > 1) {
+    usage("import");
+    return CLI_USAGE;
+  }
+  if (in_batch && (argc == optind || !strcmp(argv[optind],"-"))) {
+    fprintf(stderr,"mindex: import in batch needs a FILE, stdin is the batch\n");
+    return CLI_USAGE;
+  }
+  if (argc > optind && strcmp(argv[optind],"-") && (in = fopen(argv[optind],"r")) == NULL) {
+    fprintf(stderr,"mindex: could not read %s\n",argv[optind]);
+    return MI_EXIT_ERROR;
+  }
+
+  while (fgets(line,sizeof(line),in) != NULL) {
+    if (line[0] == '\n' || line[0] == '#') continue;
+    if ((n = split_line(line,fields,LINE_FIELDS)) < 4 ||
+	medium_parse(fields[1],&item.type) != MI_EXIT_OK ||
+	(fields[0][0] && parse_code(fields[0],&item.code))) {
+      bad++;
+      continue;
+    }
+    snprintf(item.name,sizeof(item.name),"%s",fields[2]);
+    snprintf(item.location,sizeof(item.location),"%s",fields[3]);
+    if (!fields[0][0]) item.code = code_gen(item.type,item.name);
+
+    retval = store(&item);
+    if (retval == MI_EXIT_OK) stored++;
+    else if (retval == MI_EXISTS) existing++;
+    else break;
+  }
+  if (in != stdin) fclose(in);
+
+  printf("%u stored, %u already there, %u bad\n",stored,existing,bad);
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  return (stored) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
+
+/* export, the whole catalogue in code order a page at a time */
+int cmd_export(int argc, char** argv) {
+  media_t items[EXPORT_PAGE];
+  uint32_t num_results;
+  uint32_t after;
+  FILE* out = stdout;
+  int retval;
+
+  if (getopt(argc,argv,"") != -1 || argc - optind > 1) {
+    usage("export");
+    return CLI_USAGE;
+  }
+  if (argc > optind && strcmp(argv[optind],"-") && (out = fopen(argv[optind],"w")) == NULL) {
+    fprintf(stderr,"mindex: could not write %s\n",argv[optind]);
+    return MI_EXIT_ERROR;
+  }
+
+  retval = page(items,&num_results,NULL,EXPORT_PAGE);
+  while (retval == MI_EXIT_OK) {
+    for (uint32_t i = 0; i < num_results; i++)
+      print_media(out,&items[i]);
+    after = items[num_results - 1].code;
+    retval = page(items,&num_results,&after,EXPORT_PAGE);
+  }
+  if (out != stdout && fclose(out) != 0) retval = MI_EXIT_ERROR;
+  return (retval == MI_NO_RESULTS) ? MI_EXIT_OK : retval;
+}
+
+int cmd_stats(int argc, char** argv) {
+  uint32_t items;
+  uint32_t books;
+  uint32_t movies;
+
+  if (getopt(argc,argv,"") != -1 || argc != optind) {
+    usage("stats");
+    return CLI_USAGE;
+  }
+  if (count_items(&items) != MI_EXIT_OK || count_books(&books) != MI_EXIT_OK ||
+      count_movies(&movies) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  printf("items\t%u\nbooks\t%u\nmovies\t%u\n",items,books,movies);
+  return MI_EXIT_OK;
+}
+
+/* media and genres, the names given are added before the list */
+int cmd_media(int argc, char** argv) {
+  medium_t type;
+  int retval = MI_EXIT_OK;
+
+  if (getopt(argc,argv,"") != -1) {
+    usage("media");
+    return CLI_USAGE;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (medium_add(argv[i],&type) == MI_EXIT_ERROR) {
+      fprintf(stderr,"mindex: could not add medium %s\n",argv[i]);
+      retval = MI_EXIT_ERROR;
+    }
+  }
+  for (int i = 0; i < medium_count(); i++)
+    printf("%d\t%s\n",i,medium_string((medium_t)i));
+  return retval;
+}
+
+int cmd_genres(int argc, char** argv) {
+  genre_t genre;
+  int retval = MI_EXIT_OK;
+
+  if (getopt(argc,argv,"") != -1) {
+    usage("genres");
+    return CLI_USAGE;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (genre_add(argv[i],&genre) == MI_EXIT_ERROR) {
+      fprintf(stderr,"mindex: could not add genre %s\n",argv[i]);
+      retval = MI_EXIT_ERROR;
+    }
+  }
+  for (int bit = 0; bit < GENRE_MAX; bit++)
+    if (*genre_string((genre_t)1 << bit) != '\0')
+      printf("%d\t%s\n",bit,genre_string((genre_t)1 << bit));
+  return retval;
+}
+
+/* batch, one open database and its statement cache for every line */
+int cmd_batch(int argc, char** argv) {
+  char line[LINE_SIZE];
+  char* fields[LINE_FIELDS];
+  const command_t* command;
+  double start;
+  int n;
+  int retval;
+  int failed = 0;
+
+  if (argc != 1) {
+    usage("batch");
+    return CLI_USAGE;
+  }
+  (void)argv;
+
+  in_batch = 1;
+  while (fgets(line,sizeof(line),stdin) != NULL) {
+    if ((n = split_line(line,fields,LINE_FIELDS)) == 0 || fields[0][0] == '\0' ||
+	fields[0][0] == '#') continue;
+
+    start = now();
+    command = find_command(fields[0]);
+    if (command == NULL || command->preset == NULL || command->run == cmd_batch ||
+	command->run == cmd_intake || command->run == cmd_follow) {
+      fprintf(stderr,"mindex: no such batch command %s\n",fields[0]);
+      retval = CLI_USAGE;
+    }
+    else {
+      optind = 1;
+      retval = command->run(n,fields);
+    }
+    if (retval == MI_EXIT_ERROR || retval == CLI_USAGE) failed = 1;
+
+    if (show_time)
+      printf(". %s %.6f\n",(retval == CLI_USAGE) ? "USAGE" : error_string(retval),now() - start);
+    else
+      printf(". %s\n",(retval == CLI_USAGE) ? "USAGE" : error_string(retval));
+    fflush(stdout);
+  }
+  return (failed) ? MI_EXIT_ERROR : MI_EXIT_OK;
+}
+
+/* intake */
+static const char* intake_kinds[] = { "known", "new", "repeat", "unknown", "bad" };
+
+void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+/* answers one scan, the operator's wait is from the read to the answer */
+void intake_line(intake_t* intake, const char* line, double read_at, double* slowest,
+		 double* total) {
+  uint32_t code;
+  int kind;
+  double took;
+
+  if (line[strspn(line," \t")] == '\0') return;
+  if ((kind = intake_scan(intake,line,now(),&code)) == MI_EXIT_ERROR) {
+    fprintf(stderr,"mindex: intake of %s failed\n",line);
+    return;
+  }
+  if (code)
+    printf("%s\t%u\t%s\n",intake_kinds[kind],code,line);
+  else
+    printf("%s\t-\t%s\n",intake_kinds[kind],line);
+  fflush(stdout);
+
+  took = now() - read_at;
+  *total += took;
+  if (took > *slowest) *slowest = took;
+}
+
+int cmd_intake(int argc, char** argv) {
+  struct sigaction action;
+  struct pollfd input;
+  intake_t intake;
+  char buffer[LINE_SIZE];
+  const char* location = "INTAKE";
+  double window = INTAKE_WINDOW;
+  double flush = INTAKE_FLUSH;
+  uint32_t batch = INTAKE_BATCH;
+  double slowest = 0;
+  double total = 0;
+  double wait;
+  double read_at;
+  size_t have = 0;
+  size_t end;
+  ssize_t got;
+  int fd = 0;
+  int opt;
+  int retval = MI_EXIT_OK;
+
+  while ((opt = getopt(argc,argv,"l:w:b:f:")) != -1) {
+    switch (opt) {
+    case 'l':
+      location = optarg;
+      break;
+    case 'w':
+      window = atof(optarg) / 1000.0;
+      break;
+    case 'b':
+      batch = (uint32_t)strtoul(optarg,NULL,10);
+      break;
+    case 'f':
+      flush = atof(optarg) / 1000.0;
+      break;
+    default:
+      usage("intake");
+      return CLI_USAGE;
+    }
+  }
+  if (argc - optind > 1) {
+    usage("intake");
+    return CLI_USAGE;
+  }
+  if (argc > optind && strcmp(argv[optind],"-") && (fd = open(argv[optind],O_RDONLY)) < 0) {
+    fprintf(stderr,"mindex: could not read %s\n",argv[optind]);
+    return MI_EXIT_ERROR;
+  }
+
+  intake_init(&intake,location,window,batch,flush);
+  if (intake_load(&intake) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: could not load the index\n");
+    intake_free(&intake);
+    if (fd) close(fd);
+    return MI_EXIT_ERROR;
+  }
+  fprintf(stderr,"intake: %zu codes and isbns, checking in to %s\n",intake.num_keys,location);
+
+  /* no SA_RESTART, so a signal wakes poll() up for the last flush */
+  memset(&action,0,sizeof(action));
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT,&action,NULL);
+  sigaction(SIGTERM,&action,NULL);
+
+  while (!stop) {
+    wait = intake_wait(&intake,now());
+    input.fd = fd;
+    input.events = POLLIN;
+    got = poll(&input,1,(wait < 0) ? -1 : (int)(wait * 1000) + 1);
+    if (got < 0 && errno != EINTR) break;
+
+    if (got > 0) {
+      got = read(fd,buffer + have,sizeof(buffer) - 1 - have);
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) break;
+      read_at = now();
+      have += got;
+      buffer[have] = '\0';
+
+      /* scanners end a scan with CR, LF or both */
+      while ((end = strcspn(buffer,"\r\n")) < have ||
+	     have == sizeof(buffer) - 1) {
+	buffer[(end < have) ? end : have] = '\0';
+	intake_line(&intake,buffer,read_at,&slowest,&total);
+	end = (end < have) ? end + 1 : have;
+	memmove(buffer,buffer + end,have - end);
+	have -= end;
+	buffer[have] = '\0';
+      }
+    }
+
+    if (intake_due(&intake,now()) && intake_flush(&intake) == MI_EXIT_ERROR)
+      fprintf(stderr,"mindex: intake write failed, will try again\n");
+  }
+
+  if (have) {
+    buffer[have] = '\0';
+    intake_line(&intake,buffer,now(),&slowest,&total);
+  }
+  if (intake_flush(&intake) == MI_EXIT_ERROR) {
+    fprintf(stderr,"mindex: intake write failed, %zu scans lost\n",
+	    intake.num_new + intake.num_seen);
+    retval = MI_EXIT_ERROR;
+  }
+
+  fprintf(stderr,"intake: %u scans, %u known, %u new, %u repeats, %u unknown, %u bad\n",
+	  intake.stats.scans,intake.stats.known,intake.stats.added,intake.stats.duplicates,
+	  intake.stats.unknown,intake.stats.bad);
+  fprintf(stderr,"intake: %u batches, %u stored, %u checked in, "
+	  "scan latency %.3f ms mean %.3f ms max\n",
+	  intake.stats.batches,intake.stats.stored,intake.stats.checked_out,
+	  (intake.stats.scans) ? total * 1000 / intake.stats.scans : 0,slowest * 1000);
+
+  intake_free(&intake);
+  if (fd) close(fd);
+  return retval;
+}
+
+/* snapshot */
+int snapshot_progress(const snapshot_stats_t* stats, void* data) {
+  (void)data;
+  fprintf(stderr,"\r%d/%d pages",stats->pages,stats->total);
+  return 0;
+}
+
+int cmd_snapshot(int argc, char** argv) {
+  snapshot_stats_t stats;
+  int pages = SNAPSHOT_PAGES;
+  int quiet = 0;
+  int opt;
+  int retval;
+  double mib;
+
+  while ((opt = getopt(argc,argv,"s:q")) != -1) {
+    switch (opt) {
+    case 's':
+      pages = atoi(optarg);
+      break;
+    case 'q':
+      quiet = 1;
+      break;
+    default:
+      usage("snapshot");
+      return CLI_USAGE;
+    }
+  }
+  if (argc - optind != 2) {
+    usage("snapshot");
+    return CLI_USAGE;
+  }
+  if (open_source(argv[optind])) return MI_EXIT_ERROR;
+
+  retval = snapshot_db_ex(argv[optind + 1],pages,(quiet) ? NULL : snapshot_progress,NULL,&stats);
+  close_db();
+  if (!quiet) fprintf(stderr,"\n");
+
+  if (retval != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: snapshot to %s failed\n",argv[optind + 1]);
+    return MI_EXIT_ERROR;
+  }
+
+  mib = (double)stats.pages * stats.page_size / (1024.0 * 1024.0);
+  printf("%d pages (%.1f MiB) in %d steps, %.3f s, %.1f MiB/s\n",
+	 stats.pages,mib,stats.steps,stats.seconds,
+	 (stats.seconds > 0) ? mib / stats.seconds : 0);
+  return MI_EXIT_OK;
+}
+
+/* follow */
+int cmd_follow(int argc, char** argv) {
+  struct sigaction action;
+  repl_follower_t follower;
+  repl_stats_t stats;
+  char state_file[256];
+  size_t rows = 0;
+  int wait = FOLLOW_WAIT;
+  int once = 0;
+  int opt;
+  int retval;
+
+  while ((opt = getopt(argc,argv,"b:i:o")) != -1) {
+    switch (opt) {
+    case 'b':
+      rows = (size_t)strtoul(optarg,NULL,10);
+      break;
+    case 'i':
+      wait = atoi(optarg);
+      break;
+    case 'o':
+      once = 1;
+      break;
+    default:
+      usage("follow");
+      return CLI_USAGE;
+    }
+  }
+  if (argc - optind != 1 || wait < 0) {
+    usage("follow");
+    return CLI_USAGE;
+  }
+  if (snprintf(state_file,sizeof(state_file),"%s-follow",database) >=
+      (int)sizeof(state_file) || repl_follow_open(&follower,argv[optind],state_file) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: could not follow %s\n",argv[optind]);
+    return MI_EXIT_ERROR;
+  }
+
+  memset(&action,0,sizeof(action));
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT,&action,NULL);
+  sigaction(SIGTERM,&action,NULL);
+
+  while (!stop) {
+    if ((retval = repl_follow_step(&follower,rows)) == MI_EXIT_OK) {
+      repl_follow_stats(&follower,&stats);
+      printf("%u\t%ju\t%ju\t%.3f\n",stats.seq,(uintmax_t)stats.rows,
+	     (uintmax_t)stats.lag_bytes,stats.lag_seconds);
+      fflush(stdout);
+      continue;
+    }
+    if (retval != MI_NO_RESULTS || once) break;
+    poll(NULL,0,wait);
+  }
+
+  repl_follow_stats(&follower,&stats);
+  fprintf(stderr,"follow: record %u, %ju records and %ju rows in %ju batches, "
+	  "%.3f s applying, %ju bytes behind\n",stats.seq,(uintmax_t)stats.records,
+	  (uintmax_t)stats.rows,(uintmax_t)stats.batches,stats.apply_seconds,
+	  (uintmax_t)stats.lag_bytes);
+  repl_follow_close(&follower);
+  if (retval == MI_EXIT_ERROR) fprintf(stderr,"mindex: could not apply %s\n",argv[optind]);
+  return (retval == MI_NO_RESULTS) ? MI_EXIT_OK : retval;
+}
+
+int main(int argc, char** argv) {
+  const command_t* command;
+  double start;
+  int retval;
+
+  init_debug_log(NULL,NOOP_LOG,0);
+
+  while (argc > 1 && strncmp(argv[1],"--",2) == 0) {
+    if (strcmp(argv[1],"--time") == 0)
+      show_time = 1;
+    else if (strcmp(argv[1],"--log") == 0 && argc > 2) {
+      change_log = argv[2];
+      argc--;
+      argv++;
+    }
+    else {
+      usage(NULL);
+      return 2;
+    }
+    argc--;
+    argv++;
+  }
+  if (argc < 2) {
+    usage(NULL);
+    return 2;
+  }
+  if ((command = find_command(argv[1])) == NULL) {
+    fprintf(stderr,"mindex: no such command %s\n",argv[1]);
+    usage(NULL);
+    return 2;
+  }
+  if (command->preset == NULL)
+    return exit_status(command->run(argc - 1,argv + 1));
+
+  if (argc < 3) {
+    usage(command->name);
+    return 2;
+  }
+  if (open_database(argv[2],command)) return 1;
+  if (change_log != NULL && !command->read_only && command->run != cmd_follow &&
+      repl_log_open(change_log) != MI_EXIT_OK) {
+    fprintf(stderr,"mindex: could not open %s\n",change_log);
+    close_db();
+    return 1;
+  }
+
+  /* the command sees its name then the arguments after DATABASE */
+  database = argv[2];
+  argv[2] = argv[1];
+  start = now();
+  retval = command->run(argc - 2,argv + 2);
+  if (show_time && command->run != cmd_batch && command->run != cmd_intake &&
+      command->run != cmd_follow)
+    fprintf(stderr,"%s: %.6f s\n",command->name,now() - start);
+  repl_log_close();
+  close_db();
+  return exit_status(retval);
+}
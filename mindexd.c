@@ -0,0 +1,122 @@
+/* mindexd.c - part of mindex
+ *
+ * Catalogue daemon: opens the database once and answers db_funcs calls
+ * from client_funcs over a Unix socket, so programs sharing a catalogue
+ * don't each open it and fight over its locks.
+ *
+ *   mindexd [-p preset] [-l logfile] [-i] [-r changelog] DATABASE SOCKET
+ *
+ * -i keeps every row in memory as well (the code index), for when the
+ * daemon is the only writer of its catalogue; lookups then never reach
+ * sqlite.  -r records every commit in changelog for read-only followers
+ * (see repl_funcs.h and mindex follow).  Runs in the foreground until
+ * SIGINT or SIGTERM.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L /* getopt(), sigaction() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "server_funcs.h"
+#include "repl_funcs.h"
+
+static volatile sig_atomic_t stop = 0;
+
+void on_signal(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+int main(int argc, char** argv) {
+  struct sigaction action;
+  db_options_t options;
+  const char* preset = "durable";
+  const char* log_file = NULL;
+  const char* change_log = NULL;
+  int code_index = INDEX_OFF;
+  int opt;
+  int retval;
+
+  while ((opt = getopt(argc,argv,"p:l:ir:")) != -1) {
+    switch (opt) {
+    case 'p':
+      preset = optarg;
+      break;
+    case 'l':
+      log_file = optarg;
+      break;
+    case 'i':
+      code_index = INDEX_OWNED;
+      break;
+    case 'r':
+      change_log = optarg;
+      break;
+    default:
+      fprintf(stderr,"usage: mindexd [-p preset] [-l logfile] [-i] [-r changelog] DATABASE SOCKET\n");
+      return 2;
+    }
+  }
+  if (argc - optind != 2) {
+    fprintf(stderr,"usage: mindexd [-p preset] [-l logfile] [-i] [-r changelog] DATABASE SOCKET\n");
+    return 2;
+  }
+
+  if (log_file != NULL)
+    init_debug_log(log_file,FILE_LOG,ERROR);
+  else
+    init_debug_log(NULL,NOOP_LOG,0);
+
+  if (db_options_preset(&options,preset) != MI_EXIT_OK) {
+    fprintf(stderr,"mindexd: no such preset %s\n",preset);
+    return 2;
+  }
+  if (code_index != INDEX_OFF) options.code_index = code_index;
+  if (init_db_ex(argv[optind],&options) != MI_EXIT_OK) {
+    fprintf(stderr,"mindexd: could not open %s\n",argv[optind]);
+    return 1;
+  }
+  if (change_log != NULL && repl_log_open(change_log) != MI_EXIT_OK) {
+    fprintf(stderr,"mindexd: could not open %s\n",change_log);
+    close_db();
+    return 1;
+  }
+
+  /* no SA_RESTART, so a signal wakes the event loop up */
+  memset(&action,0,sizeof(action));
+  action.sa_handler = on_signal;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT,&action,NULL);
+  sigaction(SIGTERM,&action,NULL);
+  signal(SIGPIPE,SIG_IGN);
+
+  retval = serve(argv[optind + 1],&stop);
+  repl_log_close();
+  close_db();
+  if (retval != MI_EXIT_OK) {
+    fprintf(stderr,"mindexd: could not listen on %s\n",argv[optind + 1]);
+    return 1;
+  }
+  return 0;
+}
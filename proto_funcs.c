@@ -0,0 +1,333 @@
+/* proto_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "db_funcs.h"
+#include "proto_funcs.h"
+
+/* buffers */
+void wire_init(wire_t* wire) {
+  memset(wire,0,sizeof(*wire));
+}
+
+void wire_free(wire_t* wire) {
+  free(wire->data);
+  wire_init(wire);
+}
+
+void wire_consume(wire_t* wire, size_t bytes) {
+  if (bytes >= wire->len) {
+    wire->len = 0;
+    wire->pos = 0;
+    return;
+  }
+  memmove(wire->data,wire->data + bytes,wire->len - bytes);
+  wire->len -= bytes;
+  wire->pos = (wire->pos > bytes) ? wire->pos - bytes : 0;
+}
+
+int wire_reserve(wire_t* wire, size_t bytes) {
+  unsigned char* data;
+  size_t size = (wire->size) ? wire->size : 256;
+
+  if (wire->error) return MI_EXIT_ERROR;
+  if (wire->len + bytes <= wire->size) return MI_EXIT_OK;
+
+  while (size < wire->len + bytes) size *= 2;
+  if ((data = realloc(wire->data,size)) == NULL) {
+    wire->error = 1;
+    return MI_EXIT_ERROR;
+  }
+  wire->data = data;
+  wire->size = size;
+  return MI_EXIT_OK;
+}
+
+static void wire_put(wire_t* wire, const void* src, size_t bytes) {
+  if (wire_reserve(wire,bytes) != MI_EXIT_OK) return;
+  memcpy(wire->data + wire->len,src,bytes);
+  wire->len += bytes;
+}
+
+static int wire_get(wire_t* wire, void* dest, size_t bytes) {
+  if (wire->error || wire->pos + bytes > wire->len) {
+    wire->error = 1;
+    memset(dest,0,bytes);
+    return MI_EXIT_ERROR;
+  }
+  memcpy(dest,wire->data + wire->pos,bytes);
+  wire->pos += bytes;
+  return MI_EXIT_OK;
+}
+
+/* numbers and strings */
+void wire_put_u32(wire_t* wire, uint32_t value) {
+  wire_put(wire,&value,sizeof(value));
+}
+
+void wire_put_i64(wire_t* wire, int64_t value) {
+  wire_put(wire,&value,sizeof(value));
+}
+
+void wire_put_str(wire_t* wire, const char* text) {
+  size_t len = strlen(text);
+  uint16_t len16 = (len > UINT16_MAX) ? UINT16_MAX : (uint16_t)len;
+
+  wire_put(wire,&len16,sizeof(len16));
+  wire_put(wire,text,len16);
+}
+
+uint32_t wire_get_u32(wire_t* wire) {
+  uint32_t value;
+
+  wire_get(wire,&value,sizeof(value));
+  return value;
+}
+
+int64_t wire_get_i64(wire_t* wire) {
+  int64_t value;
+
+  wire_get(wire,&value,sizeof(value));
+  return value;
+}
+
+void wire_get_str(wire_t* wire, char* dest, size_t size) {
+  uint16_t len;
+  size_t keep;
+
+  dest[0] = '\0';
+  if (wire_get(wire,&len,sizeof(len)) != MI_EXIT_OK) return;
+  if (wire->pos + len > wire->len) {
+    wire->error = 1;
+    return;
+  }
+
+  /* too long for dest: cut, but not through a UTF-8 character */
+  keep = (len < size) ? len : size - 1;
+  if (keep < len)
+    while (keep > 0 && (wire->data[wire->pos + keep] & 0xc0) == 0x80) keep--;
+  memcpy(dest,wire->data + wire->pos,keep);
+  dest[keep] = '\0';
+  wire->pos += len;
+}
+
+/* rows, field by field in column order */
+void wire_put_media(wire_t* wire, const media_t* item) {
+  wire_put_u32(wire,item->code);
+  wire_put_u32(wire,item->type);
+  wire_put_str(wire,item->name);
+  wire_put_str(wire,item->location);
+  wire_put_i64(wire,(int64_t)item->update);
+}
+
+void wire_get_media(wire_t* wire, media_t* item) {
+  item->code = wire_get_u32(wire);
+  item->type = (medium_t)wire_get_u32(wire);
+  wire_get_str(wire,item->name,sizeof(item->name));
+  wire_get_str(wire,item->location,sizeof(item->location));
+  item->update = (time_t)wire_get_i64(wire);
+}
+
+void wire_put_book(wire_t* wire, const book_t* item) {
+  wire_put_u32(wire,item->code);
+  wire_put_u32(wire,item->type);
+  wire_put_i64(wire,(int64_t)item->genre);
+  wire_put_str(wire,item->isbn);
+  wire_put_str(wire,item->title);
+  wire_put_str(wire,item->author_last);
+  wire_put_str(wire,item->author_first);
+  wire_put_str(wire,item->author_rest);
+}
+
+void wire_get_book(wire_t* wire, book_t* item) {
+  item->code = wire_get_u32(wire);
+  item->type = (medium_t)wire_get_u32(wire);
+  item->genre = (genre_t)wire_get_i64(wire);
+  wire_get_str(wire,item->isbn,sizeof(item->isbn));
+  wire_get_str(wire,item->title,sizeof(item->title));
+  wire_get_str(wire,item->author_last,sizeof(item->author_last));
+  wire_get_str(wire,item->author_first,sizeof(item->author_first));
+  wire_get_str(wire,item->author_rest,sizeof(item->author_rest));
+}
+
+void wire_put_movie(wire_t* wire, const movie_t* item) {
+  wire_put_u32(wire,item->code);
+  wire_put_u32(wire,item->type);
+  wire_put_i64(wire,(int64_t)item->genre);
+  wire_put_str(wire,item->title);
+  wire_put_str(wire,item->director);
+  wire_put_str(wire,item->studio);
+  wire_put_u32(wire,(uint32_t)item->rating);
+}
+
+void wire_get_movie(wire_t* wire, movie_t* item) {
+  item->code = wire_get_u32(wire);
+  item->type = (medium_t)wire_get_u32(wire);
+  item->genre = (genre_t)wire_get_i64(wire);
+  wire_get_str(wire,item->title,sizeof(item->title));
+  wire_get_str(wire,item->director,sizeof(item->director));
+  wire_get_str(wire,item->studio,sizeof(item->studio));
+  item->rating = (short)wire_get_u32(wire);
+}
+
+/* filters, only the terms in use are sent */
+void wire_put_filter(wire_t* wire, const filter_t* filter) {
+  const filter_term_t* term;
+
+  wire_put_u32(wire,(uint32_t)filter->num_terms);
+  wire_put_u32(wire,(uint32_t)filter->depth);
+  for (int i = 0; i < filter->num_terms; i++) {
+    term = &filter->terms[i];
+    wire_put_u32(wire,(uint32_t)term->kind);
+    wire_put_u32(wire,(uint32_t)term->join);
+    wire_put_u32(wire,(uint32_t)term->field);
+    wire_put_u32(wire,(uint32_t)term->op);
+    wire_put_u32(wire,(uint32_t)term->is_text);
+    wire_put_i64(wire,term->num);
+    wire_put_str(wire,term->text);
+  }
+  wire_put_u32(wire,(uint32_t)filter->order);
+  wire_put_u32(wire,(uint32_t)filter->desc);
+  wire_put_u32(wire,filter->limit);
+  wire_put_u32(wire,filter->offset);
+  wire_put_u32(wire,(uint32_t)filter->after);
+  wire_put_u32(wire,(uint32_t)filter->after_is_text);
+  wire_put_i64(wire,filter->after_num);
+  wire_put_str(wire,filter->after_text);
+  wire_put_u32(wire,filter->after_code);
+}
+
+void wire_get_filter(wire_t* wire, filter_t* filter) {
+  filter_term_t* term;
+
+  filter_init(filter);
+  filter->num_terms = (int)wire_get_u32(wire);
+  filter->depth = (int)wire_get_u32(wire);
+  if (filter->num_terms < 0 || filter->num_terms > FILTER_MAX_TERMS) {
+    filter->num_terms = 0;
+    wire->error = 1;
+    return;
+  }
+  for (int i = 0; i < filter->num_terms; i++) {
+    term = &filter->terms[i];
+    term->kind = (int)wire_get_u32(wire);
+    term->join = (int)wire_get_u32(wire);
+    term->field = (field_t)wire_get_u32(wire);
+    term->op = (op_t)wire_get_u32(wire);
+    term->is_text = (int)wire_get_u32(wire);
+    term->num = wire_get_i64(wire);
+    wire_get_str(wire,term->text,sizeof(term->text));
+    if (term->kind < FILTER_TERM || term->kind > FILTER_CLOSE ||
+	(term->join != FILTER_AND && term->join != FILTER_OR) ||
+	(int)term->field < 0 || term->field > F_SORT ||
+	(int)term->op < 0 || term->op > OP_HAS || (term->is_text != 0 && term->is_text != 1))
+      wire->error = 1;
+  }
+  filter->order = (int)wire_get_u32(wire);
+  filter->desc = (int)wire_get_u32(wire);
+  filter->limit = wire_get_u32(wire);
+  filter->offset = wire_get_u32(wire);
+  filter->after = (int)wire_get_u32(wire);
+  filter->after_is_text = (int)wire_get_u32(wire);
+  filter->after_num = wire_get_i64(wire);
+  wire_get_str(wire,filter->after_text,sizeof(filter->after_text));
+  filter->after_code = wire_get_u32(wire);
+
+  /* whatever a client sends goes on to filter_compile(), so nothing out
+   * of range gets past here
+   */
+  if (filter->depth < 0 || filter->depth > filter->num_terms ||
+      filter->order < -1 || filter->order > F_SORT ||
+      (filter->after != 0 && filter->after != 1) ||
+      (filter->after_is_text != 0 && filter->after_is_text != 1))
+    wire->error = 1;
+  if (wire->error) filter_init(filter);
+}
+
+/* frames */
+size_t frame_begin(wire_t* wire, uint16_t op, uint32_t id) {
+  size_t start = wire->len;
+  int16_t status = 0;
+
+  wire_put_u32(wire,0);
+  wire_put(wire,&op,sizeof(op));
+  wire_put(wire,&status,sizeof(status));
+  wire_put_u32(wire,id);
+  return start;
+}
+
+void frame_end(wire_t* wire, size_t start, int16_t status) {
+  uint32_t length;
+
+  if (wire->error) return;
+  length = (uint32_t)(wire->len - start - PROTO_HEADER_SIZE);
+  memcpy(wire->data + start,&length,sizeof(length));
+  memcpy(wire->data + start + 6,&status,sizeof(status));
+}
+
+int frame_peek(const wire_t* wire, frame_header_t* header) {
+  const unsigned char* p;
+
+  if (wire->len - wire->pos < PROTO_HEADER_SIZE) return MI_NO_RESULTS;
+  p = wire->data + wire->pos;
+  memcpy(&header->length,p,4);
+  memcpy(&header->op,p + 4,2);
+  memcpy(&header->status,p + 6,2);
+  memcpy(&header->id,p + 8,4);
+
+  if (header->length > PROTO_MAX_FRAME) return MI_EXIT_ERROR;
+  if (wire->len - wire->pos - PROTO_HEADER_SIZE < header->length) return MI_NO_RESULTS;
+  return MI_EXIT_OK;
+}
+
+/* blocking I/O, for the client end of a connection */
+int frame_write(int fd, const wire_t* wire) {
+  size_t done = 0;
+  ssize_t sent;
+
+  while (done < wire->len) {
+    sent = send(fd,wire->data + done,wire->len - done,MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      return MI_EXIT_ERROR;
+    }
+    done += sent;
+  }
+  return MI_EXIT_OK;
+}
+
+int frame_read(int fd, wire_t* wire, frame_header_t* header) {
+  ssize_t got;
+  int retval;
+
+  while ((retval = frame_peek(wire,header)) == MI_NO_RESULTS) {
+    if (wire_reserve(wire,65536) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    got = read(fd,wire->data + wire->len,65536);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return MI_EXIT_ERROR;
+    wire->len += got;
+  }
+  return retval;
+}
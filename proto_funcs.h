@@ -0,0 +1,128 @@
+#ifndef __PROTO_FUNCS_H__
+#define __PROTO_FUNCS_H__
+
+/* proto_funcs.h - part of mindex
+ *
+ * Wire format shared by mindexd and the client library.  Every request
+ * and response is a frame: a fixed header then length bytes of payload.
+ * The socket is local, so numbers go in host byte order; strings are a
+ * 16 bit length and the bytes, without the NULL.  A client may send any
+ * number of frames before reading, the daemon answers them in order and
+ * each response carries the id of its request.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define PROTO_HEADER_SIZE 12               /* length, op, status, id */
+#define PROTO_MAX_FRAME   (16 * 1024 * 1024) /* payload bytes, bigger frames drop the client */
+#define PROTO_MANY_MAX    1024               /* codes in one REQ_FETCH_MANY* */
+#define PROTO_BATCH_MAX   4096               /* rows in one REQ_STORE_BOOK_ITEM_BATCH */
+
+/* typedefs */
+
+/* request ops, a response has the op of its request */
+typedef enum {
+  REQ_FETCH = 1,     /* code -> media_t */
+  REQ_FETCH_BOOK,    /* code -> book_t */
+  REQ_FETCH_MOVIE,   /* code -> movie_t */
+  REQ_EXISTS,        /* code -> status only, for all three EXISTS */
+  REQ_EXISTS_BOOK,
+  REQ_EXISTS_MOVIE,
+  REQ_STORE,         /* media_t -> update time */
+  REQ_STORE_BOOK,    /* book_t */
+  REQ_STORE_MOVIE,   /* movie_t */
+  REQ_UPDATE,        /* media_t -> update time */
+  REQ_UPDATE_BOOK,   /* book_t */
+  REQ_UPDATE_MOVIE,  /* movie_t */
+  REQ_STORE_BOOK_ITEM,   /* media_t, book_t -> update time */
+  REQ_STORE_MOVIE_ITEM,  /* media_t, movie_t -> update time */
+  REQ_UPDATE_BOOK_ITEM,
+  REQ_UPDATE_MOVIE_ITEM,
+  REQ_SEARCH,        /* filter_t -> count, media_t... */
+  REQ_SEARCH_BOOKS,  /* filter_t -> count, book_t... */
+  REQ_SEARCH_MOVIES, /* filter_t -> count, movie_t... */
+  REQ_DELETE,        /* code */
+  REQ_TOUCH,         /* code */
+  REQ_CHECKOUT,      /* code, location */
+  REQ_FETCH_MANY,        /* rows wanted, count, codes... -> count, (found, media_t)... */
+  REQ_FETCH_MANY_BOOKS,  /* as above with book_t, the row is only there */
+  REQ_FETCH_MANY_MOVIES, /* if both found and rows wanted are 1 */
+  REQ_STORE_BOOK_ITEM_BATCH, /* count, (media_t, book_t)... -> rows stored */
+  REQ_MAX
+} req_op_t;
+
+/* a growable buffer written from the end and read from pos, error is set
+ * (and sticks) when a read runs past the end or a write can't grow it
+ */
+typedef struct {
+  unsigned char* data;
+  size_t         len;
+  size_t         size;
+  size_t         pos;
+  int            error;
+} wire_t;
+
+typedef struct {
+  uint32_t length; /* payload bytes after the header */
+  uint16_t op;     /* req_op_t */
+  int16_t  status; /* MI_* in responses, 0 in requests */
+  uint32_t id;     /* chosen by the client, echoed back */
+} frame_header_t;
+
+/* prototypes */
+void wire_init   (wire_t* wire);
+void wire_free   (wire_t* wire);
+void wire_consume(wire_t* wire, size_t bytes);    /* drops bytes from the front */
+int  wire_reserve(wire_t* wire, size_t bytes);    /* room for bytes more at the end */
+
+void wire_put_u32 (wire_t* wire, uint32_t value);
+void wire_put_i64 (wire_t* wire, int64_t value);
+void wire_put_str (wire_t* wire, const char* text);
+uint32_t wire_get_u32(wire_t* wire);
+int64_t  wire_get_i64(wire_t* wire);
+void     wire_get_str(wire_t* wire, char* dest, size_t size); /* cut short to fit size */
+
+void wire_put_media (wire_t* wire, const media_t* item);
+void wire_put_book  (wire_t* wire, const book_t* item);
+void wire_put_movie (wire_t* wire, const movie_t* item);
+void wire_put_filter(wire_t* wire, const filter_t* filter);
+void wire_get_media (wire_t* wire, media_t* item);
+void wire_get_book  (wire_t* wire, book_t* item);
+void wire_get_movie (wire_t* wire, movie_t* item);
+void wire_get_filter(wire_t* wire, filter_t* filter);
+
+size_t frame_begin(wire_t* wire, uint16_t op, uint32_t id);
+                                                  /* writes a header with no length yet,
+						   * returns where it starts
+						   */
+void   frame_end  (wire_t* wire, size_t start, int16_t status);
+                                                  /* fills in the length and status */
+int    frame_peek (const wire_t* wire, frame_header_t* header);
+                                                  /* MI_EXIT_OK if a whole frame is waiting
+						   * at pos, MI_NO_RESULTS if not yet,
+						   * MI_EXIT_ERROR if it's too big
+						   */
+int    frame_write(int fd, const wire_t* wire);   /* sends all of wire on a blocking socket,
+						   * MI_EXIT_ERROR if the other end has gone
+						   */
+int    frame_read (int fd, wire_t* wire, frame_header_t* header);
+                                                  /* reads from a blocking socket until
+						   * frame_peek() has a whole frame at pos
+						   */
+
+#endif /* __PROTO_FUNCS_H__ */
@@ -0,0 +1,401 @@
+/* repl_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "repl_funcs.h"
+
+/* a record is a frame whose id is its number and whose status is 1 when
+ * the commit goes on in the next record, 0 on its last; the payload is
+ * the commit's wall clock time in microseconds, then for each code
+ *   code, STATE_* bits, [media_t] [book_t] [movie_t]
+ * with the rows the bits say are there
+ */
+#define REPL_OP 0
+
+/* globals */
+static int log_fd = -1;
+static uint32_t log_seq = 0;
+static wire_t log_wire;
+static uint32_t* log_codes = NULL;
+static size_t size_codes = 0;
+
+static int64_t wall_micros() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t len) {
+  ssize_t wrote;
+
+  while (len) {
+    if ((wrote = write(fd,data,len)) < 0) {
+      if (errno == EINTR) continue;
+      return MI_EXIT_ERROR;
+    }
+    data += wrote;
+    len -= wrote;
+  }
+  return MI_EXIT_OK;
+}
+
+static int code_compare(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+/* the writer
+ * db_commit_hook, so this runs after the commit with the rows as they
+ * were committed
+ */
+static void log_commit(const uint32_t* codes, size_t n) {
+  char buffer[128];
+  row_state_t state;
+  uint32_t* grown;
+  int64_t when = wall_micros();
+  size_t start;
+  size_t m = 0;
+
+  if (n > size_codes) {
+    if ((grown = realloc(log_codes,sizeof(uint32_t) * n)) == NULL) {
+      log_debug(ERROR,"repl: out of memory, commit not logged");
+      return;
+    }
+    log_codes = grown;
+    size_codes = n;
+  }
+  memcpy(log_codes,codes,sizeof(uint32_t) * n);
+  qsort(log_codes,n,sizeof(uint32_t),code_compare);
+  for (size_t i = 0; i < n; i++)
+    if (i == 0 || log_codes[i] != log_codes[m - 1]) log_codes[m++] = log_codes[i];
+
+  log_wire.len = 0;
+  log_wire.error = 0;
+  start = frame_begin(&log_wire,REPL_OP,++log_seq);
+  wire_put_i64(&log_wire,when);
+  for (size_t i = 0; i < m; i++) {
+    if (log_wire.len - start > REPL_RECORD_BYTES) {
+      frame_end(&log_wire,start,1);
+      start = frame_begin(&log_wire,REPL_OP,++log_seq);
+      wire_put_i64(&log_wire,when);
+    }
+    if (fetch_state(&state,log_codes[i]) == MI_EXIT_ERROR) {
+      sprintf(buffer,"repl: could not read #%u, followers will miss it",log_codes[i]);
+      log_debug(ERROR,buffer);
+      continue;
+    }
+    wire_put_u32(&log_wire,state.code);
+    wire_put_u32(&log_wire,(uint32_t)state.tables);
+    if (state.tables & STATE_MAIN)  wire_put_media(&log_wire,&state.item);
+    if (state.tables & STATE_BOOK)  wire_put_book(&log_wire,&state.book);
+    if (state.tables & STATE_MOVIE) wire_put_movie(&log_wire,&state.movie);
+  }
+  frame_end(&log_wire,start,0);
+
+  if (log_wire.error || write_all(log_fd,log_wire.data,log_wire.len) != MI_EXIT_OK) {
+    log_debug(ERROR,"repl: could not write the change log");
+    log_debug(ERROR,strerror(errno));
+  }
+}
+
+int repl_log_open(const char* file) {
+  unsigned char header[PROTO_HEADER_SIZE];
+  char magic[REPL_MAGIC_SIZE];
+  char buffer[320];
+  struct stat st;
+  uint32_t length;
+  uint64_t at = REPL_MAGIC_SIZE;
+
+  if (log_fd >= 0) repl_log_close();
+  if ((log_fd = open(file,O_RDWR | O_CREAT | O_APPEND,0644)) < 0 || fstat(log_fd,&st) < 0) {
+    snprintf(buffer,sizeof(buffer),"repl_log_open(): could not open %.200s",file);
+    log_debug(ERROR,buffer);
+    log_debug(ERROR,strerror(errno));
+    if (log_fd >= 0) close(log_fd);
+    log_fd = -1;
+    return MI_EXIT_ERROR;
+  }
+  log_seq = 0;
+
+  if (st.st_size == 0) {
+    if (write_all(log_fd,(const unsigned char*)REPL_MAGIC,REPL_MAGIC_SIZE) != MI_EXIT_OK) {
+      log_debug(ERROR,"repl_log_open(): could not start the log");
+      repl_log_close();
+      return MI_EXIT_ERROR;
+    }
+  }
+  else {
+    if (pread(log_fd,magic,REPL_MAGIC_SIZE,0) != REPL_MAGIC_SIZE ||
+	memcmp(magic,REPL_MAGIC,REPL_MAGIC_SIZE)) {
+      snprintf(buffer,sizeof(buffer),"repl_log_open(): %.200s isn't a change log",file);
+      log_debug(ERROR,buffer);
+      repl_log_close();
+      return MI_EXIT_ERROR;
+    }
+
+    /* carry on the numbering, a record cut short by a crash goes */
+    while (pread(log_fd,header,PROTO_HEADER_SIZE,at) == PROTO_HEADER_SIZE) {
+      memcpy(&length,header,4);
+      if (at + PROTO_HEADER_SIZE + length > (uint64_t)st.st_size) break;
+      memcpy(&log_seq,header + 8,4);
+      at += PROTO_HEADER_SIZE + length;
+    }
+    if (at < (uint64_t)st.st_size) {
+      log_debug(ERROR,"repl_log_open(): dropping a record cut short");
+      if (ftruncate(log_fd,(off_t)at) < 0) {
+	repl_log_close();
+	return MI_EXIT_ERROR;
+      }
+    }
+  }
+
+  wire_init(&log_wire);
+  db_commit_hook = log_commit;
+  sprintf(buffer,"repl_log_open(): logging from record %u",log_seq + 1);
+  log_debug(INFO,buffer);
+  return MI_EXIT_OK;
+}
+
+int repl_log_close() {
+  if (db_commit_hook == log_commit) db_commit_hook = NULL;
+  if (log_fd >= 0) close(log_fd);
+  log_fd = -1;
+  wire_free(&log_wire);
+  free(log_codes);
+  log_codes = NULL;
+  size_codes = 0;
+  return MI_EXIT_OK;
+}
+
+uint32_t repl_log_seq() {
+  return log_seq;
+}
+
+/* the follower */
+int repl_follow_open(repl_follower_t* follower, const char* log_file, const char* state_file) {
+  char magic[REPL_MAGIC_SIZE];
+  char buffer[320];
+  unsigned long long offset;
+  unsigned int seq;
+  FILE* fp;
+
+  memset(follower,0,sizeof(*follower));
+  wire_init(&follower->buffer);
+  snprintf(follower->state_file,sizeof(follower->state_file),"%s",state_file);
+  follower->stats.offset = REPL_MAGIC_SIZE;
+
+  if ((follower->fd = open(log_file,O_RDONLY)) < 0 ||
+      read(follower->fd,magic,REPL_MAGIC_SIZE) != REPL_MAGIC_SIZE ||
+      memcmp(magic,REPL_MAGIC,REPL_MAGIC_SIZE)) {
+    snprintf(buffer,sizeof(buffer),"repl_follow_open(): %.200s isn't a change log",log_file);
+    log_debug(ERROR,buffer);
+    if (follower->fd >= 0) close(follower->fd);
+    follower->fd = -1;
+    return MI_EXIT_ERROR;
+  }
+
+  if ((fp = fopen(state_file,"r")) != NULL) {
+    if (fscanf(fp,"%u %llu",&seq,&offset) != 2 || offset < REPL_MAGIC_SIZE) {
+      fclose(fp);
+      log_debug(ERROR,"repl_follow_open(): state file unreadable");
+      repl_follow_close(follower);
+      return MI_EXIT_ERROR;
+    }
+    fclose(fp);
+    follower->stats.seq = seq;
+    follower->stats.offset = offset;
+  }
+  follower->read_to = follower->stats.offset;
+  return MI_EXIT_OK;
+}
+
+int repl_follow_close(repl_follower_t* follower) {
+  if (follower->fd >= 0) close(follower->fd);
+  follower->fd = -1;
+  wire_free(&follower->buffer);
+  free(follower->states);
+  follower->states = NULL;
+  follower->size_states = 0;
+  return MI_EXIT_OK;
+}
+
+/* more of the log onto the end of buffer, 0 at the end of what's there */
+static ssize_t follow_read(repl_follower_t* follower) {
+  wire_t* buffer = &follower->buffer;
+  ssize_t got;
+
+  if (wire_reserve(buffer,REPL_READ) != MI_EXIT_OK) return -1;
+  do {
+    got = pread(follower->fd,buffer->data + buffer->len,REPL_READ,(off_t)follower->read_to);
+  } while (got < 0 && errno == EINTR);
+  if (got > 0) {
+    buffer->len += got;
+    follower->read_to += got;
+  }
+  return got;
+}
+
+static int follow_save(const repl_follower_t* follower) {
+  char tmp[300];
+  FILE* fp;
+  int retval = MI_EXIT_OK;
+
+  snprintf(tmp,sizeof(tmp),"%s.tmp",follower->state_file);
+  if ((fp = fopen(tmp,"w")) == NULL) return MI_EXIT_ERROR;
+  if (fprintf(fp,"%u %llu\n",follower->stats.seq,
+	      (unsigned long long)follower->stats.offset) < 0) retval = MI_EXIT_ERROR;
+  if (fclose(fp) != 0) retval = MI_EXIT_ERROR;
+  if (retval == MI_EXIT_OK && rename(tmp,follower->state_file) < 0) retval = MI_EXIT_ERROR;
+  return retval;
+}
+
+/* reads records up to the last whole commit that fits, applies them and
+ * moves past them; anything read beyond that stays in buffer for next time
+ */
+int repl_follow_step(repl_follower_t* follower, size_t max_rows) {
+  wire_t* buffer = &follower->buffer;
+  frame_header_t header;
+  row_state_t* state;
+  row_state_t* grown;
+  size_t end;
+  size_t n = 0;
+  size_t commit_n = 0;   /* rows, bytes, records and seq up to the last commit */
+  size_t commit_at = 0;
+  uint64_t records = 0;
+  uint64_t commit_records = 0;
+  uint32_t commit_seq = follower->stats.seq;
+  ssize_t got;
+  double start;
+  int retval;
+
+  if (follower->fd < 0) {
+    log_debug(ERROR,"repl_follow_step(): not open");
+    return MI_EXIT_ERROR;
+  }
+  if (max_rows == 0) max_rows = REPL_BATCH;
+  buffer->pos = 0;
+  buffer->error = 0;
+
+  while (commit_n < max_rows && !(commit_at && n >= max_rows)) {
+    if ((retval = frame_peek(buffer,&header)) == MI_EXIT_ERROR) {
+      log_debug(ERROR,"repl_follow_step(): bad record in the log");
+      return MI_EXIT_ERROR;
+    }
+    if (retval == MI_NO_RESULTS) {
+      if ((got = follow_read(follower)) < 0) {
+	log_debug(ERROR,"repl_follow_step(): could not read the log");
+	return MI_EXIT_ERROR;
+      }
+      if (got == 0) break;
+      continue;
+    }
+
+    end = buffer->pos + PROTO_HEADER_SIZE + header.length;
+    buffer->pos += PROTO_HEADER_SIZE;
+    wire_get_i64(buffer);
+    while (buffer->pos < end && !buffer->error) {
+      if (n >= follower->size_states) {
+	size_t size = (follower->size_states) ? follower->size_states * 2 : 256;
+
+	if ((grown = realloc(follower->states,sizeof(row_state_t) * size)) == NULL) {
+	  log_debug(ERROR,"repl_follow_step(): out of memory");
+	  return MI_EXIT_ERROR;
+	}
+	follower->states = grown;
+	follower->size_states = size;
+      }
+      state = &follower->states[n++];
+      memset(state,0,sizeof(*state));
+      state->code = wire_get_u32(buffer);
+      state->tables = (int)wire_get_u32(buffer);
+      if (state->tables & STATE_MAIN)  wire_get_media(buffer,&state->item);
+      if (state->tables & STATE_BOOK)  wire_get_book(buffer,&state->book);
+      if (state->tables & STATE_MOVIE) wire_get_movie(buffer,&state->movie);
+    }
+    if (buffer->error || buffer->pos != end) {
+      log_debug(ERROR,"repl_follow_step(): record didn't decode");
+      return MI_EXIT_ERROR;
+    }
+    records++;
+
+    if (header.status == 0) {
+      commit_n = n;
+      commit_at = end;
+      commit_records = records;
+      commit_seq = header.id;
+    }
+  }
+
+  if (commit_at == 0) return MI_NO_RESULTS;
+
+  start = wall_micros() / 1e6;
+  if (commit_n && apply_states(follower->states,commit_n) != MI_EXIT_OK) {
+    log_debug(ERROR,"repl_follow_step(): could not apply the changes");
+    return MI_EXIT_ERROR;
+  }
+  follower->stats.apply_seconds += wall_micros() / 1e6 - start;
+
+  wire_consume(buffer,commit_at);
+  follower->stats.offset += commit_at;
+  follower->stats.seq = commit_seq;
+  follower->stats.records += commit_records;
+  follower->stats.rows += commit_n;
+  follower->stats.batches++;
+
+  /* the changes are in either way, they'd only be applied again */
+  if (follow_save(follower) != MI_EXIT_OK)
+    log_debug(ERROR,"repl_follow_step(): could not save the state file");
+  return MI_EXIT_OK;
+}
+
+int repl_follow_stats(repl_follower_t* follower, repl_stats_t* stats) {
+  unsigned char head[PROTO_HEADER_SIZE + sizeof(int64_t)];
+  struct stat st;
+  int64_t when;
+
+  if (follower->fd < 0 || fstat(follower->fd,&st) < 0) return MI_EXIT_ERROR;
+  follower->stats.lag_bytes = ((uint64_t)st.st_size > follower->stats.offset) ?
+    (uint64_t)st.st_size - follower->stats.offset : 0;
+
+  /* the age of the next record, when there is one */
+  follower->stats.lag_seconds = 0;
+  if (follower->stats.lag_bytes >= sizeof(head) &&
+      pread(follower->fd,head,sizeof(head),(off_t)follower->stats.offset) ==
+      (ssize_t)sizeof(head)) {
+    memcpy(&when,head + PROTO_HEADER_SIZE,sizeof(when));
+    follower->stats.lag_seconds = (wall_micros() - when) / 1e6;
+    if (follower->stats.lag_seconds < 0) follower->stats.lag_seconds = 0;
+  }
+
+  *stats = follower->stats;
+  return MI_EXIT_OK;
+}
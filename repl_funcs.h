@@ -0,0 +1,89 @@
+#ifndef __REPL_FUNCS_H__
+#define __REPL_FUNCS_H__
+
+/* repl_funcs.h - part of mindex
+ *
+ * Log shipping from a writer station to read-only followers.  The writer
+ * opens a change log after init_db(), and from then on every commit
+ * appends a record of what the codes it touched are now (rows and all,
+ * or gone), numbered in commit order.  A follower opens its own copy of
+ * the catalogue (a snapshot_db() of the writer taken when the log was
+ * opened), then repl_follow_step() reads the records it hasn't applied
+ * yet and applies them with apply_states(), many commits to one
+ * transaction.  Records hold whole rows, so applying one twice does no
+ * harm; how far the follower has got is kept in its state file after
+ * each batch.
+ *
+ * Records are wire frames (see proto_funcs.h), written but not synced: a
+ * writer that crashes may lose its last records, after which followers
+ * are best seeded again.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define REPL_MAGIC        "MINDEXL1"   /* the first bytes of a log */
+#define REPL_MAGIC_SIZE   8
+#define REPL_RECORD_BYTES (1024 * 1024) /* a bigger commit is split over records */
+#define REPL_BATCH        4096          /* rows a follower applies to a transaction */
+#define REPL_READ         (256 * 1024)  /* log bytes read at a time */
+
+/* typedefs */
+typedef struct {
+  uint32_t seq;           /* last record applied */
+  uint64_t offset;        /* log bytes applied */
+  uint64_t records;       /* since repl_follow_open() */
+  uint64_t rows;
+  uint64_t batches;
+  uint64_t lag_bytes;     /* in the log and not applied yet */
+  double   lag_seconds;   /* since the oldest record not applied was written,
+			   * 0 when caught up */
+  double   apply_seconds; /* spent in apply_states() */
+} repl_stats_t;
+
+typedef struct {
+  int          fd;
+  char         state_file[256];
+  wire_t       buffer;    /* log from offset on, as far as it's been read */
+  uint64_t     read_to;   /* log offset of the end of buffer */
+  row_state_t* states;
+  size_t       size_states;
+  repl_stats_t stats;
+} repl_follower_t;
+
+/* prototypes */
+int repl_log_open (const char* file);             /* records every commit of the open
+						   * database from now on, continuing
+						   * the numbering of a log already there
+						   */
+int repl_log_close();
+uint32_t repl_log_seq();                          /* of the last record written */
+
+int repl_follow_open (repl_follower_t* follower, const char* log_file, const char* state_file);
+                                                  /* starts where the state file says,
+						   * the top of the log without one
+						   */
+int repl_follow_step (repl_follower_t* follower, size_t max_rows);
+                                                  /* applies the next whole commits, up to
+						   * max_rows (0 for REPL_BATCH) unless one
+						   * commit is bigger, into the open
+						   * database; MI_NO_RESULTS when caught up
+						   */
+int repl_follow_stats(repl_follower_t* follower, repl_stats_t* stats);
+int repl_follow_close(repl_follower_t* follower);
+
+#endif /* __REPL_FUNCS_H__ */
@@ -0,0 +1,510 @@
+/* server_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _GNU_SOURCE /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "server_funcs.h"
+
+/* typedefs */
+typedef struct {
+  int    fd;
+  wire_t in;      /* bytes read and not yet answered */
+  wire_t out;     /* answers not yet written */
+  int    reading; /* EPOLLIN is on, off while out is over SERVER_OUT_LIMIT */
+  int    writing; /* EPOLLOUT is on */
+} conn_t;
+
+/* requests
+ * the payload is read from req and the answer, header and all, written
+ * to resp; a payload that doesn't decode is answered with MI_EXIT_ERROR
+ */
+static int answer_search(int op, wire_t* req, wire_t* resp) {
+  filter_t filter;
+  void* items = NULL;
+  uint32_t num_results = 0;
+  int retval;
+
+  wire_get_filter(req,&filter);
+  if (req->error) return MI_EXIT_ERROR;
+
+  switch (op) {
+  case REQ_SEARCH:
+    retval = search((media_t**)&items,&num_results,&filter);
+    break;
+  case REQ_SEARCH_BOOKS:
+    retval = search_books((book_t**)&items,&num_results,&filter);
+    break;
+  default:
+    retval = search_movies((movie_t**)&items,&num_results,&filter);
+  }
+
+  if (retval == MI_EXIT_OK) {
+    wire_put_u32(resp,num_results);
+    for (uint32_t i = 0; i < num_results; i++) {
+      switch (op) {
+      case REQ_SEARCH:       wire_put_media(resp,(media_t*)items + i); break;
+      case REQ_SEARCH_BOOKS: wire_put_book(resp,(book_t*)items + i);   break;
+      default:               wire_put_movie(resp,(movie_t*)items + i);
+      }
+    }
+  }
+  free(items);
+  return retval;
+}
+
+/* the found flags and rows come back in the order the codes were asked */
+static int answer_many(int op, wire_t* req, wire_t* resp) {
+  static const size_t row_sizes[] = { sizeof(media_t), sizeof(book_t), sizeof(movie_t) };
+  uint32_t codes[PROTO_MANY_MAX];
+  uint8_t found[PROTO_MANY_MAX];
+  size_t size = row_sizes[op - REQ_FETCH_MANY];
+  unsigned char* items = NULL;
+  uint32_t rows;
+  uint32_t n;
+  int retval;
+
+  rows = wire_get_u32(req);
+  n = wire_get_u32(req);
+  if (req->error || n > PROTO_MANY_MAX) return MI_EXIT_ERROR;
+  for (uint32_t i = 0; i < n; i++)
+    codes[i] = wire_get_u32(req);
+  if (req->error) return MI_EXIT_ERROR;
+  if (rows && (items = malloc(size * (n ? n : 1))) == NULL) return MI_EXIT_ERROR;
+
+  switch (op) {
+  case REQ_FETCH_MANY:
+    retval = fetch_many((media_t*)items,found,codes,n);
+    break;
+  case REQ_FETCH_MANY_BOOKS:
+    retval = fetch_many_books((book_t*)items,found,codes,n);
+    break;
+  default:
+    retval = fetch_many_movies((movie_t*)items,found,codes,n);
+  }
+
+  if (retval == MI_EXIT_OK) {
+    wire_put_u32(resp,n);
+    for (uint32_t i = 0; i < n; i++) {
+      wire_put_u32(resp,found[i]);
+      if (!found[i] || items == NULL) continue;
+      switch (op) {
+      case REQ_FETCH_MANY:       wire_put_media(resp,(media_t*)items + i); break;
+      case REQ_FETCH_MANY_BOOKS: wire_put_book(resp,(book_t*)items + i);   break;
+      default:                   wire_put_movie(resp,(movie_t*)items + i);
+      }
+    }
+  }
+  free(items);
+  return retval;
+}
+
+/* stored count, then every row's update time unless it failed */
+static int answer_batch(wire_t* req, wire_t* resp) {
+  media_t* items;
+  book_t* details;
+  size_t stored = 0;
+  uint32_t n;
+  int retval = MI_EXIT_ERROR;
+
+  n = wire_get_u32(req);
+  if (req->error || n > PROTO_BATCH_MAX) return MI_EXIT_ERROR;
+  items = malloc(sizeof(media_t) * (n ? n : 1));
+  details = malloc(sizeof(book_t) * (n ? n : 1));
+  if (items != NULL && details != NULL) {
+    for (uint32_t i = 0; i < n; i++) {
+      wire_get_media(req,&items[i]);
+      wire_get_book(req,&details[i]);
+    }
+    if (!req->error) retval = store_book_item_batch(items,details,n,&stored);
+  }
+
+  wire_put_u32(resp,(uint32_t)stored);
+  if (retval != MI_EXIT_ERROR)
+    for (uint32_t i = 0; i < n; i++)
+      wire_put_i64(resp,(int64_t)items[i].update);
+  free(items);
+  free(details);
+  return retval;
+}
+
+static int answer(const frame_header_t* header, wire_t* req, wire_t* resp) {
+  media_t item;
+  book_t book_detail;
+  movie_t movie_detail;
+  char location[sizeof(item.location)];
+  uint32_t code;
+  int retval = MI_EXIT_ERROR;
+
+  switch (header->op) {
+  case REQ_FETCH:
+  case REQ_FETCH_BOOK:
+  case REQ_FETCH_MOVIE:
+    code = wire_get_u32(req);
+    if (req->error) break;
+    if (header->op == REQ_FETCH) {
+      if ((retval = fetch(&item,code)) == MI_EXIT_OK) wire_put_media(resp,&item);
+    }
+    else if (header->op == REQ_FETCH_BOOK) {
+      if ((retval = fetch_book(&book_detail,code)) == MI_EXIT_OK) wire_put_book(resp,&book_detail);
+    }
+    else if ((retval = fetch_movie(&movie_detail,code)) == MI_EXIT_OK)
+      wire_put_movie(resp,&movie_detail);
+    break;
+
+  case REQ_EXISTS:
+  case REQ_EXISTS_BOOK:
+  case REQ_EXISTS_MOVIE:
+  case REQ_DELETE:
+  case REQ_TOUCH:
+    code = wire_get_u32(req);
+    if (req->error) break;
+    switch (header->op) {
+    case REQ_EXISTS:       retval = exists(code);       break;
+    case REQ_EXISTS_BOOK:  retval = exists_book(code);  break;
+    case REQ_EXISTS_MOVIE: retval = exists_movie(code); break;
+    case REQ_DELETE:       retval = delete(code);       break;
+    default:               retval = touch(code);
+    }
+    break;
+
+  case REQ_CHECKOUT:
+    code = wire_get_u32(req);
+    wire_get_str(req,location,sizeof(location));
+    if (req->error) break;
+    retval = checkout(code,location);
+    break;
+
+  /* the update time is set here, so it goes back to the client */
+  case REQ_STORE:
+  case REQ_UPDATE:
+    wire_get_media(req,&item);
+    if (req->error) break;
+    retval = (header->op == REQ_STORE) ? store(&item) : update(&item);
+    wire_put_i64(resp,(int64_t)item.update);
+    break;
+
+  case REQ_STORE_BOOK:
+  case REQ_UPDATE_BOOK:
+    wire_get_book(req,&book_detail);
+    if (req->error) break;
+    retval = (header->op == REQ_STORE_BOOK) ? store_book(&book_detail) : update_book(&book_detail);
+    break;
+
+  case REQ_STORE_MOVIE:
+  case REQ_UPDATE_MOVIE:
+    wire_get_movie(req,&movie_detail);
+    if (req->error) break;
+    retval = (header->op == REQ_STORE_MOVIE) ? store_movie(&movie_detail) :
+      update_movie(&movie_detail);
+    break;
+
+  case REQ_STORE_BOOK_ITEM:
+  case REQ_UPDATE_BOOK_ITEM:
+    wire_get_media(req,&item);
+    wire_get_book(req,&book_detail);
+    if (req->error) break;
+    retval = (header->op == REQ_STORE_BOOK_ITEM) ? store_book_item(&item,&book_detail) :
+      update_book_item(&item,&book_detail);
+    wire_put_i64(resp,(int64_t)item.update);
+    break;
+
+  case REQ_STORE_MOVIE_ITEM:
+  case REQ_UPDATE_MOVIE_ITEM:
+    wire_get_media(req,&item);
+    wire_get_movie(req,&movie_detail);
+    if (req->error) break;
+    retval = (header->op == REQ_STORE_MOVIE_ITEM) ? store_movie_item(&item,&movie_detail) :
+      update_movie_item(&item,&movie_detail);
+    wire_put_i64(resp,(int64_t)item.update);
+    break;
+
+  case REQ_SEARCH:
+  case REQ_SEARCH_BOOKS:
+  case REQ_SEARCH_MOVIES:
+    retval = answer_search(header->op,req,resp);
+    break;
+
+  case REQ_FETCH_MANY:
+  case REQ_FETCH_MANY_BOOKS:
+  case REQ_FETCH_MANY_MOVIES:
+    retval = answer_many(header->op,req,resp);
+    break;
+
+  case REQ_STORE_BOOK_ITEM_BATCH:
+    retval = answer_batch(req,resp);
+    break;
+
+  default:
+    log_debug(ERROR,"answer(): unknown request");
+  }
+
+  if (req->error) log_debug(ERROR,"answer(): request didn't decode");
+  return retval;
+}
+
+/* connections */
+static int watch(int epoll_fd, conn_t* conn) {
+  struct epoll_event event;
+
+  event.events = (conn->reading ? EPOLLIN : 0) | (conn->writing ? EPOLLOUT : 0);
+  event.data.ptr = conn;
+  return epoll_ctl(epoll_fd,EPOLL_CTL_MOD,conn->fd,&event);
+}
+
+static int num_conns = 0;
+
+static void drop(int epoll_fd, conn_t* conn) {
+  num_conns--;
+  epoll_ctl(epoll_fd,EPOLL_CTL_DEL,conn->fd,NULL);
+  close(conn->fd);
+  wire_free(&conn->in);
+  wire_free(&conn->out);
+  free(conn);
+  log_debug(INFO,"serve(): client gone");
+}
+
+/* answers every whole request waiting in conn->in */
+static int answer_all(conn_t* conn) {
+  frame_header_t header;
+  wire_t req;
+  size_t start;
+  size_t next;
+  int retval;
+
+  while ((retval = frame_peek(&conn->in,&header)) == MI_EXIT_OK) {
+    next = conn->in.pos + PROTO_HEADER_SIZE + header.length;
+
+    /* the payload is read out of a view that ends with it */
+    req = conn->in;
+    req.pos += PROTO_HEADER_SIZE;
+    req.len = next;
+    start = frame_begin(&conn->out,header.op,header.id);
+    frame_end(&conn->out,start,(int16_t)answer(&header,&req,&conn->out));
+    conn->in.pos = next;
+    if (conn->out.error) return MI_EXIT_ERROR;
+  }
+  wire_consume(&conn->in,conn->in.pos);
+  return (retval == MI_EXIT_ERROR) ? MI_EXIT_ERROR : MI_EXIT_OK;
+}
+
+/* MI_EXIT_ERROR if the client has gone */
+static int conn_read(conn_t* conn) {
+  ssize_t got;
+
+  while (1) {
+    if (wire_reserve(&conn->in,SERVER_READ_SIZE) != MI_EXIT_OK) return MI_EXIT_ERROR;
+    got = read(conn->fd,conn->in.data + conn->in.len,SERVER_READ_SIZE);
+    if (got > 0) {
+      conn->in.len += got;
+      if (answer_all(conn) != MI_EXIT_OK) return MI_EXIT_ERROR;
+      if (conn->out.len > SERVER_OUT_LIMIT) return MI_EXIT_OK;
+      continue;
+    }
+    if (got == 0) return MI_EXIT_ERROR;
+    if (errno == EINTR) continue;
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? MI_EXIT_OK : MI_EXIT_ERROR;
+  }
+}
+
+static int conn_write(conn_t* conn) {
+  ssize_t sent;
+
+  while (conn->out.len > 0) {
+    sent = send(conn->fd,conn->out.data,conn->out.len,MSG_NOSIGNAL);
+    if (sent > 0) {
+      wire_consume(&conn->out,sent);
+      continue;
+    }
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return MI_EXIT_OK;
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+/* listening */
+static int listen_on(const char* socket_path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    log_debug(ERROR,"serve(): socket path too long");
+    return -1;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path,socket_path);
+
+  if ((fd = socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0)) < 0) {
+    log_debug(ERROR,"serve(): could not make socket");
+    return -1;
+  }
+
+  /* a socket file nobody answers on is left over from a crash */
+  if (connect(fd,(struct sockaddr*)&addr,sizeof(addr)) == 0) {
+    log_debug(ERROR,"serve(): something is already serving that socket");
+    close(fd);
+    return -1;
+  }
+  unlink(socket_path);
+
+  if (bind(fd,(struct sockaddr*)&addr,sizeof(addr)) < 0 ||
+      chmod(socket_path,S_IRUSR | S_IWUSR) < 0 ||
+      listen(fd,SOMAXCONN) < 0) {
+    log_debug(ERROR,"serve(): could not listen on socket");
+    log_debug(ERROR,strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* fd is non-blocking, and closed if it can't be watched */
+static int conn_add(int epoll_fd, int fd) {
+  struct epoll_event event;
+  conn_t* conn;
+
+  if ((conn = calloc(1,sizeof(conn_t))) == NULL) {
+    close(fd);
+    return MI_EXIT_ERROR;
+  }
+  conn->fd = fd;
+  conn->reading = 1;
+  wire_init(&conn->in);
+  wire_init(&conn->out);
+
+  event.events = EPOLLIN;
+  event.data.ptr = conn;
+  if (epoll_ctl(epoll_fd,EPOLL_CTL_ADD,fd,&event) < 0) {
+    close(fd);
+    free(conn);
+    return MI_EXIT_ERROR;
+  }
+  num_conns++;
+  log_debug(INFO,"serve(): client connected");
+  return MI_EXIT_OK;
+}
+
+static void accept_all(int epoll_fd, int listen_fd) {
+  int fd;
+
+  while ((fd = accept4(listen_fd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    conn_add(epoll_fd,fd);
+}
+
+/* without a listening socket it ends when the last client goes */
+static void event_loop(int epoll_fd, int listen_fd, volatile sig_atomic_t* stop) {
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  conn_t* conn;
+  int ready;
+  int gone;
+
+  while (!*stop && (listen_fd >= 0 || num_conns > 0)) {
+    ready = epoll_wait(epoll_fd,events,SERVER_MAX_EVENTS,-1);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      log_debug(ERROR,"serve(): epoll_wait failed");
+      break;
+    }
+
+    for (int i = 0; i < ready; i++) {
+      if ((conn = events[i].data.ptr) == NULL) {
+	accept_all(epoll_fd,listen_fd);
+	continue;
+      }
+
+      gone = (events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN);
+      if (!gone && (events[i].events & EPOLLIN))
+	gone = conn_read(conn) != MI_EXIT_OK;
+      if (!gone)
+	gone = conn_write(conn) != MI_EXIT_OK;
+      if (gone) {
+	drop(epoll_fd,conn);
+	continue;
+      }
+
+      /* write what's left when there's room, stop reading while it's a lot */
+      conn->writing = conn->out.len > 0;
+      conn->reading = conn->out.len <= SERVER_OUT_LIMIT;
+      watch(epoll_fd,conn);
+    }
+  }
+}
+
+int serve(const char* socket_path, volatile sig_atomic_t* stop) {
+  struct epoll_event event;
+  int listen_fd;
+  int epoll_fd;
+
+  if ((listen_fd = listen_on(socket_path)) < 0)
+    return MI_EXIT_ERROR;
+  if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    log_debug(ERROR,"serve(): could not make epoll set");
+    close(listen_fd);
+    unlink(socket_path);
+    return MI_EXIT_ERROR;
+  }
+
+  /* the listening socket is the one entry whose data isn't a conn_t */
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(epoll_fd,EPOLL_CTL_ADD,listen_fd,&event);
+  log_debug(INFO,"serve(): listening");
+
+  event_loop(epoll_fd,listen_fd,stop);
+
+  /* clients still connected when stopped are closed by the exit */
+  close(epoll_fd);
+  close(listen_fd);
+  unlink(socket_path);
+  log_debug(INFO,"serve(): stopped");
+  return MI_EXIT_OK;
+}
+
+int serve_fd(int fd, volatile sig_atomic_t* stop) {
+  int epoll_fd;
+
+  if (fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK) < 0 ||
+      (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    log_debug(ERROR,"serve_fd(): could not set up the socket");
+    close(fd);
+    return MI_EXIT_ERROR;
+  }
+  if (conn_add(epoll_fd,fd) != MI_EXIT_OK) {
+    close(epoll_fd);
+    return MI_EXIT_ERROR;
+  }
+  event_loop(epoll_fd,-1,stop);
+  close(epoll_fd);
+  log_debug(INFO,"serve_fd(): stopped");
+  return MI_EXIT_OK;
+}
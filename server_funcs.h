@@ -0,0 +1,48 @@
+#ifndef __SERVER_FUNCS_H__
+#define __SERVER_FUNCS_H__
+
+/* server_funcs.h - part of mindex
+ *
+ * The mindexd event loop: one thread, one epoll set, every client on the
+ * same open database.  Requests are read as they arrive, answered in the
+ * order they came and written back without blocking, so a client can
+ * queue up as many as it likes before reading any answers.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE  65536            /* bytes asked of read() at a time */
+#define SERVER_OUT_LIMIT  (4 * 1024 * 1024) /* answers waiting before a client's
+					     * requests stop being read
+					     */
+
+/* prototypes */
+int serve(const char* socket_path, volatile sig_atomic_t* stop);
+                                                  /* answers requests on socket_path from
+						   * the database init_db() opened until
+						   * *stop is set (by a signal handler),
+						   * MI_EXIT_ERROR if it can't listen
+						   */
+int serve_fd(int fd, volatile sig_atomic_t* stop);
+                                                  /* the same on one connected socket (one
+						   * end of a socketpair()), until the
+						   * other end closes it
+						   */
+
+#endif /* __SERVER_FUNCS_H__ */
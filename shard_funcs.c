@@ -0,0 +1,903 @@
+/* shard_funcs.c - part of mindex
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "db_funcs.h"
+#include "log_funcs.h"
+#include "proto_funcs.h"
+#include "server_funcs.h"
+#include "shard_funcs.h"
+
+/* one worker and the wire to it, a request to each is answered before
+ * the next goes out, so the id only checks we're in step
+ */
+typedef struct {
+  pid_t    pid;
+  int      fd;
+  uint32_t id;
+  wire_t   request;
+  wire_t   response;     /* pos is at the payload of the current answer */
+  size_t   response_end;
+} shard_t;
+
+/* globals */
+static shard_t shards[SHARD_MAX];
+static int num_shards = 0;
+static char shard_dir[200];   /* where they are, for the dumps */
+static volatile sig_atomic_t worker_stop = 0; /* workers stop when we hang up instead */
+
+static void shard_path(char* path, size_t size, const char* dir, int i) {
+  snprintf(path,size,"%s/shard-%02d.db",dir,i);
+}
+
+/* workers
+ * a worker is the child of a fork(), so it starts with our database (if
+ * any) open; forget_db() lets go of it without closing it, which could
+ * undo the parent's journal, before the worker opens its own shard
+ */
+static void hang_up(int upto) {
+  for (int i = 0; i < upto; i++) {
+    if (shards[i].fd >= 0) close(shards[i].fd);
+    shards[i].fd = -1;
+  }
+}
+
+static int worker_start(int i, const char* dir, const db_options_t* options) {
+  char file[256];
+  int pair[2];
+  pid_t pid;
+
+  shard_path(file,sizeof(file),dir,i);
+  if (socketpair(AF_UNIX,SOCK_STREAM,0,pair) < 0) {
+    log_debug(ERROR,"shard_open(): no socketpair");
+    log_debug(ERROR,strerror(errno));
+    return MI_EXIT_ERROR;
+  }
+
+  fflush(NULL);
+  if ((pid = fork()) < 0) {
+    log_debug(ERROR,"shard_open(): could not fork a worker");
+    close(pair[0]);
+    close(pair[1]);
+    return MI_EXIT_ERROR;
+  }
+  if (pid == 0) {
+    close(pair[0]);
+    hang_up(i);
+    signal(SIGPIPE,SIG_IGN);
+    forget_db();
+    if (init_db_ex(file,options) != MI_EXIT_OK) _exit(1);
+    serve_fd(pair[1],&worker_stop);
+    close_db();
+    _exit(0);
+  }
+
+  close(pair[1]);
+  shards[i].pid = pid;
+  shards[i].fd = pair[0];
+  shards[i].id = 0;
+  wire_init(&shards[i].request);
+  wire_init(&shards[i].response);
+  shards[i].response_end = 0;
+  return MI_EXIT_OK;
+}
+
+/* the wire */
+static size_t shard_begin(shard_t* shard, int op) {
+  shard->request.len = 0;
+  shard->request.pos = 0;
+  shard->request.error = 0;
+  return frame_begin(&shard->request,(uint16_t)op,++shard->id);
+}
+
+static int shard_send(shard_t* shard, size_t start) {
+  frame_end(&shard->request,start,0);
+  if (shard->request.error) {
+    log_debug(ERROR,"shard: could not build request");
+    return MI_EXIT_ERROR;
+  }
+  if (frame_write(shard->fd,&shard->request) != MI_EXIT_OK) {
+    log_debug(ERROR,"shard: lost a worker sending");
+    return MI_EXIT_ERROR;
+  }
+  return MI_EXIT_OK;
+}
+
+/* the status of the answer to the last request sent */
+static int shard_receive(shard_t* shard) {
+  frame_header_t header;
+
+  shard->response.pos = shard->response_end;
+  wire_consume(&shard->response,shard->response.pos);
+  shard->response.error = 0;
+
+  if (frame_read(shard->fd,&shard->response,&header) != MI_EXIT_OK) {
+    log_debug(ERROR,"shard: lost a worker reading, or its answer was too big");
+    return MI_EXIT_ERROR;
+  }
+  shard->response.pos += PROTO_HEADER_SIZE;
+  shard->response_end = shard->response.pos + header.length;
+  if (header.id != shard->id) {
+    log_debug(ERROR,"shard: answer to some other request");
+    return MI_EXIT_ERROR;
+  }
+  return header.status;
+}
+
+static int shard_call(shard_t* shard, size_t start) {
+  if (shard_send(shard,start) != MI_EXIT_OK) return MI_EXIT_ERROR;
+  return shard_receive(shard);
+}
+
+/* an answer that was cut short is as good as none */
+static int checked(const shard_t* shard, int retval) {
+  return (shard->response.error) ? MI_EXIT_ERROR : retval;
+}
+
+int shard_open(const char* dir, int count, const db_options_t* options) {
+  char file[256];
+  char buffer[320];
+  FILE* fp;
+  int made = 0;
+  int retval = MI_EXIT_OK;
+
+  if (num_shards) shard_close();
+
+  if (mkdir(dir,0777) < 0 && errno != EEXIST) {
+    snprintf(buffer,sizeof(buffer),"shard_open(): could not make %.200s",dir);
+    log_debug(ERROR,buffer);
+    return MI_EXIT_ERROR;
+  }
+
+  /* the count decides where every code lives, so it can't change */
+  snprintf(file,sizeof(file),"%s/shards",dir);
+  if ((fp = fopen(file,"r")) != NULL) {
+    if (fscanf(fp,"%d",&made) != 1) made = -1;
+    fclose(fp);
+    if (made < 1 || made > SHARD_MAX) {
+      log_debug(ERROR,"shard_open(): shard count file unreadable");
+      return MI_EXIT_ERROR;
+    }
+    if (count && count != made) {
+      snprintf(buffer,sizeof(buffer),"shard_open(): %.200s has %d shards",dir,made);
+      log_debug(ERROR,buffer);
+      return MI_EXIT_ERROR;
+    }
+    count = made;
+  }
+  if (count < 1 || count > SHARD_MAX) {
+    log_debug(ERROR,"shard_open(): bad shard count");
+    return MI_EXIT_ERROR;
+  }
+
+  snprintf(shard_dir,sizeof(shard_dir),"%s",dir);
+  for (int i = 0; i < count && retval == MI_EXIT_OK; i++)
+    if ((retval = worker_start(i,dir,options)) == MI_EXIT_OK) num_shards = i + 1;
+
+  /* a worker that couldn't open its shard has hung up by now */
+  for (int i = 0; i < num_shards && retval == MI_EXIT_OK; i++) {
+    size_t start = shard_begin(&shards[i],REQ_EXISTS);
+
+    wire_put_u32(&shards[i].request,0);
+    if (shard_call(&shards[i],start) == MI_EXIT_ERROR) {
+      shard_path(file,sizeof(file),dir,i);
+      snprintf(buffer,sizeof(buffer),"shard_open(): could not open %.200s",file);
+      log_debug(ERROR,buffer);
+      retval = MI_EXIT_ERROR;
+    }
+  }
+
+  if (retval == MI_EXIT_OK && !made) {
+    snprintf(file,sizeof(file),"%s/shards",dir);
+    if ((fp = fopen(file,"w")) == NULL || fprintf(fp,"%d\n",count) < 0) retval = MI_EXIT_ERROR;
+    if (fp != NULL && fclose(fp) != 0) retval = MI_EXIT_ERROR;
+    if (retval != MI_EXIT_OK) log_debug(ERROR,"shard_open(): could not write shard count");
+  }
+
+  if (retval != MI_EXIT_OK) {
+    shard_close();
+    return MI_EXIT_ERROR;
+  }
+  log_debug(INFO,"shard_open(): workers up");
+  return MI_EXIT_OK;
+}
+
+int shard_close() {
+  hang_up(num_shards);
+  for (int i = 0; i < num_shards; i++) {
+    while (waitpid(shards[i].pid,NULL,0) < 0 && errno == EINTR);
+    wire_free(&shards[i].request);
+    wire_free(&shards[i].response);
+  }
+  num_shards = 0;
+  return MI_EXIT_OK;
+}
+
+int shard_count() {
+  return num_shards;
+}
+
+/* codes are often handed out in runs, so they're mixed before the modulo
+ * to spread a run over every shard
+ */
+int shard_of(uint32_t code) {
+  uint64_t x = code;
+
+  if (!num_shards) return 0;
+  x = (x ^ (x >> 33)) * 0xff51afd7ed558ccdULL;
+  x = (x ^ (x >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return (int)(x % (uint64_t)num_shards);
+}
+
+static shard_t* shard_for(uint32_t code) {
+  if (!num_shards) {
+    log_debug(ERROR,"shard: not open");
+    return NULL;
+  }
+  return &shards[shard_of(code)];
+}
+
+/* calls by code, to the one worker with the code */
+static int call_code(shard_t* shard, int op, uint32_t code) {
+  size_t start;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  start = shard_begin(shard,op);
+  wire_put_u32(&shard->request,code);
+  return shard_call(shard,start);
+}
+
+int shard_fetch(media_t* sought, uint32_t code) {
+  shard_t* shard = shard_for(code);
+  int retval = call_code(shard,REQ_FETCH,code);
+
+  if (retval == MI_EXIT_OK) wire_get_media(&shard->response,sought);
+  return (shard) ? checked(shard,retval) : retval;
+}
+
+int shard_fetch_book(book_t* sought, uint32_t code) {
+  shard_t* shard = shard_for(code);
+  int retval = call_code(shard,REQ_FETCH_BOOK,code);
+
+  if (retval == MI_EXIT_OK) wire_get_book(&shard->response,sought);
+  return (shard) ? checked(shard,retval) : retval;
+}
+
+int shard_fetch_movie(movie_t* sought, uint32_t code) {
+  shard_t* shard = shard_for(code);
+  int retval = call_code(shard,REQ_FETCH_MOVIE,code);
+
+  if (retval == MI_EXIT_OK) wire_get_movie(&shard->response,sought);
+  return (shard) ? checked(shard,retval) : retval;
+}
+
+int shard_exists(uint32_t code) {
+  return call_code(shard_for(code),REQ_EXISTS,code);
+}
+
+int shard_exists_book(uint32_t code) {
+  return call_code(shard_for(code),REQ_EXISTS_BOOK,code);
+}
+
+int shard_exists_movie(uint32_t code) {
+  return call_code(shard_for(code),REQ_EXISTS_MOVIE,code);
+}
+
+int shard_delete(uint32_t code) {
+  return call_code(shard_for(code),REQ_DELETE,code);
+}
+
+int shard_touch(uint32_t code) {
+  return call_code(shard_for(code),REQ_TOUCH,code);
+}
+
+int shard_checkout(uint32_t code, const char* location) {
+  shard_t* shard = shard_for(code);
+  size_t start;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  start = shard_begin(shard,REQ_CHECKOUT);
+  wire_put_u32(&shard->request,code);
+  wire_put_str(&shard->request,location);
+  return shard_call(shard,start);
+}
+
+/* writes, the worker sets the update time and sends it back */
+static int write_media(int op, media_t* item) {
+  shard_t* shard = shard_for(item->code);
+  size_t start;
+  int retval;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  start = shard_begin(shard,op);
+  wire_put_media(&shard->request,item);
+  retval = shard_call(shard,start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&shard->response);
+  return checked(shard,retval);
+}
+
+int shard_store(media_t* item) {
+  return write_media(REQ_STORE,item);
+}
+
+int shard_update(media_t* item) {
+  return write_media(REQ_UPDATE,item);
+}
+
+static int write_book(int op, book_t* item) {
+  shard_t* shard = shard_for(item->code);
+  size_t start;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  start = shard_begin(shard,op);
+  wire_put_book(&shard->request,item);
+  return shard_call(shard,start);
+}
+
+static int write_movie(int op, movie_t* item) {
+  shard_t* shard = shard_for(item->code);
+  size_t start;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  start = shard_begin(shard,op);
+  wire_put_movie(&shard->request,item);
+  return shard_call(shard,start);
+}
+
+int shard_store_book(book_t* item) {
+  return write_book(REQ_STORE_BOOK,item);
+}
+
+int shard_update_book(book_t* item) {
+  return write_book(REQ_UPDATE_BOOK,item);
+}
+
+int shard_store_movie(movie_t* item) {
+  return write_movie(REQ_STORE_MOVIE,item);
+}
+
+int shard_update_movie(movie_t* item) {
+  return write_movie(REQ_UPDATE_MOVIE,item);
+}
+
+/* detail takes its code and type from item, as in db_funcs */
+static int write_book_item(int op, media_t* item, book_t* detail) {
+  shard_t* shard = shard_for(item->code);
+  size_t start;
+  int retval;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  detail->code = item->code;
+  detail->type = item->type;
+  start = shard_begin(shard,op);
+  wire_put_media(&shard->request,item);
+  wire_put_book(&shard->request,detail);
+  retval = shard_call(shard,start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&shard->response);
+  return checked(shard,retval);
+}
+
+static int write_movie_item(int op, media_t* item, movie_t* detail) {
+  shard_t* shard = shard_for(item->code);
+  size_t start;
+  int retval;
+
+  if (shard == NULL) return MI_EXIT_ERROR;
+  detail->code = item->code;
+  detail->type = item->type;
+  start = shard_begin(shard,op);
+  wire_put_media(&shard->request,item);
+  wire_put_movie(&shard->request,detail);
+  retval = shard_call(shard,start);
+  if (retval != MI_EXIT_ERROR) item->update = (time_t)wire_get_i64(&shard->response);
+  return checked(shard,retval);
+}
+
+int shard_store_book_item(media_t* item, book_t* detail) {
+  return write_book_item(REQ_STORE_BOOK_ITEM,item,detail);
+}
+
+int shard_store_movie_item(media_t* item, movie_t* detail) {
+  return write_movie_item(REQ_STORE_MOVIE_ITEM,item,detail);
+}
+
+int shard_update_book_item(media_t* item, book_t* detail) {
+  return write_book_item(REQ_UPDATE_BOOK_ITEM,item,detail);
+}
+
+int shard_update_movie_item(media_t* item, movie_t* detail) {
+  return write_movie_item(REQ_UPDATE_MOVIE_ITEM,item,detail);
+}
+
+/* fan out
+ * the positions of a list are grouped by shard (in list order within a
+ * shard), then each round sends every shard with any left one request's
+ * worth before reading any answer, so the workers are busy together.
+ * After an error no more rounds go out, but the answers already owed are
+ * read so every worker stays in step.
+ */
+static size_t* group_by_shard(const uint32_t* codes, size_t n, size_t* begin) {
+  size_t* order = malloc(sizeof(size_t) * (n ? n : 1));
+  size_t next[SHARD_MAX];
+
+  if (order == NULL) {
+    log_debug(ERROR,"shard: out of memory");
+    return NULL;
+  }
+  memset(begin,0,sizeof(size_t) * (num_shards + 1));
+  for (size_t i = 0; i < n; i++) begin[shard_of(codes[i]) + 1]++;
+  for (int s = 0; s < num_shards; s++) begin[s + 1] += begin[s];
+  memcpy(next,begin,sizeof(size_t) * num_shards);
+  for (size_t i = 0; i < n; i++) order[next[shard_of(codes[i])]++] = i;
+  return order;
+}
+
+static int fetch_many_call(int op, void* items, size_t row_size, uint8_t* found,
+			   const uint32_t* codes, size_t n) {
+  size_t begin[SHARD_MAX + 1];
+  size_t done[SHARD_MAX];
+  uint32_t count[SHARD_MAX];
+  size_t* order;
+  size_t num_found = 0;
+  size_t start;
+  size_t at;
+  int sent;
+  int status;
+  int retval = MI_EXIT_OK;
+
+  if (!num_shards) {
+    log_debug(ERROR,"shard: not open");
+    return MI_EXIT_ERROR;
+  }
+  memset(found,0,n);
+  if ((order = group_by_shard(codes,n,begin)) == NULL) return MI_EXIT_ERROR;
+  memcpy(done,begin,sizeof(size_t) * num_shards);
+
+  do {
+    sent = 0;
+    for (int s = 0; s < num_shards; s++) {
+      count[s] = 0;
+      if (retval == MI_EXIT_ERROR || done[s] == begin[s + 1]) continue;
+      count[s] = (uint32_t)((begin[s + 1] - done[s] < PROTO_MANY_MAX) ?
+			    begin[s + 1] - done[s] : PROTO_MANY_MAX);
+      start = shard_begin(&shards[s],op);
+      wire_put_u32(&shards[s].request,items != NULL);
+      wire_put_u32(&shards[s].request,count[s]);
+      for (uint32_t i = 0; i < count[s]; i++)
+	wire_put_u32(&shards[s].request,codes[order[done[s] + i]]);
+      if (shard_send(&shards[s],start) != MI_EXIT_OK) {
+	count[s] = 0;
+	retval = MI_EXIT_ERROR;
+	continue;
+      }
+      sent++;
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+      wire_t* response = &shards[s].response;
+
+      if (!count[s]) continue;
+      status = shard_receive(&shards[s]);
+      if (status == MI_EXIT_ERROR) retval = MI_EXIT_ERROR;
+      if (status == MI_EXIT_OK && retval != MI_EXIT_ERROR) {
+	if (wire_get_u32(response) != count[s]) response->error = 1;
+	for (uint32_t i = 0; i < count[s] && !response->error; i++) {
+	  if (!wire_get_u32(response)) continue;
+	  at = order[done[s] + i];
+	  found[at] = 1;
+	  num_found++;
+	  if (items == NULL) continue;
+	  switch (op) {
+	  case REQ_FETCH_MANY:
+	    wire_get_media(response,(media_t*)((unsigned char*)items + at * row_size));
+	    break;
+	  case REQ_FETCH_MANY_BOOKS:
+	    wire_get_book(response,(book_t*)((unsigned char*)items + at * row_size));
+	    break;
+	  default:
+	    wire_get_movie(response,(movie_t*)((unsigned char*)items + at * row_size));
+	  }
+	}
+	if (response->error) {
+	  log_debug(ERROR,"shard_fetch_many(): could not read the results");
+	  retval = MI_EXIT_ERROR;
+	}
+      }
+      done[s] += count[s];
+    }
+  } while (sent);
+
+  free(order);
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  return (num_found) ? MI_EXIT_OK : MI_NO_RESULTS;
+}
+
+int shard_fetch_many(media_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY,items,sizeof(media_t),found,codes,n);
+}
+
+int shard_fetch_many_books(book_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY_BOOKS,items,sizeof(book_t),found,codes,n);
+}
+
+int shard_fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n) {
+  return fetch_many_call(REQ_FETCH_MANY_MOVIES,items,sizeof(movie_t),found,codes,n);
+}
+
+int shard_store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored) {
+  size_t begin[SHARD_MAX + 1];
+  size_t done[SHARD_MAX];
+  uint32_t count[SHARD_MAX];
+  uint32_t* codes;
+  size_t* order;
+  size_t stored = 0;
+  size_t start;
+  size_t at;
+  int all_there = 1;
+  int sent;
+  int status;
+  int retval = MI_EXIT_OK;
+
+  if (num_stored) *num_stored = 0;
+  if (!num_shards) {
+    log_debug(ERROR,"shard: not open");
+    return MI_EXIT_ERROR;
+  }
+  if ((codes = malloc(sizeof(uint32_t) * (n ? n : 1))) == NULL) {
+    log_debug(ERROR,"shard: out of memory");
+    return MI_EXIT_ERROR;
+  }
+  for (size_t i = 0; i < n; i++) {
+    details[i].code = items[i].code;
+    details[i].type = items[i].type;
+    codes[i] = items[i].code;
+  }
+  order = group_by_shard(codes,n,begin);
+  free(codes);
+  if (order == NULL) return MI_EXIT_ERROR;
+  memcpy(done,begin,sizeof(size_t) * num_shards);
+
+  do {
+    sent = 0;
+    for (int s = 0; s < num_shards; s++) {
+      count[s] = 0;
+      if (retval == MI_EXIT_ERROR || done[s] == begin[s + 1]) continue;
+      count[s] = (uint32_t)((begin[s + 1] - done[s] < PROTO_BATCH_MAX) ?
+			    begin[s + 1] - done[s] : PROTO_BATCH_MAX);
+      start = shard_begin(&shards[s],REQ_STORE_BOOK_ITEM_BATCH);
+      wire_put_u32(&shards[s].request,count[s]);
+      for (uint32_t i = 0; i < count[s]; i++) {
+	at = order[done[s] + i];
+	wire_put_media(&shards[s].request,&items[at]);
+	wire_put_book(&shards[s].request,&details[at]);
+      }
+      if (shard_send(&shards[s],start) != MI_EXIT_OK) {
+	count[s] = 0;
+	retval = MI_EXIT_ERROR;
+	continue;
+      }
+      sent++;
+    }
+
+    for (int s = 0; s < num_shards; s++) {
+      wire_t* response = &shards[s].response;
+
+      if (!count[s]) continue;
+      status = shard_receive(&shards[s]);
+      if (status == MI_EXIT_ERROR) {
+	retval = MI_EXIT_ERROR;
+	continue;
+      }
+      stored += wire_get_u32(response);
+      for (uint32_t i = 0; i < count[s]; i++)
+	items[order[done[s] + i]].update = (time_t)wire_get_i64(response);
+      if (response->error) retval = MI_EXIT_ERROR;
+      if (status != MI_EXISTS) all_there = 0;
+      done[s] += count[s];
+    }
+  } while (sent);
+
+  free(order);
+  if (num_stored) *num_stored = stored;
+  if (retval == MI_EXIT_ERROR) return MI_EXIT_ERROR;
+  return (all_there && n) ? MI_EXISTS : MI_EXIT_OK;
+}
+
+/* searches
+ * every worker gets the filter at once, with the offset folded into the
+ * limit since it can only be counted once the shards' rows are merged.
+ * The merge sorts on the filter's field with code breaking ties, as the
+ * SQL does, so the rows come back in the order one database would give.
+ */
+typedef struct {
+  const void* row;
+  int64_t     num;
+  const char* text;
+  uint32_t    code;
+} merged_t;
+
+static int merge_desc;
+
+static int merged_cmp(const void* a, const void* b) {
+  const merged_t* x = a;
+  const merged_t* y = b;
+  int cmp;
+
+  if (x->text != NULL)
+    cmp = strcmp(x->text,y->text);
+  else
+    cmp = (x->num > y->num) - (x->num < y->num);
+  if (!cmp) cmp = (x->code > y->code) - (x->code < y->code);
+  return (merge_desc) ? -cmp : cmp;
+}
+
+/* the value a row is ordered by, text stays NULL for numbers; key is
+ * room for the sort key when that's the order
+ */
+static void merged_value(merged_t* m, int op, int order, char* key, size_t key_size) {
+  const media_t* media = m->row;
+  const book_t* book = m->row;
+  const movie_t* movie = m->row;
+
+  m->num = 0;
+  m->text = NULL;
+  switch (op) {
+  case REQ_SEARCH:
+    m->code = media->code;
+    switch (order) {
+    case F_TYPE:     m->num = media->type;           break;
+    case F_NAME:     m->text = media->name;          break;
+    case F_LOCATION: m->text = media->location;      break;
+    case F_UPDATE:   m->num = (int64_t)media->update; break;
+    case F_SORT:     sort_key(media->name,key,key_size); m->text = key; break;
+    default:         m->num = media->code;
+    }
+    break;
+  case REQ_SEARCH_BOOKS:
+    m->code = book->code;
+    switch (order) {
+    case F_TYPE:         m->num = book->type;          break;
+    case F_GENRE:        m->num = book->genre;         break;
+    case F_ISBN:         m->text = book->isbn;         break;
+    case F_TITLE:        m->text = book->title;        break;
+    case F_AUTHOR_LAST:  m->text = book->author_last;  break;
+    case F_AUTHOR_FIRST: m->text = book->author_first; break;
+    case F_AUTHOR_REST:  m->text = book->author_rest;  break;
+    case F_SORT:         sort_key(book->title,key,key_size); m->text = key; break;
+    default:             m->num = book->code;
+    }
+    break;
+  default:
+    m->code = movie->code;
+    switch (order) {
+    case F_TYPE:     m->num = movie->type;      break;
+    case F_GENRE:    m->num = movie->genre;     break;
+    case F_TITLE:    m->text = movie->title;    break;
+    case F_DIRECTOR: m->text = movie->director; break;
+    case F_STUDIO:   m->text = movie->studio;   break;
+    case F_RATING:   m->num = movie->rating;    break;
+    case F_SORT:     sort_key(movie->title,key,key_size); m->text = key; break;
+    default:         m->num = movie->code;
+    }
+  }
+}
+
+static int search_call(int op, void** items, size_t row_size, uint32_t* num_results,
+		       const filter_t* filter) {
+  filter_t each;
+  size_t start;
+  size_t total = 0;
+  size_t first;
+  size_t last;
+  uint32_t count;
+  unsigned char* rows = NULL;
+  unsigned char* grown;
+  unsigned char* out;
+  merged_t* merged = NULL;
+  char (*keys)[128] = NULL;
+  int sent = 0;
+  int status;
+  int retval = MI_EXIT_OK;
+
+  *items = NULL;
+  *num_results = 0;
+  if (!num_shards) {
+    log_debug(ERROR,"shard: not open");
+    return MI_EXIT_ERROR;
+  }
+
+  if (filter != NULL)
+    each = *filter;
+  else
+    filter_init(&each);
+  /* each shard sends its first offset + limit rows, which only holds
+   * the right rows if every shard cuts them in the order of the merge,
+   * so a limit with no order is ordered by code (as the merge is)
+   */
+  if ((each.limit || each.offset) && each.order < 0) each.order = F_CODE;
+  if (each.limit)
+    each.limit = (each.limit > UINT32_MAX - each.offset) ? UINT32_MAX : each.limit + each.offset;
+  each.offset = 0;
+  for (int s = 0; s < num_shards; s++) {
+    start = shard_begin(&shards[s],op);
+    wire_put_filter(&shards[s].request,&each);
+    if (shard_send(&shards[s],start) != MI_EXIT_OK) {
+      retval = MI_EXIT_ERROR;
+      break;
+    }
+    sent++;
+  }
+
+  for (int s = 0; s < sent; s++) {
+    wire_t* response = &shards[s].response;
+
+    status = shard_receive(&shards[s]);
+    if (status == MI_EXIT_ERROR) retval = MI_EXIT_ERROR;
+    if (status != MI_EXIT_OK || retval == MI_EXIT_ERROR) continue;
+    count = wire_get_u32(response);
+    if (response->error || !count) continue;
+    if ((grown = realloc(rows,row_size * (total + count))) == NULL) {
+      log_debug(ERROR,"shard_search(): out of memory");
+      retval = MI_EXIT_ERROR;
+      continue;
+    }
+    rows = grown;
+    for (uint32_t i = 0; i < count; i++) {
+      switch (op) {
+      case REQ_SEARCH:       wire_get_media(response,(media_t*)(rows + (total + i) * row_size)); break;
+      case REQ_SEARCH_BOOKS: wire_get_book(response,(book_t*)(rows + (total + i) * row_size));   break;
+      default:               wire_get_movie(response,(movie_t*)(rows + (total + i) * row_size));
+      }
+    }
+    if (response->error) {
+      log_debug(ERROR,"shard_search(): could not read the results");
+      retval = MI_EXIT_ERROR;
+    }
+    total += count;
+  }
+
+  /* no order is merged by code, the order the shards cut a limit in */
+  if (retval == MI_EXIT_OK && total &&
+      ((merged = malloc(sizeof(merged_t) * total)) == NULL ||
+       (filter != NULL && filter->order == F_SORT &&
+	(keys = malloc(sizeof(*keys) * total)) == NULL) ||
+       (out = malloc(row_size * total)) == NULL)) {
+    log_debug(ERROR,"shard_search(): out of memory");
+    retval = MI_EXIT_ERROR;
+  }
+  if (retval != MI_EXIT_OK) {
+    free(rows);
+    free(merged);
+    free(keys);
+    return MI_EXIT_ERROR;
+  }
+  if (!total) {
+    free(rows);
+    return MI_NO_RESULTS;
+  }
+
+  for (size_t i = 0; i < total; i++) {
+    merged[i].row = rows + i * row_size;
+    merged_value(&merged[i],op,(filter != NULL) ? filter->order : -1,
+		 (keys != NULL) ? keys[i] : NULL,sizeof(*keys));
+  }
+  merge_desc = (filter != NULL && filter->desc);
+  qsort(merged,total,sizeof(merged_t),merged_cmp);
+
+  first = (filter != NULL) ? filter->offset : 0;
+  last = (filter != NULL && filter->limit && first + filter->limit < total) ?
+    first + filter->limit : total;
+  for (size_t i = first; i < last; i++)
+    memcpy(out + (i - first) * row_size,merged[i].row,row_size);
+  free(rows);
+  free(merged);
+  free(keys);
+
+  if (first >= last) {
+    free(out);
+    return MI_NO_RESULTS;
+  }
+  *items = out;
+  *num_results = (uint32_t)(last - first);
+  return MI_EXIT_OK;
+}
+
+int shard_search(media_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH,(void**)items,sizeof(media_t),num_results,filter);
+}
+
+int shard_search_books(book_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH_BOOKS,(void**)items,sizeof(book_t),num_results,filter);
+}
+
+int shard_search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter) {
+  return search_call(REQ_SEARCH_MOVIES,(void**)items,sizeof(movie_t),num_results,filter);
+}
+
+/* dumps
+ * one child per shard, each opening its file read-only alongside the
+ * workers, and all of them running at once
+ */
+static int dump_all(const char* dir, const char* prefix, int pretty) {
+  char file[256];
+  char name[256];
+  db_options_t options;
+  pid_t pids[SHARD_MAX];
+  int status;
+  int started = 0;
+  int retval = MI_EXIT_OK;
+
+  if (!num_shards) {
+    log_debug(ERROR,"shard: not open");
+    return MI_EXIT_ERROR;
+  }
+  fflush(NULL);
+  for (int i = 0; i < num_shards; i++) {
+    if ((pids[i] = fork()) < 0) {
+      log_debug(ERROR,"shard_dump(): could not fork");
+      retval = MI_EXIT_ERROR;
+      break;
+    }
+    if (pids[i] == 0) {
+      hang_up(num_shards);
+      forget_db();
+      db_options_init(&options);
+      options.read_only = DB_READ_ONLY;
+      shard_path(file,sizeof(file),shard_dir,i);
+      if (init_db_ex(file,&options) != MI_EXIT_OK) _exit(1);
+      if (pretty) {
+	snprintf(name,sizeof(name),"%s%sshard-%02d.txt",dir,prefix,i);
+	status = pretty_dump(name);
+      }
+      else {
+	snprintf(name,sizeof(name),"%sshard-%02d-",prefix,i);
+	status = csv_dump(dir,name);
+      }
+      close_db();
+      _exit(status == MI_EXIT_ERROR);
+    }
+    started++;
+  }
+
+  for (int i = 0; i < started; i++) {
+    while (waitpid(pids[i],&status,0) < 0 && errno == EINTR);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) retval = MI_EXIT_ERROR;
+  }
+  if (retval != MI_EXIT_OK) log_debug(ERROR,"shard_dump(): a shard didn't dump");
+  return retval;
+}
+
+int shard_csv_dump(const char* dir, const char* prefix) {
+  return dump_all(dir,prefix,0);
+}
+
+int shard_pretty_dump(const char* dir, const char* prefix) {
+  return dump_all(dir,prefix,1);
+}
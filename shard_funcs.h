@@ -0,0 +1,96 @@
+#ifndef __SHARD_FUNCS_H__
+#define __SHARD_FUNCS_H__
+
+/* shard_funcs.h - part of mindex
+ *
+ * A catalogue split over several database files in one directory, for
+ * collections that outgrow the write lock of a single file.  Each shard
+ * has a worker process of its own (db_funcs keeps one database per
+ * process), forked by shard_open() and spoken to over a socketpair in
+ * the mindexd protocol.  A code always lives in shard_of(code), so a
+ * lookup or write by code goes to one worker.  fetch_many, batched
+ * stores and searches are sent to every worker they need before any
+ * answer is read, so the shards do their parts at the same time, and
+ * search results are merged back into the order the filter asked for.
+ *
+ * Each shard_*() function takes the same arguments and gives the same
+ * results as the db_funcs function of the same name.  Like db_handle
+ * there is one sharded catalogue per process.
+ *
+ * Copyright © 2012 Frank Joseph Greer
+ *
+ *  mindex is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* defines */
+#define SHARD_MAX 64
+
+/* prototypes */
+int shard_open (const char* dir, int count, const db_options_t* options);
+                                                  /* makes dir and count shards in it if
+						   * they aren't there yet, count 0 opens
+						   * however many dir was made with (the
+						   * only count it opens with after that),
+						   * options (NULL for defaults) are used
+						   * by every worker
+						   */
+int shard_close();
+int shard_count();                                /* 0 when nothing is open */
+int shard_of   (uint32_t code);
+
+int shard_fetch        (media_t* sought, uint32_t code);
+int shard_fetch_book   (book_t* sought, uint32_t code);
+int shard_fetch_movie  (movie_t* sought, uint32_t code);
+int shard_exists       (uint32_t code);
+int shard_exists_book  (uint32_t code);
+int shard_exists_movie (uint32_t code);
+int shard_fetch_many       (media_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int shard_fetch_many_books (book_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+int shard_fetch_many_movies(movie_t* items, uint8_t* found, const uint32_t* codes, size_t n);
+
+int shard_store        (media_t* item);
+int shard_store_book   (book_t* item);
+int shard_store_movie  (movie_t* item);
+int shard_update       (media_t* item);
+int shard_update_book  (book_t* item);
+int shard_update_movie (movie_t* item);
+int shard_store_book_item  (media_t* item, book_t* detail);
+int shard_store_movie_item (media_t* item, movie_t* detail);
+int shard_update_book_item (media_t* item, book_t* detail);
+int shard_update_movie_item(media_t* item, movie_t* detail);
+int shard_store_book_item_batch(media_t* items, book_t* details, size_t n, size_t* num_stored);
+                                                  /* one transaction per shard per
+						   * PROTO_BATCH_MAX rows, so a failure can
+						   * leave some shards' rows stored
+						   */
+
+int shard_search       (media_t** items, uint32_t* num_results, const filter_t* filter);
+int shard_search_books (book_t** items, uint32_t* num_results, const filter_t* filter);
+int shard_search_movies(movie_t** items, uint32_t* num_results, const filter_t* filter);
+
+int shard_delete       (uint32_t code);
+int shard_touch        (uint32_t code);
+int shard_checkout     (uint32_t code, const char* location);
+
+int shard_csv_dump   (const char* dir, const char* prefix);
+int shard_pretty_dump(const char* dir, const char* prefix);
+                                                  /* every shard at once, each by a process
+						   * of its own, to files named as for
+						   * csv_dump() with "shard-NN-" after the
+						   * prefix (pretty_dump() to prefix
+						   * "shard-NN.txt")
+						   */
+
+#endif /* __SHARD_FUNCS_H__ */